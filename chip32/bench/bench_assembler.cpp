@@ -0,0 +1,108 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Throughput of the assembler front end (tokenizer and parser) on a generated source
+// Usage: chip32_bench_assembler [thousands of lines]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "chip32_assembler.h"
+
+// One block: a label, its code and data, in the different operand syntaxes
+static const char *BlockLines[] = {
+    ".loop%d:",
+    "    lcons r0, 0x%X",
+    "    lcons r1 %d ; spaces between the arguments",
+    "    mov r2, r0",
+    "    add r2, r1",
+    "    load r3, [r2 + 8]",
+    "    store [bp-4], r3",
+    "    memcpy r0, r1, r2",
+    "    vload v0, r0",
+    "    vadd8 v0, v1",
+    "    push t0",
+    "    pop t0",
+    "    je r0, r1, .loop%d",
+    "    skipz r3",
+    "    jump .loop%d",
+    "$data%d DC8 \"text\", 1, 2, 3",
+    "$buffer%d DV32 16",
+};
+
+static std::string GenerateSource(uint32_t lines)
+{
+    std::string source;
+    char line[128];
+    const uint32_t blockSize = sizeof(BlockLines) / sizeof(BlockLines[0]);
+    for (uint32_t i = 0; i < lines; i++)
+    {
+        snprintf(line, sizeof(line), BlockLines[i % blockSize], i / blockSize);
+        source += line;
+        source += '\n';
+    }
+    return source;
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t lines = ((argc > 1) ? atoi(argv[1]) : 100) * 1000U;
+    const int runs = 5;
+    const std::string source = GenerateSource(lines);
+
+    printf("%u lines, %zu bytes, best of %d runs\n", lines, source.size(), runs);
+    double parse = 1e9;
+    double total = 1e9;
+    for (int run = 0; run < runs; run++)
+    {
+        Chip32Assembler assembler;
+        std::vector<uint8_t> program;
+        AssemblyResult result;
+
+        const auto start = std::chrono::steady_clock::now();
+        if (!assembler.Parse(source))
+        {
+            printf("parse error\n");
+            return 1;
+        }
+        const auto parsed = std::chrono::steady_clock::now();
+        if (!assembler.BuildBinary(program, result))
+        {
+            printf("build error\n");
+            return 1;
+        }
+        const auto built = std::chrono::steady_clock::now();
+
+        parse = std::min(parse, std::chrono::duration<double>(parsed - start).count());
+        total = std::min(total, std::chrono::duration<double>(built - start).count());
+    }
+    printf("%-14s %8.1f MB/s %8.0f klines/s\n", "parse", source.size() / parse / 1e6, lines / parse / 1e3);
+    printf("%-14s %8.1f MB/s %8.0f klines/s\n", "parse+build", source.size() / total / 1e6, lines / total / 1e3);
+    return 0;
+}
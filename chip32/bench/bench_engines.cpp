@@ -0,0 +1,115 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Instructions per second of each engine on an ALU/memory/jump loop
+// Usage: chip32_bench_engines [millions of instructions per run]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "chip32.h"
+#include "chip32_jit.h"
+#include "chip32_trace.h"
+
+enum BenchEngine
+{
+    BENCH_SWITCH,
+    BENCH_THREADED,
+    BENCH_DECODED,
+    BENCH_FUSED,
+    BENCH_JIT,
+    BENCH_SWITCH_TRACE,
+    BENCH_THREADED_TRACE,
+    BENCH_COUNT
+};
+
+static const char *BenchNames[BENCH_COUNT] = { "switch", "threaded", "decoded", "decoded+fused", "jit", "switch+trace", "threaded+trace" };
+
+int main(int argc, char **argv)
+{
+    const uint32_t count = ((argc > 1) ? atoi(argv[1]) : 100) * 1000000U;
+    const int runs = 5;
+
+    // Endless loop, stopped by the instruction budget
+    std::vector<uint8_t> program = {
+        OP_LCONS, R1, 1, 0, 0, 0,
+        OP_ADD, R2, R0,     // 6: loop
+        OP_XOR, R3, R2,
+        OP_MOV, R4, R3,
+        OP_SUB, R0, R1,
+        OP_SHL, R4, R1,
+        OP_STORE, 0x10, 0x00, R4,
+        OP_LOAD, R5, 0x10, 0x00,
+        OP_JMP, 6, 0,
+    };
+    program.resize(256, 0);
+    static uint8_t ram[4096];
+    static chip32_decoded_t cache[256];
+    static chip32_fusion_stats_t stats;
+    static chip32_trace_record_t records[1024];
+    chip32_trace_t trace;
+    virtual_mem_t rom = { program.data(), uint16_t(program.size()), 0 };
+    virtual_mem_t ramMem = { ram, sizeof(ram), 0 };
+
+    printf("%u instructions per run, best of %d runs\n", count, runs);
+    for (int engine = 0; engine < BENCH_COUNT; engine++)
+    {
+        double best = 0.0;
+        for (int run = 0; run < runs; run++)
+        {
+            chip32_ctx_t ctx;
+            chip32_initialize(&ctx, &rom, &ramMem, 256);
+            if ((engine == BENCH_SWITCH) || (engine == BENCH_SWITCH_TRACE))
+                chip32_set_engine(&ctx, CHIP32_ENGINE_SWITCH);
+            else if ((engine == BENCH_THREADED) || (engine == BENCH_THREADED_TRACE))
+                chip32_set_engine(&ctx, CHIP32_ENGINE_THREADED);
+            else if (engine != BENCH_JIT)
+                chip32_set_decode_cache(&ctx, cache, rom.size);
+            if (engine == BENCH_FUSED)
+                chip32_fuse(&ctx, &stats, 1);
+            if ((engine == BENCH_SWITCH_TRACE) || (engine == BENCH_THREADED_TRACE))
+            {
+                chip32_trace_init(&trace, records, 1024);
+                chip32_trace_attach(&ctx, &trace);
+            }
+
+            chip32_jit_t *jit = (engine == BENCH_JIT) ? chip32_jit_create(&rom) : nullptr;
+            const auto start = std::chrono::steady_clock::now();
+            if (jit != nullptr)
+                chip32_jit_run(jit, &ctx, rom.size, count);
+            else
+                chip32_run(&ctx, rom.size, count);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (jit != nullptr)
+                chip32_jit_destroy(jit);
+
+            if (ctx.instr_count / seconds > best)
+                best = ctx.instr_count / seconds;
+        }
+        printf("%-14s %8.1f Minstr/s\n", BenchNames[engine], best / 1e6);
+    }
+    return 0;
+}
@@ -32,65 +32,448 @@ THE SOFTWARE.
 // MACROS
 // =======================================================================================
 
-#define _NEXT_BYTE g_rom->mem[++g_registers[IP]]
-#define _NEXT_SHORT ({ g_registers[IP] += 2; g_rom->mem[g_registers[IP]-1]\
-                     | g_rom->mem[g_registers[IP]] << 8; })
+#define _NEXT_BYTE ctx->rom->mem[++ctx->registers[IP]]
+#define _NEXT_SHORT ({ ctx->registers[IP] += 2; ctx->rom->mem[ctx->registers[IP]-1]\
+                     | ctx->rom->mem[ctx->registers[IP]] << 8; })
 #define _NEXT_INT ({                                                                               \
-    g_registers[IP] += 4;                                                                     \
-    g_rom->mem[g_registers[IP] - 3] | g_rom->mem[g_registers[IP] - 2] << 8 |       \
-        g_rom->mem[g_registers[IP] - 1] << 16 | g_rom->mem[g_registers[IP]] << 24; \
+    ctx->registers[IP] += 4;                                                                     \
+    ctx->rom->mem[ctx->registers[IP] - 3] | ctx->rom->mem[ctx->registers[IP] - 2] << 8 |       \
+        ctx->rom->mem[ctx->registers[IP] - 1] << 16 | ctx->rom->mem[ctx->registers[IP]] << 24; \
 })
 
 #define _CHECK_SKIP if (skip) continue;
 
+// Leave an engine, the instructions executed by this run are added to the context counter
+#define VM_RETURN(result) do { ctx->instr_count += instrCount; return (result); } while (0)
+
+// Memory written by the program: marks the RAM pages dirty, keeps the instruction
+// caches in sync when RAM and ROM overlap
+#define _RAM_WRITTEN(ptr, n)                                                        \
+    chip32_mark_dirty(ctx, (ptr) - ctx->ram->mem, n);                               \
+    if (((uintptr_t)(ptr) + (n) > (uintptr_t)ctx->rom->mem) &&                      \
+        ((uintptr_t)(ptr) < (uintptr_t)ctx->rom->mem + ctx->rom->size))             \
+        chip32_rom_written(ctx, (ptr) - ctx->rom->mem, n);
+
+// The interpreters are instantiated twice: 'checked' is false for images proven
+// valid by chip32_verify(), the checks below are then done once, ahead of time.
+// Stack checks depend on the SP value and are always done.
 #ifndef VM_DISABLE_CHECKS
 #define _CHECK_ROM_ADDR_VALID(a) \
-    if (a >= g_rom->size) \
-        return VM_ERR_INVALID_ADDRESS;
+    if (checked && (a >= ctx->rom->size)) \
+        VM_RETURN(VM_ERR_INVALID_ADDRESS);
 #define _CHECK_BYTES_AVAIL(n) \
-    _CHECK_ROM_ADDR_VALID(g_registers[IP] + n)
+    _CHECK_ROM_ADDR_VALID(ctx->registers[IP] + n)
 #define _CHECK_REGISTER_VALID(r) \
-    if (r >= REGISTER_COUNT)     \
-        return VM_ERR_INVALID_REGISTER;
-#define _CHECK_CAN_PUSH(n)                                              \
-    if (g_registers[SP] - (n * sizeof(uint32_t)) > g_ram->addr) \
-        return VM_ERR_STACK_OVERFLOW;
-#define _CHECK_CAN_POP(n)                                               \
-    if (g_registers[SP] + (n * sizeof(uint32_t)) > (g_ram->addr + g_ram->size)) \
-        return VM_ERR_STACK_UNDERFLOW;                      \
-    if (g_registers[SP] < prog_size)                          \
-        return VM_ERR_STACK_OVERFLOW;
+    if (checked && (r >= REGISTER_COUNT)) \
+        VM_RETURN(VM_ERR_INVALID_REGISTER);
+#define _CHECK_VREGISTER_VALID(v) \
+    if (checked && (v >= CHIP32_VREG_COUNT)) \
+        VM_RETURN(VM_ERR_INVALID_REGISTER);
+#define _CHECK_REGISTER_MASK_VALID(m) \
+    if (checked && (m & CHIP32_INVALID_REG_MASK)) \
+        VM_RETURN(VM_ERR_INVALID_REGISTER);
+// Dynamic jump (IP points to the last byte of the instruction): the unchecked loop
+// continues on the checked one if the target has not been verified
+#define _CHECK_DYNAMIC_TARGET()                                                    \
+    if (!checked && !chip32_is_verified(ctx, ctx->registers[IP] + 1))              \
+    {                                                                              \
+        ctx->registers[IP]++;                                                      \
+        instrCount++;                                                              \
+        VM_RETURN(chip32_run_checked(ctx, prog_size, max_instr, instrCount));      \
+    }
+// The stack is the top stack_size bytes of the RAM, SP is an offset in the RAM
+#define _CHECK_CAN_RESERVE(bytes)                                       \
+    if (_RESERVE_FAILS(ctx->registers[SP], bytes))                      \
+        VM_RETURN(VM_ERR_STACK_OVERFLOW);
+#define _CHECK_CAN_PUSH(n) _CHECK_CAN_RESERVE((n) * sizeof(uint32_t))
+#define _CHECK_CAN_POP_AT(sp, n)                                        \
+    if ((sp) + (n * sizeof(uint32_t)) > (ctx->ram->addr + ctx->ram->size)) \
+        VM_RETURN(VM_ERR_STACK_UNDERFLOW);                      \
+    if ((sp) < prog_size)                                       \
+        VM_RETURN(VM_ERR_STACK_OVERFLOW);
+#define _CHECK_CAN_POP(n) _CHECK_CAN_POP_AT(ctx->registers[SP], n)
+// Same conditions than above, for n stack operations at once
+#define _RESERVE_FAILS(sp, bytes) \
+    (((sp) > ctx->ram->size) || ((uint64_t)(sp) + ctx->stack_size < (uint64_t)(bytes) + ctx->ram->size))
+#define _PUSH_FAILS(sp, n) _RESERVE_FAILS(sp, (n) * sizeof(uint32_t))
+#define _POP_FAILS(sp, n) \
+    (((sp) + ((n) * sizeof(uint32_t)) > (ctx->ram->addr + ctx->ram->size)) || ((sp) < prog_size))
+// Addresses computed at run time (block memory, register-indirect): one check for
+// the whole RAM range, whatever its size
+#define _CHECK_RAM_RANGE(a, n) \
+    if ((uint64_t)(a) + (n) > ctx->ram->size) \
+        VM_RETURN(VM_ERR_INVALID_ADDRESS);
 #else
 #define _CHECK_ROM_ADDR_VALID(a)
 #define _CHECK_BYTES_AVAIL(n)
 #define _CHECK_REGISTER_VALID(r)
+#define _CHECK_VREGISTER_VALID(v)
+#define _CHECK_REGISTER_MASK_VALID(m)
+#define _CHECK_DYNAMIC_TARGET()
+#define _CHECK_CAN_RESERVE(bytes)
 #define _CHECK_CAN_PUSH(n)
+#define _CHECK_CAN_POP_AT(sp, n)
 #define _CHECK_CAN_POP(n)
+#define _RESERVE_FAILS(sp, bytes) false
+#define _PUSH_FAILS(sp, n) false
+#define _POP_FAILS(sp, n) false
+#define _CHECK_RAM_RANGE(a, n)
+#endif
+
+#ifdef VM_ENABLE_ASYNC_SYSCALLS
+#include "chip32_async.h"
+#endif
+
+#ifdef VM_ENABLE_PROFILER
+#include "chip32_profiler.h"
+#define _PROFILE(hook) if (ctx->profiler != nullptr) { hook; }
+#else
+#define _PROFILE(hook)
 #endif
+#define _PROFILE_INSTR(op) _PROFILE(chip32_profiler_instr(ctx->profiler, ctx->registers[IP], op))
+#define _PROFILE_CALL() _PROFILE(chip32_profiler_call(ctx->profiler, ctx->registers[RA], ctx->registers[IP] + 1))
+#define _PROFILE_RET() _PROFILE(chip32_profiler_ret(ctx->profiler, ctx->registers[RA]))
+#define _PROFILE_SYSCALL_BEGIN() _PROFILE(chip32_profiler_syscall_begin(ctx->profiler))
+#define _PROFILE_SYSCALL_END(code) _PROFILE(chip32_profiler_syscall_end(ctx->profiler, code))
+#define _PROFILE_MEM(size) _PROFILE(chip32_profiler_mem(ctx->profiler, size))
 
-static virtual_mem_t *g_ram = NULL;
-static virtual_mem_t *g_rom = NULL;
-static uint32_t g_registers[REGISTER_COUNT] = {0};
-static uint16_t g_stack_size;
+#ifndef VM_DISABLE_TRACE
+#include "chip32_trace.h"
 
-bool (*g_interrupt_callback)(uint8_t) = nullptr;
+// Position in the ring, kept in locals by the traced interpreter loops
+struct chip32_trace_cursor_t
+{
+    chip32_trace_t *trace;
+    chip32_trace_record_t *records;
+    uint32_t mask;
+    uint64_t pos;
+};
+
+static inline chip32_trace_cursor_t chip32_trace_cursor(chip32_ctx_t *ctx)
+{
+    chip32_trace_t *trace = ctx->trace;
+    return chip32_trace_cursor_t{ trace, trace->records, trace->mask, trace->count };
+}
+
+// Record a taken control transfer, the instructions in between are found again in the ROM
+static inline void chip32_trace_jump(chip32_trace_cursor_t &cursor, uint32_t from, uint32_t to, uint8_t op, uint8_t reg, uint32_t value)
+{
+    cursor.records[cursor.pos & cursor.mask] = chip32_trace_record_t{ (uint16_t)from, (uint16_t)to, op, reg, value };
+    cursor.trace->count = ++cursor.pos;
+}
+#define _TRACE_CURSOR chip32_trace_cursor_t traceCursor = traced ? chip32_trace_cursor(ctx) : chip32_trace_cursor_t{};
+// In the handler of 'op', IP on its last argument byte; 'reg' is tested or written by the transfer
+#define _TRACE_JUMP(op, to, reg)                                                                  \
+    if (traced)                                                                                   \
+    {                                                                                             \
+        chip32_trace_jump(traceCursor, ctx->registers[IP] - OpCodes[op].bytes, to, op, reg,       \
+                          ((reg) < REGISTER_COUNT) ? ctx->registers[reg] : 0);                    \
+    }
+#else
+#define _TRACE_CURSOR
+#define _TRACE_JUMP(op, to, reg)
+#endif
 
-static const OpCode OpCodes[] = OPCODES_LIST;
+static constexpr OpCode OpCodes[] = OPCODES_LIST;
 static const uint16_t OpCodesSize = sizeof(OpCodes) / sizeof(OpCodes[0]);
+static const char *const Mnemonics[] = CHIP32_MNEMONICS_LIST;
+
+// CHIP32_OPCODES must follow chip32_instruction_t, all the tables generated from it depend on that
+static constexpr bool chip32_opcodes_in_order()
+{
+    for (uint32_t i = 0; i < INSTRUCTION_COUNT; i++)
+    {
+        if (OpCodes[i].opcode != i)
+            return false;
+    }
+    return true;
+}
+static_assert(sizeof(OpCodes) / sizeof(OpCodes[0]) == INSTRUCTION_COUNT, "CHIP32_OPCODES is incomplete");
+static_assert(chip32_opcodes_in_order(), "CHIP32_OPCODES is not in the order of chip32_instruction_t");
+
+// Same for CHIP32_REGISTERS and chip32_register_t
+#define CHIP32_REGISTER_ENTRY(reg, name) reg,
+static constexpr chip32_register_t Registers[] = { CHIP32_REGISTERS(CHIP32_REGISTER_ENTRY) };
+static constexpr bool chip32_registers_in_order()
+{
+    for (uint32_t i = 0; i < REGISTER_COUNT; i++)
+    {
+        if (Registers[i] != i)
+            return false;
+    }
+    return true;
+}
+static_assert(sizeof(Registers) / sizeof(Registers[0]) == REGISTER_COUNT, "CHIP32_REGISTERS is incomplete");
+static_assert(chip32_registers_in_order(), "CHIP32_REGISTERS is not in the order of chip32_register_t");
+
+// Handler label of an opcode in the threaded dispatch tables
+#define VM_LABEL_ENTRY(op, mnemonic, nbArgs, bytes) &&L_##op,
+
+// Internal kinds of decoded instruction records, in addition to the opcodes
+enum
+{
+    DEC_INTERP = INSTRUCTION_COUNT, // executed by the interpreter
+    DEC_ERROR,                      // fails when executed, imm is the error code
+    DEC_BAD,                        // cannot even be skipped (unknown opcode, truncated), imm is the error code
+    // Superinstructions, same order than chip32_fusion_t
+    DEC_FUSED,
+    DEC_LCONS_ADD = DEC_FUSED,
+    DEC_LCONS_SUB,
+    DEC_SKIPZ_JMP,
+    DEC_SKIPNZ_JMP,
+    DEC_PUSH_PUSH,
+    DEC_PUSH_PUSH_PUSH,
+    DEC_POP_POP,
+    DEC_POP_POP_POP,
+    DEC_PUSH_CALL,
+    DEC_POP_RET,
+    DEC_KIND_COUNT
+};
+static_assert(DEC_KIND_COUNT == DEC_FUSED + CHIP32_FUSION_COUNT, "superinstruction kinds out of date");
+
+struct FusionPattern {
+    const char *name;
+    uint8_t length;
+    uint8_t ops[3];
+};
+
+// Indexed by chip32_fusion_t
+static const FusionPattern FusionPatterns[CHIP32_FUSION_COUNT] = {
+    { "lcons+add", 2, { OP_LCONS, OP_ADD } },
+    { "lcons+sub", 2, { OP_LCONS, OP_SUB } },
+    { "skipz+jump", 2, { OP_SKIPZ, OP_JMP } },
+    { "skipnz+jump", 2, { OP_SKIPNZ, OP_JMP } },
+    { "push+push", 2, { OP_PUSH, OP_PUSH } },
+    { "push+push+push", 3, { OP_PUSH, OP_PUSH, OP_PUSH } },
+    { "pop+pop", 2, { OP_POP, OP_POP } },
+    { "pop+pop+pop", 3, { OP_POP, OP_POP, OP_POP } },
+    { "push+call", 2, { OP_PUSH, OP_CALL } },
+    { "pop+ret", 2, { OP_POP, OP_RET } },
+};
+
+// Matching order: longest sequences first
+static const chip32_fusion_t FusionPriority[CHIP32_FUSION_COUNT] = {
+    CHIP32_FUSE_PUSH_PUSH_PUSH, CHIP32_FUSE_POP_POP_POP, CHIP32_FUSE_LCONS_ADD, CHIP32_FUSE_LCONS_SUB,
+    CHIP32_FUSE_SKIPZ_JMP, CHIP32_FUSE_SKIPNZ_JMP, CHIP32_FUSE_PUSH_PUSH, CHIP32_FUSE_POP_POP,
+    CHIP32_FUSE_PUSH_CALL, CHIP32_FUSE_POP_RET
+};
+
+static const uint32_t FUSED_MAX_BYTES = 9; // lcons + add
+
+static void chip32_rom_written(chip32_ctx_t *ctx, intptr_t offset, uint32_t size);
+static chip32_result_t chip32_run_engine(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr);
+static chip32_result_t chip32_run_checked(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr, uint32_t done);
+
+static uint8_t *chip32_banked_lookup(chip32_ctx_t *ctx, uint32_t addr, bool write);
+
+// Host address of the 4 bytes at a banked address, NULL if invalid
+static inline uint8_t *chip32_banked(chip32_ctx_t *ctx, uint32_t addr, bool write)
+{
+    const uint32_t offset = addr & (CHIP32_BANK_PAGE_SIZE - 1);
+    if (((addr >> CHIP32_BANK_PAGE_SHIFT) == ctx->tlb.page) && (offset + sizeof(uint32_t) <= ctx->tlb.limit) &&
+        (!write || ctx->tlb.writable))
+        return ctx->tlb.mem + offset;
+    return chip32_banked_lookup(ctx, addr, write);
+}
+
+#define _BANKED_ADDR(a) ((ctx->bank << 16) | ((a) & 0xFFFF))
+
+// Result of the memcmp instruction, the sign given by the C library is not normalized
+static inline uint32_t chip32_compare(const uint8_t *a, const uint8_t *b, uint32_t size)
+{
+    const int result = memcmp(a, b, size);
+    return (result < 0) ? UINT32_MAX : (result > 0);
+}
+
+// Register lists of pushm/popm: IP and SP cannot be part of them
+#define CHIP32_INVALID_REG_MASK (~((1U << REGISTER_COUNT) - 1) | (1U << IP) | (1U << SP))
+
+// Copies the registers of the list to 'values' in stack order (highest register first,
+// at the lowest address), returns their number
+static inline uint32_t chip32_gather_regs(const uint32_t *regs, uint32_t mask, uint32_t *values)
+{
+    uint32_t count = 0;
+    for (int32_t reg = REGISTER_COUNT - 1; reg >= 0; reg--)
+    {
+        if (mask & (1U << reg))
+            values[count++] = regs[reg];
+    }
+    return count;
+}
+
+static inline void chip32_scatter_regs(uint32_t *regs, uint32_t mask, const uint32_t *values)
+{
+    uint32_t count = 0;
+    for (int32_t reg = REGISTER_COUNT - 1; reg >= 0; reg--)
+    {
+        if (mask & (1U << reg))
+            regs[reg] = values[count++];
+    }
+}
+
+static inline uint32_t chip32_reg_count(uint32_t mask)
+{
+    uint32_t count = 0;
+    for (; mask != 0; mask &= mask - 1)
+        count++;
+    return count;
+}
+
+// =======================================================================================
+// VECTOR UNIT
+// =======================================================================================
+// SSE2 covers the 128-bit vector registers, wider instruction sets would not help.
+// Define VM_DISABLE_SIMD to use the portable implementation.
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(VM_DISABLE_SIMD)
+#include <emmintrin.h>
+#define CHIP32_HAS_SSE2
+#endif
+
+static inline bool chip32_is_vector_op(uint8_t op)
+{
+    return (op >= OP_VLOAD) && (op <= OP_VSUM16);
+}
+
+// Argument of a vector instruction that is a scalar register: 1 (first), 2 (second) or 0 (none)
+static inline uint8_t chip32_vector_scalar_arg(uint8_t op)
+{
+    if (op == OP_VLOAD)
+        return 2;
+    return ((op == OP_VSTORE) || (op == OP_VSUM8) || (op == OP_VSUM16)) ? 1 : 0;
+}
+
+static inline bool chip32_vector_args_valid(uint8_t op, uint8_t a, uint8_t b)
+{
+    const uint8_t scalar = chip32_vector_scalar_arg(op);
+    return (a < ((scalar == 1) ? REGISTER_COUNT : CHIP32_VREG_COUNT)) &&
+           (b < ((scalar == 2) ? REGISTER_COUNT : CHIP32_VREG_COUNT));
+}
+
+// 16-bit lanes are little-endian whatever the host
+static inline int16_t chip32_lane16(const uint8_t *v, uint32_t i)
+{
+    return (int16_t)(v[2 * i] | v[2 * i + 1] << 8);
+}
+
+static inline void chip32_set_lane16(uint8_t *v, uint32_t i, int32_t value)
+{
+    v[2 * i] = value & 0xFF;
+    v[2 * i + 1] = (value >> 8) & 0xFF;
+}
+
+// Lane-wise operations, the result is stored in the first register: a = a op b
+#ifdef CHIP32_HAS_SSE2
+#define CHIP32_VECTOR_OP(name, intrinsic)                                                         \
+    static inline void name(uint8_t *a, const uint8_t *b)                                         \
+    {                                                                                             \
+        _mm_storeu_si128((__m128i *)a, intrinsic(_mm_loadu_si128((const __m128i *)a),            \
+                                                 _mm_loadu_si128((const __m128i *)b)));           \
+    }
+#define CHIP32_VECTOR_OP8(name, intrinsic, expr) CHIP32_VECTOR_OP(name, intrinsic)
+#define CHIP32_VECTOR_OP16(name, intrinsic, expr) CHIP32_VECTOR_OP(name, intrinsic)
+#else
+#define CHIP32_VECTOR_OP8(name, intrinsic, expr)              \
+    static inline void name(uint8_t *a, const uint8_t *b)     \
+    {                                                         \
+        for (uint32_t i = 0; i < CHIP32_VREG_SIZE; i++)       \
+        {                                                     \
+            const uint8_t x = a[i];                           \
+            const uint8_t y = b[i];                           \
+            a[i] = (uint8_t)(expr);                           \
+        }                                                     \
+    }
+#define CHIP32_VECTOR_OP16(name, intrinsic, expr)             \
+    static inline void name(uint8_t *a, const uint8_t *b)     \
+    {                                                         \
+        for (uint32_t i = 0; i < CHIP32_VREG_SIZE / 2; i++)   \
+        {                                                     \
+            const int16_t x = chip32_lane16(a, i);            \
+            const int16_t y = chip32_lane16(b, i);            \
+            chip32_set_lane16(a, i, (expr));                  \
+        }                                                     \
+    }
+#endif
+
+CHIP32_VECTOR_OP8(chip32_vadd8, _mm_add_epi8, x + y)
+CHIP32_VECTOR_OP16(chip32_vadd16, _mm_add_epi16, x + y)
+CHIP32_VECTOR_OP8(chip32_vsub8, _mm_sub_epi8, x - y)
+CHIP32_VECTOR_OP16(chip32_vsub16, _mm_sub_epi16, x - y)
+CHIP32_VECTOR_OP8(chip32_vmin8, _mm_min_epu8, (x < y) ? x : y)
+CHIP32_VECTOR_OP16(chip32_vmin16, _mm_min_epi16, (x < y) ? x : y)
+CHIP32_VECTOR_OP8(chip32_vmax8, _mm_max_epu8, (x > y) ? x : y)
+CHIP32_VECTOR_OP16(chip32_vmax16, _mm_max_epi16, (x > y) ? x : y)
+CHIP32_VECTOR_OP8(chip32_vxor, _mm_xor_si128, x ^ y)
+
+// Horizontal sums: unsigned bytes, signed 16-bit lanes
+static inline uint32_t chip32_vsum8(const uint8_t *v)
+{
+#ifdef CHIP32_HAS_SSE2
+    const __m128i sums = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)v), _mm_setzero_si128());
+    return _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+#else
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < CHIP32_VREG_SIZE; i++)
+        sum += v[i];
+    return sum;
+#endif
+}
+
+static inline uint32_t chip32_vsum16(const uint8_t *v)
+{
+#ifdef CHIP32_HAS_SSE2
+    __m128i sums = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)v), _mm_set1_epi16(1));
+    sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 8));
+    sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 4));
+    return (uint32_t)_mm_cvtsi128_si32(sums);
+#else
+    int32_t sum = 0;
+    for (uint32_t i = 0; i < CHIP32_VREG_SIZE / 2; i++)
+        sum += chip32_lane16(v, i);
+    return (uint32_t)sum;
+#endif
+}
+
+static inline bool chip32_is_verified(const chip32_ctx_t *ctx, uint32_t addr)
+{
+    return (ctx->verified != nullptr) && (addr < ctx->rom->size) && (ctx->verified[addr / 8] & (1 << (addr % 8)));
+}
+
+static inline void chip32_mark_dirty(chip32_ctx_t *ctx, intptr_t offset, uint32_t size)
+{
+    if ((offset < 0) || (offset >= ctx->ram->size) || (size == 0))
+        return;
+
+    const uint32_t first = offset >> CHIP32_PAGE_SHIFT;
+    uint32_t last = (offset + size - 1) >> CHIP32_PAGE_SHIFT;
+    if (last > (uint32_t)(ctx->ram->size - 1) >> CHIP32_PAGE_SHIFT)
+        last = (uint32_t)(ctx->ram->size - 1) >> CHIP32_PAGE_SHIFT;
+    for (uint32_t page = first; page <= last; page++)
+        ctx->dirty[page / 64] |= 1ULL << (page % 64);
+}
+
+#if defined(__GNUC__) && !defined(VM_DISABLE_THREADED)
+#define CHIP32_HAS_THREADED
+#endif
 
 // =======================================================================================
 // FUNCTIONS
 // =======================================================================================
-void chip32_initialize(virtual_mem_t *rom, virtual_mem_t *ram, uint16_t stack_size)
+void chip32_initialize(chip32_ctx_t *ctx, virtual_mem_t *rom, virtual_mem_t *ram, uint16_t stack_size)
 {
-    g_ram = ram;
-    g_rom = rom;
-    g_stack_size = stack_size;
+    memset(ctx, 0, sizeof(chip32_ctx_t));
+
+    ctx->ram = ram;
+    ctx->rom = rom;
+    ctx->stack_size = stack_size;
+#if defined(CHIP32_HAS_THREADED) && !defined(VM_DEFAULT_ENGINE_SWITCH)
+    ctx->engine = CHIP32_ENGINE_THREADED;
+#else
+    ctx->engine = CHIP32_ENGINE_SWITCH;
+#endif
 
-    memset(g_ram->mem, 0, g_ram->size);
-    memset(g_registers, 0, REGISTER_COUNT * sizeof(uint32_t));
+    memset(ctx->ram->mem, 0, ctx->ram->size);
 
-    g_registers[SP] = g_ram->size;
+    ctx->registers[SP] = ctx->ram->size;
 }
 
 #define MEM_ACCESS(addr, vmem) if ((addr >= vmem->addr) && ((addr + vmem->size) < vmem->size))\
@@ -99,291 +482,1523 @@ void chip32_initialize(virtual_mem_t *rom, virtual_mem_t *ram, uint16_t stack_si
     return &vmem->mem[addr];\
 }
 
-uint8_t *chip32_memory(uint16_t addr)
+uint8_t *chip32_memory(chip32_ctx_t *ctx, uint16_t addr)
 {
-    static uint8_t dummy = 0;
     // Beware, can provoke memory overflow
-    MEM_ACCESS(addr, g_rom);
-    MEM_ACCESS(addr, g_ram);
+    MEM_ACCESS(addr, ctx->rom);
+    MEM_ACCESS(addr, ctx->ram);
+
+    return ctx->ram->mem; //!< Defaut memory to RAM location if address out of segment.
+}
+
+void chip32_set_syscall(chip32_ctx_t *ctx, chip32_syscall_t callback, void *user_data)
+{
+    ctx->syscall = callback;
+    ctx->user_data = user_data;
+}
+
+void chip32_host_table_init(chip32_host_table_t *table)
+{
+    memset(table, 0, sizeof(chip32_host_table_t));
+}
+
+bool chip32_host_table_register(chip32_host_table_t *table, uint8_t code, chip32_host_fn_t fn, uint8_t nb_args, uint8_t ret)
+{
+    if (nb_args > CHIP32_HOST_MAX_ARGS)
+        return false;
+    if ((ret != CHIP32_HOST_NO_RESULT) && ((ret >= REGISTER_COUNT) || (ret == IP) || (ret == SP)))
+        return false;
 
-    return g_ram->mem; //!< Defaut memory to RAM location if address out of segment.
+    table->functions[code].fn = fn;
+    table->functions[code].nb_args = nb_args;
+    table->functions[code].ret = ret;
+    return true;
 }
 
-static void chip32_on_interrupt(bool (*callback)(uint8_t))
+void chip32_set_host_table(chip32_ctx_t *ctx, const chip32_host_table_t *table)
 {
-    g_interrupt_callback = callback;
+    ctx->host_table = table;
 }
 
-uint32_t chip32_stack_count()
+void chip32_suspend(chip32_ctx_t *ctx)
 {
-    return g_ram->size - g_registers[SP];
+    ctx->suspend = true;
 }
 
-void chip32_stack_push(uint32_t value)
+uint32_t chip32_stack_count(chip32_ctx_t *ctx)
 {
-    g_registers[SP] -= 4;
-    memcpy(chip32_memory(g_registers[SP]), &value, sizeof(uint32_t));
+    return ctx->ram->size - ctx->registers[SP];
 }
 
-uint32_t chip32_stack_pop()
+void chip32_stack_push(chip32_ctx_t *ctx, uint32_t value)
+{
+    ctx->registers[SP] -= 4;
+    uint8_t *ptr = chip32_memory(ctx, ctx->registers[SP]);
+    memcpy(ptr, &value, sizeof(uint32_t));
+    _RAM_WRITTEN(ptr, sizeof(uint32_t));
+}
+
+uint32_t chip32_stack_pop(chip32_ctx_t *ctx)
 {
     uint32_t val = 0;
-    memcpy(&val, chip32_memory(g_registers[SP]), sizeof(uint32_t));
-    g_registers[SP] += 4;
+    memcpy(&val, chip32_memory(ctx, ctx->registers[SP]), sizeof(uint32_t));
+    ctx->registers[SP] += 4;
     return val;
 }
 
-uint32_t chip32_get_register(chip32_register_t reg)
+void chip32_ram_written(chip32_ctx_t *ctx, uint32_t offset, uint32_t size)
 {
-    return g_registers[reg];
+    _RAM_WRITTEN(ctx->ram->mem + offset, size);
 }
 
-void chip32_set_register(chip32_register_t reg, uint32_t val)
+uint32_t chip32_get_register(chip32_ctx_t *ctx, chip32_register_t reg)
 {
-    g_registers[reg] = val;
+    return ctx->registers[reg];
 }
 
-chip32_result_t chip32_run(uint16_t prog_size, uint32_t max_instr)
+void chip32_set_register(chip32_ctx_t *ctx, chip32_register_t reg, uint32_t val)
 {
-    uint32_t instrCount = 0;
-    bool skip = false;
+    ctx->registers[reg] = val;
+}
 
-    while ((max_instr == 0) || (instrCount < max_instr))
-    {
-        _CHECK_ROM_ADDR_VALID(g_registers[IP])
-        const uint8_t instr = g_rom->mem[g_registers[IP]];
-        if (instr >= INSTRUCTION_COUNT)
-            return VM_ERR_UNKNOWN_OPCODE;
+// =======================================================================================
+// BANKED MEMORY
+// =======================================================================================
+void chip32_set_segments(chip32_ctx_t *ctx, const chip32_segment_t *segments, uint32_t count)
+{
+    ctx->segments = segments;
+    ctx->segment_count = count;
+    ctx->bank = 0;
+    memset(&ctx->tlb, 0, sizeof(ctx->tlb));
+}
 
-        uint8_t bytes = OpCodes[instr].bytes;
-        _CHECK_BYTES_AVAIL(bytes);
+// TLB miss: search the segments, then cache the page
+static uint8_t *chip32_banked_lookup(chip32_ctx_t *ctx, uint32_t addr, bool write)
+{
+    for (uint32_t i = 0; i < ctx->segment_count; i++)
+    {
+        const chip32_segment_t &seg = ctx->segments[i];
+        if ((addr < seg.addr) || (addr - seg.addr >= seg.size) || (seg.size - (addr - seg.addr) < sizeof(uint32_t)))
+            continue;
+        if (write && !seg.writable)
+            return nullptr;
 
-        if (skip)
+        const uint32_t pageStart = addr & ~(CHIP32_BANK_PAGE_SIZE - 1);
+        if (pageStart >= seg.addr)
         {
-            skip = false;
-            g_registers[IP] += bytes + 1; // jump over arguments and point to the next instruction
-            instrCount++;
-            continue;
+            const uint64_t end = (uint64_t)seg.addr + seg.size;
+            ctx->tlb.page = addr >> CHIP32_BANK_PAGE_SHIFT;
+            ctx->tlb.limit = (end - pageStart >= CHIP32_BANK_PAGE_SIZE) ? CHIP32_BANK_PAGE_SIZE : (uint32_t)(end - pageStart);
+            ctx->tlb.mem = seg.mem + (pageStart - seg.addr);
+            ctx->tlb.writable = seg.writable;
         }
+        return seg.mem + (addr - seg.addr);
+    }
+    return nullptr;
+}
 
-        switch (instr)
-        {
-        case OP_NOP:
+// =======================================================================================
+// INSTRUCTION CACHE
+// =======================================================================================
+static void chip32_decode(const virtual_mem_t *rom, uint32_t addr, chip32_decoded_t *d)
+{
+    const uint8_t *mem = rom->mem;
+    const uint8_t op = mem[addr];
+
+    memset(d, 0, sizeof(chip32_decoded_t));
+    d->next = addr;
+
+    if (op >= INSTRUCTION_COUNT)
+    {
+        d->kind = DEC_BAD;
+        d->imm = VM_ERR_UNKNOWN_OPCODE;
+        return;
+    }
+
+    const uint8_t bytes = OpCodes[op].bytes;
+    if (addr + bytes >= rom->size)
+    {
+#ifndef VM_DISABLE_CHECKS
+        d->kind = DEC_BAD;
+        d->imm = VM_ERR_INVALID_ADDRESS;
+#else
+        d->kind = DEC_INTERP;
+#endif
+        return;
+    }
+
+    d->kind = op;
+    d->next = addr + bytes + 1;
+    uint8_t nbRegs = 0;
+
+    switch (op)
+    {
+    case OP_SYSCALL:
+        // Host functions are called directly, anything else goes to the interpreter
+        d->imm = mem[addr + 1];
+        break;
+    case OP_LCONS:
+        d->ra = mem[addr + 1];
+        d->imm = mem[addr + 2] | mem[addr + 3] << 8 | mem[addr + 4] << 16 | (uint32_t)mem[addr + 5] << 24;
+        nbRegs = 1;
+        break;
+    case OP_PUSH:
+    case OP_POP:
+    case OP_NOT:
+    case OP_JR:
+    case OP_SKIPZ:
+    case OP_SKIPNZ:
+    case OP_BANK:
+        d->ra = mem[addr + 1];
+        nbRegs = 1;
+        break;
+    case OP_CALL:
+    case OP_JMP:
+        d->target = mem[addr + 1] | mem[addr + 2] << 8;
+        break;
+    case OP_STORE:
+        d->imm = mem[addr + 1] | mem[addr + 2] << 8;
+        d->ra = mem[addr + 3];
+        nbRegs = 1;
+        break;
+    case OP_LOAD:
+        d->ra = mem[addr + 1];
+        d->imm = mem[addr + 2] | mem[addr + 3] << 8;
+        nbRegs = 1;
+        break;
+    case OP_MEMCPY:
+    case OP_MEMSET:
+    case OP_MEMCMP:
+        d->ra = mem[addr + 1];
+        d->rb = mem[addr + 2];
+        d->imm = mem[addr + 3];
+        nbRegs = 3;
+        break;
+    case OP_JE:
+    case OP_JNE:
+    case OP_JLT:
+    case OP_JGE:
+        d->ra = mem[addr + 1];
+        d->rb = mem[addr + 2];
+        d->target = mem[addr + 3] | mem[addr + 4] << 8;
+        nbRegs = 2;
+        break;
+    case OP_LOADR:
+        d->ra = mem[addr + 1];
+        d->rb = mem[addr + 2];
+        d->imm = (int16_t)(mem[addr + 3] | mem[addr + 4] << 8);
+        nbRegs = 2;
+        break;
+    case OP_STORER:
+        d->rb = mem[addr + 1];
+        d->imm = (int16_t)(mem[addr + 2] | mem[addr + 3] << 8);
+        d->ra = mem[addr + 4];
+        nbRegs = 2;
+        break;
+    case OP_PUSHM:
+    case OP_POPM:
+        d->imm = mem[addr + 1] | mem[addr + 2] << 8 | mem[addr + 3] << 16;
+        break;
+    case OP_ENTER:
+        d->imm = mem[addr + 1] | mem[addr + 2] << 8;
+        break;
+    case OP_NOP:
+    case OP_HALT:
+    case OP_RET:
+    case OP_LEAVE:
+        break;
+    default: // two registers
+        d->ra = mem[addr + 1];
+        d->rb = mem[addr + 2];
+        nbRegs = chip32_is_vector_op(op) ? 0 : 2; // vector operands are checked below
+        break;
+    }
+
+    if (chip32_is_vector_op(op))
+    {
+        const uint8_t scalar = chip32_vector_scalar_arg(op);
+        if ((scalar != 0) && (((scalar == 1) ? d->ra : d->rb) == IP))
+            d->kind = DEC_INTERP;
+#ifndef VM_DISABLE_CHECKS
+        if (!chip32_vector_args_valid(op, d->ra, d->rb))
         {
-            break;
+            d->kind = DEC_ERROR;
+            d->imm = VM_ERR_INVALID_REGISTER;
+            d->target = d->next - 1;
         }
-        case OP_HALT:
+#endif
+    }
+
+    // Instructions using the instruction pointer as an argument are left to the interpreter
+    if (((nbRegs >= 1) && (d->ra == IP)) || ((nbRegs >= 2) && (d->rb == IP)) || ((nbRegs == 3) && (d->imm == IP)))
+        d->kind = DEC_INTERP;
+
+#ifndef VM_DISABLE_CHECKS
+    // For errors, target is the value of IP left by the interpreter: arguments are read
+    // before the checks, except the lcons constant
+    if (((nbRegs >= 1) && (d->ra >= REGISTER_COUNT)) || ((nbRegs >= 2) && (d->rb >= REGISTER_COUNT)) ||
+        ((nbRegs == 3) && (d->imm >= REGISTER_COUNT)))
+    {
+        d->kind = DEC_ERROR;
+        d->imm = VM_ERR_INVALID_REGISTER;
+        d->target = (op == OP_LCONS) ? addr + 1 : d->next - 1;
+    }
+    else if (((op == OP_PUSHM) || (op == OP_POPM)) && (d->imm & CHIP32_INVALID_REG_MASK))
+    {
+        d->kind = DEC_ERROR;
+        d->imm = VM_ERR_INVALID_REGISTER;
+        d->target = d->next - 1;
+    }
+    else if (((op == OP_STORE) || (op == OP_LOAD)) && (d->imm + 3 >= rom->size))
+    {
+        d->kind = DEC_ERROR;
+        d->imm = VM_ERR_INVALID_ADDRESS;
+        d->target = d->next - 1;
+    }
+#endif
+}
+
+bool chip32_set_decode_cache(chip32_ctx_t *ctx, chip32_decoded_t *cache, uint32_t count)
+{
+    if (count < ctx->rom->size)
+        return false;
+
+    ctx->decoded = cache;
+    chip32_invalidate_rom(ctx);
+    ctx->engine = CHIP32_ENGINE_DECODED;
+    return true;
+}
+
+void chip32_invalidate_rom(chip32_ctx_t *ctx)
+{
+    ctx->rom_epoch++;
+    ctx->verified = nullptr;
+    if (ctx->decoded != nullptr)
+    {
+        for (uint32_t addr = 0; addr < ctx->rom->size; addr++)
+            chip32_decode(ctx->rom, addr, &ctx->decoded[addr]);
+    }
+}
+
+static void chip32_rom_written(chip32_ctx_t *ctx, intptr_t offset, uint32_t size)
+{
+    ctx->rom_epoch++;
+    if (ctx->decoded != nullptr)
+    {
+        // Records starting before the written bytes may include them (longest superinstruction)
+        intptr_t first = offset - (FUSED_MAX_BYTES - 1);
+        intptr_t last = offset + size;
+        if (first < 0)
+            first = 0;
+        if (last > ctx->rom->size)
+            last = ctx->rom->size;
+        for (intptr_t addr = first; addr < last; addr++)
+            chip32_decode(ctx->rom, addr, &ctx->decoded[addr]);
+    }
+}
+
+// =======================================================================================
+// SUPERINSTRUCTIONS
+// =======================================================================================
+static bool chip32_fusion_match(chip32_ctx_t *ctx, uint32_t addr, chip32_fusion_t fusion, bool allowPush)
+{
+    const FusionPattern &pattern = FusionPatterns[fusion];
+
+    for (uint32_t i = 0; i < pattern.length; i++)
+    {
+        if (addr >= ctx->rom->size)
+            return false;
+
+        const chip32_decoded_t *d = &ctx->decoded[addr];
+        if (d->kind != pattern.ops[i])
+            return false;
+        // A fused push could modify the following instructions, and the pop checks are
+        // done at once, before the stack pointer itself is popped
+        if ((d->kind == OP_PUSH) && !allowPush)
+            return false;
+        if ((d->kind == OP_POP) && (d->ra == SP))
+            return false;
+        addr = d->next;
+    }
+    return true;
+}
+
+bool chip32_fuse(chip32_ctx_t *ctx, chip32_fusion_stats_t *stats, uint32_t min_sites)
+{
+    if (ctx->decoded == nullptr)
+        return false;
+
+    memset(stats, 0, sizeof(chip32_fusion_stats_t));
+    ctx->fusion = stats;
+
+    const chip32_decoded_t *cache = ctx->decoded;
+    const uint8_t *mem = ctx->rom->mem;
+    const uint32_t size = ctx->rom->size;
+
+    // Pushes are not fused if the stack can overwrite the code
+    const bool allowPush = ((uintptr_t)ctx->ram->mem + ctx->ram->size <= (uintptr_t)ctx->rom->mem) ||
+                           ((uintptr_t)ctx->rom->mem + size <= (uintptr_t)ctx->ram->mem);
+
+    // 1. Profile the image, following the instructions from the start
+    uint32_t candidates[CHIP32_FUSION_COUNT] = {0};
+    for (uint32_t addr = 0; addr < size; )
+    {
+        const chip32_decoded_t *d = &cache[addr];
+        if (d->kind == DEC_BAD)
         {
-            return VM_FINISHED;
+            addr++;
+            continue;
         }
-        case OP_SYSCALL:
-        {
-            const uint8_t code = _NEXT_BYTE;
+        if ((d->next < size) && (cache[d->next].kind != DEC_BAD))
+            stats->pairs[mem[addr]][mem[d->next]]++;
 
-            if (g_interrupt_callback == nullptr)
-                return VM_ERR_UNHANDLED_INTERRUPT;
-            if (!g_interrupt_callback(code))
-                return VM_FINISHED;
-            break;
-        }
-        case OP_LCONS:
+        for (uint32_t i = 0; i < CHIP32_FUSION_COUNT; i++)
         {
-            const uint8_t reg = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg)
-            g_registers[reg] = _NEXT_INT;
-            break;
+            if (chip32_fusion_match(ctx, addr, FusionPriority[i], allowPush))
+            {
+                candidates[FusionPriority[i]]++;
+                break;
+            }
         }
-        case OP_MOV:
+        addr = d->next;
+    }
+
+    // 2. Replace the frequent sequences
+    for (uint32_t addr = 0; addr < size; )
+    {
+        chip32_decoded_t *d = &ctx->decoded[addr];
+        if (d->kind == DEC_BAD)
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg2];
-            break;
+            addr++;
+            continue;
         }
-        case OP_PUSH:
+
+        uint32_t next = d->next;
+        for (uint32_t i = 0; i < CHIP32_FUSION_COUNT; i++)
         {
-            const uint8_t reg = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg)
-            _CHECK_CAN_PUSH(1)
-            g_registers[SP] -= 4;
-            memcpy(&g_ram->mem[g_registers[SP]], &g_registers[reg], sizeof(uint32_t));
-            break;
+            const chip32_fusion_t fusion = FusionPriority[i];
+            if ((candidates[fusion] >= min_sites) && (candidates[fusion] > 0) &&
+                chip32_fusion_match(ctx, addr, fusion, allowPush))
+            {
+                d->base = d->kind;
+                d->kind = DEC_FUSED + fusion;
+                stats->sites[fusion]++;
+                // Continue after the superinstruction
+                for (uint32_t j = 1; j < FusionPatterns[fusion].length; j++)
+                    next = ctx->decoded[next].next;
+                break;
+            }
         }
-        case OP_POP:
+        addr = next;
+    }
+    return true;
+}
+
+void chip32_fusion_report(const chip32_fusion_stats_t *stats, FILE *out)
+{
+    uint32_t shown[INSTRUCTION_COUNT][INSTRUCTION_COUNT] = {{0}};
+
+    fprintf(out, "Most frequent pairs:\n");
+    for (int n = 0; n < 10; n++)
+    {
+        uint32_t best = 0, first = 0, second = 0;
+        for (uint32_t i = 0; i < INSTRUCTION_COUNT; i++)
         {
-            const uint8_t reg = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg)
-            _CHECK_CAN_POP(1)
-            memcpy(&g_registers[reg], &g_ram->mem[g_registers[SP]], sizeof(uint32_t));
-            g_registers[SP] += 4;
-            break;
+            for (uint32_t j = 0; j < INSTRUCTION_COUNT; j++)
+            {
+                if (!shown[i][j] && (stats->pairs[i][j] > best))
+                {
+                    best = stats->pairs[i][j];
+                    first = i;
+                    second = j;
+                }
+            }
         }
-        case OP_CALL:
-        {
-            g_registers[RA] = g_registers[IP] + 3;
-            g_registers[IP] = _NEXT_SHORT - 1;
+        if (best == 0)
             break;
-        }
-        case OP_RET:
+        shown[first][second] = 1;
+        fprintf(out, "   %-8s -> %-8s %u\n", Mnemonics[first], Mnemonics[second], best);
+    }
+
+    uint64_t saved = 0;
+    fprintf(out, "Superinstructions:\n");
+    for (uint32_t i = 0; i < CHIP32_FUSION_COUNT; i++)
+    {
+        if (stats->sites[i] == 0)
+            continue;
+        const uint64_t dispatches = stats->fired[i] * (FusionPatterns[i].length - 1);
+        saved += dispatches;
+        fprintf(out, "   %-16s sites: %-6u fired: %-12llu saved dispatches: %llu\n", FusionPatterns[i].name,
+                stats->sites[i], (unsigned long long)stats->fired[i], (unsigned long long)dispatches);
+    }
+    fprintf(out, "Total saved dispatches: %llu\n", (unsigned long long)saved);
+}
+
+// =======================================================================================
+// VERIFIER
+// =======================================================================================
+static inline void chip32_set_start(uint8_t *starts, uint32_t addr)
+{
+    starts[addr / 8] |= 1 << (addr % 8);
+}
+
+static inline bool chip32_is_start(const uint8_t *starts, uint32_t addr)
+{
+    return starts[addr / 8] & (1 << (addr % 8));
+}
+
+// Size of the instruction at 'addr', 0 if it is invalid or truncated
+static uint32_t chip32_instr_size(const virtual_mem_t *rom, uint32_t addr)
+{
+    if ((addr >= rom->size) || (rom->mem[addr] >= INSTRUCTION_COUNT))
+        return 0;
+    const uint32_t bytes = OpCodes[rom->mem[addr]].bytes;
+    return (addr + bytes < rom->size) ? bytes + 1 : 0;
+}
+
+// Checks one instruction, and gives the addresses where execution can go on
+static bool chip32_verify_instr(chip32_ctx_t *ctx, uint32_t addr, uint32_t succ[2], uint32_t &nbSucc)
+{
+    const virtual_mem_t *rom = ctx->rom;
+    const uint8_t *mem = rom->mem;
+    const uint32_t size = chip32_instr_size(rom, addr);
+    if (size == 0)
+        return false;
+
+    const uint8_t op = mem[addr];
+    uint8_t dst = R0; // written register
+    uint8_t src = R0; // read register
+    bool writes = false;
+
+    nbSucc = 1;
+    succ[0] = addr + size;
+
+    switch (op)
+    {
+    case OP_HALT:
+        nbSucc = 0;
+        break;
+    case OP_NOP:
+    case OP_SYSCALL:
+        break;
+    case OP_LCONS:
+    case OP_POP:
+    case OP_NOT:
+        dst = mem[addr + 1];
+        writes = true;
+        break;
+    case OP_PUSH:
+    case OP_BANK:
+        src = mem[addr + 1];
+        break;
+    case OP_STOREB:
+        if (mem[addr + 1] >= REGISTER_COUNT)
+            return false;
+        src = mem[addr + 2];
+        break;
+    case OP_MEMCPY:
+    case OP_MEMSET:
+        if ((mem[addr + 1] >= REGISTER_COUNT) || (mem[addr + 2] >= REGISTER_COUNT))
+            return false;
+        src = mem[addr + 3];
+        break;
+    case OP_JE:
+    case OP_JNE:
+    case OP_JLT:
+    case OP_JGE:
+        if (mem[addr + 1] >= REGISTER_COUNT)
+            return false;
+        src = mem[addr + 2];
+        succ[1] = mem[addr + 3] | mem[addr + 4] << 8;
+        nbSucc = 2;
+        break;
+    case OP_LOADR:
+        dst = mem[addr + 1];
+        src = mem[addr + 2];
+        writes = true;
+        break;
+    case OP_STORER:
+        if (mem[addr + 1] >= REGISTER_COUNT)
+            return false;
+        src = mem[addr + 4];
+        break;
+    case OP_MEMCMP:
+        dst = mem[addr + 1];
+        src = mem[addr + 2];
+        writes = true;
+        if (mem[addr + 3] >= REGISTER_COUNT)
+            return false;
+        break;
+    case OP_VLOAD:
+    case OP_VSTORE:
+    case OP_VADD8:
+    case OP_VADD16:
+    case OP_VSUB8:
+    case OP_VSUB16:
+    case OP_VMIN8:
+    case OP_VMIN16:
+    case OP_VMAX8:
+    case OP_VMAX16:
+    case OP_VXOR:
+    case OP_VSUM8:
+    case OP_VSUM16:
+        if (!chip32_vector_args_valid(op, mem[addr + 1], mem[addr + 2]))
+            return false;
+        if (op == OP_VLOAD)
+            src = mem[addr + 2];
+        else if (op == OP_VSTORE)
+            src = mem[addr + 1];
+        else if ((op == OP_VSUM8) || (op == OP_VSUM16))
         {
-            g_registers[IP] = g_registers[RA] - 1;
-            break;
+            dst = mem[addr + 1];
+            writes = true;
         }
-        case OP_STORE:
-        {
-            const uint16_t addr = _NEXT_SHORT;
-            const uint8_t reg = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg)
-            _CHECK_ROM_ADDR_VALID((uint32_t)addr + 3)
-            memcpy(&g_ram->mem[addr], &g_registers[reg], sizeof(uint32_t));
-            break;
-        }
-        case OP_LOAD:
-        {
-            const uint8_t reg = _NEXT_BYTE;
-            const uint16_t addr = _NEXT_SHORT;
-            _CHECK_REGISTER_VALID(reg)
-            _CHECK_ROM_ADDR_VALID((uint32_t)addr + 3)
-            memcpy(&g_registers[reg], &g_ram->mem[addr], sizeof(uint32_t));
-            break;
-        }
-        case OP_ADD:
-        {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] + g_registers[reg2];
-            break;
-        }
-        case OP_SUB:
-        {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] - g_registers[reg2];
-            break;
-        }
-        case OP_MUL:
+        break;
+    case OP_PUSHM:
+    case OP_POPM:
+        if ((mem[addr + 1] | mem[addr + 2] << 8 | mem[addr + 3] << 16) & CHIP32_INVALID_REG_MASK)
+            return false;
+        break;
+    case OP_ENTER:
+    case OP_LEAVE:
+        break;
+    case OP_JR:
+        src = mem[addr + 1];
+        nbSucc = 0; // checked at run time
+        break;
+    case OP_RET:
+        nbSucc = 0; // checked at run time
+        break;
+    case OP_SKIPZ:
+    case OP_SKIPNZ:
+    {
+        src = mem[addr + 1];
+        // The skipped instruction must be complete, and followed by another one
+        const uint32_t skipped = chip32_instr_size(rom, succ[0]);
+        if (skipped == 0)
+            return false;
+        succ[1] = succ[0] + skipped;
+        nbSucc = 2;
+        break;
+    }
+    case OP_JMP:
+        succ[0] = mem[addr + 1] | mem[addr + 2] << 8;
+        break;
+    case OP_CALL:
+        succ[1] = succ[0]; // return address
+        succ[0] = mem[addr + 1] | mem[addr + 2] << 8;
+        nbSucc = 2;
+        break;
+    case OP_STORE:
+    case OP_LOAD:
+    {
+        const uint32_t data = (op == OP_STORE) ? mem[addr + 1] | mem[addr + 2] << 8 : mem[addr + 2] | mem[addr + 3] << 8;
+        if (op == OP_STORE)
+            src = mem[addr + 3];
+        else
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] * g_registers[reg2];
-            break;
+            dst = mem[addr + 1];
+            writes = true;
         }
-        case OP_DIV:
+        // Limit checked by the interpreter, and actual memory access
+        if ((data + 3 >= rom->size) || (data + 3 >= ctx->ram->size))
+            return false;
+        break;
+    }
+    default: // two registers, the first one is written
+        dst = mem[addr + 1];
+        src = mem[addr + 2];
+        writes = true;
+        break;
+    }
+
+    if ((src >= REGISTER_COUNT) || (dst >= REGISTER_COUNT) || (writes && (dst == IP)))
+        return false;
+
+    for (uint32_t i = 0; i < nbSucc; i++)
+    {
+        if (succ[i] >= rom->size)
+            return false;
+    }
+    return true;
+}
+
+bool chip32_verify(chip32_ctx_t *ctx, uint8_t *starts, uint32_t starts_size, uint32_t *fault_addr)
+{
+    const virtual_mem_t *rom = ctx->rom;
+    const uint32_t entry = ctx->registers[IP];
+
+    ctx->verified = nullptr;
+    *fault_addr = entry;
+
+    if ((starts_size < (rom->size + 7u) / 8) || (entry >= rom->size))
+        return false;
+    // Self-modifying program
+    if (((uintptr_t)ctx->ram->mem < (uintptr_t)rom->mem + rom->size) &&
+        ((uintptr_t)rom->mem < (uintptr_t)ctx->ram->mem + ctx->ram->size))
+        return false;
+
+    // Every address is queued once, when it is marked as an instruction start
+    uint32_t *pending = (uint32_t *)malloc(rom->size * sizeof(uint32_t));
+    if (pending == nullptr)
+        return false;
+
+    memset(starts, 0, (rom->size + 7) / 8);
+    uint32_t nbPending = 0;
+    pending[nbPending++] = entry;
+    chip32_set_start(starts, entry);
+
+    bool valid = true;
+    while (valid && (nbPending > 0))
+    {
+        const uint32_t addr = pending[--nbPending];
+        uint32_t succ[2];
+        uint32_t nbSucc = 0;
+
+        if (!chip32_verify_instr(ctx, addr, succ, nbSucc))
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] / g_registers[reg2];
+            *fault_addr = addr;
+            valid = false;
             break;
         }
-        case OP_SHL:
+        for (uint32_t i = 0; i < nbSucc; i++)
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] << g_registers[reg2];
-            break;
+            if (!chip32_is_start(starts, succ[i]))
+            {
+                chip32_set_start(starts, succ[i]);
+                pending[nbPending++] = succ[i];
+            }
         }
-        case OP_SHR:
+    }
+    free(pending);
+
+    if (valid)
+        ctx->verified = starts;
+    return valid;
+}
+
+// =======================================================================================
+// EXECUTION ENGINES
+// =======================================================================================
+bool chip32_set_engine(chip32_ctx_t *ctx, chip32_engine_t engine)
+{
+#ifndef CHIP32_HAS_THREADED
+    if (engine == CHIP32_ENGINE_THREADED)
+        return false;
+#endif
+    if ((engine == CHIP32_ENGINE_DECODED) && (ctx->decoded == nullptr))
+        return false;
+    ctx->engine = engine;
+    return true;
+}
+
+/**
+ * Portable engine: one central switch, every instruction goes through the same
+ * decode and checks at the top of the loop.
+ */
+template <bool checked, bool traced>
+static chip32_result_t chip32_run_switch(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr)
+{
+    uint32_t instrCount = 0;
+    bool skip = ctx->skip;
+    _TRACE_CURSOR
+
+    ctx->skip = false;
+
+    while ((max_instr == 0) || (instrCount < max_instr))
+    {
+        _CHECK_ROM_ADDR_VALID(ctx->registers[IP])
+        const uint8_t instr = ctx->rom->mem[ctx->registers[IP]];
+        if (checked && (instr >= INSTRUCTION_COUNT))
+            VM_RETURN(VM_ERR_UNKNOWN_OPCODE);
+
+        uint8_t bytes = OpCodes[instr].bytes;
+        _CHECK_BYTES_AVAIL(bytes);
+
+        if (skip)
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] >> g_registers[reg2];
-            break;
+            skip = false;
+            ctx->registers[IP] += bytes + 1; // jump over arguments and point to the next instruction
+            instrCount++;
+            continue;
         }
-        case OP_ISHR:
+
+        _PROFILE_INSTR(instr)
+        switch (instr)
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            *((int32_t *)&g_registers[reg1]) = *((int32_t *)&g_registers[reg1]) >> *((int32_t *)&g_registers[reg2]);
-            break;
+#define VM_OP(op) case op:
+#define VM_NEXT break
+#define VM_SKIP skip = true
+#include "chip32_ops.inc"
+#undef VM_OP
+#undef VM_NEXT
+#undef VM_SKIP
         }
-        case OP_AND:
+
+        ctx->registers[IP]++;
+        instrCount++;
+    }
+
+    ctx->skip = skip; // pending skip goes on when the execution is resumed
+    VM_RETURN(VM_PAUSED);
+}
+
+#ifdef CHIP32_HAS_THREADED
+/**
+ * Direct-threaded engine (GCC "labels as values" extension). Each handler ends
+ * with its own copy of the dispatch code so that the host branch predictor
+ * learns opcode sequences instead of a single indirect jump. The skip flag is
+ * only handled by the skip instructions, and the argument bytes check uses the
+ * constant size of the handler's own opcode.
+ *
+ * Results (registers, memory, return code, executed instruction count) are the
+ * same than chip32_run_switch().
+ */
+template <bool checked, bool traced>
+static chip32_result_t chip32_run_threaded(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr)
+{
+    static const void *const dispatch[INSTRUCTION_COUNT] = { CHIP32_OPCODES(VM_LABEL_ENTRY) };
+
+    uint32_t instrCount = 0;
+    uint8_t instr;
+    _TRACE_CURSOR
+
+#define VM_DISPATCH()                                       \
+    if ((max_instr != 0) && (instrCount >= max_instr))      \
+        VM_RETURN(VM_PAUSED);                               \
+    _CHECK_ROM_ADDR_VALID(ctx->registers[IP])                  \
+    instr = ctx->rom->mem[ctx->registers[IP]];                    \
+    if (checked && (instr >= INSTRUCTION_COUNT))            \
+        VM_RETURN(VM_ERR_UNKNOWN_OPCODE);                   \
+    goto *dispatch[instr]
+
+#define VM_OP(op) L_##op: _CHECK_BYTES_AVAIL(OpCodes[op].bytes) _PROFILE_INSTR(op)
+#define VM_NEXT ctx->registers[IP]++; instrCount++; VM_DISPATCH()
+#define VM_SKIP goto skip_next
+
+    if (ctx->skip)
+    {
+        ctx->skip = false;
+        goto skip_resume;
+    }
+    VM_DISPATCH();
+
+#include "chip32_ops.inc"
+
+skip_next:
+    // Terminate the skip instruction, then jump over the next one
+    ctx->registers[IP]++;
+    instrCount++;
+    if ((max_instr != 0) && (instrCount >= max_instr))
+    {
+        ctx->skip = true;
+        VM_RETURN(VM_PAUSED);
+    }
+skip_resume:
+    _CHECK_ROM_ADDR_VALID(ctx->registers[IP])
+    instr = ctx->rom->mem[ctx->registers[IP]];
+    if (checked && (instr >= INSTRUCTION_COUNT))
+        VM_RETURN(VM_ERR_UNKNOWN_OPCODE);
+    _CHECK_BYTES_AVAIL(OpCodes[instr].bytes);
+    ctx->registers[IP] += OpCodes[instr].bytes + 1;
+    instrCount++;
+    VM_DISPATCH();
+
+#undef VM_DISPATCH
+#undef VM_OP
+#undef VM_NEXT
+#undef VM_SKIP
+}
+#endif
+
+/**
+ * Cached engine: executes the pre-decoded records, the instruction pointer lives in
+ * a local variable. Rare instructions (system calls without host table, any use of
+ * IP as argument) go through the switch engine. Dispatch is direct-threaded when available.
+ */
+static chip32_result_t chip32_run_decoded(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr)
+{
+    uint32_t *const regs = ctx->registers;
+    uint8_t *const ram = ctx->ram->mem;
+    const chip32_decoded_t *const cache = ctx->decoded;
+    const uint32_t romSize = ctx->rom->size;
+    uint64_t unused[CHIP32_FUSION_COUNT]; // fused records shared with a context that has statistics (clones)
+    uint64_t *const fired = (ctx->fusion != nullptr) ? ctx->fusion->fired : unused;
+    uint32_t instrCount = 0;
+    uint32_t ip = regs[IP];
+    const chip32_decoded_t *d;
+
+#define DEC_EXIT(result) do { regs[IP] = ip; VM_RETURN(result); } while (0)
+#define DEC_FETCH()                                     \
+    if ((max_instr != 0) && (instrCount >= max_instr))  \
+        DEC_EXIT(VM_PAUSED);                            \
+    if (ip >= romSize)                                  \
+        DEC_EXIT(VM_ERR_INVALID_ADDRESS);               \
+    d = &cache[ip]
+
+#ifdef CHIP32_HAS_THREADED
+    // The opcodes, then the internal kinds in their enum order
+    static const void *const dispatch[DEC_KIND_COUNT] = {
+        CHIP32_OPCODES(VM_LABEL_ENTRY)
+        &&L_DEC_INTERP, &&L_DEC_ERROR, &&L_DEC_BAD,
+        &&L_DEC_LCONS_ADD, &&L_DEC_LCONS_SUB, &&L_DEC_SKIPZ_JMP, &&L_DEC_SKIPNZ_JMP,
+        &&L_DEC_PUSH_PUSH, &&L_DEC_PUSH_PUSH_PUSH, &&L_DEC_POP_POP, &&L_DEC_POP_POP_POP,
+        &&L_DEC_PUSH_CALL, &&L_DEC_POP_RET
+    };
+#define DEC_OP(kind) L_##kind:
+#define DEC_DISPATCH() DEC_FETCH(); goto *dispatch[d->kind]
+#define DEC_UNFUSED() goto *dispatch[d->base]
+#define DEC_INTERPRET() goto L_DEC_INTERP
+#else
+    uint8_t kind;
+#define DEC_OP(kind) case kind:
+#define DEC_DISPATCH() goto dispatch
+#define DEC_UNFUSED() do { kind = d->base; goto redispatch; } while (0)
+#define DEC_INTERPRET() do { kind = DEC_INTERP; goto redispatch; } while (0)
+#endif
+#define DEC_FUSED_OP(fusion) DEC_OP(DEC_##fusion)
+#define DEC_FITS(n) ((max_instr == 0) || (max_instr - instrCount >= (n)))
+#define DEC_PUSH(rec) \
+    regs[SP] -= 4; \
+    memcpy(&ram[regs[SP]], &regs[(rec)->ra], sizeof(uint32_t)); \
+    _RAM_WRITTEN(&ram[regs[SP]], sizeof(uint32_t));
+#define DEC_POP(rec) \
+    memcpy(&regs[(rec)->ra], &ram[regs[SP]], sizeof(uint32_t)); \
+    regs[SP] += 4;
+#define DEC_NEXT ip = d->next; instrCount++; DEC_DISPATCH()
+#define DEC_JUMP(addr) ip = (addr); instrCount++; DEC_DISPATCH()
+
+    if (ctx->skip)
+    {
+        ctx->skip = false;
+        goto skip_resume;
+    }
+
+#ifdef CHIP32_HAS_THREADED
+    DEC_DISPATCH();
+#else
+dispatch:
+    DEC_FETCH();
+    kind = d->kind;
+redispatch:
+    switch (kind)
+#endif
+    {
+    DEC_OP(OP_NOP)
+    {
+        DEC_NEXT;
+    }
+    DEC_OP(OP_HALT)
+    {
+        DEC_EXIT(VM_FINISHED);
+    }
+    DEC_OP(OP_SYSCALL)
+    {
+        const chip32_host_table_t *table = ctx->host_table;
+#ifdef VM_ENABLE_ASYNC_SYSCALLS
+        if (ctx->async != nullptr)
+            table = nullptr;
+#endif
+        if (table == nullptr)
+            DEC_INTERPRET();
+        const chip32_host_function_t *host = &table->functions[d->imm];
+        regs[IP] = d->next - 1;
+        if (host->fn == nullptr)
+            VM_RETURN(VM_ERR_UNHANDLED_INTERRUPT);
+        const uint32_t value = host->fn(ctx, &regs[R0]);
+        if (host->ret != CHIP32_HOST_NO_RESULT)
+            regs[host->ret] = value;
+        if (ctx->suspend)
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] & g_registers[reg2];
-            break;
+            ctx->suspend = false;
+            regs[IP]++;
+            instrCount++;
+            VM_RETURN(VM_WAIT_SYSCALL);
         }
-        case OP_OR:
+        // The function may have changed IP
+        DEC_JUMP(regs[IP] + 1);
+    }
+    DEC_OP(OP_LCONS)
+    {
+        regs[d->ra] = d->imm;
+        DEC_NEXT;
+    }
+    DEC_OP(OP_MOV)
+    {
+        regs[d->ra] = regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_PUSH)
+    {
+        regs[IP] = d->next - 1; // value seen by the checks, as in the interpreter
+        _CHECK_CAN_PUSH(1)
+        regs[SP] -= 4;
+        memcpy(&ram[regs[SP]], &regs[d->ra], sizeof(uint32_t));
+        _RAM_WRITTEN(&ram[regs[SP]], sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_POP)
+    {
+        regs[IP] = d->next - 1;
+        _CHECK_CAN_POP(1)
+        memcpy(&regs[d->ra], &ram[regs[SP]], sizeof(uint32_t));
+        regs[SP] += 4;
+        DEC_NEXT;
+    }
+    DEC_OP(OP_CALL)
+    {
+        regs[RA] = ip + 3;
+        DEC_JUMP(d->target);
+    }
+    DEC_OP(OP_RET)
+    {
+        DEC_JUMP(regs[RA]);
+    }
+    DEC_OP(OP_STORE)
+    {
+        memcpy(&ram[d->imm], &regs[d->ra], sizeof(uint32_t));
+        _RAM_WRITTEN(&ram[d->imm], sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_LOAD)
+    {
+        memcpy(&regs[d->ra], &ram[d->imm], sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_ADD)
+    {
+        regs[d->ra] = regs[d->ra] + regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_SUB)
+    {
+        regs[d->ra] = regs[d->ra] - regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_MUL)
+    {
+        regs[d->ra] = regs[d->ra] * regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_DIV)
+    {
+        regs[d->ra] = regs[d->ra] / regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_SHL)
+    {
+        regs[d->ra] = regs[d->ra] << regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_SHR)
+    {
+        regs[d->ra] = regs[d->ra] >> regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_ISHR)
+    {
+        *((int32_t *)&regs[d->ra]) = *((int32_t *)&regs[d->ra]) >> *((int32_t *)&regs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_AND)
+    {
+        regs[d->ra] = regs[d->ra] & regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_OR)
+    {
+        regs[d->ra] = regs[d->ra] | regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_XOR)
+    {
+        regs[d->ra] = regs[d->ra] ^ regs[d->rb];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_NOT)
+    {
+        regs[d->ra] = ~regs[d->ra];
+        DEC_NEXT;
+    }
+    DEC_OP(OP_JMP)
+    {
+        DEC_JUMP(d->target);
+    }
+    DEC_OP(OP_JR)
+    {
+        DEC_JUMP((uint16_t)regs[d->ra]);
+    }
+    DEC_OP(OP_SKIPZ)
+    {
+        if (regs[d->ra] == 0)
+            goto skip_next;
+        DEC_NEXT;
+    }
+    DEC_OP(OP_SKIPNZ)
+    {
+        if (regs[d->ra] != 0)
+            goto skip_next;
+        DEC_NEXT;
+    }
+    DEC_OP(OP_BANK)
+    {
+        ctx->bank = regs[d->ra] & 0xFFFF;
+        DEC_NEXT;
+    }
+    DEC_OP(OP_LOADB)
+    {
+        const uint8_t *ptr = chip32_banked(ctx, _BANKED_ADDR(regs[d->rb]), false);
+        if (ptr == nullptr)
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] | g_registers[reg2];
-            break;
+            regs[IP] = d->next - 1;
+            VM_RETURN(VM_ERR_INVALID_ADDRESS);
         }
-        case OP_XOR:
+        memcpy(&regs[d->ra], ptr, sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_STOREB)
+    {
+        uint8_t *ptr = chip32_banked(ctx, _BANKED_ADDR(regs[d->ra]), true);
+        if (ptr == nullptr)
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            const uint8_t reg2 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            _CHECK_REGISTER_VALID(reg2)
-            g_registers[reg1] = g_registers[reg1] ^ g_registers[reg2];
-            break;
+            regs[IP] = d->next - 1;
+            VM_RETURN(VM_ERR_INVALID_ADDRESS);
         }
-        case OP_NOT:
+        memcpy(ptr, &regs[d->rb], sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_MEMCPY)
+    {
+        const uint32_t size = regs[d->imm];
+        regs[IP] = d->next - 1;
+        _CHECK_RAM_RANGE(regs[d->ra], size)
+        _CHECK_RAM_RANGE(regs[d->rb], size)
+        memmove(&ram[regs[d->ra]], &ram[regs[d->rb]], size);
+        _RAM_WRITTEN(&ram[regs[d->ra]], size);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_MEMSET)
+    {
+        const uint32_t size = regs[d->imm];
+        regs[IP] = d->next - 1;
+        _CHECK_RAM_RANGE(regs[d->ra], size)
+        memset(&ram[regs[d->ra]], regs[d->rb] & 0xFF, size);
+        _RAM_WRITTEN(&ram[regs[d->ra]], size);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_MEMCMP)
+    {
+        const uint32_t size = regs[d->imm];
+        regs[IP] = d->next - 1;
+        _CHECK_RAM_RANGE(regs[d->ra], size)
+        _CHECK_RAM_RANGE(regs[d->rb], size)
+        regs[d->ra] = chip32_compare(&ram[regs[d->ra]], &ram[regs[d->rb]], size);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_JE)
+    {
+        if (regs[d->ra] == regs[d->rb])
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            g_registers[reg1] = ~g_registers[reg1];
-            break;
+            DEC_JUMP(d->target);
         }
-        case OP_JMP:
+        DEC_NEXT;
+    }
+    DEC_OP(OP_JNE)
+    {
+        if (regs[d->ra] != regs[d->rb])
         {
-            g_registers[IP] = _NEXT_SHORT - 1;
-            break;
+            DEC_JUMP(d->target);
         }
-        case OP_JR:
+        DEC_NEXT;
+    }
+    DEC_OP(OP_JLT)
+    {
+        if ((int32_t)regs[d->ra] < (int32_t)regs[d->rb])
         {
-            const uint8_t reg1 = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg1)
-            uint16_t addr = g_registers[reg1];
-            g_registers[IP] = addr;
-            break;
+            DEC_JUMP(d->target);
         }
-        case OP_SKIPZ:
+        DEC_NEXT;
+    }
+    DEC_OP(OP_JGE)
+    {
+        if ((int32_t)regs[d->ra] >= (int32_t)regs[d->rb])
         {
-            const uint8_t reg = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg)
-            if (reg == 0)
-            {
-                skip = true;
-            }
-            break;
+            DEC_JUMP(d->target);
         }
-        case OP_SKIPNZ:
+        DEC_NEXT;
+    }
+    DEC_OP(OP_LOADR)
+    {
+        const uint32_t addr = regs[d->rb] + d->imm;
+        regs[IP] = d->next - 1;
+        _CHECK_RAM_RANGE(addr, sizeof(uint32_t))
+        memcpy(&regs[d->ra], &ram[addr], sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_STORER)
+    {
+        const uint32_t addr = regs[d->rb] + d->imm;
+        regs[IP] = d->next - 1;
+        _CHECK_RAM_RANGE(addr, sizeof(uint32_t))
+        memcpy(&ram[addr], &regs[d->ra], sizeof(uint32_t));
+        _RAM_WRITTEN(&ram[addr], sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VLOAD)
+    {
+        const uint32_t addr = regs[d->rb];
+        regs[IP] = d->next - 1;
+        _CHECK_RAM_RANGE(addr, CHIP32_VREG_SIZE)
+        memcpy(ctx->vregs[d->ra], &ram[addr], CHIP32_VREG_SIZE);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VSTORE)
+    {
+        const uint32_t addr = regs[d->ra];
+        regs[IP] = d->next - 1;
+        _CHECK_RAM_RANGE(addr, CHIP32_VREG_SIZE)
+        memcpy(&ram[addr], ctx->vregs[d->rb], CHIP32_VREG_SIZE);
+        _RAM_WRITTEN(&ram[addr], CHIP32_VREG_SIZE);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VADD8)
+    {
+        chip32_vadd8(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VADD16)
+    {
+        chip32_vadd16(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VSUB8)
+    {
+        chip32_vsub8(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VSUB16)
+    {
+        chip32_vsub16(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VMIN8)
+    {
+        chip32_vmin8(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VMIN16)
+    {
+        chip32_vmin16(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VMAX8)
+    {
+        chip32_vmax8(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VMAX16)
+    {
+        chip32_vmax16(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VXOR)
+    {
+        chip32_vxor(ctx->vregs[d->ra], ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VSUM8)
+    {
+        regs[d->ra] = chip32_vsum8(ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_VSUM16)
+    {
+        regs[d->ra] = chip32_vsum16(ctx->vregs[d->rb]);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_PUSHM)
+    {
+        uint32_t values[REGISTER_COUNT];
+        const uint32_t count = chip32_gather_regs(regs, d->imm, values);
+        regs[IP] = d->next - 1;
+        _CHECK_CAN_PUSH(count)
+        regs[SP] -= count * sizeof(uint32_t);
+        memcpy(&ram[regs[SP]], values, count * sizeof(uint32_t));
+        _RAM_WRITTEN(&ram[regs[SP]], count * sizeof(uint32_t));
+        DEC_NEXT;
+    }
+    DEC_OP(OP_POPM)
+    {
+        uint32_t values[REGISTER_COUNT];
+        const uint32_t count = chip32_reg_count(d->imm);
+        regs[IP] = d->next - 1;
+        _CHECK_CAN_POP(count)
+        memcpy(values, &ram[regs[SP]], count * sizeof(uint32_t));
+        regs[SP] += count * sizeof(uint32_t);
+        chip32_scatter_regs(regs, d->imm, values);
+        DEC_NEXT;
+    }
+    DEC_OP(OP_ENTER)
+    {
+        regs[IP] = d->next - 1;
+        _CHECK_CAN_RESERVE(sizeof(uint32_t) + d->imm)
+        regs[SP] -= 4;
+        memcpy(&ram[regs[SP]], &regs[BP], sizeof(uint32_t));
+        _RAM_WRITTEN(&ram[regs[SP]], sizeof(uint32_t));
+        regs[BP] = regs[SP];
+        regs[SP] -= d->imm;
+        DEC_NEXT;
+    }
+    DEC_OP(OP_LEAVE)
+    {
+        regs[IP] = d->next - 1;
+        _CHECK_CAN_POP_AT(regs[BP], 1)
+        regs[SP] = regs[BP];
+        memcpy(&regs[BP], &ram[regs[SP]], sizeof(uint32_t));
+        regs[SP] += 4;
+        DEC_NEXT;
+    }
+    DEC_OP(DEC_INTERP)
+    {
+        // One instruction with the interpreter. Its instruction counter is restored
+        // since the instruction is accounted here.
+        const uint64_t savedCount = ctx->instr_count;
+        regs[IP] = ip;
+        chip32_result_t result = chip32_run_switch<true, false>(ctx, prog_size, 1);
+        const uint64_t executed = ctx->instr_count - savedCount;
+        ctx->instr_count = savedCount;
+        ip = regs[IP];
+        if (result == VM_WAIT_SYSCALL)
+            instrCount += executed; // 0 if the system call could not be posted
+        if (result != VM_PAUSED)
+            DEC_EXIT(result);
+        instrCount++;
+        if (ctx->skip)
         {
-            const uint8_t reg = _NEXT_BYTE;
-            _CHECK_REGISTER_VALID(reg)
-            if (reg != 0)
-            {
-                skip = true;
-            }
-            break;
-        }
+            // e.g. skipz ip
+            if ((max_instr != 0) && (instrCount >= max_instr))
+                DEC_EXIT(VM_PAUSED);
+            ctx->skip = false;
+            goto skip_resume;
         }
+        DEC_DISPATCH();
+    }
+    DEC_OP(DEC_ERROR)
+    {
+        ip = d->target;
+        DEC_EXIT((chip32_result_t)d->imm);
+    }
+    DEC_OP(DEC_BAD)
+    {
+        DEC_EXIT((chip32_result_t)d->imm);
+    }
 
-        g_registers[IP]++;
-        instrCount++;
+    // Superinstructions: the following records are the ones matched by chip32_fuse()
+    DEC_FUSED_OP(LCONS_ADD)
+    {
+        if (!DEC_FITS(2))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        regs[d->ra] = d->imm;
+        regs[d2->ra] = regs[d2->ra] + regs[d2->rb];
+        fired[CHIP32_FUSE_LCONS_ADD]++;
+        ip = d2->next;
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(LCONS_SUB)
+    {
+        if (!DEC_FITS(2))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        regs[d->ra] = d->imm;
+        regs[d2->ra] = regs[d2->ra] - regs[d2->rb];
+        fired[CHIP32_FUSE_LCONS_SUB]++;
+        ip = d2->next;
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(SKIPZ_JMP)
+    {
+        if (!DEC_FITS(2))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        fired[CHIP32_FUSE_SKIPZ_JMP]++;
+        ip = (regs[d->ra] == 0) ? d2->next : d2->target; // skipped jump or taken jump
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(SKIPNZ_JMP)
+    {
+        if (!DEC_FITS(2))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        fired[CHIP32_FUSE_SKIPNZ_JMP]++;
+        ip = (regs[d->ra] != 0) ? d2->next : d2->target;
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(PUSH_PUSH)
+    {
+        if (!DEC_FITS(2) || _PUSH_FAILS(regs[SP], 1) || _PUSH_FAILS(regs[SP], 2))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        DEC_PUSH(d);
+        DEC_PUSH(d2);
+        fired[CHIP32_FUSE_PUSH_PUSH]++;
+        ip = d2->next;
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(PUSH_PUSH_PUSH)
+    {
+        if (!DEC_FITS(3) || _PUSH_FAILS(regs[SP], 1) || _PUSH_FAILS(regs[SP], 2) || _PUSH_FAILS(regs[SP], 3))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        const chip32_decoded_t *d3 = &cache[d2->next];
+        DEC_PUSH(d);
+        DEC_PUSH(d2);
+        DEC_PUSH(d3);
+        fired[CHIP32_FUSE_PUSH_PUSH_PUSH]++;
+        ip = d3->next;
+        instrCount += 3;
+        DEC_DISPATCH();
     }
+    DEC_FUSED_OP(POP_POP)
+    {
+        if (!DEC_FITS(2) || _POP_FAILS(regs[SP], 1) || _POP_FAILS(regs[SP] + 4, 1))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        DEC_POP(d);
+        DEC_POP(d2);
+        fired[CHIP32_FUSE_POP_POP]++;
+        ip = d2->next;
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(POP_POP_POP)
+    {
+        if (!DEC_FITS(3) || _POP_FAILS(regs[SP], 1) || _POP_FAILS(regs[SP] + 4, 1) || _POP_FAILS(regs[SP] + 8, 1))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        const chip32_decoded_t *d3 = &cache[d2->next];
+        DEC_POP(d);
+        DEC_POP(d2);
+        DEC_POP(d3);
+        fired[CHIP32_FUSE_POP_POP_POP]++;
+        ip = d3->next;
+        instrCount += 3;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(PUSH_CALL)
+    {
+        if (!DEC_FITS(2) || _PUSH_FAILS(regs[SP], 1))
+            DEC_UNFUSED();
+        const chip32_decoded_t *d2 = &cache[d->next];
+        DEC_PUSH(d);
+        regs[RA] = d->next + 3;
+        fired[CHIP32_FUSE_PUSH_CALL]++;
+        ip = d2->target;
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    DEC_FUSED_OP(POP_RET)
+    {
+        if (!DEC_FITS(2) || _POP_FAILS(regs[SP], 1))
+            DEC_UNFUSED();
+        DEC_POP(d);
+        fired[CHIP32_FUSE_POP_RET]++;
+        ip = regs[RA];
+        instrCount += 2;
+        DEC_DISPATCH();
+    }
+    }
+
+skip_next:
+    // Terminate the skip instruction, then jump over the next one
+    ip = d->next;
+    instrCount++;
+    if ((max_instr != 0) && (instrCount >= max_instr))
+    {
+        ctx->skip = true;
+        DEC_EXIT(VM_PAUSED);
+    }
+skip_resume:
+    if (ip >= romSize)
+        DEC_EXIT(VM_ERR_INVALID_ADDRESS);
+    d = &cache[ip];
+    if (d->kind == DEC_BAD)
+        DEC_EXIT((chip32_result_t)d->imm);
+    DEC_NEXT;
+
+#undef DEC_EXIT
+#undef DEC_FETCH
+#undef DEC_OP
+#undef DEC_DISPATCH
+#undef DEC_UNFUSED
+#undef DEC_INTERPRET
+#undef DEC_FUSED_OP
+#undef DEC_FITS
+#undef DEC_PUSH
+#undef DEC_POP
+#undef DEC_NEXT
+#undef DEC_JUMP
+}
+
+chip32_result_t chip32_run(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr)
+{
+#ifndef VM_DISABLE_TRACE
+    if (ctx->trace != nullptr)
+    {
+        chip32_trace_begin(ctx);
+        const chip32_result_t result = chip32_run_engine(ctx, prog_size, max_instr);
+        chip32_trace_result(ctx, result);
+        return result;
+    }
+#endif
+    return chip32_run_engine(ctx, prog_size, max_instr);
+}
+
+// Interpreter loop of the context, the traced variants only when a trace is attached
+template <bool checked>
+static chip32_result_t chip32_run_interpreter(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr)
+{
+#ifndef VM_DISABLE_TRACE
+    if (ctx->trace != nullptr)
+    {
+#ifdef CHIP32_HAS_THREADED
+        if (ctx->engine != CHIP32_ENGINE_SWITCH)
+            return chip32_run_threaded<checked, true>(ctx, prog_size, max_instr);
+#endif
+        return chip32_run_switch<checked, true>(ctx, prog_size, max_instr);
+    }
+#endif
+#ifdef CHIP32_HAS_THREADED
+    if (ctx->engine != CHIP32_ENGINE_SWITCH)
+        return chip32_run_threaded<checked, false>(ctx, prog_size, max_instr);
+#endif
+    return chip32_run_switch<checked, false>(ctx, prog_size, max_instr);
+}
+
+static chip32_result_t chip32_run_engine(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr)
+{
+    // The profiler and trace hooks are only in the interpreters
+    if ((ctx->engine == CHIP32_ENGINE_DECODED) && (ctx->profiler == nullptr) && (ctx->trace == nullptr))
+        return chip32_run_decoded(ctx, prog_size, max_instr);
+
+    // Verified image, and a start point proven by the verifier
+    if (chip32_is_verified(ctx, ctx->registers[IP]))
+        return chip32_run_interpreter<false>(ctx, prog_size, max_instr);
+    return chip32_run_checked(ctx, prog_size, max_instr, 0);
+}
+
+// Continue a run on the checked loops, 'done' instructions have already been executed
+static chip32_result_t chip32_run_checked(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr, uint32_t done)
+{
+    if ((max_instr != 0) && (done >= max_instr))
+        return VM_PAUSED;
+    if (max_instr != 0)
+        max_instr -= done;
 
-    return VM_PAUSED;
+    return chip32_run_interpreter<true>(ctx, prog_size, max_instr);
 }
@@ -27,6 +27,13 @@ THE SOFTWARE.
 #define CHIP32_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Also included by C sources, e.g. the ones generated by Chip32Translator
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum
 {
@@ -68,10 +75,51 @@ typedef enum
 
     // branching:
     OP_JMP, // jump to address, e.g.: jmp 0x0A 0x00
-    OP_JR,  // jump to address in register, e.g.: jr r1
+    OP_JR,  // jump to address in register, e.g.: jumpr r1
     OP_SKIPZ,  // skip next instruction if zero, e.g.: skipz r0
     OP_SKIPNZ, // skip next instruction if not zero, e.g.: skipnz r2
 
+    // banked memory (see chip32_set_segments()):
+    OP_BANK,   // select the bank (upper 16 bits of banked addresses) from a register, e.g.: bank r0
+    OP_LOADB,  // copy a value from the banked address in the second register, e.g.: loadb r0, r1
+    OP_STOREB, // copy a value to the banked address in the first register, e.g.: storeb r1, r0
+
+    // block memory, RAM addresses and byte count in registers:
+    OP_MEMCPY, // copy r2 bytes from address r1 to address r0 (may overlap), e.g.: memcpy r0, r1, r2
+    OP_MEMSET, // fill r2 bytes at address r0 with the low byte of r1, e.g.: memset r0, r1, r2
+    OP_MEMCMP, // compare r2 bytes at addresses r0 and r1, r0 is set to -1, 0 or 1, e.g.: memcmp r0, r1, r2
+
+    // compare and branch (signed comparison of two registers):
+    OP_JE,  // jump if equal, e.g.: je r0, r1, .label
+    OP_JNE, // jump if not equal, e.g.: jne r0, r1, .label
+    OP_JLT, // jump if the first register is lower, e.g.: jlt r0, r1, .label
+    OP_JGE, // jump if the first register is greater or equal, e.g.: jge r0, r1, .label
+
+    // register-indirect memory, base register plus a signed 16-bit offset:
+    OP_LOADR,  // copy a value from a heap address to a register, e.g.: load r0, [r1+8]
+    OP_STORER, // copy a value from a register to a heap address, e.g.: store [r1-4], r0
+
+    // vector registers v0-v7, 16 bytes each, lanes of 8 bits (unsigned) or 16 bits (signed):
+    OP_VLOAD,  // copy 16 bytes from the heap address in a register, e.g.: vload v0, r1
+    OP_VSTORE, // copy 16 bytes to the heap address in a register, e.g.: vstore r1, v0
+    OP_VADD8,  // lane-wise wrapping sum, stored in the first register, e.g.: vadd8 v0, v1
+    OP_VADD16,
+    OP_VSUB8,  // lane-wise wrapping difference, stored in the first register, e.g.: vsub8 v0, v1
+    OP_VSUB16,
+    OP_VMIN8,  // lane-wise minimum, stored in the first register, e.g.: vmin8 v0, v1
+    OP_VMIN16,
+    OP_VMAX8,  // lane-wise maximum, stored in the first register, e.g.: vmax8 v0, v1
+    OP_VMAX16,
+    OP_VXOR,   // xor, stored in the first register, e.g.: vxor v0, v1
+    OP_VSUM8,  // sum of all the lanes of a vector register into a register, e.g.: vsum8 r0, v1
+    OP_VSUM16,
+
+    // stack frames, the register list is a 24-bit mask (bit n for register n, IP and SP excluded):
+    OP_PUSHM, // push the registers in ascending order (same as push r0, push r1...), e.g.: pushm r0-r3, ra
+    OP_POPM,  // pop the registers in descending order, undoes pushm with the same list, e.g.: popm r0-r3, ra
+    OP_ENTER, // push BP, set BP to SP and reserve a 16-bit number of bytes below it, e.g.: enter 16
+    OP_LEAVE, // set SP to BP and pop BP, undoes enter, e.g.: leave
+
     INSTRUCTION_COUNT
 } chip32_instruction_t;
 
@@ -119,11 +167,25 @@ typedef enum
     REGISTER_COUNT
 } chip32_register_t;
 
+/**
+ * Assembly name of each register, in the order of chip32_register_t:
+ *     X(register, name)
+ * chip32.cpp checks its order against the enum.
+ */
+#define CHIP32_REGISTERS(X) \
+    X(R0, "r0") X(R1, "r1") X(R2, "r2") X(R3, "r3") X(R4, "r4") X(R5, "r5") \
+    X(T0, "t0") X(T1, "t1") X(T2, "t2") X(T3, "t3") X(T4, "t4") X(T5, "t5") X(T6, "t6") X(T7, "t7") X(T8, "t8") X(T9, "t9") \
+    X(IP, "ip") X(BP, "bp") X(SP, "sp") X(RA, "ra") X(OV, "ov")
+
+#define CHIP32_REGISTER_NAME_ENTRY(reg, name) name,
+#define CHIP32_REGISTER_NAMES_LIST { CHIP32_REGISTERS(CHIP32_REGISTER_NAME_ENTRY) }
+
 
 typedef enum
 {
     VM_FINISHED,                // execution completed (i.e. got halt instruction)
     VM_PAUSED,                  // execution paused since we hit the maximum instructions
+    VM_WAIT_SYSCALL,            // execution suspended by the system call handler (see chip32_suspend())
     VM_ERR_UNKNOWN_OPCODE,      // unknown opcode
     VM_ERR_UNSUPPORTED_OPCODE,  // instruction not supported on this platform
     VM_ERR_INVALID_REGISTER,    // invalid register access
@@ -139,12 +201,74 @@ typedef struct {
     uint8_t bytes; //!< Size of bytes arguments
 } OpCode;
 
-#define OPCODES_LIST { { OP_NOP, 0, 0 }, { OP_HALT, 0, 0 }, { OP_SYSCALL, 1, 1 }, { OP_LCONS, 2, 5 }, \
-{ OP_MOV, 2, 2 }, { OP_PUSH, 1, 1 }, {OP_POP, 1, 1 }, { OP_CALL, 1, 2 }, { OP_RET, 0, 0 }, \
-{ OP_STORE, 2, 3 }, { OP_LOAD, 2, 3 }, { OP_ADD, 2, 2 }, { OP_SUB, 2, 2 }, { OP_MUL, 2, 2 }, \
-{ OP_DIV, 2, 2 }, { OP_SHL, 2, 2 }, { OP_SHR, 2, 2 }, { OP_ISHR, 2, 2 }, { OP_AND, 2, 2 }, \
-{ OP_OR, 2, 2 }, { OP_XOR, 2, 2 }, { OP_NOT, 1 }, { OP_JMP, 1 }, { OP_JR, 1 }, \
-{ OP_SKIPZ, 1 }, { OP_SKIPNZ, 1 } }
+/**
+ * The instruction set, one row per opcode in the order of chip32_instruction_t:
+ *     X(opcode, mnemonic, number of assembly arguments, bytes of arguments)
+ * Tables indexed by opcode (OPCODES_LIST, CHIP32_MNEMONICS_LIST, dispatch tables) are
+ * generated from it, chip32.cpp checks its order against the enum.
+ */
+#define CHIP32_OPCODES(X) \
+    X(OP_NOP,     "nop",     0, 0) \
+    X(OP_HALT,    "halt",    0, 0) \
+    X(OP_SYSCALL, "syscall", 1, 1) \
+    X(OP_LCONS,   "lcons",   2, 5) \
+    X(OP_MOV,     "mov",     2, 2) \
+    X(OP_PUSH,    "push",    1, 1) \
+    X(OP_POP,     "pop",     1, 1) \
+    X(OP_CALL,    "call",    1, 2) \
+    X(OP_RET,     "ret",     0, 0) \
+    X(OP_STORE,   "store",   2, 3) \
+    X(OP_LOAD,    "load",    2, 3) \
+    X(OP_ADD,     "add",     2, 2) \
+    X(OP_SUB,     "sub",     2, 2) \
+    X(OP_MUL,     "mul",     2, 2) \
+    X(OP_DIV,     "div",     2, 2) \
+    X(OP_SHL,     "shiftl",  2, 2) \
+    X(OP_SHR,     "shiftr",  2, 2) \
+    X(OP_ISHR,    "ishiftr", 2, 2) \
+    X(OP_AND,     "and",     2, 2) \
+    X(OP_OR,      "or",      2, 2) \
+    X(OP_XOR,     "xor",     2, 2) \
+    X(OP_NOT,     "not",     1, 1) \
+    X(OP_JMP,     "jump",    1, 2) \
+    X(OP_JR,      "jumpr",   1, 1) \
+    X(OP_SKIPZ,   "skipz",   1, 1) \
+    X(OP_SKIPNZ,  "skipnz",  1, 1) \
+    X(OP_BANK,    "bank",    1, 1) \
+    X(OP_LOADB,   "loadb",   2, 2) \
+    X(OP_STOREB,  "storeb",  2, 2) \
+    X(OP_MEMCPY,  "memcpy",  3, 3) \
+    X(OP_MEMSET,  "memset",  3, 3) \
+    X(OP_MEMCMP,  "memcmp",  3, 3) \
+    X(OP_JE,      "je",      3, 4) \
+    X(OP_JNE,     "jne",     3, 4) \
+    X(OP_JLT,     "jlt",     3, 4) \
+    X(OP_JGE,     "jge",     3, 4) \
+    X(OP_LOADR,   "loadr",   2, 4) \
+    X(OP_STORER,  "storer",  2, 4) \
+    X(OP_VLOAD,   "vload",   2, 2) \
+    X(OP_VSTORE,  "vstore",  2, 2) \
+    X(OP_VADD8,   "vadd8",   2, 2) \
+    X(OP_VADD16,  "vadd16",  2, 2) \
+    X(OP_VSUB8,   "vsub8",   2, 2) \
+    X(OP_VSUB16,  "vsub16",  2, 2) \
+    X(OP_VMIN8,   "vmin8",   2, 2) \
+    X(OP_VMIN16,  "vmin16",  2, 2) \
+    X(OP_VMAX8,   "vmax8",   2, 2) \
+    X(OP_VMAX16,  "vmax16",  2, 2) \
+    X(OP_VXOR,    "vxor",    2, 2) \
+    X(OP_VSUM8,   "vsum8",   2, 2) \
+    X(OP_VSUM16,  "vsum16",  2, 2) \
+    X(OP_PUSHM,   "pushm",   1, 3) \
+    X(OP_POPM,    "popm",    1, 3) \
+    X(OP_ENTER,   "enter",   1, 2) \
+    X(OP_LEAVE,   "leave",   0, 0)
+
+#define CHIP32_OPCODE_ENTRY(op, mnemonic, nbArgs, bytes) { op, nbArgs, bytes },
+#define CHIP32_MNEMONIC_ENTRY(op, mnemonic, nbArgs, bytes) mnemonic,
+
+#define OPCODES_LIST { CHIP32_OPCODES(CHIP32_OPCODE_ENTRY) }
+#define CHIP32_MNEMONICS_LIST { CHIP32_OPCODES(CHIP32_MNEMONIC_ENTRY) }
 
 /**
   Whole memory is 64KB
@@ -175,16 +299,272 @@ typedef struct
 
 } virtual_mem_t;
 
+/**
+ * Banked memory: a 32-bit address space made of segments, in addition to the
+ * 64 KB RAM/ROM. Banked addresses are (bank << 16) | (16 low bits of the address
+ * register), only reached by loadb/storeb. The load/store instructions and the
+ * stack keep the flat 64 KB model, at the same speed.
+ */
+#define CHIP32_BANK_PAGE_SHIFT 12
+#define CHIP32_BANK_PAGE_SIZE (1U << CHIP32_BANK_PAGE_SHIFT)
+
+typedef struct
+{
+    uint8_t *mem; //!< Host memory, owned by the caller
+    uint32_t addr; //!< Start in the banked address space, page aligned for the TLB to cache it
+    uint32_t size;
+    bool writable; //!< false for ROM segments
+} chip32_segment_t;
+
+// Translation of the last page used by loadb/storeb
+typedef struct
+{
+    uint32_t page; //!< Banked address >> CHIP32_BANK_PAGE_SHIFT
+    uint32_t limit; //!< Bytes of the page inside the segment, 0 if the entry is empty
+    uint8_t *mem; //!< Host address of the start of the page
+    bool writable;
+} chip32_tlb_t;
+
+typedef enum
+{
+    CHIP32_ENGINE_SWITCH,   // portable decode loop around a switch
+    CHIP32_ENGINE_THREADED, // direct-threaded dispatch (computed goto), GCC/Clang only
+    CHIP32_ENGINE_DECODED,  // runs from a pre-decoded instruction cache, see chip32_set_decode_cache()
+} chip32_engine_t;
+
+/**
+ * Pre-decoded instruction: the variable-length encoding of the instruction found
+ * at one ROM address, expanded to a fixed-width, aligned record.
+ */
+typedef struct
+{
+    uint8_t kind; //!< Opcode, or an internal record kind (error, interpreted...)
+    uint8_t ra; //!< First register argument
+    uint8_t rb; //!< Second register argument
+    uint8_t base; //!< Kind of the instruction alone, when the record starts a superinstruction
+    uint32_t imm; //!< Constant of lcons, address of load/store, offset of loadr/storer, third register of memcpy/memset/memcmp, result code of errors
+    uint32_t target; //!< Resolved branch target of jump/call/compare and branch
+    uint32_t next; //!< Address of the next instruction
+} chip32_decoded_t;
+
+/**
+ * Superinstructions: frequent sequences executed by a single handler of the
+ * decoded engine (see chip32_fuse()).
+ */
+typedef enum
+{
+    CHIP32_FUSE_LCONS_ADD,      // lcons rX, imm + add rY, rZ
+    CHIP32_FUSE_LCONS_SUB,      // lcons rX, imm + sub rY, rZ
+    CHIP32_FUSE_SKIPZ_JMP,      // skipz rX + jump label
+    CHIP32_FUSE_SKIPNZ_JMP,     // skipnz rX + jump label
+    CHIP32_FUSE_PUSH_PUSH,      // 2 x push
+    CHIP32_FUSE_PUSH_PUSH_PUSH, // 3 x push
+    CHIP32_FUSE_POP_POP,        // 2 x pop
+    CHIP32_FUSE_POP_POP_POP,    // 3 x pop
+    CHIP32_FUSE_PUSH_CALL,      // push rX + call label
+    CHIP32_FUSE_POP_RET,        // pop rX + ret
+    CHIP32_FUSION_COUNT
+} chip32_fusion_t;
+
+typedef struct
+{
+    uint32_t pairs[INSTRUCTION_COUNT][INSTRUCTION_COUNT]; //!< Adjacent opcode pairs found in the image
+    uint32_t sites[CHIP32_FUSION_COUNT]; //!< Number of places where each superinstruction is used
+    uint64_t fired[CHIP32_FUSION_COUNT]; //!< Number of executions of each superinstruction
+} chip32_fusion_stats_t;
+
+// Vector registers, used by the OP_Vxxx instructions
+#define CHIP32_VREG_COUNT 8
+#define CHIP32_VREG_SIZE 16
+
+// RAM writes are tracked by pages of 64 bytes (see chip32_snapshot.h)
+#define CHIP32_PAGE_SHIFT 6
+#define CHIP32_DIRTY_WORDS ((0x10000 >> CHIP32_PAGE_SHIFT) / 64)
+
+typedef struct chip32_ctx_t chip32_ctx_t;
+
+/**
+ * System call handler, called by OP_SYSCALL with the code given in the instruction.
+ * Arguments are in R0 - R3, results can be written back with chip32_set_register().
+ * Return false to stop the execution (chip32_run() then returns VM_FINISHED).
+ */
+typedef bool (*chip32_syscall_t)(chip32_ctx_t *ctx, uint8_t code);
+
+/**
+ * Host function, called by OP_SYSCALL for the code it is registered at (see
+ * chip32_host_table_register()). 'args' points to R0 - R3 of the context, the
+ * returned value is written into the return register of the entry, if any.
+ * The function may call chip32_suspend() like a system call handler.
+ */
+typedef uint32_t (*chip32_host_fn_t)(chip32_ctx_t *ctx, const uint32_t *args);
+
+#define CHIP32_HOST_MAX_ARGS 4
+#define CHIP32_HOST_NO_RESULT 0xFF // Return register of functions without result
+
+typedef struct
+{
+    chip32_host_fn_t fn; //!< NULL if the code is not registered
+    uint8_t nb_args; //!< Declared argument count, read from R0 onwards
+    uint8_t ret; //!< Return register, CHIP32_HOST_NO_RESULT if none
+} chip32_host_function_t;
+
+// One entry per system call code
+typedef struct
+{
+    chip32_host_function_t functions[256];
+} chip32_host_table_t;
+
+/**
+ * Complete state of one virtual machine. Contexts are fully independent: any number
+ * of them can run at the same time, each one on its own thread.
+ * Memory segments are owned by the caller and must outlive the context.
+ */
+struct chip32_ctx_t
+{
+    virtual_mem_t *rom;
+    virtual_mem_t *ram;
+    uint16_t stack_size;
+    uint32_t registers[REGISTER_COUNT];
+    uint8_t vregs[CHIP32_VREG_COUNT][CHIP32_VREG_SIZE]; //!< Vector registers, lanes in little-endian order
+    bool skip; //!< Next instruction must be skipped (pending when paused after a skip instruction)
+    chip32_engine_t engine; //!< Interpreter loop used by chip32_run()
+    chip32_syscall_t syscall; //!< System call handler, NULL if none
+    const chip32_host_table_t *host_table; //!< Host functions, set by chip32_set_host_table()
+    void *user_data; //!< Free for the user, e.g. to find back the device in the system call handler
+    bool suspend; //!< Set by chip32_suspend()
+    uint64_t instr_count; //!< Instructions executed since chip32_initialize()
+    chip32_decoded_t *decoded; //!< Instruction cache, one record per ROM address (NULL if none)
+    chip32_fusion_stats_t *fusion; //!< Superinstruction statistics, set by chip32_fuse()
+    struct chip32_profiler_t *profiler; //!< Set by chip32_profiler_attach() (see chip32_profiler.h)
+    struct chip32_trace_t *trace; //!< Set by chip32_trace_attach() (see chip32_trace.h)
+    struct chip32_async_t *async; //!< Asynchronous system calls, set by chip32_async_attach() (see chip32_async.h)
+    uint32_t rom_epoch; //!< Incremented each time the program writes into the ROM
+    const chip32_segment_t *segments; //!< Banked memory segments, set by chip32_set_segments()
+    uint32_t segment_count;
+    uint32_t bank; //!< Selected by the bank instruction
+    chip32_tlb_t tlb;
+    const uint8_t *verified; //!< Instruction start bitmap of an image proven valid by chip32_verify(), NULL if none
+    uint64_t dirty[CHIP32_DIRTY_WORDS]; //!< Bitmap of the RAM pages written since the RAM was equal to the snapshot 'snapshot_id'
+    uint64_t snapshot_id; //!< Snapshot the dirty pages are relative to, 0 if none (see chip32_snapshot.h)
+};
+
 // =======================================================================================
 // VM RUN
 // =======================================================================================
-void chip32_initialize(virtual_mem_t *rom, virtual_mem_t *ram, uint16_t stack_size);
-chip32_result_t chip32_run(uint16_t prog_size, uint32_t max_instr);
+void chip32_initialize(chip32_ctx_t *ctx, virtual_mem_t *rom, virtual_mem_t *ram, uint16_t stack_size);
+chip32_result_t chip32_run(chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr);
+
+/**
+ * Register the system call handler of a context, call it after chip32_initialize().
+ */
+void chip32_set_syscall(chip32_ctx_t *ctx, chip32_syscall_t callback, void *user_data);
+
+// Unregister all the functions of a table
+void chip32_host_table_init(chip32_host_table_t *table);
+
+/**
+ * Register 'fn' for the system call 'code', with 'nb_args' arguments (at most
+ * CHIP32_HOST_MAX_ARGS) and its result written into 'ret' (CHIP32_HOST_NO_RESULT
+ * if none). Returns false if the argument count or the return register is invalid,
+ * IP and SP cannot receive a result.
+ */
+bool chip32_host_table_register(chip32_host_table_t *table, uint8_t code, chip32_host_fn_t fn, uint8_t nb_args, uint8_t ret);
+
+/**
+ * Dispatch the system calls of a context through 'table' (owned by the caller, it
+ * must outlive the context, several contexts can share it). The table replaces the
+ * system call handler: codes without function fail with VM_ERR_UNHANDLED_INTERRUPT.
+ * NULL goes back to the handler of chip32_set_syscall().
+ */
+void chip32_set_host_table(chip32_ctx_t *ctx, const chip32_host_table_t *table);
+
+/**
+ * To be called from the system call handler when the result is not available yet
+ * (blocking I/O...). chip32_run() returns VM_WAIT_SYSCALL right after the handler,
+ * and the next call to chip32_run() continues with the instruction following the
+ * system call.
+ */
+void chip32_suspend(chip32_ctx_t *ctx);
+
+/**
+ * Select the interpreter loop used by chip32_run(). The default is the threaded
+ * engine when the compiler supports it, unless VM_DEFAULT_ENGINE_SWITCH is defined.
+ * Define VM_DISABLE_THREADED to build the switch engine only.
+ * Returns false if the engine is not available in this build.
+ */
+bool chip32_set_engine(chip32_ctx_t *ctx, chip32_engine_t engine);
+
+/**
+ * Decode the whole ROM into 'cache', which must hold one record per ROM byte
+ * (rom->size records), then select CHIP32_ENGINE_DECODED.
+ * The cache is owned by the caller. Contexts running the same ROM can share a
+ * cache, as long as nothing writes into that ROM.
+ * Returns false if the cache is too small.
+ */
+bool chip32_set_decode_cache(chip32_ctx_t *ctx, chip32_decoded_t *cache, uint32_t count);
+
+/**
+ * Scan the decoded image (see chip32_set_decode_cache()) for adjacent instruction
+ * sequences and replace the ones appearing at least 'min_sites' times by
+ * superinstructions. Fewer dispatches, same results and instruction counts: a
+ * superinstruction that does not fit in the max_instr budget, or whose stack
+ * checks would fail, runs as separate instructions.
+ * 'stats' is owned by the caller, it receives the image profile and counts the
+ * superinstruction executions. ROM writes undo the superinstructions they touch.
+ * Returns false if the context has no decode cache.
+ */
+bool chip32_fuse(chip32_ctx_t *ctx, chip32_fusion_stats_t *stats, uint32_t min_sites);
+
+// Print the most frequent pairs, the superinstructions used and the dispatches they saved
+void chip32_fusion_report(const chip32_fusion_stats_t *stats, FILE *out);
+
+/**
+ * Give the banked memory segments (owned by the caller, they must outlive the
+ * context) used by loadb/storeb. Accesses outside the segments, or writes into
+ * read-only ones, fail with VM_ERR_INVALID_ADDRESS. Selects bank 0.
+ */
+void chip32_set_segments(chip32_ctx_t *ctx, const chip32_segment_t *segments, uint32_t count);
+
+/**
+ * Static verification of the image, from the current IP: every reachable
+ * instruction is complete, has valid opcode and register indexes, does not write
+ * IP, uses load/store addresses inside the RAM, and its successors (next
+ * instruction, skip, jump and call targets, return address of calls) are
+ * instruction starts inside the ROM.
+ *
+ * On success, chip32_run() uses interpreter loops without these checks. Jumps
+ * whose target is only known at run time (ret, jumpr, IP changed by a system
+ * call) are checked against the verified instruction starts, execution goes on
+ * with the checked loops otherwise. Stack checks are always done.
+ *
+ * 'starts' is owned by the caller, it must hold one bit per ROM byte and stay
+ * valid while the context runs. Images sharing memory with the RAM are never
+ * verified. Returns false and the address of the first faulty instruction otherwise.
+ */
+bool chip32_verify(chip32_ctx_t *ctx, uint8_t *starts, uint32_t starts_size, uint32_t *fault_addr);
+
+/**
+ * To be called when the host has modified the ROM content. Writes done by the
+ * program itself (RAM and ROM sharing the same memory) are tracked automatically.
+ * Superinstructions and verification are removed, call chip32_fuse() or
+ * chip32_verify() again if needed.
+ */
+void chip32_invalidate_rom(chip32_ctx_t *ctx);
 
 // =======================================================================================
 // VM ACCESS
 // =======================================================================================
-uint32_t chip32_get_register(chip32_register_t reg);
-void chip32_set_register(chip32_register_t reg, uint32_t val);
+/**
+ * To be called when the host writes into the RAM (e.g. results of a system call),
+ * 'offset' is relative to the start of the RAM segment. Needed by chip32_snapshot_restore().
+ */
+void chip32_ram_written(chip32_ctx_t *ctx, uint32_t offset, uint32_t size);
+
+uint32_t chip32_get_register(chip32_ctx_t *ctx, chip32_register_t reg);
+void chip32_set_register(chip32_ctx_t *ctx, chip32_register_t reg, uint32_t val);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // CHIP32_H
@@ -25,109 +25,286 @@ THE SOFTWARE.
 
 #include "chip32_assembler.h"
 
-#include <sstream>
+#include <string_view>
 #include <vector>
 #include <algorithm>
 #include <iostream>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <unordered_map>
 
 // =============================================================================
 // GLOBAL UTILITY FUNCTIONS
 // =============================================================================
 static const char* ws = " \t\n\r\f\v";
 
-// trim from end of string (right)
-static inline std::string& rtrim(std::string& s, const char* t = ws)
+// The lexer works on views of the source text, only the Instr records allocate
+// trim from both ends of a view
+static inline std::string_view Trim(std::string_view s)
 {
-    s.erase(s.find_last_not_of(t) + 1);
-    return s;
+    const size_t first = s.find_first_not_of(ws);
+    if (first == std::string_view::npos)
+        return std::string_view();
+    return s.substr(first, s.find_last_not_of(ws) - first + 1);
 }
 
-// trim from beginning of string (left)
-static inline std::string& ltrim(std::string& s, const char* t = ws)
+// Next word separated by white spaces, false at the end of the text
+static bool NextToken(std::string_view &text, std::string_view &token)
 {
-    s.erase(0, s.find_first_not_of(t));
-    return s;
+    const size_t first = text.find_first_not_of(ws);
+    if (first == std::string_view::npos)
+    {
+        text = std::string_view();
+        return false;
+    }
+    size_t last = text.find_first_of(ws, first);
+    if (last == std::string_view::npos)
+        last = text.size();
+    token = text.substr(first, last - first);
+    text.remove_prefix(last);
+    return true;
+}
+
+// Next instruction argument, false at the end of the text. Arguments are separated
+// by a comma and/or white spaces, white spaces inside brackets belong to the
+// argument (e.g. [r1 + 4])
+static bool NextArgument(std::string_view &text, std::string_view &arg)
+{
+    text = Trim(text);
+    if (text.empty())
+        return false;
+
+    size_t end = 0;
+    bool inBrackets = false;
+    for (; end < text.size(); end++)
+    {
+        const char c = text[end];
+        if (c == '[')
+            inBrackets = true;
+        else if (c == ']')
+            inBrackets = false;
+        else if ((c == ',') || (!inBrackets && (strchr(ws, c) != nullptr)))
+            break;
+    }
+    arg = text.substr(0, end);
+
+    // One comma at most after the argument, an empty argument is kept for the error
+    text = Trim(text.substr(end));
+    if (!text.empty() && (text[0] == ','))
+        text.remove_prefix(1);
+    return true;
+}
+
+static bool EqualsNoCase(std::string_view text, std::string_view lowText)
+{
+    if (text.size() != lowText.size())
+        return false;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (std::tolower(static_cast<unsigned char>(text[i])) != lowText[i])
+            return false;
+    }
+    return true;
 }
 
-// trim from both ends of string (right then left)
-static inline std::string& trim(std::string& s, const char* t = ws)
+// Same as strtol(text, NULL, 0), 'complete' tells if the whole text is a number
+static long ToInteger(std::string_view text, bool *complete = nullptr)
 {
-    return ltrim(rtrim(s, t), t);
+    char buffer[64];
+    const size_t len = std::min(text.size(), sizeof(buffer) - 1);
+    memcpy(buffer, text.data(), len);
+    buffer[len] = '\0';
+
+    char *end = nullptr;
+    const long value = strtol(buffer, &end, 0);
+    if (complete != nullptr)
+        *complete = (len == text.size()) && (*end == '\0');
+    return value;
 }
 
-static std::vector<std::string> Split(const std::string &theString)
+// Argument without the white spaces around, inner white spaces become one space (e.g. [r1 + 4])
+static void PushArg(Instr &instr, std::string_view arg)
 {
-    std::vector<std::string> result;
-    std::istringstream iss(theString);
-    for(std::string s; iss >> s; )
-        result.push_back(s);
-    return result;
+    arg = Trim(arg);
+    std::string &out = instr.args.emplace_back();
+    out.reserve(arg.size());
+    std::string_view word;
+    while (NextToken(arg, word))
+    {
+        if (!out.empty())
+            out += ' ';
+        out += word;
+    }
 }
 
-static std::string ToLower(const std::string &text)
+// =============================================================================
+// KEYWORD LOOKUP
+// =============================================================================
+// Mnemonics and registers are found with a perfect hash built at compile time:
+// the seed is searched until every keyword has its own slot, so a lookup is one
+// hash of the token and one comparison.
+
+static constexpr char ToLowerAscii(char c)
 {
-    std::string newText = text;
-    std::transform(newText.begin(), newText.end(), newText.begin(), [](unsigned char c){ return std::tolower(c); });
-    return newText;
+    return ((c >= 'A') && (c <= 'Z')) ? static_cast<char>(c - 'A' + 'a') : c;
 }
 
-static const RegNames AllRegs[] = { { R0, "r0" }, { R1, "r1" }, { R2, "r2" }, { R3, "r3" }, { R4, "r4" }, { R5, "r5" },
-    { T0, "t0" }, { T1, "t1" }, { T2, "t2" }, { T3, "t3" }, { T4, "t4" }, { T5, "t5" }, { T6, "t6" }, { T7, "t7" },
-    { T8, "t8" }, { T9, "t9" }, { IP, "ip" }, { BP, "bp" }, { SP, "sp" }, { RA, "ra" }
+// FNV-1a of the lower case text
+static constexpr uint32_t KeywordHash(std::string_view text, uint32_t seed)
+{
+    uint32_t hash = 2166136261U ^ seed;
+    for (char c : text)
+    {
+        hash ^= static_cast<uint8_t>(ToLowerAscii(c));
+        hash *= 16777619U;
+    }
+    return hash ^ (hash >> 16);
+}
+
+template <size_t SLOTS>
+struct KeywordTable
+{
+    static_assert((SLOTS & (SLOTS - 1)) == 0, "the slot count must be a power of two");
+
+    uint32_t seed{0};
+    uint8_t slots[SLOTS]{}; //!< keyword index + 1, 0 for an empty slot
+
+    // Index of the only keyword that can match the text, -1 if none
+    constexpr int Find(std::string_view text) const
+    {
+        return static_cast<int>(slots[KeywordHash(text, seed) & (SLOTS - 1)]) - 1;
+    }
 };
 
-static const uint32_t NbRegs = sizeof(AllRegs) / sizeof(AllRegs[0]);
+static constexpr std::string_view KeywordOf(std::string_view name) { return name; }
+static constexpr std::string_view KeywordOf(const RegNames &reg) { return reg.name; }
 
-static bool GetRegister(const std::string &regName, uint8_t &reg)
+template <size_t SLOTS, typename T, size_t N>
+static constexpr KeywordTable<SLOTS> MakeKeywordTable(const T (&keywords)[N])
 {
-    std::string lowReg = ToLower(regName);
-    for (uint32_t i = 0; i < NbRegs; i++)
+    static_assert(N < 255, "too many keywords for the slot type");
+    KeywordTable<SLOTS> table;
+    for (uint32_t seed = 0; seed < 100000; seed++)
     {
-        if (lowReg == AllRegs[i].name)
+        table = KeywordTable<SLOTS>();
+        table.seed = seed;
+        bool collision = false;
+        for (size_t i = 0; (i < N) && !collision; i++)
         {
-            reg = AllRegs[i].reg;
-            return true;
+            uint8_t &slot = table.slots[KeywordHash(KeywordOf(keywords[i]), seed) & (SLOTS - 1)];
+            collision = (slot != 0);
+            slot = static_cast<uint8_t>(i + 1);
         }
+        if (!collision)
+            return table;
     }
-    return false;
+    table.seed = UINT32_MAX; // caught by the static_assert of the table
+    return table;
 }
 
-// Keep same order than the opcodes list!!
-static const std::string Mnemonics[] = {
-    "nop", "halt", "syscall", "lcons", "mov", "push", "pop", "call", "ret", "store", "load", "add", "sub", "mul", "div",
-    "shiftl", "shiftr", "ishiftr", "and", "or", "xor", "not", "jump", "jumpr", "skipz", "skipnz"
-};
+// Indexed by register number, all of them from CHIP32_REGISTERS
+#define REG_NAMES_ENTRY(reg, name) { reg, name },
+static constexpr RegNames AllRegs[] = { CHIP32_REGISTERS(REG_NAMES_ENTRY) };
+static_assert(sizeof(AllRegs) / sizeof(AllRegs[0]) == REGISTER_COUNT, "a register has no name");
+
+static constexpr KeywordTable<64> RegisterTable = MakeKeywordTable<64>(AllRegs);
+static_assert(RegisterTable.seed != UINT32_MAX, "no perfect hash found for the registers");
 
-static OpCode OpCodes[] = OPCODES_LIST;
+// Same order as OpCodes, both come from CHIP32_OPCODES
+// loadr and storer are also selected by load/store with a [reg+offset] argument
+static constexpr std::string_view Mnemonics[] = CHIP32_MNEMONICS_LIST;
+static const OpCode OpCodes[] = OPCODES_LIST;
 
-static const uint32_t nbOpCodes = sizeof(OpCodes) / sizeof(OpCodes[0]);
+static constexpr KeywordTable<512> MnemonicTable = MakeKeywordTable<512>(Mnemonics);
+static_assert(MnemonicTable.seed != UINT32_MAX, "no perfect hash found for the mnemonics");
 
-static bool IsOpCode(const std::string &label, OpCode &op)
+static bool GetRegister(std::string_view regName, uint8_t &reg)
 {
-    bool success = false;
-    std::string lowLabel = ToLower(label);
+    const int index = RegisterTable.Find(regName);
+    if ((index < 0) || !EqualsNoCase(regName, AllRegs[index].name))
+        return false;
+    reg = AllRegs[index].reg;
+    return true;
+}
+
+static bool IsOpCode(std::string_view label, OpCode &op)
+{
+    const int index = MnemonicTable.Find(label);
+    if ((index < 0) || !EqualsNoCase(label, Mnemonics[index]))
+        return false;
+    op = OpCodes[index];
+    return true;
+}
+
+// Vector registers: v0 - v7
+static bool GetVRegister(std::string_view regName, uint8_t &vreg)
+{
+    if ((regName.size() != 2) || (std::tolower(static_cast<unsigned char>(regName[0])) != 'v') ||
+        (regName[1] < '0') || (regName[1] >= '0' + CHIP32_VREG_COUNT))
+        return false;
+    vreg = regName[1] - '0';
+    return true;
+}
 
-    for (uint32_t i = 0; i < nbOpCodes; i++)
+// Register list of pushm/popm, e.g.: r0-r3, t0, ra
+static bool GetRegisterMask(const std::vector<std::string> &args, uint32_t &mask)
+{
+    mask = 0;
+    for (const std::string &arg : args)
     {
-        if (Mnemonics[i] == lowLabel)
+        uint8_t first, last;
+        const size_t dash = arg.find('-');
+        if (dash == std::string::npos)
         {
-            success = true;
-            op = OpCodes[i];
-            break;
+            if (!GetRegister(arg, first))
+                return false;
+            last = first;
+        }
+        else
+        {
+            const std::string_view range(arg);
+            if (!GetRegister(Trim(range.substr(0, dash)), first) || !GetRegister(Trim(range.substr(dash + 1)), last) ||
+                (first > last))
+                return false;
+        }
+        for (uint8_t reg = first; reg <= last; reg++)
+        {
+            if ((reg == IP) || (reg == SP))
+                return false;
+            mask |= 1U << reg;
         }
     }
-    return success;
+    return true;
 }
 
-static void GetArgs(Instr &instr, const std::string &data)
+// Register-indirect argument: [reg], [reg+offset] or [reg-offset]
+static bool GetIndirect(std::string_view arg, uint8_t &reg, int16_t &offset)
 {
-    std::string value;
-    std::istringstream iss(data);
-    while (getline(iss, value, ','))
+    if ((arg.size() < 3) || (arg.front() != '[') || (arg.back() != ']'))
+        return false;
+
+    const std::string_view inner = arg.substr(1, arg.size() - 2);
+    const size_t sign = inner.find_first_of("+-");
+    if (!GetRegister(Trim(inner.substr(0, sign)), reg))
+        return false;
+
+    long value = 0;
+    if (sign != std::string_view::npos)
     {
-        instr.args.push_back(trim(value));
+        const std::string_view number = Trim(inner.substr(sign + 1));
+        bool complete = false;
+        value = ToInteger(number, &complete);
+        if (number.empty() || !complete)
+            return false;
+        if (inner[sign] == '-')
+            value = -value;
     }
+    if ((value < INT16_MIN) || (value > INT16_MAX))
+        return false;
+    offset = static_cast<int16_t>(value);
+    return true;
 }
 
 static inline void leu32_put(std::vector<std::uint8_t> &container, uint32_t data)
@@ -148,6 +325,14 @@ static inline void leu16_put(std::vector<std::uint8_t> &container, uint16_t data
     std::cout << "ERROR! Bad register name: " << name << std::endl;\
     return false; }
 
+#define GET_VREG(name, va) if (!GetVRegister(name, va)) {\
+    std::cout << "ERROR! Bad vector register name: " << name << std::endl;\
+    return false; }
+
+#define GET_INDIRECT(arg, ra, offset) if (!GetIndirect(arg, ra, offset)) {\
+    std::cout << "ERROR! Bad register-indirect argument: " << arg << std::endl;\
+    return false; }
+
 #define CHIP32_CHECK(instr, cond, error) if (!(cond)) { \
     std::cout << "error: " << instr.line << ": " << error << std::endl; \
     return false; } \
@@ -157,13 +342,15 @@ static inline void leu16_put(std::vector<std::uint8_t> &container, uint16_t data
 // =============================================================================
 bool Chip32Assembler::CompileMnemonicArguments(Instr &instr)
 {
-    uint8_t ra, rb;
+    uint8_t ra, rb, rc;
+    int16_t offset;
 
     switch(instr.code.opcode)
     {
     case OP_NOP:
     case OP_HALT:
     case OP_RET:
+    case OP_LEAVE:
         // no arguments, just use the opcode
         break;
     case OP_SYSCALL:
@@ -178,6 +365,9 @@ bool Chip32Assembler::CompileMnemonicArguments(Instr &instr)
     case OP_PUSH:
     case OP_SKIPZ:
     case OP_SKIPNZ:
+    case OP_NOT:
+    case OP_JR:
+    case OP_BANK:
         GET_REG(instr.args[0], ra);
         instr.compiledArgs.push_back(ra);
         break;
@@ -192,26 +382,118 @@ bool Chip32Assembler::CompileMnemonicArguments(Instr &instr)
     case OP_AND:
     case OP_OR:
     case OP_XOR:
-    case OP_NOT:
+    case OP_LOADB:
+    case OP_STOREB:
+        GET_REG(instr.args[0], ra);
+        GET_REG(instr.args[1], rb);
+        instr.compiledArgs.push_back(ra);
+        instr.compiledArgs.push_back(rb);
+        break;
+    case OP_MEMCPY:
+    case OP_MEMSET:
+    case OP_MEMCMP:
         GET_REG(instr.args[0], ra);
         GET_REG(instr.args[1], rb);
+        GET_REG(instr.args[2], rc);
         instr.compiledArgs.push_back(ra);
         instr.compiledArgs.push_back(rb);
+        instr.compiledArgs.push_back(rc);
         break;
     case OP_JMP:
     case OP_CALL:
-    case OP_JR:
         // Reserve 2 bytes for address, it will be filled at the end
         instr.useLabel = true;
         instr.compiledArgs.push_back(0);
         instr.compiledArgs.push_back(0);
         break;
+    case OP_JE:
+    case OP_JNE:
+    case OP_JLT:
+    case OP_JGE:
+        GET_REG(instr.args[0], ra);
+        GET_REG(instr.args[1], rb);
+        instr.compiledArgs.push_back(ra);
+        instr.compiledArgs.push_back(rb);
+        // Reserve 2 bytes for address, it will be filled at the end
+        instr.useLabel = true;
+        instr.compiledArgs.push_back(0);
+        instr.compiledArgs.push_back(0);
+        break;
+    case OP_LOADR:
+        GET_REG(instr.args[0], ra);
+        GET_INDIRECT(instr.args[1], rb, offset);
+        instr.compiledArgs.push_back(ra);
+        instr.compiledArgs.push_back(rb);
+        leu16_put(instr.compiledArgs, static_cast<uint16_t>(offset));
+        break;
+    case OP_STORER:
+        GET_INDIRECT(instr.args[0], rb, offset);
+        GET_REG(instr.args[1], ra);
+        instr.compiledArgs.push_back(rb);
+        leu16_put(instr.compiledArgs, static_cast<uint16_t>(offset));
+        instr.compiledArgs.push_back(ra);
+        break;
+    case OP_VLOAD:
+        GET_VREG(instr.args[0], ra);
+        GET_REG(instr.args[1], rb);
+        instr.compiledArgs.push_back(ra);
+        instr.compiledArgs.push_back(rb);
+        break;
+    case OP_VSTORE:
+    case OP_VSUM8:
+    case OP_VSUM16:
+        GET_REG(instr.args[0], ra);
+        GET_VREG(instr.args[1], rb);
+        instr.compiledArgs.push_back(ra);
+        instr.compiledArgs.push_back(rb);
+        break;
+    case OP_VADD8:
+    case OP_VADD16:
+    case OP_VSUB8:
+    case OP_VSUB16:
+    case OP_VMIN8:
+    case OP_VMIN16:
+    case OP_VMAX8:
+    case OP_VMAX16:
+    case OP_VXOR:
+        GET_VREG(instr.args[0], ra);
+        GET_VREG(instr.args[1], rb);
+        instr.compiledArgs.push_back(ra);
+        instr.compiledArgs.push_back(rb);
+        break;
+    case OP_PUSHM:
+    case OP_POPM:
+    {
+        uint32_t mask;
+        if (!GetRegisterMask(instr.args, mask))
+        {
+            std::cout << "ERROR! Bad register list (IP and SP are not allowed)" << std::endl;
+            return false;
+        }
+        instr.compiledArgs.push_back(mask & 0xFF);
+        instr.compiledArgs.push_back((mask >> 8) & 0xFF);
+        instr.compiledArgs.push_back((mask >> 16) & 0xFF);
+        break;
+    }
+    case OP_ENTER:
+        leu16_put(instr.compiledArgs, static_cast<uint16_t>(strtol(instr.args[0].c_str(),  NULL, 0)));
+        break;
     case OP_STORE:
+        if (instr.args[0][0] == '[')
+        {
+            instr.code = OpCodes[OP_STORER];
+            return CompileMnemonicArguments(instr);
+        }
         leu16_put(instr.compiledArgs, static_cast<uint16_t>(strtol(instr.args[0].c_str(),  NULL, 0)));
         GET_REG(instr.args[1], ra);
         instr.compiledArgs.push_back(ra);
         break;
     case OP_LOAD:
+        if (instr.args[1][0] == '[')
+        {
+            instr.code = OpCodes[OP_LOADR];
+            return CompileMnemonicArguments(instr);
+        }
         GET_REG(instr.args[0], ra);
         instr.compiledArgs.push_back(ra);
         leu16_put(instr.compiledArgs, static_cast<uint16_t>(strtol(instr.args[1].c_str(),  NULL, 0)));
@@ -272,7 +554,7 @@ bool Chip32Assembler::BuildBinary(std::vector<uint8_t> &program, AssemblyResult
     for (auto &i : m_instructions)
     {
         i.addr = program.size();
-        if (! (i.isRamData || i.isRomData)) program.push_back(i.code.opcode);
+        if (! (i.isLabel || i.isRamData || i.isRomData)) program.push_back(i.code.opcode);
 
         if (i.isLabel || i.isRamData)
         {
@@ -291,11 +573,11 @@ bool Chip32Assembler::BuildBinary(std::vector<uint8_t> &program, AssemblyResult
     {
         if (i.useLabel && (i.args.size() > 0))
         {
-            // label is always the first argument
-            std::string label = i.args[0];
+            // label is always the last argument, encoded in the last 2 bytes
+            std::string label = i.args.back();
             CHIP32_CHECK(i, m_labels.count(label) > 0, "label not found: " << label);
             uint16_t addr = m_labels[label];
-            uint16_t argsIndex = i.addr + 1;
+            uint16_t argsIndex = i.addr + i.compiledArgs.size() - 1;
 
             program[argsIndex] = addr & 0xFF;
             program[argsIndex+1] = (addr >> 8U) & 0xFF;
@@ -307,119 +589,960 @@ bool Chip32Assembler::BuildBinary(std::vector<uint8_t> &program, AssemblyResult
 
 bool Chip32Assembler::Parse(const std::string &data)
 {
-    std::stringstream data_stream(data);
-    std::string line;
+    const std::string_view text(data);
+    size_t lineStart = 0;
 
     Clear();
+    m_instructions.reserve(std::count(text.begin(), text.end(), '\n') + 1);
 
     int lineNum = 0;
-    while(std::getline(data_stream, line))
+    while (lineStart < text.size())
     {
+        size_t lineEnd = text.find('\n', lineStart);
+        if (lineEnd == std::string_view::npos)
+            lineEnd = text.size();
+        const std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+
         lineNum++;
         Instr instr;
         instr.line = lineNum;
+        if (!ParseLine(line, instr))
+            return false;
+        if (instr.mnemonic.empty())
+            continue; // blank line or comment
+
+        if (instr.isLabel || instr.isRomData || instr.isRamData)
+        {
+            CHIP32_CHECK(instr, m_labels.count(instr.mnemonic) == 0, "duplicated label : " << instr.mnemonic);
+            m_labels[instr.mnemonic] = 0; // will be filled during the build binary phase
+        }
+        m_instructions.push_back(std::move(instr));
+    }
+    return true;
+}
+
+bool Chip32Assembler::ParseLine(std::string_view line, Instr &instr)
+{
+    line = Trim(line);
+    const size_t pos = line.find(';');
+    if (pos != std::string_view::npos) {
+        line = line.substr(0, pos);
+    }
+
+    // First word, 'rest' is what follows it
+    std::string_view rest = line;
+    std::string_view opcode;
+    if (!NextToken(rest, opcode)) return true;
+    rest = Trim(rest);
+
+    // =======================================================================================
+    // LABEL
+    // =======================================================================================
+    if (opcode[0] == '.')
+    {
+        CHIP32_CHECK(instr, (opcode.back() == ':') && rest.empty(), "label must end with ':'");
+        // Label
+        instr.mnemonic = opcode.substr(0, opcode.size() - 1); // remove the colon character
+        instr.isLabel = true;
+    }
+
+    // =======================================================================================
+    // INSTRUCTIONS
+    // =======================================================================================
+    else if (IsOpCode(opcode, instr.code))
+    {
+        instr.mnemonic = opcode;
+        // Test nedded arguments
+        if ((instr.code.nbAargs == 0) && rest.empty())
+        {
+            return true; // no arguments, solo mnemonic
+        }
+        CHIP32_CHECK(instr, (instr.code.nbAargs > 0) && !rest.empty(), "Bad number of parameters");
+
+        instr.args.reserve(instr.code.nbAargs);
+        instr.compiledArgs.reserve(instr.code.bytes);
+        std::string_view arg;
+        while (NextArgument(rest, arg))
+            PushArg(instr, arg);
+
+        // Register lists take any number of arguments
+        const bool isList = (instr.code.opcode == OP_PUSHM) || (instr.code.opcode == OP_POPM);
+        CHIP32_CHECK(instr, (instr.args.size() == instr.code.nbAargs) || isList,
+                     "Bad number of parameters. Required: " << instr.code.nbAargs << ", got: " << instr.args.size());
+        CHIP32_CHECK(instr, CompileMnemonicArguments(instr) == true, "Compile failure");
+    }
+    // =======================================================================================
+    // CONSTANTS IN ROM OR RAM (eg: $yourLabel  DC8 "a string", 5, 4, 8  (DV32 for RAM
+    // =======================================================================================
+    else if (opcode[0] == '$')
+    {
+        instr.mnemonic = opcode;
+        std::string_view type;
+        std::string_view value;
+        const bool hasType = NextToken(rest, type);
+        rest = Trim(rest);
+        CHIP32_CHECK(instr, hasType && !rest.empty(), "bad number of parameters");
+
+        CHIP32_CHECK(instr, (type.size() >= 3), "bad data type size");
+        CHIP32_CHECK(instr, (type[0] == 'D') && ((type[1] == 'C') || (type[1] == 'V')), "bad data type (must be DCxx or DVxx");
+
+        instr.isRomData = type[1] == 'C' ? true : false;
+        instr.isRamData = type[1] == 'V' ? true : false;
+        instr.dataTypeSize = static_cast<uint32_t>(ToInteger(type.substr(2)));
+
+        if (instr.isRomData)
+        {
+            // Each word is a list of comma separated values
+            while (NextToken(rest, value))
+            {
+                size_t comma;
+                while ((comma = value.find(',')) != std::string_view::npos)
+                {
+                    instr.args.emplace_back(value.substr(0, comma));
+                    value.remove_prefix(comma + 1);
+                }
+                if (!value.empty())
+                    instr.args.emplace_back(value);
+            }
+            CHIP32_CHECK(instr, CompileConstantArguments(instr), "Compile error, stopping.");
+        }
+        else
+        {
+            NextToken(rest, value);
+            instr.dataLen = static_cast<uint16_t>(ToInteger(value));
+        }
+    }
+    return true;
+}
+
+// =============================================================================
+// PEEPHOLE OPTIMIZER
+// =============================================================================
+// Works on the parsed instructions, before any address is assigned. Labels and
+// data split the code in basic blocks. The instruction following a skip is
+// executed conditionally: it is never removed nor merged with a neighbour, and
+// the skip would jump over something else if it was.
+
+static const uint32_t ALL_REGISTERS = 0xFFFFFFFFU;
+
+static inline bool IsCode(const Instr &instr)
+{
+    return !(instr.isLabel || instr.isRomData || instr.isRamData);
+}
 
-        line = trim(line);
+// First item at or after 'i' that is placed in the image (instruction or ROM data)
+static size_t NextEmitting(const std::vector<Instr> &instrs, size_t i)
+{
+    while ((i < instrs.size()) && (instrs[i].isLabel || instrs[i].isRamData))
+        i++;
+    return i;
+}
 
-        int pos = line.find_first_of(";");
-        if (pos != std::string::npos) {
-            line.erase(pos);
+// Scalar registers written by an instruction, ALL_REGISTERS for calls, host calls and jumps
+static uint32_t WrittenRegisters(const Instr &instr)
+{
+    const uint32_t first = instr.compiledArgs.empty() ? 0 : 1U << instr.compiledArgs[0];
+
+    switch (instr.code.opcode)
+    {
+    case OP_NOP:
+    case OP_STORE:
+    case OP_STORER:
+    case OP_STOREB:
+    case OP_MEMCPY:
+    case OP_MEMSET:
+    case OP_BANK:
+    case OP_SKIPZ:
+    case OP_SKIPNZ:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JLT:
+    case OP_JGE:
+    case OP_VLOAD:
+    case OP_VSTORE:
+    case OP_VADD8:
+    case OP_VADD16:
+    case OP_VSUB8:
+    case OP_VSUB16:
+    case OP_VMIN8:
+    case OP_VMIN16:
+    case OP_VMAX8:
+    case OP_VMAX16:
+    case OP_VXOR:
+        return 0;
+    case OP_LCONS:
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_ISHR:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_NOT:
+    case OP_LOAD:
+    case OP_LOADR:
+    case OP_LOADB:
+    case OP_MEMCMP:
+    case OP_VSUM8:
+    case OP_VSUM16:
+        return first;
+    case OP_POP:
+        return first | (1U << SP);
+    case OP_PUSH:
+    case OP_PUSHM:
+        return 1U << SP;
+    case OP_POPM:
+        return instr.compiledArgs[0] | (instr.compiledArgs[1] << 8) | (instr.compiledArgs[2] << 16) | (1U << SP);
+    case OP_ENTER:
+    case OP_LEAVE:
+        return (1U << BP) | (1U << SP);
+    default:
+        return ALL_REGISTERS;
+    }
+}
+
+// Moving code is only safe when every code address comes from a label: jumpr,
+// a use of ip or a ra not restored from the stack use absolute numbers instead
+static bool ComputesCodeAddresses(const std::vector<Instr> &instrs)
+{
+    for (const Instr &instr : instrs)
+    {
+        if (!IsCode(instr))
+            continue;
+        if (instr.code.opcode == OP_JR)
+            return true;
+
+        for (const std::string &arg : instr.args)
+        {
+            uint8_t reg;
+            int16_t offset;
+            if ((GetRegister(arg, reg) || GetIndirect(arg, reg, offset)) && (reg == IP))
+                return true;
         }
 
-        if (line.length() <= 0) continue;
+        const uint32_t written = WrittenRegisters(instr);
+        if ((written != ALL_REGISTERS) && (written & (1U << RA)) &&
+            (instr.code.opcode != OP_POP) && (instr.code.opcode != OP_POPM))
+            return true;
+    }
+    return false;
+}
+
+// True for the items that a skip before them may jump over
+static std::vector<bool> FindGuarded(const std::vector<Instr> &instrs)
+{
+    std::vector<bool> guarded(instrs.size(), false);
+    bool afterSkip = false;
+    for (size_t i = 0; i < instrs.size(); i++)
+    {
+        guarded[i] = afterSkip;
+        if (instrs[i].isLabel || instrs[i].isRamData)
+            continue; // nothing in the image, the skip goes on to the next item
+        afterSkip = IsCode(instrs[i]) && ((instrs[i].code.opcode == OP_SKIPZ) || (instrs[i].code.opcode == OP_SKIPNZ));
+    }
+    return guarded;
+}
 
-        // Split the line
-        std::vector<std::string> lineParts = Split(line);
+static void EraseRemoved(std::vector<Instr> &instrs, const std::vector<bool> &removed, OptimizationResult &result)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < instrs.size(); i++)
+    {
+        if (removed[i])
+        {
+            result.removedLines.push_back(instrs[i].line);
+            continue;
+        }
+        if (out != i)
+            instrs[out] = std::move(instrs[i]);
+        out++;
+    }
+    instrs.resize(out);
+}
 
-        CHIP32_CHECK(instr, (lineParts.size() > 0), " not a valid line");
+static uint32_t ImageSize(const std::vector<Instr> &instrs)
+{
+    uint32_t size = 0;
+    for (const Instr &instr : instrs)
+    {
+        if (IsCode(instr))
+            size += 1 + instr.compiledArgs.size();
+        else if (instr.isRomData)
+            size += instr.compiledArgs.size();
+    }
+    return size;
+}
 
-        // Ok until now
-        std::string opcode = lineParts[0];
+// Instructions between halt, ret or jump and the next label are never executed
+static bool RemoveDeadCode(std::vector<Instr> &instrs, OptimizationResult &result)
+{
+    const std::vector<bool> guarded = FindGuarded(instrs);
+    std::vector<bool> removed(instrs.size(), false);
+    bool dead = false;
+    bool changed = false;
 
-        // =======================================================================================
-        // LABEL
-        // =======================================================================================
-        if (opcode[0] == '.')
+    for (size_t i = 0; i < instrs.size(); i++)
+    {
+        if (!IsCode(instrs[i]))
         {
-            CHIP32_CHECK(instr, (opcode[opcode.length() - 1] == ':') && (lineParts.size() == 1), "label must end with ':'");
-            // Label
-            opcode.pop_back(); // remove the colon character
-            instr.mnemonic = opcode;
-            instr.isLabel = true;
-            CHIP32_CHECK(instr, m_labels.count(opcode) == 0, "duplicated label : " << opcode);
-            m_labels[opcode] = 0; // will be filled during the build binary phase
-            m_instructions.push_back(instr);
+            dead = false; // reachable through a label, data is kept anyway
+            continue;
         }
+        if (dead)
+        {
+            removed[i] = true;
+            result.deadRemoved++;
+            changed = true;
+            continue;
+        }
+        const uint8_t op = instrs[i].code.opcode;
+        dead = !guarded[i] && ((op == OP_HALT) || (op == OP_RET) || (op == OP_JMP));
+    }
+    EraseRemoved(instrs, removed, result);
+    return changed;
+}
+
+// Branches to a jump go directly to its target, branches to the next instruction are removed
+static bool ThreadJumps(std::vector<Instr> &instrs, OptimizationResult &result)
+{
+    const std::vector<bool> guarded = FindGuarded(instrs);
+    std::vector<bool> removed(instrs.size(), false);
+    std::map<std::string, size_t> labels;
+    bool changed = false;
+
+    for (size_t i = 0; i < instrs.size(); i++)
+    {
+        if (instrs[i].isLabel)
+            labels[instrs[i].mnemonic] = i;
+    }
+
+    for (size_t i = 0; i < instrs.size(); i++)
+    {
+        Instr &instr = instrs[i];
+        const uint8_t op = instr.code.opcode;
+        if (!IsCode(instr) || !instr.useLabel || instr.args.empty() ||
+            ((op != OP_JMP) && (op != OP_CALL) && (op != OP_JE) && (op != OP_JNE) && (op != OP_JLT) && (op != OP_JGE)))
+            continue;
 
-        // =======================================================================================
-        // INSTRUCTIONS
-        // =======================================================================================
-        else if (IsOpCode(opcode, instr.code))
+        // Follow the chain of jumps, a loop of jumps is left as is
+        std::string label = instr.args.back();
+        std::vector<std::string> visited;
+        bool loop = false;
+        while (labels.count(label) > 0)
         {
-            instr.mnemonic = opcode;
-            bool nbArgsSuccess = false;
-            // Test nedded arguments
-            if ((instr.code.nbAargs == 0) && (lineParts.size() == 1))
+            const size_t target = NextEmitting(instrs, labels[label]);
+            if ((target >= instrs.size()) || !IsCode(instrs[target]) || (instrs[target].code.opcode != OP_JMP) ||
+                instrs[target].args.empty())
+                break;
+            visited.push_back(label);
+            label = instrs[target].args.back();
+            if (std::find(visited.begin(), visited.end(), label) != visited.end())
             {
-                nbArgsSuccess = true; // no arguments, solo mnemonic
+                loop = true;
+                break;
             }
-            else if ((instr.code.nbAargs > 0) && (lineParts.size() >= 2))
+        }
+        if (!loop && (label != instr.args.back()))
+        {
+            instr.args.back() = label;
+            result.jumpsThreaded++;
+            changed = true;
+        }
+
+        if ((op != OP_CALL) && !guarded[i] && (labels.count(instr.args.back()) > 0))
+        {
+            const size_t labelIndex = labels[instr.args.back()];
+            if ((labelIndex > i) && (NextEmitting(instrs, i + 1) == NextEmitting(instrs, labelIndex)))
             {
-                // Compute arguments
-                for (int i = 1; i < lineParts.size(); i++)
-                {
-                    GetArgs(instr, lineParts[i]);
-                }
+                removed[i] = true;
+                result.jumpsRemoved++;
+                changed = true;
+            }
+        }
+    }
+    EraseRemoved(instrs, removed, result);
+    return changed;
+}
+
+// Symbolic content of the registers within a basic block: two registers with the
+// same number hold the same value, constants are numbered by their value
+class RegisterValues
+{
+public:
+    static const uint64_t CONSTANT = 1ULL << 32;
+
+    RegisterValues() { Forget(ALL_REGISTERS); }
+
+    void Forget(uint32_t mask)
+    {
+        for (uint32_t reg = 0; reg < REGISTER_COUNT; reg++)
+        {
+            if (mask & (1U << reg))
+                m_values[reg] = m_next++;
+        }
+    }
+
+    uint64_t &operator[](uint8_t reg) { return m_values[reg]; }
+
+    // Register holding the value, REGISTER_COUNT if none
+    uint8_t Find(uint64_t value) const
+    {
+        for (uint8_t reg = 0; reg < REGISTER_COUNT; reg++)
+        {
+            if (m_values[reg] == value)
+                return reg;
+        }
+        return REGISTER_COUNT;
+    }
+
+private:
+    uint64_t m_values[REGISTER_COUNT];
+    uint64_t m_next{CONSTANT << 1}; //!< unknown values, never equal to a constant
+};
+
+static void MakeMov(Instr &instr, const std::string &dest, uint8_t destReg, const std::string &src, uint8_t srcReg)
+{
+    instr.code = OpCodes[OP_MOV];
+    instr.mnemonic = "mov";
+    instr.args = { dest, src };
+    instr.compiledArgs = { destReg, srcReg };
+}
+
+// Removes the mov and lcons that do not change their destination, and the push/pop pairs
+static bool ForwardValues(std::vector<Instr> &instrs, OptimizationResult &result)
+{
+    const std::vector<bool> guarded = FindGuarded(instrs);
+    std::vector<bool> removed(instrs.size(), false);
+    RegisterValues values;
+    bool changed = false;
+
+    for (size_t i = 0; i < instrs.size(); i++)
+    {
+        Instr &instr = instrs[i];
+        if (!IsCode(instr))
+        {
+            values.Forget(ALL_REGISTERS); // a label can be reached from anywhere
+            continue;
+        }
+        const uint8_t op = instr.code.opcode;
+        const uint32_t written = WrittenRegisters(instr);
 
-                CHIP32_CHECK(instr, instr.args.size() == instr.code.nbAargs,
-                             "Bad number of parameters. Required: " << instr.code.nbAargs << ", got: " << instr.args.size());
-                nbArgsSuccess = true;
+        if (guarded[i])
+        {
+            values.Forget(written); // old or new value
+            continue;
+        }
+
+        if (op == OP_MOV)
+        {
+            const uint8_t dest = instr.compiledArgs[0];
+            const uint8_t src = instr.compiledArgs[1];
+            if (values[dest] == values[src])
+            {
+                removed[i] = true;
+                result.movRemoved++;
+                changed = true;
+                continue;
             }
-            else
+            values[dest] = values[src];
+        }
+        else if (op == OP_LCONS)
+        {
+            const uint8_t dest = instr.compiledArgs[0];
+            const uint64_t value = RegisterValues::CONSTANT | (instr.compiledArgs[1] | (instr.compiledArgs[2] << 8) |
+                                   (instr.compiledArgs[3] << 16) | (static_cast<uint32_t>(instr.compiledArgs[4]) << 24));
+            const uint8_t holder = values.Find(value);
+            if (holder == dest)
             {
-                CHIP32_CHECK(instr, false, "Bad number of parameters");
+                removed[i] = true;
+                result.lconsRemoved++;
+                changed = true;
+                continue;
             }
-
-            if (nbArgsSuccess)
+            if (holder < REGISTER_COUNT)
             {
-                CHIP32_CHECK(instr, CompileMnemonicArguments(instr) == true, "Compile failure");
-                m_instructions.push_back(instr);
+                MakeMov(instr, instr.args[0], dest, AllRegs[holder].name, holder);
+                result.lconsToMov++;
+                changed = true;
             }
+            values[dest] = value;
         }
-        // =======================================================================================
-        // CONSTANTS IN ROM OR RAM (eg: $yourLabel  DC8 "a string", 5, 4, 8  (DV32 for RAM
-        // =======================================================================================
-        else if (opcode[0] == '$')
+        else if ((op == OP_PUSH) && (i + 1 < instrs.size()) && IsCode(instrs[i + 1]) &&
+                 (instrs[i + 1].code.opcode == OP_POP) && (instr.compiledArgs[0] != SP) &&
+                 (instrs[i + 1].compiledArgs[0] != SP))
         {
-            instr.mnemonic = opcode;
-            CHIP32_CHECK(instr, (lineParts.size() >= 3), "bad number of parameters");
+            // The slot below the stack pointer is not read back, the pair is a copy (but for sp that moves in between)
+            Instr &pop = instrs[i + 1];
+            const uint8_t src = instr.compiledArgs[0];
+            const uint8_t dest = pop.compiledArgs[0];
+            removed[i] = true;
+            if (src == dest)
+                removed[i + 1] = true;
+            else
+                MakeMov(pop, pop.args[0], dest, instr.args[0], src);
+            values[dest] = values[src];
+            result.pushPopRemoved++;
+            changed = true;
+            i++;
+        }
+        else
+        {
+            values.Forget(written);
+        }
+    }
+    EraseRemoved(instrs, removed, result);
+    return changed;
+}
 
-            std::string type = lineParts[1];
+void Chip32Assembler::Optimize(OptimizationResult &result)
+{
+    result = OptimizationResult();
+    if (ComputesCodeAddresses(m_instructions))
+    {
+        result.skipped = true;
+        return;
+    }
 
-            CHIP32_CHECK(instr, (type.size() >= 3), "bad data type size");
-            CHIP32_CHECK(instr, (type[0] == 'D') && ((type[1] == 'C') || (type[1] == 'V')), "bad data type (must be DCxx or DVxx");
-            CHIP32_CHECK(instr, m_labels.count(opcode) == 0, "duplicated label : " << opcode);
-            m_labels[opcode] = 0; // will be filled during the build binary phase
+    const uint32_t sizeBefore = ImageSize(m_instructions);
+    bool changed = true;
+    while (changed)
+    {
+        changed = RemoveDeadCode(m_instructions, result);
+        changed = ThreadJumps(m_instructions, result) || changed;
+        changed = ForwardValues(m_instructions, result) || changed;
+    }
+    result.bytesSaved = sizeBefore - ImageSize(m_instructions);
+    std::sort(result.removedLines.begin(), result.removedLines.end());
+}
 
-            instr.isRomData = type[1] == 'C' ? true : false;
-            instr.isRamData = type[1] == 'V' ? true : false;
-            type.erase(0, 2);
-            instr.dataTypeSize = static_cast<uint32_t>(strtol(type.c_str(),  NULL, 0));
+// =============================================================================
+// OBJECT OUTPUT
+// =============================================================================
+static uint16_t FindSymbol(Chip32Object &object, std::map<std::string, uint16_t> &indexes, const std::string &name)
+{
+    auto it = indexes.find(name);
+    if (it != indexes.end())
+        return it->second;
+
+    const uint16_t index = object.symbols.size();
+    object.symbols.emplace_back();
+    object.symbols.back().name = name;
+    object.symbols.back().section = Chip32Object::UNDEFINED;
+    indexes[name] = index;
+    return index;
+}
+
+static void DefineSymbol(Chip32Object &object, std::map<std::string, uint16_t> &indexes, const std::string &name)
+{
+    ObjectSymbol &symbol = object.symbols[FindSymbol(object, indexes, name)];
+    symbol.section = object.sections.size() - 1;
+    symbol.offset = object.sections.back().bytes.size();
+}
+
+bool Chip32Assembler::BuildObject(Chip32Object &object)
+{
+    const std::vector<bool> guarded = FindGuarded(m_instructions);
+    std::map<std::string, uint16_t> indexes;
+    bool fallsThrough = true; // the first section is the entry point
+    bool inCode = false;
+
+    object = Chip32Object();
+    object.keepAll = ComputesCodeAddresses(m_instructions);
+
+    for (size_t i = 0; i < m_instructions.size(); i++)
+    {
+        const Instr &instr = m_instructions[i];
 
+        if (instr.isRomData || instr.isRamData)
+        {
+            if (!object.sections.empty())
+                object.sections.back().fallsThrough = fallsThrough;
+            object.sections.emplace_back();
+            object.sections.back().isData = true;
+            DefineSymbol(object, indexes, instr.mnemonic);
             if (instr.isRomData)
-            {
-                for (int i = 2; i < lineParts.size(); i++)
-                {
-                    GetArgs(instr, lineParts[i]);
-                }
-                CHIP32_CHECK(instr, CompileConstantArguments(instr), "Compile error, stopping.");
-            }
+                object.sections.back().bytes = instr.compiledArgs;
             else
+                object.sections.back().ramUsage = instr.dataLen * instr.dataTypeSize / 8;
+            inCode = false;
+            continue;
+        }
+
+        // A label not reached by the previous code starts a section, as code after data
+        if (!inCode || (instr.isLabel && !fallsThrough))
+        {
+            if (!object.sections.empty())
+                object.sections.back().fallsThrough = fallsThrough;
+            object.sections.emplace_back();
+            inCode = true;
+            fallsThrough = true; // until its first jump
+        }
+
+        if (instr.isLabel)
+        {
+            DefineSymbol(object, indexes, instr.mnemonic);
+            continue;
+        }
+
+        ObjectSection &section = object.sections.back();
+        section.bytes.push_back(instr.code.opcode);
+        section.bytes.insert(section.bytes.end(), instr.compiledArgs.begin(), instr.compiledArgs.end());
+        if (instr.useLabel && (instr.args.size() > 0))
+        {
+            // label is always the last argument, encoded in the last 2 bytes
+            ObjectReloc reloc;
+            reloc.section = object.sections.size() - 1;
+            reloc.offset = section.bytes.size() - 2;
+            reloc.symbol = FindSymbol(object, indexes, instr.args.back());
+            object.relocs.push_back(reloc);
+        }
+
+        // A skip at the end of the previous object can jump over the first instruction
+        const bool first = (object.sections.size() == 1) && (section.bytes.size() == 1 + instr.compiledArgs.size());
+        const uint8_t op = instr.code.opcode;
+        fallsThrough = guarded[i] || first || ((op != OP_HALT) && (op != OP_RET) && (op != OP_JMP) && (op != OP_JR));
+    }
+    if (!object.sections.empty())
+        object.sections.back().fallsThrough = fallsThrough;
+    return true;
+}
+
+// =============================================================================
+// INCREMENTAL ASSEMBLY
+// =============================================================================
+// The lines of the previous source are kept parsed. An update compares the new
+// source with the previous one and parses the lines between the common prefix
+// and the common suffix. The lines are then placed again from the first changed
+// one, the image before it is kept, which only reads their compiled bytes: much
+// cheaper than tokenizing, and shifted addresses need no special case. All the
+// label fixups are written again from a compact list.
+
+struct LiveLabel
+{
+    uint32_t addr{0};
+    uint32_t defs{0};   //!< Lines defining the label
+    uint32_t uses{0};   //!< Lines branching to it
+    uint32_t pass{0};   //!< Last placement that met a definition, finds the duplicates
+};
+
+struct LiveLine
+{
+    Instr instr;
+    bool valid{false};
+    LiveLabel *label{nullptr};  //!< Defined label (label, constants or RAM variable)
+    LiveLabel *target{nullptr}; //!< Label of a branch
+    uint32_t addr{0};           //!< Image size before the line, as placed last time
+    uint32_t ramUsage{0};       //!< RAM usage before the line
+    uint32_t constants{0};      //!< Constants size before the line
+};
+
+struct LiveFixup
+{
+    uint32_t end;       //!< Image position after the instruction, the label address is in the last 2 bytes
+    LiveLabel *target;
+    uint32_t line;
+};
+
+struct CachedLine
+{
+    std::string text;
+    Instr instr;
+    bool valid{false};
+};
+
+struct Chip32LiveState
+{
+    std::string source;
+    std::vector<uint32_t> lineStarts;   //!< Offset of each line in 'source'
+    std::vector<LiveLine> lines;
+    std::unordered_map<std::string, LiveLabel> labels; //!< Nodes are stable, lines point to them
+    std::unordered_map<uint64_t, CachedLine> cache;    //!< Parsed lines by content hash
+    std::vector<uint8_t> program;       //!< Last image built
+    std::vector<LiveFixup> fixups;      //!< Of the last image, by position
+    AssemblyResult totals{0, 0, 0};     //!< Of the last image
+    uint32_t duplicates{0};             //!< Labels defined more than once
+    uint32_t pass{0};
+    bool placed{false};                 //!< The last placement succeeded, its lines can be kept
+};
+
+static const size_t LIVE_CACHE_EXTRA = 4096; // cached lines beyond the ones of the source
+static const size_t LIVE_MERGED_GAP = 16;    // unchanged bytes between two changed ranges
+
+Chip32Assembler::Chip32Assembler() = default;
+Chip32Assembler::~Chip32Assembler() = default;
+
+// FNV-1a
+static uint64_t LineHash(std::string_view text)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : text)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t CommonPrefix(const char *a, const char *b, size_t size)
+{
+    const size_t BLOCK = 256;
+    size_t n = 0;
+    while ((n + BLOCK <= size) && (memcmp(a + n, b + n, BLOCK) == 0))
+        n += BLOCK;
+    while ((n < size) && (a[n] == b[n]))
+        n++;
+    return n;
+}
+
+// Common size at the end of a[0, aSize) and b[0, bSize), at most 'size'
+static size_t CommonSuffix(const char *a, size_t aSize, const char *b, size_t bSize, size_t size)
+{
+    const size_t BLOCK = 256;
+    size_t n = 0;
+    while ((n + BLOCK <= size) && (memcmp(a + aSize - n - BLOCK, b + bSize - n - BLOCK, BLOCK) == 0))
+        n += BLOCK;
+    while ((n < size) && (a[aSize - n - 1] == b[bSize - n - 1]))
+        n++;
+    return n;
+}
+
+static void AttachLabels(Chip32LiveState &live, LiveLine &line)
+{
+    const Instr &instr = line.instr;
+    if (!line.valid || instr.mnemonic.empty())
+        return;
+    if (instr.isLabel || instr.isRomData || instr.isRamData)
+    {
+        line.label = &live.labels[instr.mnemonic];
+        if (++line.label->defs == 2)
+            live.duplicates++;
+    }
+    else if (instr.useLabel && (instr.args.size() > 0))
+    {
+        line.target = &live.labels[instr.args.back()];
+        line.target->uses++;
+    }
+}
+
+static void DetachLabels(Chip32LiveState &live, LiveLine &line)
+{
+    if (line.label != nullptr)
+    {
+        if (line.label->defs == 2)
+            live.duplicates--;
+        if ((--line.label->defs == 0) && (line.label->uses == 0))
+            live.labels.erase(line.instr.mnemonic);
+        line.label = nullptr;
+    }
+    if (line.target != nullptr)
+    {
+        if ((--line.target->uses == 0) && (line.target->defs == 0))
+            live.labels.erase(line.instr.args.back());
+        line.target = nullptr;
+    }
+}
+
+bool Chip32Assembler::Update(const std::string &data, std::vector<uint8_t> &program, AssemblyResult &result, std::vector<RomRange> &changes)
+{
+    if (!m_live)
+        m_live = std::make_unique<Chip32LiveState>();
+    Chip32LiveState &live = *m_live;
+    const std::string &old = live.source;
+    changes.clear();
+
+    // 1. Lines [first, last) of the previous source are replaced by the lines of data[start, end)
+    const size_t common = std::min(old.size(), data.size());
+    const size_t prefix = CommonPrefix(old.data(), data.data(), common);
+    const size_t suffix = CommonSuffix(old.data(), old.size(), data.data(), data.size(), common - prefix);
+
+    std::vector<uint32_t> &starts = live.lineStarts;
+    size_t first = std::upper_bound(starts.begin(), starts.end(), prefix) - starts.begin();
+    first = (first > 0) ? first - 1 : 0;
+    // The next unchanged line follows a new line character in the common suffix
+    const size_t last = std::lower_bound(starts.begin() + first, starts.end(), old.size() - suffix + 1) - starts.begin();
+    const size_t start = (first < starts.size()) ? starts[first] : 0;
+    const size_t end = (last < starts.size()) ? starts[last] + data.size() - old.size() : data.size();
+
+    // 2. Parse the new lines, or take them from the cache
+    for (size_t i = first; i < last; i++)
+    {
+        DetachLabels(live, live.lines[i]);
+    }
+    if (live.cache.size() > live.lines.size() + LIVE_CACHE_EXTRA)
+        live.cache.clear();
+
+    std::vector<LiveLine> added;
+    std::vector<uint32_t> addedStarts;
+    std::vector<bool> reported; //!< Errors printed by the parser
+    size_t pos = start;
+    while (pos < end)
+    {
+        size_t lineEnd = data.find('\n', pos);
+        if ((lineEnd == std::string::npos) || (lineEnd > end))
+            lineEnd = end;
+        const std::string_view text = std::string_view(data).substr(pos, lineEnd - pos);
+        addedStarts.push_back(pos);
+        pos = lineEnd + 1;
+
+        LiveLine &line = added.emplace_back();
+        const uint64_t hash = LineHash(text);
+        auto cached = live.cache.find(hash);
+        if ((cached != live.cache.end()) && (cached->second.text == text))
+        {
+            line.instr = cached->second.instr;
+            line.valid = cached->second.valid;
+            reported.push_back(false);
+        }
+        else
+        {
+            line.instr.line = first + added.size();
+            line.valid = ParseLine(text, line.instr);
+            CachedLine &entry = live.cache[hash];
+            entry.text = text;
+            entry.instr = line.instr;
+            entry.valid = line.valid;
+            reported.push_back(true);
+        }
+        line.instr.line = first + added.size();
+        AttachLabels(live, line);
+    }
+
+    // Where the placement can start, the new lines replace the old line 'first'
+    uint32_t baseAddr = live.program.size();
+    AssemblyResult base = live.totals;
+    if (first < live.lines.size())
+    {
+        baseAddr = live.lines[first].addr;
+        base.ramUsageSize = live.lines[first].ramUsage;
+        base.constantsSize = live.lines[first].constants;
+    }
+
+    // Splice them in place of the old ones, the following lines move by the size difference
+    const size_t kept = std::min(last - first, added.size());
+    const int32_t delta = static_cast<int32_t>(data.size() - old.size());
+    std::move(added.begin(), added.begin() + kept, live.lines.begin() + first);
+    std::copy(addedStarts.begin(), addedStarts.begin() + kept, starts.begin() + first);
+    for (size_t i = last; i < starts.size(); i++)
+        starts[i] += delta;
+    if (added.size() > kept)
+    {
+        live.lines.insert(live.lines.begin() + last, std::make_move_iterator(added.begin() + kept), std::make_move_iterator(added.end()));
+        starts.insert(starts.begin() + last, addedStarts.begin() + kept, addedStarts.end());
+    }
+    else
+    {
+        live.lines.erase(live.lines.begin() + first + kept, live.lines.begin() + last);
+        starts.erase(starts.begin() + first + kept, starts.begin() + last);
+    }
+    live.source = data;
+
+    // 3. Place the lines as BuildBinary(), from the first changed one when the
+    // previous lines were all placed (a duplicated label must be reported at its
+    // first duplicate, which may be before)
+    size_t from = 0;
+    if (live.placed && (live.duplicates == 0))
+        from = first;
+    std::vector<uint8_t> image;
+    image.reserve(live.program.size() + 64);
+    result = { 0, 0, 0 };
+    if (from > 0)
+    {
+        result.ramUsageSize = base.ramUsageSize;
+        result.constantsSize = base.constantsSize;
+        image.assign(live.program.begin(), live.program.begin() + baseAddr);
+        live.fixups.erase(std::lower_bound(live.fixups.begin(), live.fixups.end(), baseAddr + 1,
+                                           [](const LiveFixup &f, uint32_t pos) { return f.end < pos; }),
+                          live.fixups.end());
+    }
+    else
+    {
+        live.fixups.clear();
+    }
+    live.placed = false;
+    live.pass++;
+    bool success = true;
+
+    for (size_t i = from; i < live.lines.size(); i++)
+    {
+        LiveLine &line = live.lines[i];
+        const Instr &instr = line.instr;
+        line.instr.line = i + 1;
+        line.addr = image.size();
+        line.ramUsage = result.ramUsageSize;
+        line.constants = result.constantsSize;
+        if (!line.valid)
+        {
+            // Parse the first wrong line again if its error was not printed yet
+            if (success && ((i < first) || (i >= first + added.size()) || !reported[i - first]))
             {
-                instr.dataLen = static_cast<uint16_t>(strtol(lineParts[2].c_str(),  NULL, 0));
+                Instr again;
+                again.line = i + 1;
+                const size_t lineEnd = (i + 1 < starts.size()) ? starts[i + 1] - 1 : data.size();
+                ParseLine(std::string_view(data).substr(starts[i], lineEnd - starts[i]), again);
             }
-            m_instructions.push_back(instr);
+            success = false;
+            continue;
         }
+
+        if (line.label != nullptr)
+        {
+            CHIP32_CHECK(instr, line.label->pass != live.pass, "duplicated label : " << instr.mnemonic);
+            line.label->pass = live.pass;
+            // as BuildBinary(), the labels of constants are not placed
+            line.label->addr = instr.isRomData ? 0 : image.size();
+        }
+        if (instr.isRamData)
+        {
+            result.ramUsageSize += instr.dataLen * instr.dataTypeSize / 8;
+        }
+        else if (instr.isRomData)
+        {
+            result.constantsSize += instr.compiledArgs.size();
+            image.insert(image.end(), instr.compiledArgs.begin(), instr.compiledArgs.end());
+        }
+        else if (!instr.isLabel && !instr.mnemonic.empty())
+        {
+            image.push_back(instr.code.opcode);
+            image.insert(image.end(), instr.compiledArgs.begin(), instr.compiledArgs.end());
+            if (line.target != nullptr)
+                live.fixups.push_back({ static_cast<uint32_t>(image.size()), line.target, static_cast<uint32_t>(i) });
+        }
+    }
+    if (!success)
+        return false;
+
+    // 4. Label fixups, the label address goes in the last 2 bytes of the instruction
+    for (const LiveFixup &fixup : live.fixups)
+    {
+        const Instr &instr = live.lines[fixup.line].instr;
+        CHIP32_CHECK(instr, fixup.target->defs > 0, "label not found: " << instr.args.back());
+        image[fixup.end - 2] = fixup.target->addr & 0xFF;
+        image[fixup.end - 1] = (fixup.target->addr >> 8U) & 0xFF;
     }
+    live.placed = true;
+    live.totals = result;
+
+    // 5. Differences with the previous image, close ranges are merged (a shift changes most bytes)
+    const size_t overlap = std::min(image.size(), live.program.size());
+    for (size_t i = 0; i < overlap; i++)
+    {
+        if (image[i] == live.program[i])
+            continue;
+        if (!changes.empty() && (i - changes.back().end < LIVE_MERGED_GAP))
+            changes.back().end = i + 1;
+        else
+            changes.push_back({ static_cast<uint32_t>(i), static_cast<uint32_t>(i + 1) });
+    }
+    if (image.size() > live.program.size())
+        changes.push_back({ static_cast<uint32_t>(live.program.size()), static_cast<uint32_t>(image.size()) });
+
+    live.program = std::move(image);
+    program = live.program;
+    result.romUsageSize = program.size();
     return true;
 }
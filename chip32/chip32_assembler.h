@@ -29,7 +29,9 @@ THE SOFTWARE.
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <map>
+#include <memory>
 #include <iostream>
 
 
@@ -59,7 +61,7 @@ struct Instr {
 struct RegNames
 {
     chip32_register_t reg;
-    std::string name;
+    const char *name;
 };
 
 struct AssemblyResult
@@ -79,14 +81,115 @@ struct AssemblyResult
     }
 };
 
+struct OptimizationResult
+{
+    int movRemoved{0};      //!< copies of a value already in the destination register
+    int lconsRemoved{0};    //!< constants already in the destination register
+    int lconsToMov{0};      //!< constants already in another register, loaded with a shorter mov
+    int jumpsThreaded{0};   //!< branches retargeted past a jump
+    int jumpsRemoved{0};    //!< branches to the next instruction
+    int pushPopRemoved{0};  //!< push/pop pairs removed or turned into a mov
+    int deadRemoved{0};     //!< unreachable instructions after halt, ret or jump
+    int bytesSaved{0};
+    bool skipped{false};    //!< the program computes code addresses, nothing was changed
+    std::vector<uint16_t> removedLines; //!< source lines of the removed instructions
+
+    void Print()
+    {
+        if (skipped)
+        {
+            std::cout << "Optimizer skipped: the program computes code addresses (jumpr, ip or ra)\n" << std::endl;
+            return;
+        }
+        std::cout << "Redundant mov: " << movRemoved << "\n"
+                  << "Redundant lcons: " << lconsRemoved << " (" << lconsToMov << " turned into mov)\n"
+                  << "Threaded jumps: " << jumpsThreaded << "\n"
+                  << "Jumps to next: " << jumpsRemoved << "\n"
+                  << "Push/pop pairs: " << pushPopRemoved << "\n"
+                  << "Dead instructions: " << deadRemoved << "\n"
+                  << "Saved: " << bytesSaved << " bytes\n"
+                  << std::endl;
+    }
+};
+
+// =============================================================================
+// RELOCATABLE OBJECTS
+// =============================================================================
+// The code is cut into sections after each halt, ret or jump (the next section
+// is not reached by falling through), constants and RAM variables have their own
+// sections. Label addresses are left to the linker (chip32_linker.h).
+
+struct ObjectSection
+{
+    std::vector<uint8_t> bytes;
+    uint16_t ramUsage{0};       //!< Size of the RAM variable declared by the section
+    bool isData{false};         //!< Constants or RAM variable, never stripped
+    bool fallsThrough{false};   //!< The execution can continue into the next section
+};
+
+struct ObjectSymbol
+{
+    std::string name;
+    uint16_t section{0};        //!< Chip32Object::UNDEFINED for the labels of other objects
+    uint16_t offset{0};
+};
+
+// 16-bit label address to write in a section
+struct ObjectReloc
+{
+    uint16_t section{0};
+    uint16_t offset{0};
+    uint16_t symbol{0};         //!< Index in Chip32Object::symbols
+};
+
+struct Chip32Object
+{
+    static const uint16_t UNDEFINED = 0xFFFF;
+
+    std::vector<ObjectSection> sections;
+    std::vector<ObjectSymbol> symbols;
+    std::vector<ObjectReloc> relocs;
+    bool keepAll{false};        //!< The code computes code addresses (jumpr, ip or ra): nothing can be stripped
+};
+
+// Bytes [start, end) of the image changed by Chip32Assembler::Update()
+struct RomRange
+{
+    uint32_t start;
+    uint32_t end;
+};
+
+struct Chip32LiveState;
 
 class Chip32Assembler
 {
 public:
+    Chip32Assembler();
+    ~Chip32Assembler();
+
     // Separated parser to allow only code check
     bool Parse(const std::string &data);
+    // Optional peephole pass, between Parse() and BuildBinary()
+    void Optimize(OptimizationResult &result);
     // Generate the executable binary after the parse pass
     bool BuildBinary(std::vector<uint8_t> &program, AssemblyResult &result);
+    // Generate a relocatable object after the parse pass, to link with others
+    bool BuildObject(Chip32Object &object);
+
+    /**
+     * Incremental mode for live edition, independent of Parse() and BuildBinary().
+     * The whole source is given at each call but only the lines changed since the
+     * previous call are parsed again, parsed lines are also cached by content.
+     * 'changes' gets the ranges of 'program' that differ from the previous image
+     * (a size change is given by program.size()). On error, 'program' is not
+     * modified and stays the reference of the next call.
+     */
+    bool Update(const std::string &data, std::vector<uint8_t> &program, AssemblyResult &result, std::vector<RomRange> &changes);
+
+    // Label addresses, valid after BuildBinary()
+    const std::map<std::string, uint16_t> &GetLabels() const {
+        return m_labels;
+    }
 
     void Clear() {
         m_labels.clear();
@@ -94,6 +197,8 @@ public:
     }
 
 private:
+    // Tokenize and compile one line, 'instr' gets no mnemonic for a blank line or a comment
+    bool ParseLine(std::string_view line, Instr &instr);
     bool CompileMnemonicArguments(Instr &instr);
 
     // label, address
@@ -101,6 +206,8 @@ private:
 
     std::vector<Instr> m_instructions;
     bool CompileConstantArguments(Instr &instr);
+
+    std::unique_ptr<Chip32LiveState> m_live; //!< Incremental mode, created by the first Update()
 };
 
 #endif // CHIP32_ASSEMBLER_H
@@ -0,0 +1,188 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_async.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstring>
+
+static const uint32_t IDLE_SPINS = 64; // empty polls before the consumer thread sleeps
+static const std::chrono::microseconds IDLE_SLEEP(50);
+
+struct chip32_async_t
+{
+    // Producer (VM) and consumer indexes on their own cache lines, they only grow
+    alignas(64) std::atomic<uint32_t> tail{0};
+    uint32_t cachedHead{0}; //!< Last head seen by the producer
+    alignas(64) std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> handled{0}; //!< Messages given to the handler of the consumer thread
+    alignas(64) uint32_t mask{0};
+    std::vector<chip32_syscall_msg_t> slots;
+    uint64_t asyncCodes[256 / 64]{0}; //!< Bitmap of the asynchronous codes
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+    chip32_async_handler_t handler{nullptr};
+    void *userData{nullptr};
+    uint32_t batch{0};
+};
+
+static void chip32_async_loop(chip32_async_t *async)
+{
+    std::vector<chip32_syscall_msg_t> msgs(async->batch);
+    uint32_t idle = 0;
+
+    while (true)
+    {
+        const uint32_t count = chip32_async_poll(async, msgs.data(), async->batch);
+        if (count > 0)
+        {
+            async->handler(msgs.data(), count, async->userData);
+            async->handled.fetch_add(count, std::memory_order_release);
+            idle = 0;
+        }
+        else if (!async->running.load(std::memory_order_acquire))
+        {
+            break;
+        }
+        else if (++idle < IDLE_SPINS)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(IDLE_SLEEP);
+        }
+    }
+}
+
+// =============================================================================
+// PUBLIC API
+// =============================================================================
+chip32_async_t *chip32_async_create(uint32_t capacity)
+{
+    uint32_t size = 2;
+    while ((size < capacity) && (size < 0x80000000U))
+        size *= 2;
+
+    chip32_async_t *async = new chip32_async_t();
+    async->mask = size - 1;
+    async->slots.resize(size);
+    return async;
+}
+
+void chip32_async_destroy(chip32_async_t *async)
+{
+    chip32_async_stop(async);
+    delete async;
+}
+
+void chip32_async_set_mode(chip32_async_t *async, uint8_t code, bool asynchronous)
+{
+    if (asynchronous)
+        async->asyncCodes[code / 64] |= 1ULL << (code % 64);
+    else
+        async->asyncCodes[code / 64] &= ~(1ULL << (code % 64));
+}
+
+bool chip32_async_attach(chip32_ctx_t *ctx, chip32_async_t *async)
+{
+#ifdef VM_ENABLE_ASYNC_SYSCALLS
+    ctx->async = async;
+    return true;
+#else
+    (void) ctx;
+    (void) async;
+    return false;
+#endif
+}
+
+chip32_async_status_t chip32_async_post(chip32_async_t *async, uint8_t code, const uint32_t *registers)
+{
+    if ((async->asyncCodes[code / 64] & (1ULL << (code % 64))) == 0)
+        return CHIP32_ASYNC_SYNC;
+
+    const uint32_t tail = async->tail.load(std::memory_order_relaxed);
+    if (tail - async->cachedHead > async->mask)
+    {
+        async->cachedHead = async->head.load(std::memory_order_acquire);
+        if (tail - async->cachedHead > async->mask)
+            return CHIP32_ASYNC_FULL;
+    }
+
+    chip32_syscall_msg_t &msg = async->slots[tail & async->mask];
+    msg.code = code;
+    memcpy(msg.args, &registers[R0], sizeof(msg.args));
+    async->tail.store(tail + 1, std::memory_order_release);
+    return CHIP32_ASYNC_POSTED;
+}
+
+uint32_t chip32_async_poll(chip32_async_t *async, chip32_syscall_msg_t *msgs, uint32_t max)
+{
+    const uint32_t head = async->head.load(std::memory_order_relaxed);
+    const uint32_t tail = async->tail.load(std::memory_order_acquire);
+    uint32_t count = tail - head;
+    if (count > max)
+        count = max;
+
+    for (uint32_t i = 0; i < count; i++)
+        msgs[i] = async->slots[(head + i) & async->mask];
+    async->head.store(head + count, std::memory_order_release);
+    return count;
+}
+
+bool chip32_async_start(chip32_async_t *async, chip32_async_handler_t handler, void *user_data, uint32_t batch)
+{
+    if (async->running || (handler == nullptr) || (batch == 0))
+        return false;
+
+    async->handler = handler;
+    async->userData = user_data;
+    async->batch = batch;
+    async->handled = async->head.load();
+    async->running = true;
+    async->thread = std::thread(chip32_async_loop, async);
+    return true;
+}
+
+void chip32_async_stop(chip32_async_t *async)
+{
+    if (!async->running)
+        return;
+    async->running = false;
+    async->thread.join();
+}
+
+void chip32_async_flush(chip32_async_t *async)
+{
+    if (!async->running)
+        return;
+
+    const uint32_t target = async->tail.load(std::memory_order_relaxed);
+    while ((int32_t)(async->handled.load(std::memory_order_acquire) - target) < 0)
+        std::this_thread::yield();
+}
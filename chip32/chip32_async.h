@@ -0,0 +1,88 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_ASYNC_H
+#define CHIP32_ASYNC_H
+
+#include "chip32.h"
+
+/**
+  Asynchronous system calls, compiled in only when VM_ENABLE_ASYNC_SYSCALLS is
+  defined (for chip32.cpp and chip32_async.cpp), chip32_async_attach() returns
+  false otherwise.
+
+  System call codes marked asynchronous do not call the handler of the context:
+  the code and the values of R0-R3 are posted into a lock-free single producer,
+  single consumer ring and the VM goes on immediately. A host thread consumes
+  the ring by batches. Such system calls cannot return values to the program.
+
+  If the ring is full, chip32_run() returns VM_WAIT_SYSCALL with IP left on the
+  system call, which is posted again when the VM is resumed.
+
+  Other codes are synchronous and go through the handler set with chip32_set_syscall()
+  or the host functions of chip32_set_host_table(), which can call chip32_async_flush()
+  first if they depend on earlier asynchronous calls.
+
+  One ring per context: the VM is the only producer.
+ */
+typedef struct chip32_async_t chip32_async_t;
+
+typedef struct
+{
+    uint8_t code;
+    uint32_t args[4]; //!< R0 - R3 at the time of the call
+} chip32_syscall_msg_t;
+
+typedef enum
+{
+    CHIP32_ASYNC_SYNC,   // code not marked asynchronous, call the handler of the context
+    CHIP32_ASYNC_POSTED, // posted into the ring
+    CHIP32_ASYNC_FULL,   // ring full, to be posted again later
+} chip32_async_status_t;
+
+// Consumer callback: a batch of messages, in order
+typedef void (*chip32_async_handler_t)(const chip32_syscall_msg_t *msgs, uint32_t count, void *user_data);
+
+// 'capacity' is rounded up to a power of two
+chip32_async_t *chip32_async_create(uint32_t capacity);
+void chip32_async_destroy(chip32_async_t *async);
+
+void chip32_async_set_mode(chip32_async_t *async, uint8_t code, bool asynchronous);
+// Attach (async != NULL) or detach (async == NULL) the ring to a context
+bool chip32_async_attach(chip32_ctx_t *ctx, chip32_async_t *async);
+
+// Producer side, called by the interpreter
+chip32_async_status_t chip32_async_post(chip32_async_t *async, uint8_t code, const uint32_t *registers);
+
+// Consumer side, by hand: copies up to 'max' messages, returns the number of messages
+uint32_t chip32_async_poll(chip32_async_t *async, chip32_syscall_msg_t *msgs, uint32_t max);
+
+// Consumer side, by a thread calling 'handler' with batches of at most 'batch' messages
+bool chip32_async_start(chip32_async_t *async, chip32_async_handler_t handler, void *user_data, uint32_t batch);
+// Stop the thread once the ring is empty
+void chip32_async_stop(chip32_async_t *async);
+// Wait until the consumer thread has handled all the posted messages
+void chip32_async_flush(chip32_async_t *async);
+
+#endif // CHIP32_ASYNC_H
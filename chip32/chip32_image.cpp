@@ -0,0 +1,152 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_image.h"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP32_IMAGE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+struct chip32_image_t
+{
+    std::string key; //!< Identity of the file in the registry
+    uint32_t refCount;
+    virtual_mem_t rom;
+    size_t length; //!< Size of the mapping
+};
+
+// Images open in the process, by file identity
+static std::mutex gImagesLock;
+static std::map<std::string, chip32_image_t *> gImages;
+
+// =============================================================================
+// PUBLIC API
+// =============================================================================
+chip32_image_t *chip32_image_open(const char *path)
+{
+#ifdef CHIP32_IMAGE_MMAP
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0) || (st.st_size > 0xFFFF))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    // Same file, whatever the path used to open it
+    const std::string key = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" +
+                            std::to_string(st.st_mtime) + ":" + std::to_string(st.st_size);
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+        return nullptr;
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if ((size <= 0) || (size > 0xFFFF))
+    {
+        fclose(file);
+        return nullptr;
+    }
+    const std::string key = path;
+#endif
+
+    std::lock_guard<std::mutex> guard(gImagesLock);
+    auto it = gImages.find(key);
+    if (it != gImages.end())
+    {
+#ifdef CHIP32_IMAGE_MMAP
+        close(fd);
+#else
+        fclose(file);
+#endif
+        it->second->refCount++;
+        return it->second;
+    }
+
+    chip32_image_t *image = new chip32_image_t();
+    image->key = key;
+    image->refCount = 1;
+    image->rom.addr = 0;
+
+#ifdef CHIP32_IMAGE_MMAP
+    image->length = st.st_size;
+    void *pages = mmap(nullptr, image->length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (pages == MAP_FAILED)
+    {
+        delete image;
+        return nullptr;
+    }
+    image->rom.mem = static_cast<uint8_t *>(pages);
+#else
+    image->length = size;
+    image->rom.mem = static_cast<uint8_t *>(malloc(size));
+    const bool ok = (image->rom.mem != nullptr) && (fread(image->rom.mem, 1, size, file) == (size_t)size);
+    fclose(file);
+    if (!ok)
+    {
+        free(image->rom.mem);
+        delete image;
+        return nullptr;
+    }
+#endif
+    image->rom.size = image->length;
+
+    gImages[key] = image;
+    return image;
+}
+
+void chip32_image_close(chip32_image_t *image)
+{
+    std::lock_guard<std::mutex> guard(gImagesLock);
+    if (--image->refCount > 0)
+        return;
+
+    gImages.erase(image->key);
+#ifdef CHIP32_IMAGE_MMAP
+    munmap(image->rom.mem, image->length);
+#else
+    free(image->rom.mem);
+#endif
+    delete image;
+}
+
+virtual_mem_t *chip32_image_rom(chip32_image_t *image)
+{
+    return &image->rom;
+}
@@ -0,0 +1,58 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_IMAGE_H
+#define CHIP32_IMAGE_H
+
+#include "chip32.h"
+
+/**
+  Program images loaded by memory mapping.
+
+  The file is mapped read-only and the ROM segment points directly to the
+  mapping: nothing is copied, the pages are loaded on first use and shared by
+  all the VMs (and processes) running the same image. Opening a file already
+  open in the process returns the same image, with a reference count.
+
+  The ROM of an image must not be written: do not make the RAM overlap it.
+  Images are limited to the 64 KB address space. On platforms without mmap,
+  the file is read into memory.
+
+  The mapping is shared with the file: a program file rewritten in place changes
+  the code under the running VMs, and a truncated one makes them crash (SIGBUS)
+  on the pages past its new end. Install a new version by writing it to another
+  file and renaming it over the old one; the open images keep the old content
+  and the next chip32_image_open() gets the new one.
+ */
+typedef struct chip32_image_t chip32_image_t;
+
+// Returns NULL if the file cannot be opened, is empty or too large
+chip32_image_t *chip32_image_open(const char *path);
+// The last close of an image unmaps it
+void chip32_image_close(chip32_image_t *image);
+
+// ROM segment to give to chip32_initialize(), shared by all the users of the image
+virtual_mem_t *chip32_image_rom(chip32_image_t *image);
+
+#endif // CHIP32_IMAGE_H
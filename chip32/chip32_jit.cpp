@@ -0,0 +1,362 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_jit.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define CHIP32_JIT_X64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// =============================================================================
+// CODE BUFFER
+// =============================================================================
+static const size_t JIT_CODE_SIZE = 1024 * 1024; // flushed when full
+static const int32_t BLOCK_UNKNOWN = -1; // not translated yet
+static const int32_t BLOCK_NONE = -2; // first instruction cannot be translated
+
+// Native block: takes the register file, returns the address of the next instruction
+typedef uint32_t (*jit_block_fn_t)(uint32_t *registers);
+
+struct JitBlock {
+    jit_block_fn_t code;
+    uint32_t nbInstr;
+};
+
+struct chip32_jit_t
+{
+    const virtual_mem_t *rom;
+    uint8_t *code; //!< mmap'd pages
+    size_t codeUsed;
+    std::vector<int32_t> index; //!< ROM address -> block, or BLOCK_xxx
+    std::vector<JitBlock> blocks;
+};
+
+#ifdef CHIP32_JIT_X64
+
+// Register file: rdi, register n is at [rdi + 4 * n]
+#define REG_DISP(r) static_cast<uint8_t>((r) * 4)
+
+class X64Emitter
+{
+public:
+    void Byte(uint8_t b) { m_code.push_back(b); }
+    void Imm32(uint32_t v)
+    {
+        for (int i = 0; i < 4; i++)
+            Byte((v >> (8 * i)) & 0xFF);
+    }
+    // <op> [rdi + disp8] with a ModRM register field (eax = 0, ecx = 1, or an opcode extension)
+    void RegMem(uint8_t op, uint8_t field, uint8_t reg) { Byte(op); Byte(0x40 | (field << 3) | 7); Byte(REG_DISP(reg)); }
+
+    void LoadEax(uint8_t reg) { RegMem(0x8B, 0, reg); }    // mov eax, [reg]
+    void LoadEcx(uint8_t reg) { RegMem(0x8B, 1, reg); }    // mov ecx, [reg]
+    void StoreEax(uint8_t reg) { RegMem(0x89, 0, reg); }   // mov [reg], eax
+    void AluEax(uint8_t op, uint8_t reg) { RegMem(op, 0, reg); } // add/sub/and/or/xor [reg], eax
+    void ImulEax(uint8_t reg) { Byte(0x0F); RegMem(0xAF, 0, reg); } // imul eax, [reg]
+    void ShiftCl(uint8_t ext, uint8_t reg) { RegMem(0xD3, ext, reg); } // shl/shr/sar [reg], cl
+    void Not(uint8_t reg) { RegMem(0xF7, 2, reg); }         // not [reg]
+    void StoreImm(uint8_t reg, uint32_t v) { RegMem(0xC7, 0, reg); Imm32(v); } // mov dword [reg], imm32
+    void ReturnImm(uint32_t v) { Byte(0xB8); Imm32(v); Byte(0xC3); } // mov eax, imm32; ret
+    void ReturnReg(uint8_t reg) { LoadEax(reg); Byte(0xC3); } // mov eax, [reg]; ret
+    void CmpEax(uint8_t reg) { RegMem(0x3B, 0, reg); }      // cmp eax, [reg]
+    // Returns 'taken' if the flags match the condition code 'cc', else 'next'
+    void ReturnCond(uint8_t cc, uint32_t taken, uint32_t next)
+    {
+        Byte(0xB8); Imm32(next);          // mov eax, next (flags unchanged)
+        Byte(0x70 | (cc ^ 1)); Byte(5);   // j<not cc> over the next mov
+        ReturnImm(taken);
+    }
+
+    const std::vector<uint8_t> &Code() const { return m_code; }
+
+private:
+    std::vector<uint8_t> m_code;
+};
+
+static inline bool IsRegister(uint8_t r)
+{
+    // The instruction pointer is handled by the interpreter only
+    return (r < REGISTER_COUNT) && (r != IP);
+}
+
+/**
+ * Translate the block starting at 'addr'. Returns the number of instructions in
+ * the block, 0 if the first instruction cannot be translated.
+ */
+static uint32_t TranslateBlock(const virtual_mem_t *rom, uint32_t addr, X64Emitter &e)
+{
+    const uint8_t *mem = rom->mem;
+    uint32_t ip = addr;
+    uint32_t nbInstr = 0;
+
+    while (ip < rom->size)
+    {
+        const uint8_t op = mem[ip];
+        uint8_t ra = 0, rb = 0;
+
+        switch (op)
+        {
+        case OP_LCONS:
+        {
+            if (ip + 5 >= rom->size)
+                break;
+            ra = mem[ip + 1];
+            if (!IsRegister(ra))
+                break;
+            uint32_t v = mem[ip + 2] | mem[ip + 3] << 8 | mem[ip + 4] << 16 | (uint32_t)mem[ip + 5] << 24;
+            e.StoreImm(ra, v);
+            ip += 6;
+            nbInstr++;
+            continue;
+        }
+        case OP_NOT:
+        {
+            if (ip + 1 >= rom->size)
+                break;
+            ra = mem[ip + 1];
+            if (!IsRegister(ra))
+                break;
+            e.Not(ra);
+            ip += 2;
+            nbInstr++;
+            continue;
+        }
+        case OP_MOV:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_ISHR:
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR:
+        {
+            if (ip + 2 >= rom->size)
+                break;
+            ra = mem[ip + 1];
+            rb = mem[ip + 2];
+            if (!IsRegister(ra) || !IsRegister(rb))
+                break;
+
+            switch (op)
+            {
+            case OP_MOV: e.LoadEax(rb); e.StoreEax(ra); break;
+            case OP_ADD: e.LoadEax(rb); e.AluEax(0x01, ra); break;
+            case OP_SUB: e.LoadEax(rb); e.AluEax(0x29, ra); break;
+            case OP_AND: e.LoadEax(rb); e.AluEax(0x21, ra); break;
+            case OP_OR:  e.LoadEax(rb); e.AluEax(0x09, ra); break;
+            case OP_XOR: e.LoadEax(rb); e.AluEax(0x31, ra); break;
+            case OP_MUL: e.LoadEax(ra); e.ImulEax(rb); e.StoreEax(ra); break;
+            case OP_SHL: e.LoadEcx(rb); e.ShiftCl(4, ra); break;
+            case OP_SHR: e.LoadEcx(rb); e.ShiftCl(5, ra); break;
+            case OP_ISHR: e.LoadEcx(rb); e.ShiftCl(7, ra); break;
+            }
+            ip += 3;
+            nbInstr++;
+            continue;
+        }
+        // Block terminators
+        case OP_JMP:
+        case OP_CALL:
+        {
+            if (ip + 2 >= rom->size)
+                break;
+            uint32_t target = mem[ip + 1] | mem[ip + 2] << 8;
+            if (op == OP_CALL)
+                e.StoreImm(RA, ip + 3);
+            e.ReturnImm(target);
+            return nbInstr + 1;
+        }
+        case OP_RET:
+        {
+            e.ReturnReg(RA);
+            return nbInstr + 1;
+        }
+        case OP_JE:
+        case OP_JNE:
+        case OP_JLT:
+        case OP_JGE:
+        {
+            if (ip + 4 >= rom->size)
+                break;
+            ra = mem[ip + 1];
+            rb = mem[ip + 2];
+            if (!IsRegister(ra) || !IsRegister(rb))
+                break;
+            // x86 condition codes: e = 4, ne = 5, l = 0xC, ge = 0xD
+            static const uint8_t cc[] = { 0x4, 0x5, 0xC, 0xD };
+            uint32_t target = mem[ip + 3] | mem[ip + 4] << 8;
+            e.LoadEax(ra);
+            e.CmpEax(rb);
+            e.ReturnCond(cc[op - OP_JE], target, ip + 5);
+            return nbInstr + 1;
+        }
+        default:
+            break;
+        }
+        break; // not supported, end of block
+    }
+
+    if (nbInstr > 0)
+        e.ReturnImm(ip);
+    return nbInstr;
+}
+
+static int32_t CompileBlock(chip32_jit_t *jit, uint32_t addr)
+{
+    X64Emitter e;
+    uint32_t nbInstr = TranslateBlock(jit->rom, addr, e);
+    if (nbInstr == 0)
+        return BLOCK_NONE;
+
+    const std::vector<uint8_t> &code = e.Code();
+    if (code.size() > JIT_CODE_SIZE)
+        return BLOCK_NONE;
+    if (jit->codeUsed + code.size() > JIT_CODE_SIZE)
+        chip32_jit_invalidate(jit);
+
+    // Only the pages written are made writable, W^X policies may refuse it
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t first = jit->codeUsed & ~(pageSize - 1);
+    const size_t last = (jit->codeUsed + code.size() + pageSize - 1) & ~(pageSize - 1);
+    if (mprotect(jit->code + first, last - first, PROT_READ | PROT_WRITE) != 0)
+        return BLOCK_NONE;
+    memcpy(jit->code + jit->codeUsed, code.data(), code.size());
+    if (mprotect(jit->code + first, last - first, PROT_READ | PROT_EXEC) != 0)
+    {
+        // The first page may hold other blocks, none of them can run anymore
+        chip32_jit_invalidate(jit);
+        return BLOCK_NONE;
+    }
+
+    JitBlock block;
+    block.code = reinterpret_cast<jit_block_fn_t>(jit->code + jit->codeUsed);
+    block.nbInstr = nbInstr;
+    jit->codeUsed += code.size();
+    jit->blocks.push_back(block);
+    return jit->blocks.size() - 1;
+}
+
+#endif // CHIP32_JIT_X64
+
+// =============================================================================
+// PUBLIC API
+// =============================================================================
+chip32_jit_t *chip32_jit_create(const virtual_mem_t *rom)
+{
+    chip32_jit_t *jit = new chip32_jit_t();
+    jit->rom = rom;
+    jit->code = nullptr;
+    jit->codeUsed = 0;
+#ifdef CHIP32_JIT_X64
+    void *pages = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages != MAP_FAILED)
+    {
+        jit->code = static_cast<uint8_t *>(pages);
+    }
+#endif
+    jit->index.assign(rom->size, BLOCK_UNKNOWN);
+    return jit;
+}
+
+void chip32_jit_destroy(chip32_jit_t *jit)
+{
+#ifdef CHIP32_JIT_X64
+    if (jit->code != nullptr)
+        munmap(jit->code, JIT_CODE_SIZE);
+#endif
+    delete jit;
+}
+
+void chip32_jit_invalidate(chip32_jit_t *jit)
+{
+    jit->codeUsed = 0;
+    jit->blocks.clear();
+    jit->index.assign(jit->rom->size, BLOCK_UNKNOWN);
+}
+
+chip32_result_t chip32_jit_run(chip32_jit_t *jit, chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr)
+{
+#ifdef CHIP32_JIT_X64
+    // Profiled and traced contexts stay on the interpreter
+    if ((jit->code == nullptr) || (ctx->profiler != nullptr) || (ctx->trace != nullptr))
+        return chip32_run(ctx, prog_size, max_instr);
+
+    uint32_t instrCount = 0;
+    uint32_t epoch = ctx->rom_epoch;
+
+    while ((max_instr == 0) || (instrCount < max_instr))
+    {
+        const uint32_t ip = ctx->registers[IP];
+        int32_t block = BLOCK_NONE;
+
+        if (!ctx->skip && (ip < jit->index.size()))
+        {
+            block = jit->index[ip];
+            if (block == BLOCK_UNKNOWN)
+            {
+                block = CompileBlock(jit, ip);
+                jit->index[ip] = block;
+            }
+        }
+
+        if (block >= 0)
+        {
+            const JitBlock &b = jit->blocks[block];
+            if ((max_instr == 0) || (max_instr - instrCount >= b.nbInstr))
+            {
+                ctx->registers[IP] = b.code(ctx->registers);
+                ctx->instr_count += b.nbInstr;
+                instrCount += b.nbInstr;
+                continue;
+            }
+            // The block does not fit in the budget: let the interpreter finish it
+            return chip32_run(ctx, prog_size, max_instr - instrCount);
+        }
+
+        // Interpreted instruction
+        chip32_result_t result = chip32_run(ctx, prog_size, 1);
+        if (ctx->rom_epoch != epoch)
+        {
+            // Self-modifying program
+            chip32_jit_invalidate(jit);
+            epoch = ctx->rom_epoch;
+        }
+        if (result != VM_PAUSED)
+            return result;
+        instrCount++;
+    }
+    return VM_PAUSED;
+#else
+    (void) jit;
+    return chip32_run(ctx, prog_size, max_instr);
+#endif
+}
@@ -0,0 +1,60 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_JIT_H
+#define CHIP32_JIT_H
+
+#include "chip32.h"
+
+/**
+  Baseline JIT tier, x86-64 Linux only.
+
+  ROM code is translated on demand, one block at a time, into native code
+  placed in mmap'd pages. A block is a straight-line run of lcons, mov and ALU
+  instructions (div excepted), optionally terminated by jump, call, ret or a
+  compare and branch.
+  Everything else (system calls, stack, memory, skips, errors...) is executed
+  by chip32_run(), instruction by instruction.
+
+  The register file is the one of the context, and a block only runs if it fits
+  entirely in the remaining max_instr budget, so registers, memory, results and
+  instruction counts are the same than with the interpreter.
+
+  If the system refuses to flip the code pages between writable and executable
+  (W^X policy), the blocks are not translated and the interpreter runs them.
+  On other platforms, chip32_jit_run() simply calls chip32_run().
+ */
+typedef struct chip32_jit_t chip32_jit_t;
+
+// One JIT instance per ROM image, it can be shared by contexts running on the same thread
+chip32_jit_t *chip32_jit_create(const virtual_mem_t *rom);
+void chip32_jit_destroy(chip32_jit_t *jit);
+
+// Drop all the translated code, to be called if the host has changed the ROM content.
+// Writes done by the program itself are detected through chip32_ctx_t::rom_epoch.
+void chip32_jit_invalidate(chip32_jit_t *jit);
+
+chip32_result_t chip32_jit_run(chip32_jit_t *jit, chip32_ctx_t *ctx, uint16_t prog_size, uint32_t max_instr);
+
+#endif // CHIP32_JIT_H
@@ -0,0 +1,343 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_linker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+static const uint16_t OBJECT_VERSION = 1;
+
+static const uint8_t OBJECT_KEEP_ALL = 1;
+static const uint8_t SECTION_DATA = 1;
+static const uint8_t SECTION_FALLS_THROUGH = 2;
+
+// =============================================================================
+// PARALLEL ASSEMBLY
+// =============================================================================
+struct AssemblyJob
+{
+    const std::vector<std::string> *sources;
+    std::vector<Chip32Object> *objects;
+    std::vector<uint8_t> success;
+    std::atomic<size_t> next{0}; //!< Next source to take
+};
+
+static void AssembleWorker(AssemblyJob *job)
+{
+    size_t i;
+    while ((i = job->next.fetch_add(1)) < job->sources->size())
+    {
+        Chip32Assembler assembler;
+        job->success[i] = assembler.Parse((*job->sources)[i]) && assembler.BuildObject((*job->objects)[i]);
+    }
+}
+
+bool Chip32Linker::AssembleAll(const std::vector<std::string> &sources, std::vector<Chip32Object> &objects, uint32_t threads)
+{
+    AssemblyJob job;
+    job.sources = &sources;
+    job.objects = &objects;
+    job.success.assign(sources.size(), 0);
+    objects.assign(sources.size(), Chip32Object());
+
+    if (threads == 0)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, sources.size());
+
+    // The calling thread is one of the workers
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < threads; i++)
+        workers.emplace_back(AssembleWorker, &job);
+    AssembleWorker(&job);
+    for (std::thread &worker : workers)
+        worker.join();
+
+    return std::find(job.success.begin(), job.success.end(), 0) == job.success.end();
+}
+
+// =============================================================================
+// OBJECT FILES
+// =============================================================================
+static inline void put16(std::vector<uint8_t> &data, uint16_t value)
+{
+    data.push_back(value & 0xFFU);
+    data.push_back((value >> 8U) & 0xFFU);
+}
+
+void Chip32Linker::Serialize(const Chip32Object &object, std::vector<uint8_t> &data)
+{
+    data.assign({ 'C', '3', '2', 'O' });
+    put16(data, OBJECT_VERSION);
+    data.push_back(object.keepAll ? OBJECT_KEEP_ALL : 0);
+
+    put16(data, object.sections.size());
+    for (const ObjectSection &section : object.sections)
+    {
+        data.push_back((section.isData ? SECTION_DATA : 0) | (section.fallsThrough ? SECTION_FALLS_THROUGH : 0));
+        put16(data, section.ramUsage);
+        put16(data, section.bytes.size());
+        data.insert(data.end(), section.bytes.begin(), section.bytes.end());
+    }
+
+    put16(data, object.symbols.size());
+    for (const ObjectSymbol &symbol : object.symbols)
+    {
+        put16(data, symbol.section);
+        put16(data, symbol.offset);
+        data.push_back(std::min<size_t>(symbol.name.size(), UINT8_MAX));
+        data.insert(data.end(), symbol.name.begin(), symbol.name.begin() + std::min<size_t>(symbol.name.size(), UINT8_MAX));
+    }
+
+    put16(data, object.relocs.size());
+    for (const ObjectReloc &reloc : object.relocs)
+    {
+        put16(data, reloc.section);
+        put16(data, reloc.offset);
+        put16(data, reloc.symbol);
+    }
+}
+
+// Bounds checked reads, 'ok' turns false at the first read past the end
+class ObjectReader
+{
+public:
+    explicit ObjectReader(const std::vector<uint8_t> &data) : m_data(data) {}
+
+    bool Ok() const { return m_ok; }
+    bool AtEnd() const { return m_pos == m_data.size(); }
+
+    uint8_t Get8()
+    {
+        if (m_pos + 1 > m_data.size())
+        {
+            m_ok = false;
+            return 0;
+        }
+        return m_data[m_pos++];
+    }
+
+    uint16_t Get16()
+    {
+        const uint16_t low = Get8();
+        return low | (Get8() << 8);
+    }
+
+    const uint8_t *GetBytes(size_t size)
+    {
+        if (m_pos + size > m_data.size())
+        {
+            m_ok = false;
+            return nullptr;
+        }
+        m_pos += size;
+        return &m_data[m_pos - size];
+    }
+
+private:
+    const std::vector<uint8_t> &m_data;
+    size_t m_pos{0};
+    bool m_ok{true};
+};
+
+bool Chip32Linker::Deserialize(const std::vector<uint8_t> &data, Chip32Object &object)
+{
+    ObjectReader in(data);
+    object = Chip32Object();
+
+    const uint8_t *magic = in.GetBytes(4);
+    if ((magic == nullptr) || (memcmp(magic, "C32O", 4) != 0) || (in.Get16() != OBJECT_VERSION))
+        return false;
+    object.keepAll = (in.Get8() & OBJECT_KEEP_ALL) != 0;
+
+    object.sections.resize(in.Get16());
+    for (ObjectSection &section : object.sections)
+    {
+        const uint8_t flags = in.Get8();
+        section.isData = (flags & SECTION_DATA) != 0;
+        section.fallsThrough = (flags & SECTION_FALLS_THROUGH) != 0;
+        section.ramUsage = in.Get16();
+        const uint16_t size = in.Get16();
+        const uint8_t *bytes = in.GetBytes(size);
+        if (bytes == nullptr)
+            return false;
+        section.bytes.assign(bytes, bytes + size);
+    }
+
+    object.symbols.resize(in.Get16());
+    for (ObjectSymbol &symbol : object.symbols)
+    {
+        symbol.section = in.Get16();
+        symbol.offset = in.Get16();
+        const uint8_t size = in.Get8();
+        const uint8_t *name = in.GetBytes(size);
+        if ((name == nullptr) || ((symbol.section != Chip32Object::UNDEFINED) &&
+            ((symbol.section >= object.sections.size()) || (symbol.offset > object.sections[symbol.section].bytes.size()))))
+            return false;
+        symbol.name.assign(reinterpret_cast<const char *>(name), size);
+    }
+
+    object.relocs.resize(in.Get16());
+    for (ObjectReloc &reloc : object.relocs)
+    {
+        reloc.section = in.Get16();
+        reloc.offset = in.Get16();
+        reloc.symbol = in.Get16();
+        if ((reloc.section >= object.sections.size()) || (reloc.offset + 2U > object.sections[reloc.section].bytes.size()) ||
+            (reloc.symbol >= object.symbols.size()))
+            return false;
+    }
+    return in.Ok() && in.AtEnd();
+}
+
+// =============================================================================
+// LINKER
+// =============================================================================
+struct Definition
+{
+    uint32_t section; //!< Index in the sections of all the objects
+    uint16_t offset;
+};
+
+bool Chip32Linker::Link(const std::vector<Chip32Object> &objects, bool stripDead, std::vector<uint8_t> &program, AssemblyResult &result)
+{
+    result = { 0, 0, 0 };
+    m_labels.clear();
+    m_strippedSize = 0;
+
+    // Sections of all the objects in link order
+    std::vector<const ObjectSection *> sections;
+    std::vector<uint32_t> firstSection;
+    std::map<std::string, Definition> definitions;
+    for (const Chip32Object &object : objects)
+    {
+        firstSection.push_back(sections.size());
+        for (const ObjectSymbol &symbol : object.symbols)
+        {
+            if (symbol.section == Chip32Object::UNDEFINED)
+                continue;
+            if (definitions.count(symbol.name) > 0)
+            {
+                std::cout << "error: link: duplicated label : " << symbol.name << std::endl;
+                return false;
+            }
+            definitions[symbol.name] = { static_cast<uint32_t>(sections.size()) + symbol.section, symbol.offset };
+        }
+        for (const ObjectSection &section : object.sections)
+            sections.push_back(&section);
+    }
+
+    // Section referenced by each relocation
+    std::vector<std::vector<uint32_t>> targets(sections.size());
+    for (size_t o = 0; o < objects.size(); o++)
+    {
+        for (const ObjectReloc &reloc : objects[o].relocs)
+        {
+            const std::string &label = objects[o].symbols[reloc.symbol].name;
+            auto it = definitions.find(label);
+            if (it == definitions.end())
+            {
+                std::cout << "error: link: label not found: " << label << std::endl;
+                return false;
+            }
+            targets[firstSection[o] + reloc.section].push_back(it->second.section);
+        }
+    }
+
+    // Sections reachable from the entry point
+    std::vector<bool> live(sections.size(), !stripDead);
+    if (stripDead)
+    {
+        std::vector<uint32_t> pending;
+        for (size_t o = 0; o < objects.size(); o++)
+        {
+            for (size_t s = 0; s < objects[o].sections.size(); s++)
+            {
+                if (objects[o].keepAll || objects[o].sections[s].isData)
+                    pending.push_back(firstSection[o] + s);
+            }
+        }
+        if (!sections.empty())
+            pending.push_back(0);
+
+        while (!pending.empty())
+        {
+            const uint32_t s = pending.back();
+            pending.pop_back();
+            if (live[s])
+                continue;
+            live[s] = true;
+            pending.insert(pending.end(), targets[s].begin(), targets[s].end());
+            if (sections[s]->fallsThrough && (s + 1 < sections.size()))
+                pending.push_back(s + 1);
+        }
+    }
+
+    // Layout
+    std::vector<uint32_t> addresses(sections.size(), 0);
+    program.clear();
+    for (size_t s = 0; s < sections.size(); s++)
+    {
+        if (!live[s])
+        {
+            m_strippedSize += sections[s]->bytes.size();
+            continue;
+        }
+        addresses[s] = program.size();
+        program.insert(program.end(), sections[s]->bytes.begin(), sections[s]->bytes.end());
+        result.ramUsageSize += sections[s]->ramUsage;
+        if (sections[s]->isData)
+            result.constantsSize += sections[s]->bytes.size();
+    }
+    if (program.size() > UINT16_MAX + 1U)
+    {
+        std::cout << "error: link: program too large: " << program.size() << " bytes" << std::endl;
+        return false;
+    }
+
+    for (auto &definition : definitions)
+    {
+        if (live[definition.second.section])
+            m_labels[definition.first] = addresses[definition.second.section] + definition.second.offset;
+    }
+
+    // Relocations
+    for (size_t o = 0; o < objects.size(); o++)
+    {
+        for (const ObjectReloc &reloc : objects[o].relocs)
+        {
+            const uint32_t s = firstSection[o] + reloc.section;
+            if (!live[s])
+                continue;
+            const uint16_t addr = m_labels[objects[o].symbols[reloc.symbol].name];
+            const uint32_t index = addresses[s] + reloc.offset;
+            program[index] = addr & 0xFF;
+            program[index + 1] = (addr >> 8U) & 0xFF;
+        }
+    }
+    result.romUsageSize = program.size();
+    return true;
+}
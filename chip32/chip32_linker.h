@@ -0,0 +1,83 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_LINKER_H
+#define CHIP32_LINKER_H
+
+#include "chip32_assembler.h"
+
+/**
+  Linker of the relocatable objects built by Chip32Assembler::BuildObject().
+
+  The objects are placed in the given order and the first section of the first
+  one is the entry point (address 0). Labels are global: a label defined by two
+  objects is an error, as in a single source. Without stripping, linking the
+  objects of several sources gives the image of their concatenation.
+
+  Dead code stripping leaves out the code sections that cannot be reached from
+  the entry point through branches, calls and fall throughs. Constants and RAM
+  variables are always kept since the code addresses them by number, and so
+  are all the sections of an object that computes code addresses.
+
+  Objects can be saved with Serialize() so that only the changed sources are
+  assembled again.
+ */
+class Chip32Linker
+{
+public:
+    // Assemble each source into an object, on 'threads' threads (0: one per core)
+    static bool AssembleAll(const std::vector<std::string> &sources, std::vector<Chip32Object> &objects, uint32_t threads = 0);
+
+    /**
+     * Object file, little endian:
+     *   "C32O", version (16 bits), flags (8 bits: 1 = keep all)
+     *   section count (16 bits), then per section: flags (8 bits: 1 = data, 2 = falls through),
+     *       RAM usage (16 bits), size (16 bits), bytes
+     *   symbol count (16 bits), then per symbol: section (16 bits), offset (16 bits),
+     *       name length (8 bits), name
+     *   relocation count (16 bits), then per relocation: section, offset, symbol (16 bits each)
+     */
+    static void Serialize(const Chip32Object &object, std::vector<uint8_t> &data);
+    // Returns false if the data is not a valid object
+    static bool Deserialize(const std::vector<uint8_t> &data, Chip32Object &object);
+
+    bool Link(const std::vector<Chip32Object> &objects, bool stripDead, std::vector<uint8_t> &program, AssemblyResult &result);
+
+    // Label addresses of the kept sections, valid after Link()
+    const std::map<std::string, uint16_t> &GetLabels() const {
+        return m_labels;
+    }
+
+    // Bytes of the sections left out by the last Link()
+    uint32_t GetStrippedSize() const {
+        return m_strippedSize;
+    }
+
+private:
+    // label, address
+    std::map<std::string, uint16_t> m_labels;
+    uint32_t m_strippedSize{0};
+};
+
+#endif // CHIP32_LINKER_H
@@ -0,0 +1,473 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_profiler.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint32_t MAX_CALL_DEPTH = 1024; // deeper calls are counted but not followed
+static const uint32_t ROOT_NODE = 0;
+static const uint32_t NO_CYCLES = 0xFFFFFFFF;
+
+static const char *const OpcodeNames[] = CHIP32_MNEMONICS_LIST;
+static_assert(sizeof(OpcodeNames) / sizeof(OpcodeNames[0]) == INSTRUCTION_COUNT, "opcode names out of date");
+
+// =============================================================================
+// REFERENCE COST MODELS
+// =============================================================================
+// Ballpark figures, from the code generated for the switch engine: dispatch, then
+// about 6 cycles per register operand (check + access) and the flash wait states.
+// Refine them with measurements on the boards (DWT cycle counter) when available.
+
+// Cycles per executed instruction, one row per opcode in opcode order
+struct OpcodeCost
+{
+    chip32_instruction_t op;
+    uint16_t m0; //!< Cortex-M0+
+    uint16_t m4; //!< Cortex-M4
+};
+
+static constexpr OpcodeCost OpcodeCosts[] = {
+    { OP_NOP,     12,  7 },
+    { OP_HALT,    14,  9 },
+    { OP_SYSCALL, 30, 18 },
+    { OP_LCONS,   30, 16 },
+    { OP_MOV,     22, 12 },
+    { OP_PUSH,    28, 15 },
+    { OP_POP,     28, 15 },
+    { OP_CALL,    30, 17 },
+    { OP_RET,     22, 12 },
+    { OP_STORE,   34, 18 },
+    { OP_LOAD,    34, 18 },
+    { OP_ADD,     24, 13 },
+    { OP_SUB,     24, 13 },
+    { OP_MUL,     25, 13 },
+    { OP_DIV,     90, 24 },
+    { OP_SHL,     24, 13 },
+    { OP_SHR,     24, 13 },
+    { OP_ISHR,    24, 13 },
+    { OP_AND,     24, 13 },
+    { OP_OR,      24, 13 },
+    { OP_XOR,     24, 13 },
+    { OP_NOT,     18, 10 },
+    { OP_JMP,     20, 11 },
+    { OP_JR,      20, 11 },
+    { OP_SKIPZ,   20, 11 },
+    { OP_SKIPNZ,  20, 11 },
+    { OP_BANK,    24, 13 },
+    { OP_LOADB,   44, 24 },
+    { OP_STOREB,  46, 25 },
+    { OP_MEMCPY,  50, 28 },
+    { OP_MEMSET,  46, 26 },
+    { OP_MEMCMP,  50, 28 },
+    { OP_JE,      30, 16 },
+    { OP_JNE,     30, 16 },
+    { OP_JLT,     30, 16 },
+    { OP_JGE,     30, 16 },
+    { OP_LOADR,   36, 19 },
+    { OP_STORER,  38, 20 },
+    { OP_VLOAD,   40, 22 },
+    { OP_VSTORE,  42, 23 },
+    { OP_VADD8,   72, 20 },
+    { OP_VADD16,  56, 20 },
+    { OP_VSUB8,   72, 20 },
+    { OP_VSUB16,  56, 20 },
+    { OP_VMIN8,   88, 28 },
+    { OP_VMIN16,  64, 28 },
+    { OP_VMAX8,   88, 28 },
+    { OP_VMAX16,  64, 28 },
+    { OP_VXOR,    40, 18 },
+    { OP_VSUM8,   60, 22 },
+    { OP_VSUM16,  48, 22 },
+    { OP_PUSHM,   60, 34 },
+    { OP_POPM,    60, 34 },
+    { OP_ENTER,   40, 22 },
+    { OP_LEAVE,   34, 20 },
+};
+
+static constexpr bool CostsInOrder()
+{
+    for (uint32_t i = 0; i < sizeof(OpcodeCosts) / sizeof(OpcodeCosts[0]); i++)
+    {
+        if (OpcodeCosts[i].op != i)
+            return false;
+    }
+    return sizeof(OpcodeCosts) / sizeof(OpcodeCosts[0]) == INSTRUCTION_COUNT;
+}
+static_assert(CostsInOrder(), "one cost row per opcode, in opcode order");
+
+static constexpr chip32_cost_model_t MakeCostModel(const char *name, uint32_t clock_hz, uint16_t OpcodeCost::*cycles,
+                                                   uint16_t mem_word, uint32_t syscall_handler)
+{
+    chip32_cost_model_t model{};
+    model.name = name;
+    model.clock_hz = clock_hz;
+    for (uint32_t i = 0; i < INSTRUCTION_COUNT; i++)
+        model.opcodes[i] = OpcodeCosts[i].*cycles;
+    model.mem_word = mem_word;
+    model.syscall_handler = syscall_handler;
+    return model;
+}
+
+constexpr chip32_cost_model_t chip32_cost_cortex_m0 = MakeCostModel("cortex-m0+ 48MHz", 48000000, &OpcodeCost::m0, 8, 200);
+constexpr chip32_cost_model_t chip32_cost_cortex_m4 = MakeCostModel("cortex-m4 168MHz", 168000000, &OpcodeCost::m4, 3, 120);
+
+// Catches the entries forgotten when an opcode is added
+static constexpr bool AllOpcodesCosted(const chip32_cost_model_t &model)
+{
+    for (uint32_t i = 0; i < INSTRUCTION_COUNT; i++)
+    {
+        if (model.opcodes[i] == 0)
+            return false;
+    }
+    return true;
+}
+static_assert(AllOpcodesCosted(chip32_cost_cortex_m0), "cortex-m0 cost model out of date");
+static_assert(AllOpcodesCosted(chip32_cost_cortex_m4), "cortex-m4 cost model out of date");
+
+// One node per distinct call path, for the folded stacks
+struct CallNode {
+    uint32_t function{0}; //!< Call target
+    uint32_t parent{ROOT_NODE};
+    uint64_t self{0}; //!< Instructions executed in this function, for this path
+    std::map<uint32_t, uint32_t> children; //!< Call target -> node
+};
+
+struct CallFrame {
+    uint32_t node;
+    uint32_t retAddr; //!< Expected value of RA when the function returns
+    uint64_t instructions; //!< Instruction counter at the call
+    uint64_t cycles; //!< Cycle counter at the call
+    Clock::time_point start;
+};
+
+struct FunctionStats {
+    uint64_t calls{0};
+    uint64_t instructions{0}; //!< Inclusive, completed calls only
+    uint64_t cycles{0}; //!< Inclusive, completed calls only
+    uint64_t ns{0};
+    uint64_t maxNs{0};
+};
+
+struct SyscallStats {
+    uint64_t count{0};
+    uint64_t cycles{0};
+    uint64_t ns{0};
+    uint64_t maxNs{0};
+};
+
+struct chip32_profiler_t
+{
+    const virtual_mem_t *rom;
+    uint64_t instructions;
+    uint64_t opcodes[INSTRUCTION_COUNT];
+    std::vector<uint64_t> hits; //!< One counter per ROM address
+    std::vector<CallNode> nodes;
+    uint32_t current; //!< Node of the running function
+    std::vector<CallFrame> stack;
+    std::map<uint32_t, FunctionStats> functions;
+    SyscallStats syscalls[256];
+    Clock::time_point syscallStart;
+    const chip32_cost_model_t *model; //!< NULL if no cycle estimation
+    uint64_t cycles;
+    std::vector<uint64_t> addrCycles; //!< Estimated cycles per ROM address
+    uint32_t address; //!< Address of the running instruction
+    uint32_t syscallCycles[256]; //!< Handler cost per code, on the target (NO_CYCLES: default of the model)
+};
+
+static uint64_t ElapsedNs(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static void AddCycles(chip32_profiler_t *prof, uint64_t cycles)
+{
+    prof->cycles += cycles;
+    if (prof->address < prof->addrCycles.size())
+        prof->addrCycles[prof->address] += cycles;
+}
+
+static double CyclesToUs(const chip32_profiler_t *prof, uint64_t cycles)
+{
+    return (double)cycles * 1e6 / prof->model->clock_hz;
+}
+
+static void EndCall(chip32_profiler_t *prof, const CallFrame &frame)
+{
+    FunctionStats &stats = prof->functions[prof->nodes[frame.node].function];
+    const uint64_t ns = ElapsedNs(frame.start);
+    stats.instructions += prof->instructions - frame.instructions;
+    stats.cycles += prof->cycles - frame.cycles;
+    stats.ns += ns;
+    if (ns > stats.maxNs)
+        stats.maxNs = ns;
+    prof->current = prof->nodes[frame.node].parent;
+}
+
+// =============================================================================
+// PUBLIC API
+// =============================================================================
+chip32_profiler_t *chip32_profiler_create(const virtual_mem_t *rom)
+{
+    chip32_profiler_t *prof = new chip32_profiler_t();
+    prof->rom = rom;
+    prof->model = nullptr;
+    std::fill(std::begin(prof->syscallCycles), std::end(prof->syscallCycles), NO_CYCLES);
+    chip32_profiler_reset(prof);
+    return prof;
+}
+
+void chip32_profiler_destroy(chip32_profiler_t *prof)
+{
+    delete prof;
+}
+
+void chip32_profiler_reset(chip32_profiler_t *prof)
+{
+    prof->instructions = 0;
+    memset(prof->opcodes, 0, sizeof(prof->opcodes));
+    prof->hits.assign(prof->rom->size, 0);
+    prof->nodes.assign(1, CallNode());
+    prof->current = ROOT_NODE;
+    prof->stack.clear();
+    prof->functions.clear();
+    for (SyscallStats &s : prof->syscalls)
+        s = SyscallStats();
+    prof->cycles = 0;
+    prof->addrCycles.assign(prof->rom->size, 0);
+    prof->address = 0;
+}
+
+bool chip32_profiler_attach(chip32_ctx_t *ctx, chip32_profiler_t *prof)
+{
+#ifdef VM_ENABLE_PROFILER
+    ctx->profiler = prof;
+    return true;
+#else
+    (void) ctx;
+    (void) prof;
+    return false;
+#endif
+}
+
+void chip32_profiler_write_csv(const chip32_profiler_t *prof, FILE *out)
+{
+    fprintf(out, "kind,key,count,instructions,total_ns,max_ns\n");
+    for (uint32_t i = 0; i < INSTRUCTION_COUNT; i++)
+    {
+        if (prof->opcodes[i] > 0)
+            fprintf(out, "opcode,%s,%llu,,,\n", OpcodeNames[i], (unsigned long long)prof->opcodes[i]);
+    }
+    for (uint32_t addr = 0; addr < prof->hits.size(); addr++)
+    {
+        if (prof->hits[addr] > 0)
+            fprintf(out, "address,0x%04X,%llu,,,\n", addr, (unsigned long long)prof->hits[addr]);
+    }
+    for (const auto &f : prof->functions)
+    {
+        fprintf(out, "function,0x%04X,%llu,%llu,%llu,%llu\n", f.first, (unsigned long long)f.second.calls,
+                (unsigned long long)f.second.instructions, (unsigned long long)f.second.ns,
+                (unsigned long long)f.second.maxNs);
+    }
+    for (uint32_t code = 0; code < 256; code++)
+    {
+        const SyscallStats &s = prof->syscalls[code];
+        if (s.count > 0)
+            fprintf(out, "syscall,%u,%llu,,%llu,%llu\n", code, (unsigned long long)s.count,
+                    (unsigned long long)s.ns, (unsigned long long)s.maxNs);
+    }
+}
+
+void chip32_profiler_write_folded(const chip32_profiler_t *prof, FILE *out)
+{
+    for (uint32_t n = 0; n < prof->nodes.size(); n++)
+    {
+        if (prof->nodes[n].self == 0)
+            continue;
+
+        std::string path;
+        char frame[16];
+        for (uint32_t i = n; i != ROOT_NODE; i = prof->nodes[i].parent)
+        {
+            snprintf(frame, sizeof(frame), ";0x%04X", prof->nodes[i].function);
+            path.insert(0, frame);
+        }
+        fprintf(out, "entry%s %llu\n", path.c_str(), (unsigned long long)prof->nodes[n].self);
+    }
+}
+
+void chip32_profiler_set_cost_model(chip32_profiler_t *prof, const chip32_cost_model_t *model)
+{
+    prof->model = model;
+}
+
+void chip32_profiler_set_syscall_cycles(chip32_profiler_t *prof, uint8_t code, uint32_t cycles)
+{
+    prof->syscallCycles[code] = cycles;
+}
+
+uint64_t chip32_profiler_cycles(const chip32_profiler_t *prof)
+{
+    return prof->cycles;
+}
+
+void chip32_profiler_write_timing(const chip32_profiler_t *prof, const chip32_label_t *labels, uint32_t count, FILE *out)
+{
+    fprintf(out, "kind,key,count,cycles,us\n");
+    if (prof->model == nullptr)
+        return;
+
+    std::vector<chip32_label_t> sorted;
+    if (labels != nullptr)
+        sorted.assign(labels, labels + count);
+    std::sort(sorted.begin(), sorted.end(), [](const chip32_label_t &a, const chip32_label_t &b) { return a.addr < b.addr; });
+
+    fprintf(out, "total,%s,%llu,%llu,%.3f\n", prof->model->name, (unsigned long long)prof->instructions,
+            (unsigned long long)prof->cycles, CyclesToUs(prof, prof->cycles));
+    for (const auto &f : prof->functions)
+    {
+        const char *name = "";
+        for (const chip32_label_t &l : sorted)
+        {
+            if (l.addr == f.first)
+                name = l.name;
+        }
+        fprintf(out, "function,0x%04X %s,%llu,%llu,%.3f\n", f.first, name, (unsigned long long)f.second.calls,
+                (unsigned long long)f.second.cycles, CyclesToUs(prof, f.second.cycles));
+    }
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        const size_t end = (i + 1 < sorted.size()) ? sorted[i + 1].addr : prof->hits.size();
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+        for (size_t addr = sorted[i].addr; addr < std::min(end, prof->hits.size()); addr++)
+        {
+            instructions += prof->hits[addr];
+            cycles += prof->addrCycles[addr];
+        }
+        if (instructions > 0)
+            fprintf(out, "label,%s,%llu,%llu,%.3f\n", sorted[i].name, (unsigned long long)instructions,
+                    (unsigned long long)cycles, CyclesToUs(prof, cycles));
+    }
+    for (uint32_t code = 0; code < 256; code++)
+    {
+        const SyscallStats &s = prof->syscalls[code];
+        if (s.count > 0)
+            fprintf(out, "syscall,%u,%llu,%llu,%.3f\n", code, (unsigned long long)s.count,
+                    (unsigned long long)s.cycles, CyclesToUs(prof, s.cycles));
+    }
+}
+
+// =============================================================================
+// HOOKS
+// =============================================================================
+void chip32_profiler_instr(chip32_profiler_t *prof, uint32_t addr, uint8_t opcode)
+{
+    prof->instructions++;
+    prof->opcodes[opcode]++;
+    if (addr < prof->hits.size())
+        prof->hits[addr]++;
+    prof->nodes[prof->current].self++;
+    prof->address = addr;
+    if (prof->model != nullptr)
+        AddCycles(prof, prof->model->opcodes[opcode]);
+}
+
+void chip32_profiler_call(chip32_profiler_t *prof, uint32_t ret_addr, uint32_t target)
+{
+    prof->functions[target].calls++;
+    if (prof->stack.size() >= MAX_CALL_DEPTH)
+        return;
+
+    uint32_t node;
+    auto it = prof->nodes[prof->current].children.find(target);
+    if (it != prof->nodes[prof->current].children.end())
+    {
+        node = it->second;
+    }
+    else
+    {
+        node = prof->nodes.size();
+        prof->nodes[prof->current].children[target] = node;
+        prof->nodes.emplace_back();
+        prof->nodes.back().function = target;
+        prof->nodes.back().parent = prof->current;
+    }
+
+    // Stamp the time last, to not measure the profiler itself
+    prof->stack.push_back({node, ret_addr, prof->instructions, prof->cycles, Clock::time_point()});
+    prof->current = node;
+    prof->stack.back().start = Clock::now();
+}
+
+void chip32_profiler_ret(chip32_profiler_t *prof, uint32_t ret_addr)
+{
+    // Functions that did not return through ret (jump out, RA modified...) end with their caller
+    for (size_t depth = prof->stack.size(); depth > 0; depth--)
+    {
+        if (prof->stack[depth - 1].retAddr == ret_addr)
+        {
+            while (prof->stack.size() >= depth)
+            {
+                EndCall(prof, prof->stack.back());
+                prof->stack.pop_back();
+            }
+            return;
+        }
+    }
+}
+
+void chip32_profiler_syscall_begin(chip32_profiler_t *prof)
+{
+    prof->syscallStart = Clock::now();
+}
+
+void chip32_profiler_syscall_end(chip32_profiler_t *prof, uint8_t code)
+{
+    SyscallStats &s = prof->syscalls[code];
+    const uint64_t ns = ElapsedNs(prof->syscallStart);
+    s.count++;
+    s.ns += ns;
+    if (ns > s.maxNs)
+        s.maxNs = ns;
+    if (prof->model != nullptr)
+    {
+        const uint64_t cycles = (prof->syscallCycles[code] != NO_CYCLES) ? prof->syscallCycles[code] : prof->model->syscall_handler;
+        s.cycles += cycles;
+        AddCycles(prof, cycles);
+    }
+}
+
+void chip32_profiler_mem(chip32_profiler_t *prof, uint32_t size)
+{
+    if (prof->model != nullptr)
+        AddCycles(prof, (uint64_t)prof->model->mem_word * ((size + 3ULL) / 4));
+}
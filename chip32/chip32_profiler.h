@@ -0,0 +1,118 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_PROFILER_H
+#define CHIP32_PROFILER_H
+
+#include "chip32.h"
+
+/**
+  Execution profiler, compiled in only when VM_ENABLE_PROFILER is defined
+  (for chip32.cpp and chip32_profiler.cpp). Otherwise the hooks are empty macros
+  and chip32_profiler_attach() returns false: production builds run at full speed.
+
+  Collected data:
+   - executed instructions per opcode and per ROM address (skipped instructions are not counted)
+   - calls: the call stack is followed through call/ret (the return address is RA),
+     each function (call target) gets its number of calls, inclusive instructions and host time
+   - system calls: number of calls, total and worst host time spent in the handler, per code
+
+  While a profiler is attached, the context runs on the switch or threaded engine
+  (the decoded engine and the JIT are bypassed).
+
+  With a cost model (chip32_profiler_set_cost_model()), every executed instruction
+  also adds its estimated cycles on a target microcontroller, so the timing of a
+  program on the device can be followed from a desktop build.
+ */
+typedef struct chip32_profiler_t chip32_profiler_t;
+
+/**
+ * Cycles spent by the interpreter running on a given target, per chip32 instruction.
+ * Host time is meaningless there: the cost of a system call handler is the default one
+ * of the model, unless its code has its own with chip32_profiler_set_syscall_cycles().
+ */
+typedef struct
+{
+    const char *name;
+    uint32_t clock_hz;
+    uint16_t opcodes[INSTRUCTION_COUNT]; //!< Per executed instruction, fetch and dispatch included
+    uint16_t mem_word; //!< Per 32-bit word (rounded up) moved or compared by memcpy, memset and memcmp
+    uint32_t syscall_handler; //!< Default cost of a system call handler
+} chip32_cost_model_t;
+
+// Reference models, switch engine built with -O2, code in flash (wait states included)
+extern const chip32_cost_model_t chip32_cost_cortex_m0; // Cortex-M0+ at 48 MHz, no hardware divide
+extern const chip32_cost_model_t chip32_cost_cortex_m4; // Cortex-M4 at 168 MHz, flash accelerator on
+
+// Address range starting at a label, up to the next label, for the timing report
+typedef struct
+{
+    const char *name;
+    uint16_t addr;
+} chip32_label_t;
+
+chip32_profiler_t *chip32_profiler_create(const virtual_mem_t *rom);
+void chip32_profiler_destroy(chip32_profiler_t *prof);
+void chip32_profiler_reset(chip32_profiler_t *prof);
+
+// Attach (prof != NULL) or detach (prof == NULL) a profiler, one profiler per context
+bool chip32_profiler_attach(chip32_ctx_t *ctx, chip32_profiler_t *prof);
+
+/**
+ * One table, one row per counter:
+ *    kind,key,count,instructions,total_ns,max_ns
+ * kind is opcode (key = mnemonic), address (key = ROM address), function (key =
+ * call target) or syscall (key = code). Unused columns are left empty.
+ */
+void chip32_profiler_write_csv(const chip32_profiler_t *prof, FILE *out);
+
+// Folded stacks ("entry;0x0040;0x0102 1234", self instructions), input of flamegraph.pl
+void chip32_profiler_write_folded(const chip32_profiler_t *prof, FILE *out);
+
+// Select the cost model (NULL: no cycle estimation), counters are not reset
+void chip32_profiler_set_cost_model(chip32_profiler_t *prof, const chip32_cost_model_t *model);
+// Cycles of the handler of a system call code on the target, instead of the default of the model
+void chip32_profiler_set_syscall_cycles(chip32_profiler_t *prof, uint8_t code, uint32_t cycles);
+// Estimated cycles since the last reset, to be compared against a reference in CI
+uint64_t chip32_profiler_cycles(const chip32_profiler_t *prof);
+
+/**
+ * Timing estimation, one row per counter:
+ *    kind,key,count,cycles,us
+ * kind is total (key = cost model, count = instructions), function (key = call target
+ * followed by its label if any, count = calls, inclusive cycles of the completed calls),
+ * label (count = executed instructions between this label and the next one) or
+ * syscall (key = code). Labels may be given in any order, or be NULL.
+ */
+void chip32_profiler_write_timing(const chip32_profiler_t *prof, const chip32_label_t *labels, uint32_t count, FILE *out);
+
+// Hooks called by the interpreter
+void chip32_profiler_instr(chip32_profiler_t *prof, uint32_t addr, uint8_t opcode);
+void chip32_profiler_call(chip32_profiler_t *prof, uint32_t ret_addr, uint32_t target);
+void chip32_profiler_ret(chip32_profiler_t *prof, uint32_t ret_addr);
+void chip32_profiler_syscall_begin(chip32_profiler_t *prof);
+void chip32_profiler_syscall_end(chip32_profiler_t *prof, uint8_t code);
+void chip32_profiler_mem(chip32_profiler_t *prof, uint32_t size);
+
+#endif // CHIP32_PROFILER_H
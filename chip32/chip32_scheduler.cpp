@@ -0,0 +1,280 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_scheduler.h"
+
+#include <algorithm>
+
+static double ToMicroseconds(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+// =============================================================================
+// SCHEDULER CLASS
+// =============================================================================
+Chip32Scheduler::Chip32Scheduler(unsigned nbWorkers, uint32_t quantum)
+    : m_quantum(quantum)
+    , m_workers(nbWorkers > 0 ? nbWorkers : std::max(1U, std::thread::hardware_concurrency()))
+{
+}
+
+Chip32Scheduler::~Chip32Scheduler()
+{
+    Stop();
+}
+
+uint32_t Chip32Scheduler::Submit(chip32_ctx_t *ctx, uint16_t prog_size)
+{
+    Job *job;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_allJobs.emplace_back();
+        job = &m_allJobs.back();
+        job->id = m_allJobs.size() - 1;
+        job->ctx = ctx;
+        job->progSize = prog_size;
+        job->submitted = Clock::now();
+        m_pending++;
+    }
+    Enqueue(job, m_nextWorker++ % m_workers.size());
+    return job->id;
+}
+
+void Chip32Scheduler::Resume(uint32_t id)
+{
+    Job *job;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if ((id >= m_allJobs.size()) || !m_allJobs[id].finished)
+            return;
+        job = &m_allJobs[id];
+        job->finished = false;
+        m_pending++;
+    }
+    Enqueue(job, m_nextWorker++ % m_workers.size());
+}
+
+void Chip32Scheduler::Start()
+{
+    if (m_running)
+        return;
+
+    m_running = true;
+    m_startTime = Clock::now();
+    for (unsigned i = 0; i < m_workers.size(); i++)
+    {
+        m_workers[i].thread = std::thread(&Chip32Scheduler::WorkerLoop, this, i);
+    }
+}
+
+void Chip32Scheduler::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_running = false;
+    }
+    m_workAvailable.notify_all();
+    m_completionSignal.notify_all();
+
+    for (auto &w : m_workers)
+    {
+        if (w.thread.joinable())
+            w.thread.join();
+    }
+}
+
+bool Chip32Scheduler::WaitCompletion(Chip32Completion &completion)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_completionSignal.wait(lock, [this] {
+        return !m_completions.empty() || (m_pending == 0) || !m_running;
+    });
+
+    if (m_completions.empty())
+        return false;
+
+    completion = m_completions.front();
+    m_completions.pop();
+    return true;
+}
+
+bool Chip32Scheduler::PollCompletion(Chip32Completion &completion)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_completions.empty())
+        return false;
+
+    completion = m_completions.front();
+    m_completions.pop();
+    return true;
+}
+
+Chip32SchedulerStats Chip32Scheduler::GetStats()
+{
+    Chip32SchedulerStats stats;
+    double waitUs = 0;
+
+    for (auto &w : m_workers)
+    {
+        std::lock_guard<std::mutex> guard(w.lock);
+        stats.instructions += w.instructions;
+        stats.slices += w.slices;
+        stats.steals += w.steals;
+        waitUs += w.waitUs;
+        stats.maxWaitUs = std::max(stats.maxWaitUs, w.maxWaitUs);
+    }
+
+    Clock::time_point now = Clock::now();
+    if (stats.slices > 0)
+        stats.meanWaitUs = waitUs / stats.slices;
+    if (m_running)
+        stats.seconds = std::chrono::duration<double>(now - m_startTime).count();
+    if (stats.seconds > 0)
+        stats.throughput = stats.instructions / stats.seconds;
+
+    // Jain's fairness index over the execution rate of each job since its submission
+    double sum = 0;
+    double sumSquares = 0;
+    uint32_t count = 0;
+    std::lock_guard<std::mutex> guard(m_lock);
+    for (auto &job : m_allJobs)
+    {
+        double elapsed = ToMicroseconds((job.finished ? job.done : now) - job.submitted);
+        if (elapsed <= 0)
+            continue;
+        double rate = job.executed / elapsed;
+        sum += rate;
+        sumSquares += rate * rate;
+        count++;
+    }
+    if (sumSquares > 0)
+        stats.fairness = (sum * sum) / (count * sumSquares);
+
+    return stats;
+}
+
+void Chip32Scheduler::Enqueue(Job *job, unsigned worker)
+{
+    job->queued = Clock::now();
+    {
+        std::lock_guard<std::mutex> guard(m_workers[worker].lock);
+        m_workers[worker].jobs.push_back(job);
+    }
+    m_ready++;
+
+    // Wake up an idle worker so that it can steal the job
+    if (m_sleepers > 0)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_workAvailable.notify_one();
+    }
+}
+
+bool Chip32Scheduler::NextJob(unsigned self, Job *&job)
+{
+    // Own queue first, in FIFO order so that paused VMs take turns
+    {
+        Worker &w = m_workers[self];
+        std::lock_guard<std::mutex> guard(w.lock);
+        if (!w.jobs.empty())
+        {
+            job = w.jobs.front();
+            w.jobs.pop_front();
+            m_ready--;
+            return true;
+        }
+    }
+
+    // Then steal from the back of the other queues
+    bool stolen = false;
+    for (unsigned i = 1; (i < m_workers.size()) && !stolen; i++)
+    {
+        Worker &victim = m_workers[(self + i) % m_workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty())
+        {
+            job = victim.jobs.back();
+            victim.jobs.pop_back();
+            m_ready--;
+            stolen = true;
+        }
+    }
+
+    if (stolen)
+    {
+        std::lock_guard<std::mutex> guard(m_workers[self].lock);
+        m_workers[self].steals++;
+    }
+    return stolen;
+}
+
+void Chip32Scheduler::Complete(Job *job, chip32_result_t result)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    job->done = Clock::now();
+    job->finished = true;
+    m_completions.push({ job->id, result });
+    m_pending--;
+    m_completionSignal.notify_all();
+}
+
+void Chip32Scheduler::WorkerLoop(unsigned self)
+{
+    Worker &w = m_workers[self];
+
+    while (m_running)
+    {
+        Job *job;
+        if (!NextJob(self, job))
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_sleepers++;
+            m_workAvailable.wait(lock, [this] { return !m_running || (m_ready > 0); });
+            m_sleepers--;
+            continue;
+        }
+
+        Clock::time_point start = Clock::now();
+        uint64_t before = job->ctx->instr_count;
+
+        chip32_result_t result = chip32_run(job->ctx, job->progSize, m_quantum);
+
+        uint64_t executed = job->ctx->instr_count - before;
+        job->executed += executed;
+        {
+            std::lock_guard<std::mutex> guard(w.lock);
+            double waitUs = ToMicroseconds(start - job->queued);
+            w.slices++;
+            w.instructions += executed;
+            w.waitUs += waitUs;
+            w.maxWaitUs = std::max(w.maxWaitUs, waitUs);
+        }
+
+        if (result == VM_PAUSED)
+            Enqueue(job, self);
+        else
+            Complete(job, result);
+    }
+}
@@ -0,0 +1,149 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_SCHEDULER_H
+#define CHIP32_SCHEDULER_H
+
+#include "chip32.h"
+#include <vector>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+// Reported when a VM leaves the scheduler: finished, error or waiting on a system call
+struct Chip32Completion {
+    uint32_t job{0}; //!< Job identifier returned by Submit()
+    chip32_result_t result{VM_FINISHED};
+};
+
+struct Chip32SchedulerStats
+{
+    uint64_t instructions{0}; //!< Instructions executed by all the VMs
+    uint64_t slices{0}; //!< Number of chip32_run() calls
+    uint64_t steals{0}; //!< Jobs taken from another worker queue
+    double seconds{0}; //!< Time spent since Start()
+    double throughput{0}; //!< Instructions per second
+    double meanWaitUs{0}; //!< Average time spent in a queue before a slice, in microseconds
+    double maxWaitUs{0}; //!< Worst time spent in a queue before a slice, in microseconds
+    double fairness{1.0}; //!< Jain's index of the instructions per second received by each job (1.0 = perfectly fair)
+
+    void Print()
+    {
+        std::cout << "Instructions: " << instructions << "\n"
+                  << "Slices: " << slices << " (steals: " << steals << ")\n"
+                  << "Throughput: " << throughput / 1e6 << " Minstr/s\n"
+                  << "Queue wait: " << meanWaitUs << " us average, " << maxWaitUs << " us max\n"
+                  << "Fairness: " << fairness << "\n"
+                  << std::endl;
+    }
+};
+
+/**
+ * Runs a large number of chip32 contexts on a pool of threads.
+ *
+ * Each VM runs by slices of 'quantum' instructions (the max_instr parameter of
+ * chip32_run()). A VM that returns VM_PAUSED goes back to the end of the queue of
+ * its worker, any other result is posted to the completion queue. Every worker
+ * owns a deque; an idle worker steals jobs from the others so that all the cores
+ * stay busy even if the scripts have very different lengths.
+ *
+ * Contexts are owned by the caller, they must be initialized and stay valid until
+ * their completion is reported.
+ */
+class Chip32Scheduler
+{
+public:
+    // nbWorkers == 0 means one worker per hardware thread
+    explicit Chip32Scheduler(unsigned nbWorkers = 0, uint32_t quantum = 10000);
+    ~Chip32Scheduler();
+
+    // Add a VM, can be called before or after Start(). Returns the job identifier.
+    uint32_t Submit(chip32_ctx_t *ctx, uint16_t prog_size);
+    // Put back a VM that was reported with VM_WAIT_SYSCALL
+    void Resume(uint32_t job);
+
+    void Start();
+    // Stop the workers, VMs still queued are left as is
+    void Stop();
+
+    // Block until a VM leaves the scheduler. Returns false if there is no more VM to wait for.
+    bool WaitCompletion(Chip32Completion &completion);
+    bool PollCompletion(Chip32Completion &completion);
+
+    Chip32SchedulerStats GetStats();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Job {
+        uint32_t id{0};
+        chip32_ctx_t *ctx{nullptr};
+        uint16_t progSize{0};
+        std::atomic<uint64_t> executed{0}; //!< Instructions executed by this job
+        Clock::time_point submitted;
+        Clock::time_point queued; //!< Last time the job went into a queue
+        Clock::time_point done; //!< Completion time, valid if finished is true
+        bool finished{false};
+    };
+
+    struct Worker {
+        std::mutex lock; //!< Protects the deque and the statistics
+        std::deque<Job *> jobs;
+        std::thread thread;
+        uint64_t slices{0};
+        uint64_t steals{0};
+        uint64_t instructions{0};
+        double waitUs{0};
+        double maxWaitUs{0};
+    };
+
+    void Enqueue(Job *job, unsigned worker);
+    bool NextJob(unsigned self, Job *&job);
+    void Complete(Job *job, chip32_result_t result);
+    void WorkerLoop(unsigned self);
+
+    uint32_t m_quantum;
+    std::vector<Worker> m_workers;
+    std::atomic<bool> m_running{false};
+    std::atomic<unsigned> m_nextWorker{0};
+    std::atomic<uint32_t> m_ready{0}; //!< Jobs sitting in the worker deques
+    std::atomic<uint32_t> m_sleepers{0}; //!< Idle workers waiting on m_workAvailable
+    Clock::time_point m_startTime;
+
+    // Everything below is protected by m_lock
+    std::mutex m_lock;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_completionSignal;
+    std::deque<Job> m_allJobs; //!< Deque: references stay valid when jobs are added
+    uint32_t m_pending{0}; //!< Jobs queued or being executed
+    std::queue<Chip32Completion> m_completions;
+};
+
+#endif // CHIP32_SCHEDULER_H
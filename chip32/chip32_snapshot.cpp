@@ -0,0 +1,234 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_snapshot.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__linux__)
+#define CHIP32_SNAPSHOT_MEMFD
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const uint32_t PAGE_SIZE = 1U << CHIP32_PAGE_SHIFT;
+
+// Snapshot identifiers, never reused (a new snapshot may get the address of a destroyed one)
+static std::atomic<uint64_t> g_lastSnapshotId{0};
+
+struct chip32_snapshot_t
+{
+    uint64_t id; //!< Value of chip32_ctx_t::snapshot_id for the contexts tracking their pages against it
+    chip32_ctx_t ctx; //!< Registers, counters and settings at the time of the snapshot
+    uint8_t *ram; //!< Copy of the RAM
+    size_t mappedSize; //!< Size of the memfd mapping, 0 if the copy is on the heap
+    int fd; //!< memfd holding the RAM copy, -1 if none
+};
+
+static bool chip32_overlaps(const virtual_mem_t *a, const virtual_mem_t *b)
+{
+    return ((uintptr_t)a->mem < (uintptr_t)b->mem + b->size) && ((uintptr_t)b->mem < (uintptr_t)a->mem + a->size);
+}
+
+#ifdef CHIP32_SNAPSHOT_MEMFD
+static size_t chip32_mapped_size(uint16_t size)
+{
+    const size_t hostPage = sysconf(_SC_PAGESIZE);
+    return ((size + hostPage - 1) / hostPage) * hostPage;
+}
+#endif
+
+// =======================================================================================
+// SNAPSHOT
+// =======================================================================================
+chip32_snapshot_t *chip32_snapshot_create(chip32_ctx_t *ctx)
+{
+    chip32_snapshot_t *snap = new chip32_snapshot_t();
+    snap->id = ++g_lastSnapshotId;
+    snap->ctx = *ctx;
+    snap->ram = nullptr;
+    snap->mappedSize = 0;
+    snap->fd = -1;
+
+    const uint16_t size = ctx->ram->size;
+#ifdef CHIP32_SNAPSHOT_MEMFD
+    if (size > 0)
+    {
+        snap->fd = memfd_create("chip32_snapshot", MFD_CLOEXEC);
+        if (snap->fd >= 0)
+        {
+            snap->mappedSize = chip32_mapped_size(size);
+            void *pages = MAP_FAILED;
+            if (ftruncate(snap->fd, snap->mappedSize) == 0)
+                pages = mmap(nullptr, snap->mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, snap->fd, 0);
+            if (pages != MAP_FAILED)
+            {
+                snap->ram = static_cast<uint8_t *>(pages);
+            }
+            else
+            {
+                close(snap->fd);
+                snap->fd = -1;
+                snap->mappedSize = 0;
+            }
+        }
+    }
+#endif
+    if (snap->ram == nullptr)
+    {
+        snap->ram = static_cast<uint8_t *>(malloc(size > 0 ? size : 1));
+        if (snap->ram == nullptr)
+        {
+            delete snap;
+            return nullptr;
+        }
+    }
+
+    memcpy(snap->ram, ctx->ram->mem, size);
+    memset(ctx->dirty, 0, sizeof(ctx->dirty));
+    ctx->snapshot_id = snap->id;
+    return snap;
+}
+
+void chip32_snapshot_destroy(chip32_snapshot_t *snap)
+{
+#ifdef CHIP32_SNAPSHOT_MEMFD
+    if (snap->fd >= 0)
+    {
+        munmap(snap->ram, snap->mappedSize);
+        close(snap->fd);
+        snap->ram = nullptr;
+    }
+#endif
+    free(snap->ram);
+    delete snap;
+}
+
+void chip32_snapshot_restore(const chip32_snapshot_t *snap, chip32_ctx_t *ctx)
+{
+    const uint16_t size = ctx->ram->size;
+    const uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // The dirty pages are those written since another snapshot: all the RAM may differ
+    const bool whole = (ctx->snapshot_id != snap->id);
+    bool restored = whole;
+    if (whole)
+        memcpy(ctx->ram->mem, snap->ram, size);
+
+    for (uint32_t page = 0; (page < pages) && !whole; page++)
+    {
+        const uint64_t bits = ctx->dirty[page / 64];
+        if (bits == 0)
+        {
+            page |= 63; // next word
+            continue;
+        }
+        if (bits & (1ULL << (page % 64)))
+        {
+            const uint32_t offset = page * PAGE_SIZE;
+            const uint32_t n = (offset + PAGE_SIZE > size) ? (size - offset) : PAGE_SIZE;
+            memcpy(ctx->ram->mem + offset, snap->ram + offset, n);
+            restored = true;
+        }
+    }
+    memset(ctx->dirty, 0, sizeof(ctx->dirty));
+    ctx->snapshot_id = snap->id;
+
+    memcpy(ctx->registers, snap->ctx.registers, sizeof(ctx->registers));
+    memcpy(ctx->vregs, snap->ctx.vregs, sizeof(ctx->vregs));
+    ctx->skip = snap->ctx.skip;
+    ctx->bank = snap->ctx.bank;
+    ctx->suspend = false;
+    ctx->instr_count = snap->ctx.instr_count;
+
+    // Self-modifying program: the restored pages may contain code
+    if (restored && chip32_overlaps(ctx->ram, ctx->rom))
+        chip32_invalidate_rom(ctx);
+}
+
+// =======================================================================================
+// CLONES
+// =======================================================================================
+bool chip32_snapshot_clone(const chip32_snapshot_t *snap, chip32_ctx_t *clone, virtual_mem_t *ram)
+{
+    const uint16_t size = snap->ctx.ram->size;
+
+    // The ROM would still point into the RAM of the context, not into the clone's
+    if (chip32_overlaps(snap->ctx.ram, snap->ctx.rom))
+        return false;
+
+    ram->mem = nullptr;
+    ram->size = size;
+    ram->addr = snap->ctx.ram->addr;
+
+#ifdef CHIP32_SNAPSHOT_MEMFD
+    if (snap->fd >= 0)
+    {
+        // Private mapping: the pages are shared with the snapshot until the clone writes them
+        void *pages = mmap(nullptr, snap->mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, snap->fd, 0);
+        if (pages == MAP_FAILED)
+            return false;
+        ram->mem = static_cast<uint8_t *>(pages);
+    }
+#endif
+    if (ram->mem == nullptr)
+    {
+        ram->mem = static_cast<uint8_t *>(malloc(size > 0 ? size : 1));
+        if (ram->mem == nullptr)
+            return false;
+        memcpy(ram->mem, snap->ram, size);
+    }
+
+    *clone = snap->ctx;
+    clone->ram = ram;
+    clone->suspend = false;
+    memset(clone->dirty, 0, sizeof(clone->dirty));
+    clone->snapshot_id = snap->id;
+
+    // Written at each instruction: a clone running next to the context must not share them
+    clone->fusion = nullptr;
+    clone->profiler = nullptr;
+    clone->trace = nullptr;
+    clone->async = nullptr;
+    return true;
+}
+
+void chip32_snapshot_release_clone(const chip32_snapshot_t *snap, chip32_ctx_t *clone)
+{
+    virtual_mem_t *ram = clone->ram;
+#ifdef CHIP32_SNAPSHOT_MEMFD
+    if (snap->fd >= 0)
+    {
+        munmap(ram->mem, snap->mappedSize);
+        ram->mem = nullptr;
+        return;
+    }
+#else
+    (void) snap;
+#endif
+    free(ram->mem);
+    ram->mem = nullptr;
+}
@@ -0,0 +1,71 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_SNAPSHOT_H
+#define CHIP32_SNAPSHOT_H
+
+#include "chip32.h"
+
+/**
+  Snapshot of a VM: registers (vector ones included), pending skip, selected bank, instruction counter
+  and RAM content.
+
+  After chip32_snapshot_create(), the context tracks the RAM pages (64 bytes) it
+  writes, so chip32_snapshot_restore() only copies back these pages: resetting a
+  booted VM costs O(touched bytes) instead of O(RAM). RAM writes done by the
+  host must be reported with chip32_ram_written().
+  The pages are tracked against one snapshot: the last one created, restored or
+  cloned by the context. Restoring any other snapshot copies the whole RAM, and
+  the tracking then follows that snapshot.
+
+  Clones are new contexts started from the snapshot. On Linux, the snapshot RAM
+  is kept in a memfd and a clone maps it privately: pages are only copied by
+  the kernel when the clone writes them. Elsewhere, the RAM is copied.
+
+  The ROM, the banked memory segments, the engine, the system call handler and
+  the caches are shared with the context the snapshot was taken from. Clones are not supported if the RAM
+  and the ROM overlap (self-modifying programs): chip32_snapshot_clone() fails.
+  A clone starts without profiler, trace, asynchronous system call ring and
+  superinstruction statistics: each one is written by a single running context,
+  attach new ones to the clone if needed.
+ */
+typedef struct chip32_snapshot_t chip32_snapshot_t;
+
+// Capture the state of 'ctx', its dirty pages are now tracked against the snapshot. Returns NULL on failure.
+chip32_snapshot_t *chip32_snapshot_create(chip32_ctx_t *ctx);
+void chip32_snapshot_destroy(chip32_snapshot_t *snap);
+
+// Put back the state of the snapshot into 'ctx', the context it was taken from or one of its clones
+void chip32_snapshot_restore(const chip32_snapshot_t *snap, chip32_ctx_t *ctx);
+
+/**
+ * Initialize 'clone' from the snapshot. 'ram' is filled by the function (it
+ * points to memory allocated for the clone) and must outlive the clone.
+ * Returns false if the memory cannot be allocated, or if the ROM lies in the RAM.
+ */
+bool chip32_snapshot_clone(const chip32_snapshot_t *snap, chip32_ctx_t *clone, virtual_mem_t *ram);
+// Free the RAM of a clone, 'snap' is the snapshot it was cloned from
+void chip32_snapshot_release_clone(const chip32_snapshot_t *snap, chip32_ctx_t *clone);
+
+#endif // CHIP32_SNAPSHOT_H
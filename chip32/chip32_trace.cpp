@@ -0,0 +1,367 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "chip32_trace.h"
+
+#include <cstring>
+
+static const char *const OpcodeNames[] = CHIP32_MNEMONICS_LIST;
+static_assert(sizeof(OpcodeNames) / sizeof(OpcodeNames[0]) == INSTRUCTION_COUNT, "opcode names out of date");
+
+static const char *const RegisterNames[] = CHIP32_REGISTER_NAMES_LIST;
+static_assert(sizeof(RegisterNames) / sizeof(RegisterNames[0]) == REGISTER_COUNT, "register names out of date");
+
+static const OpCode OpCodes[] = OPCODES_LIST;
+
+static const char *const ResultNames[] = {
+    "finished", "paused", "wait syscall", "unknown opcode", "unsupported opcode", "invalid register",
+    "unhandled interrupt", "stack overflow", "stack underflow", "invalid address"
+};
+static_assert(sizeof(ResultNames) / sizeof(ResultNames[0]) == VM_ERR_INVALID_ADDRESS + 1, "result names out of date");
+
+// =============================================================================
+// DISASSEMBLER
+// =============================================================================
+// Appends to a fixed-size text, truncates silently
+class TextOut
+{
+public:
+    TextOut(char *text, uint32_t size) : m_text(text), m_size(size) { Put(""); }
+
+    void Put(const char *s)
+    {
+        const uint32_t len = (uint32_t)strlen(s);
+        const uint32_t room = (m_used + 1 < m_size) ? (m_size - m_used - 1) : 0;
+        const uint32_t n = (len < room) ? len : room;
+        if (m_size > 0)
+        {
+            memcpy(m_text + m_used, s, n);
+            m_used += n;
+            m_text[m_used] = '\0';
+        }
+    }
+
+    void Reg(uint8_t reg) { Put((reg < REGISTER_COUNT) ? RegisterNames[reg] : "r?"); }
+
+    void VReg(uint8_t vreg)
+    {
+        char name[8];
+        snprintf(name, sizeof(name), "v%u", vreg);
+        Put(name);
+    }
+
+    void Number(uint32_t value, const char *format = "0x%X")
+    {
+        char number[16];
+        snprintf(number, sizeof(number), format, value);
+        Put(number);
+    }
+
+private:
+    char *m_text;
+    uint32_t m_size;
+    uint32_t m_used{0};
+};
+
+uint32_t chip32_disassemble(const virtual_mem_t *rom, uint32_t addr, char *text, uint32_t text_size)
+{
+    TextOut out(text, text_size);
+    if (addr >= rom->size)
+        return 0;
+
+    const uint8_t *a = &rom->mem[addr + 1];
+    const uint8_t op = rom->mem[addr];
+    if ((op >= INSTRUCTION_COUNT) || (addr + OpCodes[op].bytes >= rom->size))
+    {
+        out.Put(".byte ");
+        out.Number(op, "0x%02X");
+        return 0;
+    }
+
+    const uint16_t short1 = a[0] | a[1] << 8;
+    out.Put(OpcodeNames[op]);
+    if (OpCodes[op].nbAargs > 0)
+        out.Put(" ");
+
+    switch (op)
+    {
+    case OP_SYSCALL:
+        out.Number(a[0], "%u");
+        break;
+    case OP_LCONS:
+        out.Reg(a[0]);
+        out.Put(", ");
+        out.Number(a[1] | a[2] << 8 | a[3] << 16 | (uint32_t)a[4] << 24);
+        break;
+    case OP_PUSH:
+    case OP_POP:
+    case OP_NOT:
+    case OP_JR:
+    case OP_SKIPZ:
+    case OP_SKIPNZ:
+    case OP_BANK:
+        out.Reg(a[0]);
+        break;
+    case OP_CALL:
+    case OP_JMP:
+        out.Number(short1, "0x%04X");
+        break;
+    case OP_STORE:
+        out.Number(short1, "0x%04X");
+        out.Put(", ");
+        out.Reg(a[2]);
+        break;
+    case OP_LOAD:
+        out.Reg(a[0]);
+        out.Put(", ");
+        out.Number(a[1] | a[2] << 8, "0x%04X");
+        break;
+    case OP_MEMCPY:
+    case OP_MEMSET:
+    case OP_MEMCMP:
+        out.Reg(a[0]);
+        out.Put(", ");
+        out.Reg(a[1]);
+        out.Put(", ");
+        out.Reg(a[2]);
+        break;
+    case OP_JE:
+    case OP_JNE:
+    case OP_JLT:
+    case OP_JGE:
+        out.Reg(a[0]);
+        out.Put(", ");
+        out.Reg(a[1]);
+        out.Put(", ");
+        out.Number(a[2] | a[3] << 8, "0x%04X");
+        break;
+    case OP_LOADR:
+    {
+        const int16_t offset = (int16_t)(a[2] | a[3] << 8);
+        out.Reg(a[0]);
+        out.Put(", [");
+        out.Reg(a[1]);
+        out.Number((offset < 0) ? -offset : offset, (offset < 0) ? "-%u" : "+%u");
+        out.Put("]");
+        break;
+    }
+    case OP_STORER:
+    {
+        const int16_t offset = (int16_t)(a[1] | a[2] << 8);
+        out.Put("[");
+        out.Reg(a[0]);
+        out.Number((offset < 0) ? -offset : offset, (offset < 0) ? "-%u" : "+%u");
+        out.Put("], ");
+        out.Reg(a[3]);
+        break;
+    }
+    case OP_VLOAD:
+        out.VReg(a[0]);
+        out.Put(", ");
+        out.Reg(a[1]);
+        break;
+    case OP_VSTORE:
+    case OP_VSUM8:
+    case OP_VSUM16:
+        out.Reg(a[0]);
+        out.Put(", ");
+        out.VReg(a[1]);
+        break;
+    case OP_VADD8:
+    case OP_VADD16:
+    case OP_VSUB8:
+    case OP_VSUB16:
+    case OP_VMIN8:
+    case OP_VMIN16:
+    case OP_VMAX8:
+    case OP_VMAX16:
+    case OP_VXOR:
+        out.VReg(a[0]);
+        out.Put(", ");
+        out.VReg(a[1]);
+        break;
+    case OP_PUSHM:
+    case OP_POPM:
+    {
+        const uint32_t mask = a[0] | a[1] << 8 | a[2] << 16;
+        const char *sep = "";
+        for (uint8_t reg = 0; reg < 24; reg++)
+        {
+            if (mask & (1U << reg))
+            {
+                out.Put(sep);
+                out.Reg(reg);
+                sep = ", ";
+            }
+        }
+        break;
+    }
+    case OP_ENTER:
+        out.Number(short1, "%u");
+        break;
+    case OP_NOP:
+    case OP_HALT:
+    case OP_RET:
+    case OP_LEAVE:
+        break;
+    default:
+        // Two registers: mov, arithmetic and logic, loadb, storeb
+        out.Reg(a[0]);
+        out.Put(", ");
+        out.Reg(a[1]);
+        break;
+    }
+    return OpCodes[op].bytes + 1;
+}
+
+// =============================================================================
+// TRACE
+// =============================================================================
+bool chip32_trace_init(chip32_trace_t *trace, chip32_trace_record_t *records, uint32_t count)
+{
+    if ((count == 0) || ((count & (count - 1)) != 0))
+        return false;
+
+    trace->records = records;
+    trace->mask = count - 1;
+    trace->error_out = nullptr;
+    chip32_trace_reset(trace);
+    return true;
+}
+
+void chip32_trace_reset(chip32_trace_t *trace)
+{
+    trace->count = 0;
+    // The next run records where it starts
+    trace->stop = UINT32_MAX;
+}
+
+void chip32_trace_attach(chip32_ctx_t *ctx, chip32_trace_t *trace)
+{
+    ctx->trace = trace;
+}
+
+void chip32_trace_dump_on_error(chip32_trace_t *trace, FILE *out)
+{
+    trace->error_out = out;
+}
+
+uint32_t chip32_trace_read(const chip32_trace_t *trace, chip32_trace_record_t *out, uint32_t max)
+{
+    uint64_t available = trace->count;
+    if (available > (uint64_t)trace->mask + 1)
+        available = (uint64_t)trace->mask + 1;
+    const uint32_t n = (available < max) ? (uint32_t)available : max;
+
+    for (uint32_t i = 0; i < n; i++)
+        out[i] = trace->records[(trace->count - n + i) & trace->mask];
+    return n;
+}
+
+// Instructions of [addr, end), executed one after the other between two transfers
+static void WriteStraight(const chip32_ctx_t *ctx, uint32_t addr, uint32_t end, FILE *out)
+{
+    char text[64];
+    while (addr < end)
+    {
+        const uint32_t size = chip32_disassemble(ctx->rom, addr, text, sizeof(text));
+        fprintf(out, "0x%04X  %s\n", addr, text);
+        if (size == 0)
+            return;
+        addr += size;
+    }
+}
+
+void chip32_trace_write(const chip32_trace_t *trace, const chip32_ctx_t *ctx, FILE *out)
+{
+    char text[64];
+    const virtual_mem_t *rom = ctx->rom;
+
+    uint64_t available = trace->count;
+    if (available > (uint64_t)trace->mask + 1)
+        available = (uint64_t)trace->mask + 1;
+    fprintf(out, "# %llu transfers, last %llu\n", (unsigned long long)trace->count, (unsigned long long)available);
+
+    // The instructions before the oldest record are unknown
+    bool known = false;
+    uint32_t addr = 0;
+    for (uint64_t i = trace->count - available; i < trace->count; i++)
+    {
+        const chip32_trace_record_t &record = trace->records[i & trace->mask];
+        const bool skip = (record.opcode == OP_SKIPZ) || (record.opcode == OP_SKIPNZ);
+        if (known)
+            WriteStraight(ctx, addr, record.from, out);
+
+        if (record.opcode == CHIP32_TRACE_ENTRY)
+        {
+            fprintf(out, "# run from 0x%04X\n", record.to);
+        }
+        else
+        {
+            chip32_disassemble(rom, record.from, text, sizeof(text));
+            if ((record.from >= rom->size) || (rom->mem[record.from] != record.opcode))
+                snprintf(text, sizeof(text), "%s (rewritten)", OpcodeNames[record.opcode]);
+
+            fprintf(out, "0x%04X  %-28s; %s 0x%04X", record.from, text, skip ? "skips" : "->", record.to);
+            if (record.reg < REGISTER_COUNT)
+                fprintf(out, ", %s = 0x%08X", RegisterNames[record.reg], record.value);
+            fprintf(out, "\n");
+        }
+
+        addr = record.to;
+        known = true;
+        if (skip && (addr < rom->size) && (rom->mem[addr] < INSTRUCTION_COUNT))
+            addr += OpCodes[rom->mem[addr]].bytes + 1;
+    }
+
+    // Up to the instruction IP points to, not executed yet or the one that failed
+    const uint32_t ip = ctx->registers[IP];
+    if (known)
+        WriteStraight(ctx, addr, ip, out);
+    chip32_disassemble(rom, ip, text, sizeof(text));
+    fprintf(out, "0x%04X  %-28s; <- ip\n", ip, text);
+}
+
+void chip32_trace_begin(chip32_ctx_t *ctx)
+{
+    chip32_trace_t *trace = ctx->trace;
+    const uint32_t ip = ctx->registers[IP];
+    if (ip == trace->stop)
+        return;
+
+    trace->records[trace->count & trace->mask] = chip32_trace_record_t{ (uint16_t)trace->stop, (uint16_t)ip, CHIP32_TRACE_ENTRY, CHIP32_TRACE_NO_REG, 0 };
+    trace->count++;
+}
+
+void chip32_trace_result(chip32_ctx_t *ctx, chip32_result_t result)
+{
+    chip32_trace_t *trace = ctx->trace;
+    trace->stop = ctx->registers[IP];
+    if ((trace->error_out == nullptr) || (result <= VM_WAIT_SYSCALL))
+        return;
+
+    fprintf(trace->error_out, "# error: %s, ip = 0x%04X\n", ResultNames[result], ctx->registers[IP]);
+    chip32_trace_write(trace, ctx, trace->error_out);
+    fflush(trace->error_out);
+}
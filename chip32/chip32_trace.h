@@ -0,0 +1,117 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_TRACE_H
+#define CHIP32_TRACE_H
+
+#include "chip32.h"
+#include <stdio.h>
+
+/**
+  Post-mortem trace: the last control transfers of a context, kept in a ring of
+  fixed size owned by the caller. Only the taken jumps, calls, returns and skips
+  are recorded, the instructions in between are found again by walking the ROM
+  from one transfer to the next. The cost depends on how often the program jumps:
+  a few percent with a taken transfer every 8 instructions (chip32_bench_engines),
+  up to 10-15% on the threaded engine with one every 5.
+  The hooks are compiled in unless VM_DISABLE_TRACE is defined, chip32_trace.cpp
+  must be linked with chip32.cpp otherwise. Traced runs use their own instances
+  of the interpreter loops, so the untraced ones are not slowed down.
+
+  Each record holds the ROM address and the opcode of the transfer, the address
+  executed next, and the register tested or written by the transfer with its
+  value (the condition of skips and conditional jumps, the first compared
+  register of je/jne/jlt/jge, the target of jumpr, RA for call and ret). A run
+  starting away from where the previous traced run stopped (IP set by the host)
+  is recorded too, with the opcode CHIP32_TRACE_ENTRY.
+
+  While a trace is attached, the context runs on the switch or threaded engine
+  (the decoded engine, the JIT and translated code are bypassed).
+
+  The ring can be read at any time, or written as disassembled text, automatically
+  when chip32_run() returns an error (chip32_trace_dump_on_error()).
+ */
+#define CHIP32_TRACE_NO_REG 0xFF
+#define CHIP32_TRACE_ENTRY 0xFF //!< Opcode of the record of a run start
+
+typedef struct
+{
+    uint16_t from; //!< ROM address of the transfer, for an entry: where the previous run stopped
+    uint16_t to; //!< Address executed next (for a skip: the skipped instruction)
+    uint8_t opcode;
+    uint8_t reg; //!< Register tested or written, CHIP32_TRACE_NO_REG if none
+    uint32_t value; //!< Value of 'reg' at the transfer
+} chip32_trace_record_t;
+
+typedef struct chip32_trace_t
+{
+    chip32_trace_record_t *records;
+    uint32_t mask; //!< Number of records - 1
+    uint64_t count; //!< Records written since the last reset
+    uint32_t stop; //!< IP at the end of the last traced run
+    FILE *error_out; //!< Set by chip32_trace_dump_on_error()
+} chip32_trace_t;
+
+/**
+ * Use 'records' (owned by the caller) as ring, 'count' must be a power of two.
+ * Returns false otherwise.
+ */
+bool chip32_trace_init(chip32_trace_t *trace, chip32_trace_record_t *records, uint32_t count);
+// Only between two runs: chip32_run() keeps its position in the ring until it returns
+void chip32_trace_reset(chip32_trace_t *trace);
+
+// Attach (trace != NULL) or detach (trace == NULL) a trace, one trace per context
+void chip32_trace_attach(chip32_ctx_t *ctx, chip32_trace_t *trace);
+
+// Write the trace into 'out' each time chip32_run() returns an error (NULL: never)
+void chip32_trace_dump_on_error(chip32_trace_t *trace, FILE *out);
+
+/**
+ * Copy the last 'max' records at most into 'out', oldest first.
+ * Returns the number of records copied.
+ */
+uint32_t chip32_trace_read(const chip32_trace_t *trace, chip32_trace_record_t *out, uint32_t max);
+
+/**
+ * Disassembled trace, oldest instruction first, one per line. The instructions
+ * between two transfers are decoded from the current ROM of 'ctx', the context
+ * the trace is attached to; the transfers give the register they tested:
+ *    0x0010  sub r0, r1
+ *    0x0013  skipz r0                    ; skips 0x0015, r0 = 0x00000000
+ *    0x0018  halt                        ; <- ip
+ */
+void chip32_trace_write(const chip32_trace_t *trace, const chip32_ctx_t *ctx, FILE *out);
+
+/**
+ * Disassemble the instruction at 'addr' of 'rom' into 'text' (assembler syntax).
+ * Returns its size in bytes, 0 if the opcode is unknown or the instruction is
+ * truncated ('text' then gives the raw byte).
+ */
+uint32_t chip32_disassemble(const virtual_mem_t *rom, uint32_t addr, char *text, uint32_t text_size);
+
+// Hooks called by chip32_run() before and after a traced run
+void chip32_trace_begin(chip32_ctx_t *ctx);
+void chip32_trace_result(chip32_ctx_t *ctx, chip32_result_t result);
+
+#endif // CHIP32_TRACE_H
@@ -0,0 +1,675 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "chip32_translator.h"
+
+#include <cstdio>
+
+static const OpCode OpCodes[] = OPCODES_LIST;
+
+static const char *const OpNames[] = CHIP32_MNEMONICS_LIST;
+static_assert(sizeof(OpNames) / sizeof(OpNames[0]) == INSTRUCTION_COUNT, "opcode names out of date");
+
+// Local variable and register file index of each register
+#define REG_INDEX_ENTRY(reg, name) #reg,
+static const char *const RegLocals[REGISTER_COUNT] = CHIP32_REGISTER_NAMES_LIST;
+static const char *const RegIndexes[REGISTER_COUNT] = { CHIP32_REGISTERS(REG_INDEX_ENTRY) };
+
+// Code shared by all the translations of a source file
+static const char *const Prelude =
+    "#ifndef CHIP32_TRANSLATED_PRELUDE\n"
+    "#define CHIP32_TRANSLATED_PRELUDE\n"
+    "#include \"chip32.h\"\n"
+    "#include <string.h>\n"
+    "\n"
+    "// Returned by a block: the instruction at the returned address is executed by chip32_run()\n"
+    "#define TR_STEP ((chip32_result_t)-1)\n"
+    "\n"
+    "typedef uint32_t (*tr_block_t)(chip32_ctx_t *ctx, uint32_t *r, uint16_t prog_size, chip32_result_t *result);\n"
+    "\n"
+    "// Same as the interpreter, needed by the snapshots\n"
+    "static void tr_dirty(chip32_ctx_t *ctx, uint32_t offset, uint32_t size)\n"
+    "{\n"
+    "    uint32_t first, last, page;\n"
+    "    if ((offset >= ctx->ram->size) || (size == 0))\n"
+    "        return;\n"
+    "    first = offset >> CHIP32_PAGE_SHIFT;\n"
+    "    last = (offset + size - 1) >> CHIP32_PAGE_SHIFT;\n"
+    "    if (last > (uint32_t)(ctx->ram->size - 1) >> CHIP32_PAGE_SHIFT)\n"
+    "        last = (uint32_t)(ctx->ram->size - 1) >> CHIP32_PAGE_SHIFT;\n"
+    "    for (page = first; page <= last; page++)\n"
+    "        ctx->dirty[page / 64] |= 1ULL << (page % 64);\n"
+    "}\n"
+    "\n"
+    "static bool tr_overlap(const chip32_ctx_t *ctx)\n"
+    "{\n"
+    "    return (ctx->ram->mem < ctx->rom->mem + ctx->rom->size) && (ctx->rom->mem < ctx->ram->mem + ctx->ram->size);\n"
+    "}\n"
+    "#endif\n";
+
+static std::string Hex(uint32_t value)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "0x%04X", value);
+    return buf;
+}
+
+// Leaves the block, the execution goes on at 'next'
+static std::string Exit(uint32_t count, const std::string &next)
+{
+    std::string code = "BLOCK_SYNC(); ";
+    if (count > 0)
+        code += "ctx->instr_count += " + std::to_string(count) + "; ";
+    return code + "return " + next + ";";
+}
+
+// Leaves the block and the translated code: halt, end of a system call
+static std::string Stop(uint32_t count, const std::string &result, const std::string &ip)
+{
+    std::string code = "BLOCK_SYNC(); ";
+    if (count > 0)
+        code += "ctx->instr_count += " + std::to_string(count) + "; ";
+    return code + "r[IP] = " + ip + "; *result = " + result + "; return 0;";
+}
+
+// The instruction at 'addr' is executed by the interpreter
+static std::string Step(uint32_t count, uint32_t addr)
+{
+    std::string code = "BLOCK_SYNC(); ";
+    if (count > 0)
+        code += "ctx->instr_count += " + std::to_string(count) + "; ";
+    return code + "*result = TR_STEP; return " + Hex(addr) + ";";
+}
+
+// Stack checks of the interpreter (_RESERVE_FAILS, _POP_FAILS)
+static std::string PushFails(const std::string &bytes)
+{
+    return "(sp > ctx->ram->size) || ((uint64_t)sp + ctx->stack_size < (uint64_t)" + bytes + " + ctx->ram->size)";
+}
+
+static std::string PopFails(const std::string &sp, const std::string &bytes)
+{
+    return "((uint64_t)" + sp + " + " + bytes + " > (uint64_t)(ctx->ram->addr + ctx->ram->size)) || (" + sp + " < prog_size)";
+}
+
+// =============================================================================
+// TRANSLATOR CLASS
+// =============================================================================
+bool Chip32Translator::Decode(uint32_t addr, Instr &instr) const
+{
+    const uint8_t *mem = m_program.data();
+    const uint32_t size = m_program.size();
+
+    instr = Instr();
+    instr.addr = addr;
+    if ((addr >= size) || (mem[addr] >= INSTRUCTION_COUNT) || (addr + OpCodes[mem[addr]].bytes >= size))
+        return false; // error reported by the interpreter
+
+    const uint8_t op = mem[addr];
+    instr.op = op;
+    instr.size = OpCodes[op].bytes + 1;
+    instr.flow = FLOW_NEXT;
+
+    switch (op)
+    {
+    case OP_NOP:
+        break;
+    case OP_HALT:
+    case OP_RET:
+        instr.flow = FLOW_END;
+        break;
+    case OP_SYSCALL:
+        instr.imm = mem[addr + 1];
+        instr.flow = FLOW_SYSCALL;
+        break;
+    case OP_LCONS:
+        instr.regs[0] = mem[addr + 1];
+        instr.nbRegs = 1;
+        instr.imm = mem[addr + 2] | mem[addr + 3] << 8 | mem[addr + 4] << 16 | (uint32_t)mem[addr + 5] << 24;
+        break;
+    case OP_CALL:
+    case OP_JMP:
+        instr.target = mem[addr + 1] | mem[addr + 2] << 8;
+        instr.flow = (op == OP_CALL) ? FLOW_CALL : FLOW_JUMP;
+        break;
+    case OP_STORE:
+    case OP_LOAD:
+        instr.regs[0] = mem[addr + ((op == OP_STORE) ? 3 : 1)];
+        instr.nbRegs = 1;
+        instr.imm = (op == OP_STORE) ? mem[addr + 1] | mem[addr + 2] << 8 : mem[addr + 2] | mem[addr + 3] << 8;
+        if (instr.imm + 3 >= size)
+            instr.flow = FLOW_STEP;
+        break;
+    case OP_PUSH:
+    case OP_POP:
+    case OP_NOT:
+        instr.regs[0] = mem[addr + 1];
+        instr.nbRegs = 1;
+        break;
+    case OP_PUSHM:
+    case OP_POPM:
+        instr.imm = mem[addr + 1] | mem[addr + 2] << 8 | mem[addr + 3] << 16;
+        if (instr.imm & (~((1U << REGISTER_COUNT) - 1) | (1U << IP) | (1U << SP)))
+            instr.flow = FLOW_STEP;
+        break;
+    case OP_ENTER:
+        instr.imm = mem[addr + 1] | mem[addr + 2] << 8;
+        break;
+    case OP_JR:
+        instr.regs[0] = mem[addr + 1];
+        instr.nbRegs = 1;
+        instr.flow = FLOW_END;
+        break;
+    case OP_SKIPZ:
+    case OP_SKIPNZ:
+    {
+        instr.regs[0] = mem[addr + 1];
+        instr.nbRegs = 1;
+        // The skipped instruction must be complete, or the interpreter reports the error
+        const uint32_t skipped = addr + instr.size;
+        if ((skipped < size) && (mem[skipped] < INSTRUCTION_COUNT) && (skipped + OpCodes[mem[skipped]].bytes < size))
+        {
+            instr.target = skipped + OpCodes[mem[skipped]].bytes + 1;
+            instr.flow = FLOW_SKIP;
+        }
+        else
+            instr.flow = FLOW_STEP;
+        break;
+    }
+    case OP_BANK:
+    case OP_LOADB:
+    case OP_STOREB:
+        // Banked memory goes through the TLB of the interpreter
+        instr.flow = FLOW_STEP;
+        break;
+    case OP_VLOAD:
+    case OP_VSTORE:
+    case OP_VADD8:
+    case OP_VADD16:
+    case OP_VSUB8:
+    case OP_VSUB16:
+    case OP_VMIN8:
+    case OP_VMIN16:
+    case OP_VMAX8:
+    case OP_VMAX16:
+    case OP_VXOR:
+    case OP_VSUM8:
+    case OP_VSUM16:
+        // Vector registers live in the context, they are used through the interpreter (SIMD)
+        instr.flow = FLOW_STEP;
+        break;
+    case OP_MEMCPY:
+    case OP_MEMSET:
+    case OP_MEMCMP:
+        instr.regs[0] = mem[addr + 1];
+        instr.regs[1] = mem[addr + 2];
+        instr.regs[2] = mem[addr + 3];
+        instr.nbRegs = 3;
+        break;
+    case OP_JE:
+    case OP_JNE:
+    case OP_JLT:
+    case OP_JGE:
+        instr.regs[0] = mem[addr + 1];
+        instr.regs[1] = mem[addr + 2];
+        instr.nbRegs = 2;
+        instr.target = mem[addr + 3] | mem[addr + 4] << 8;
+        instr.flow = FLOW_BRANCH;
+        break;
+    case OP_LOADR:
+        instr.regs[0] = mem[addr + 1];
+        instr.regs[1] = mem[addr + 2];
+        instr.nbRegs = 2;
+        instr.imm = (int16_t)(mem[addr + 3] | mem[addr + 4] << 8);
+        break;
+    case OP_STORER:
+        instr.regs[0] = mem[addr + 4];
+        instr.regs[1] = mem[addr + 1];
+        instr.nbRegs = 2;
+        instr.imm = (int16_t)(mem[addr + 2] | mem[addr + 3] << 8);
+        break;
+    default: // two registers
+        instr.regs[0] = mem[addr + 1];
+        instr.regs[1] = mem[addr + 2];
+        instr.nbRegs = 2;
+        break;
+    }
+
+    // Invalid registers are reported by the interpreter, IP arguments depend on its decoding
+    for (uint8_t i = 0; i < instr.nbRegs; i++)
+    {
+        if ((instr.regs[i] >= REGISTER_COUNT) || (instr.regs[i] == IP))
+            instr.flow = FLOW_STEP;
+    }
+    return true;
+}
+
+void Chip32Translator::FindBlocks()
+{
+    std::vector<bool> visited(m_program.size(), false);
+    std::vector<uint32_t> pending;
+
+    m_leaders.clear();
+    m_blocks.clear();
+    m_leaders.insert(0);
+    pending.push_back(0);
+
+    while (!pending.empty())
+    {
+        const uint32_t addr = pending.back();
+        pending.pop_back();
+
+        Instr instr;
+        if ((addr >= m_program.size()) || visited[addr] || !Decode(addr, instr))
+            continue;
+        visited[addr] = true;
+
+        const uint32_t next = addr + instr.size;
+        switch (instr.flow)
+        {
+        case FLOW_NEXT:
+            pending.push_back(next);
+            break;
+        case FLOW_END:
+            break;
+        case FLOW_JUMP:
+            m_leaders.insert(instr.target);
+            pending.push_back(instr.target);
+            break;
+        case FLOW_CALL:
+        case FLOW_BRANCH:
+        case FLOW_SKIP:
+            m_leaders.insert(instr.target);
+            m_leaders.insert(next);
+            pending.push_back(instr.target);
+            pending.push_back(next);
+            break;
+        case FLOW_SYSCALL:
+        case FLOW_STEP:
+            m_leaders.insert(next);
+            pending.push_back(next);
+            break;
+        }
+    }
+
+    // Leaders starting with an instruction of the interpreter stay in the interpreter
+    for (uint32_t leader : m_leaders)
+    {
+        Instr instr;
+        if (Decode(leader, instr) && (instr.flow != FLOW_STEP))
+            m_blocks.push_back(leader);
+    }
+}
+
+void Chip32Translator::EmitInstr(const Instr &instr, uint32_t count, std::ostringstream &out)
+{
+    const char *a = RegLocals[instr.regs[0]];
+    const char *b = RegLocals[instr.regs[1]];
+    const char *c = RegLocals[instr.regs[2]];
+    const std::string next = Hex(instr.addr + instr.size);
+    const std::string target = Hex(instr.target);
+    const std::string step = Step(count, instr.addr);
+
+    switch (instr.op)
+    {
+    case OP_NOP:
+        break;
+    case OP_HALT:
+        out << "    " << Stop(count, "VM_FINISHED", Hex(instr.addr)) << "\n";
+        break;
+    case OP_SYSCALL:
+        // The handler sees the registers of the context, and may change them.
+        // Unregistered host functions are reported by the interpreter.
+        out << "    if ((ctx->async != NULL) || ((ctx->host_table != NULL) ? (ctx->host_table->functions[" << instr.imm
+            << "].fn == NULL) : (ctx->syscall == NULL))) { " << step << " }\n"
+            << "    BLOCK_SYNC();\n";
+        if (count > 0)
+            out << "    ctx->instr_count += " << count << ";\n";
+        out << "    memcpy(ctx->registers, r, sizeof(ctx->registers));\n"
+            << "    ctx->registers[IP] = " << Hex(instr.addr + 1) << ";\n"
+            << "    if (ctx->host_table != NULL) {\n"
+            << "        const chip32_host_function_t *host = &ctx->host_table->functions[" << instr.imm << "];\n"
+            << "        const uint32_t value = host->fn(ctx, &ctx->registers[R0]);\n"
+            << "        if (host->ret != CHIP32_HOST_NO_RESULT) ctx->registers[host->ret] = value;\n"
+            << "    } else if (!ctx->syscall(ctx, " << instr.imm << ")) { memcpy(r, ctx->registers, sizeof(ctx->registers)); *result = VM_FINISHED; return 0; }\n"
+            << "    memcpy(r, ctx->registers, sizeof(ctx->registers));\n"
+            << "    ctx->instr_count++;\n"
+            << "    if (ctx->suspend) { ctx->suspend = false; r[IP]++; *result = VM_WAIT_SYSCALL; return 0; }\n"
+            << "    return r[IP] + 1;\n";
+        break;
+    case OP_LCONS:
+        out << "    " << a << " = " << Hex(instr.imm) << "u;\n";
+        break;
+    case OP_MOV:
+        out << "    " << a << " = " << b << ";\n";
+        break;
+    case OP_PUSH:
+        // Same stack checks as the interpreter
+        out << "    if (" << PushFails("sizeof(uint32_t)") << ") { " << step << " }\n"
+            << "    sp -= 4;\n"
+            << "    memcpy(&ram[sp], &" << a << ", sizeof(uint32_t));\n"
+            << "    tr_dirty(ctx, sp, sizeof(uint32_t));\n";
+        break;
+    case OP_POP:
+        out << "    if (" << PopFails("sp", "sizeof(uint32_t)") << ") { " << step << " }\n"
+            << "    memcpy(&" << a << ", &ram[sp], sizeof(uint32_t));\n"
+            << "    sp += 4;\n";
+        break;
+    case OP_PUSHM:
+    case OP_POPM:
+    {
+        // Stack order: highest register first, at the lowest address
+        std::vector<uint8_t> list;
+        for (int32_t reg = REGISTER_COUNT - 1; reg >= 0; reg--)
+        {
+            if (instr.imm & (1U << reg))
+                list.push_back(reg);
+        }
+        const std::string bytes = std::to_string(list.size() * sizeof(uint32_t)) + "u";
+        if (instr.op == OP_PUSHM)
+        {
+            out << "    if (" << PushFails(bytes) << ") { " << step << " }\n"
+                << "    sp -= " << bytes << ";\n";
+            for (size_t i = 0; i < list.size(); i++)
+                out << "    memcpy(&ram[sp + " << i * sizeof(uint32_t) << "], &" << RegLocals[list[i]] << ", sizeof(uint32_t));\n";
+            out << "    tr_dirty(ctx, sp, " << bytes << ");\n";
+        }
+        else
+        {
+            out << "    if (" << PopFails("sp", bytes) << ") { " << step << " }\n";
+            for (size_t i = 0; i < list.size(); i++)
+                out << "    memcpy(&" << RegLocals[list[i]] << ", &ram[sp + " << i * sizeof(uint32_t) << "], sizeof(uint32_t));\n";
+            out << "    sp += " << bytes << ";\n";
+        }
+        break;
+    }
+    case OP_ENTER:
+        out << "    if (" << PushFails(std::to_string(sizeof(uint32_t) + instr.imm) + "u") << ") { " << step << " }\n"
+            << "    sp -= 4;\n"
+            << "    memcpy(&ram[sp], &bp, sizeof(uint32_t));\n"
+            << "    tr_dirty(ctx, sp, sizeof(uint32_t));\n"
+            << "    bp = sp;\n"
+            << "    sp -= " << Hex(instr.imm) << "u;\n";
+        break;
+    case OP_LEAVE:
+        out << "    if (" << PopFails("bp", "sizeof(uint32_t)") << ") { " << step << " }\n"
+            << "    sp = bp;\n"
+            << "    memcpy(&bp, &ram[sp], sizeof(uint32_t));\n"
+            << "    sp += 4;\n";
+        break;
+    case OP_CALL:
+        out << "    ra = " << next << ";\n"
+            << "    " << Exit(count + 1, target) << "\n";
+        break;
+    case OP_RET:
+        out << "    " << Exit(count + 1, "ra") << "\n";
+        break;
+    case OP_STORE:
+        out << "    memcpy(&ram[" << Hex(instr.imm) << "], &" << a << ", sizeof(uint32_t));\n"
+            << "    tr_dirty(ctx, " << Hex(instr.imm) << ", sizeof(uint32_t));\n";
+        break;
+    case OP_LOAD:
+        out << "    memcpy(&" << a << ", &ram[" << Hex(instr.imm) << "], sizeof(uint32_t));\n";
+        break;
+    case OP_ADD: out << "    " << a << " = " << a << " + " << b << ";\n"; break;
+    case OP_SUB: out << "    " << a << " = " << a << " - " << b << ";\n"; break;
+    case OP_MUL: out << "    " << a << " = " << a << " * " << b << ";\n"; break;
+    case OP_DIV: out << "    " << a << " = " << a << " / " << b << ";\n"; break;
+    // Shift counts are masked like the x86 instructions the interpreter ends up with (and the JIT),
+    // a count above 31 would be undefined in C
+    case OP_SHL: out << "    " << a << " = " << a << " << (" << b << " & 31);\n"; break;
+    case OP_SHR: out << "    " << a << " = " << a << " >> (" << b << " & 31);\n"; break;
+    case OP_ISHR: out << "    " << a << " = (uint32_t)((int32_t)" << a << " >> (" << b << " & 31));\n"; break;
+    case OP_AND: out << "    " << a << " = " << a << " & " << b << ";\n"; break;
+    case OP_OR: out << "    " << a << " = " << a << " | " << b << ";\n"; break;
+    case OP_XOR: out << "    " << a << " = " << a << " ^ " << b << ";\n"; break;
+    case OP_NOT: out << "    " << a << " = ~" << a << ";\n"; break;
+    case OP_JMP:
+        out << "    " << Exit(count + 1, target) << "\n";
+        break;
+    case OP_JR:
+        out << "    " << Exit(count + 1, std::string("(uint32_t)(uint16_t)") + a) << "\n";
+        break;
+    case OP_SKIPZ:
+    case OP_SKIPNZ:
+        // The skipped instruction is counted as executed
+        out << "    if (" << a << ((instr.op == OP_SKIPZ) ? " == 0" : " != 0") << ") { " << Exit(count + 2, target) << " }\n"
+            << "    " << Exit(count + 1, next) << "\n";
+        break;
+    case OP_MEMCPY:
+        out << "    if (((uint64_t)" << a << " + " << c << " > ctx->ram->size) || ((uint64_t)" << b << " + " << c << " > ctx->ram->size)) { " << step << " }\n"
+            << "    memmove(&ram[" << a << "], &ram[" << b << "], " << c << ");\n"
+            << "    tr_dirty(ctx, " << a << ", " << c << ");\n";
+        break;
+    case OP_MEMSET:
+        out << "    if ((uint64_t)" << a << " + " << c << " > ctx->ram->size) { " << step << " }\n"
+            << "    memset(&ram[" << a << "], " << b << " & 0xFF, " << c << ");\n"
+            << "    tr_dirty(ctx, " << a << ", " << c << ");\n";
+        break;
+    case OP_MEMCMP:
+        out << "    if (((uint64_t)" << a << " + " << c << " > ctx->ram->size) || ((uint64_t)" << b << " + " << c << " > ctx->ram->size)) { " << step << " }\n"
+            << "    {\n"
+            << "        const int cmp = memcmp(&ram[" << a << "], &ram[" << b << "], " << c << ");\n"
+            << "        " << a << " = (cmp < 0) ? 0xFFFFFFFFu : (cmp > 0);\n"
+            << "    }\n";
+        break;
+    case OP_JE:
+    case OP_JNE:
+    case OP_JLT:
+    case OP_JGE:
+    {
+        static const char *const conditions[] = { "%s == %s", "%s != %s", "(int32_t)%s < (int32_t)%s", "(int32_t)%s >= (int32_t)%s" };
+        char cond[64];
+        if (instr.regs[0] == instr.regs[1])
+        {
+            // Comparing a register with itself: resolved here, keeps the C compiler quiet
+            const bool taken = (instr.op == OP_JE) || (instr.op == OP_JGE);
+            out << "    " << Exit(count + 1, taken ? target : next) << "\n";
+            break;
+        }
+        snprintf(cond, sizeof(cond), conditions[instr.op - OP_JE], a, b);
+        out << "    if (" << cond << ") { " << Exit(count + 1, target) << " }\n"
+            << "    " << Exit(count + 1, next) << "\n";
+        break;
+    }
+    case OP_LOADR:
+    case OP_STORER:
+    {
+        // Value, then base register
+        const std::string addr = "(uint32_t)(" + std::string(b) + " + " + Hex(instr.imm) + "u)";
+        out << "    if ((uint64_t)" << addr << " + sizeof(uint32_t) > ctx->ram->size) { " << step << " }\n";
+        if (instr.op == OP_LOADR)
+            out << "    memcpy(&" << a << ", &ram[" << addr << "], sizeof(uint32_t));\n";
+        else
+            out << "    memcpy(&ram[" << addr << "], &" << a << ", sizeof(uint32_t));\n"
+                << "    tr_dirty(ctx, " << addr << ", sizeof(uint32_t));\n";
+        break;
+    }
+    default:
+        out << "    " << step << "\n";
+        break;
+    }
+}
+
+void Chip32Translator::EmitBlock(uint32_t leader, std::ostringstream &out)
+{
+    std::ostringstream body;
+    std::set<uint8_t> used; // registers kept in locals
+    bool usesRam = false;
+    uint32_t addr = leader;
+    uint32_t count = 0;
+
+    for (;;)
+    {
+        Instr instr;
+        if (!Decode(addr, instr) || (instr.flow == FLOW_STEP))
+        {
+            body << "    " << Step(count, addr) << "\n";
+            break;
+        }
+
+        body << "    // " << Hex(addr) << " " << OpNames[instr.op] << "\n";
+        EmitInstr(instr, count, body);
+        for (uint8_t i = 0; i < instr.nbRegs; i++)
+            used.insert(instr.regs[i]);
+        switch (instr.op)
+        {
+        case OP_PUSH:
+        case OP_POP:
+            used.insert(SP);
+            usesRam = true;
+            break;
+        case OP_PUSHM:
+        case OP_POPM:
+            for (uint8_t reg = 0; reg < REGISTER_COUNT; reg++)
+            {
+                if (instr.imm & (1U << reg))
+                    used.insert(reg);
+            }
+            used.insert(SP);
+            usesRam = true;
+            break;
+        case OP_ENTER:
+        case OP_LEAVE:
+            used.insert(BP);
+            used.insert(SP);
+            usesRam = true;
+            break;
+        case OP_CALL:
+        case OP_RET:
+            used.insert(RA);
+            break;
+        case OP_STORE:
+        case OP_LOAD:
+        case OP_MEMCPY:
+        case OP_MEMSET:
+        case OP_MEMCMP:
+        case OP_LOADR:
+        case OP_STORER:
+            usesRam = true;
+            break;
+        }
+        if (instr.flow != FLOW_NEXT)
+            break; // the instruction has left the block
+
+        count++;
+        addr += instr.size;
+        if ((addr >= m_program.size()) || (m_leaders.count(addr) > 0))
+        {
+            body << "    " << Exit(count, Hex(addr)) << "\n";
+            break;
+        }
+    }
+
+    out << "#define BLOCK_SYNC()";
+    for (uint8_t reg : used)
+        out << " r[" << RegIndexes[reg] << "] = " << RegLocals[reg] << ";";
+    out << "\n"
+        << "static uint32_t " << m_name << "_" << Hex(leader) << "(chip32_ctx_t *ctx, uint32_t *r, uint16_t prog_size, chip32_result_t *result)\n"
+        << "{\n";
+    for (uint8_t reg : used)
+        out << "    uint32_t " << RegLocals[reg] << " = r[" << RegIndexes[reg] << "];\n";
+    if (usesRam)
+        out << "    uint8_t *const ram = ctx->ram->mem;\n";
+    out << "    (void) prog_size;\n"
+        << "    (void) result;\n"
+        << body.str()
+        << "}\n"
+        << "#undef BLOCK_SYNC\n\n";
+}
+
+bool Chip32Translator::Translate(const std::vector<uint8_t> &program, const std::string &name, std::string &source)
+{
+    if (program.empty() || (program.size() > UINT16_MAX) || name.empty())
+        return false;
+
+    m_program = program;
+    m_name = name;
+    FindBlocks();
+    m_blockCount = m_blocks.size();
+
+    std::ostringstream out;
+    const std::string size = std::to_string(m_program.size());
+
+    out << "// Generated by Chip32Translator from a " << size << "-byte chip32 image, do not edit\n"
+        << Prelude << "\n";
+
+    for (uint32_t leader : m_blocks)
+        EmitBlock(leader, out);
+
+    // Jump table: ROM address -> block
+    out << "static const tr_block_t " << m_name << "_blocks[" << size << "] = {";
+    size_t next = 0;
+    for (uint32_t addr = 0; addr < m_program.size(); addr++)
+    {
+        if ((addr % 8) == 0)
+            out << "\n    /* " << Hex(addr) << " */";
+        if ((next < m_blocks.size()) && (m_blocks[next] == addr))
+        {
+            out << " " << m_name << "_" << Hex(addr) << ",";
+            next++;
+        }
+        else
+            out << " NULL,";
+    }
+    out << "\n};\n\n";
+
+    out << "chip32_result_t " << m_name << "(chip32_ctx_t *ctx, uint16_t prog_size)\n"
+        << "{\n"
+        << "    uint32_t r[REGISTER_COUNT];\n"
+        << "    uint32_t ip;\n"
+        << "    chip32_result_t result = VM_PAUSED;\n"
+        << "\n"
+        << "    if ((ctx->rom->size != " << size << ") || (ctx->profiler != NULL) || (ctx->trace != NULL) || tr_overlap(ctx))\n"
+        << "        return chip32_run(ctx, prog_size, 0);\n"
+        << "\n"
+        << "    memcpy(r, ctx->registers, sizeof(r));\n"
+        << "    ip = r[IP];\n"
+        << "    for (;;)\n"
+        << "    {\n"
+        << "        if (!ctx->skip && (ip < " << size << ") && (" << m_name << "_blocks[ip] != NULL))\n"
+        << "        {\n"
+        << "            ip = " << m_name << "_blocks[ip](ctx, r, prog_size, &result);\n"
+        << "            if (result == VM_PAUSED)\n"
+        << "                continue;\n"
+        << "            if (result != TR_STEP)\n"
+        << "                break;\n"
+        << "        }\n"
+        << "        // One instruction with the interpreter\n"
+        << "        memcpy(ctx->registers, r, sizeof(r));\n"
+        << "        ctx->registers[IP] = ip;\n"
+        << "        result = chip32_run(ctx, prog_size, 1);\n"
+        << "        memcpy(r, ctx->registers, sizeof(r));\n"
+        << "        ip = r[IP];\n"
+        << "        if (result != VM_PAUSED)\n"
+        << "            break;\n"
+        << "    }\n"
+        << "    memcpy(ctx->registers, r, sizeof(r));\n"
+        << "    return result;\n"
+        << "}\n";
+
+    source = out.str();
+    return true;
+}
@@ -0,0 +1,106 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef CHIP32_TRANSLATOR_H
+#define CHIP32_TRANSLATOR_H
+
+#include "chip32.h"
+#include <vector>
+#include <set>
+#include <string>
+#include <sstream>
+#include <cstdint>
+
+/**
+ * Ahead-of-time translation of a chip32 image into C source.
+ *
+ * The input is the binary produced by Chip32Assembler::BuildBinary(), the output
+ * defines one function:
+ *
+ *     chip32_result_t <name>(chip32_ctx_t *ctx, uint16_t prog_size);
+ *
+ * It runs the context until it stops, as chip32_run(ctx, prog_size, 0) does, with
+ * the same registers, memory, result and instruction count. The code reachable from
+ * address 0 is split into basic blocks, one C function each, that keep the registers
+ * they use in locals. Blocks are found through a table indexed by ROM address, so
+ * that ret, jumpr and system calls changing IP are dispatched like direct jumps.
+ *
+ * Everything the translation cannot do exactly is executed by chip32_run(), one
+ * instruction at a time: errors (the interpreter then reports them), banked memory,
+ * vector instructions (their SIMD implementation is in the interpreter),
+ * instructions using IP as a register argument, asynchronous system calls, and
+ * targets that are not the start of a translated block. Contexts with a profiler
+ * or a trace, or whose RAM overlaps the ROM (self-modifying programs), run entirely
+ * with chip32_run().
+ *
+ * The ROM of the context must hold the translated image. The generated file is
+ * plain C, it only needs chip32.h and must be linked with chip32.cpp. Several
+ * translations can be concatenated in the same file if their names differ.
+ */
+class Chip32Translator
+{
+public:
+    bool Translate(const std::vector<uint8_t> &program, const std::string &name, std::string &source);
+
+    // Basic blocks of the last translation
+    uint32_t GetBlockCount() const { return m_blockCount; }
+
+private:
+    // Control flow of one instruction
+    enum Flow {
+        FLOW_NEXT,    //!< Goes on with the next instruction
+        FLOW_END,     //!< No static successor (halt, ret, jumpr)
+        FLOW_JUMP,    //!< Unconditional jump to 'target'
+        FLOW_CALL,    //!< Jump to 'target', returns to the next instruction
+        FLOW_BRANCH,  //!< Next instruction or 'target'
+        FLOW_SKIP,    //!< Next instruction or the one after
+        FLOW_SYSCALL, //!< Next instruction, unless the handler changes IP
+        FLOW_STEP     //!< Executed by chip32_run(), then next instruction
+    };
+
+    struct Instr {
+        uint32_t addr{0};
+        uint8_t op{OP_NOP};
+        uint32_t size{0}; //!< Opcode and arguments, 0 if the instruction is invalid
+        uint8_t regs[3]{0, 0, 0}; //!< Register arguments, the written or stored one first
+        uint8_t nbRegs{0};
+        uint32_t imm{0}; //!< Constant, address or offset
+        uint32_t target{0};
+        Flow flow{FLOW_STEP};
+    };
+
+    bool Decode(uint32_t addr, Instr &instr) const;
+    void FindBlocks();
+    void EmitBlock(uint32_t leader, std::ostringstream &out);
+    void EmitInstr(const Instr &instr, uint32_t count, std::ostringstream &out);
+
+    std::vector<uint8_t> m_program;
+    std::string m_name;
+    std::set<uint32_t> m_leaders;
+    std::vector<uint32_t> m_blocks; //!< Leaders that start with a translated instruction
+    uint32_t m_blockCount{0};
+};
+
+#endif // CHIP32_TRANSLATOR_H
@@ -0,0 +1,64 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "test.h"
+
+std::vector<TestCase> &TestCases()
+{
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+// Usage: chip32_tests [name], runs the test cases whose name contains 'name'
+int main(int argc, char **argv)
+{
+    const char *filter = (argc > 1) ? argv[1] : "";
+    int passed = 0;
+    int failed = 0;
+
+    for (const TestCase &test : TestCases())
+    {
+        if (strstr(test.name, filter) == nullptr)
+            continue;
+        const int line = test.func();
+        if (line == 0)
+        {
+            passed++;
+        }
+        else
+        {
+            failed++;
+            std::cout << "FAILED: " << test.name << " (at line " << line << ")" << std::endl;
+        }
+    }
+
+    std::cout << "PASSED: " << passed << "\nFAILED: " << failed << std::endl;
+    // A mistyped filter must not pass silently
+    if (passed + failed == 0)
+    {
+        std::cout << "no test case matches '" << filter << "'" << std::endl;
+        return 1;
+    }
+    return (failed == 0) ? 0 : 1;
+}
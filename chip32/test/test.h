@@ -0,0 +1,141 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHIP32_TEST_H
+#define CHIP32_TEST_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chip32.h"
+#include "chip32_assembler.h"
+
+// =============================================================================
+// TEST RUNNER
+// =============================================================================
+// A test case is a function returning 0, or the line of the first failed check.
+
+typedef int (*TestFunction)();
+
+struct TestCase
+{
+    const char *name;
+    TestFunction func;
+};
+
+// Registered by TEST_CASE(), run by test.cpp
+std::vector<TestCase> &TestCases();
+
+struct TestRegistration
+{
+    TestRegistration(const char *name, TestFunction func)
+    {
+        TestCases().push_back({ name, func });
+    }
+};
+
+#define TEST_CASE(name) \
+    static int name(); \
+    static TestRegistration name##_registration(#name, name); \
+    static int name()
+
+// Stop the current test with an error
+#define FAIL() return __LINE__
+
+// Successful end of the test case
+#define DONE() return 0
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        std::cout << "    " << __FILE__ << ":" << __LINE__ << ": check failed: " << #cond << std::endl; \
+        FAIL(); \
+    } } while (0)
+
+// =============================================================================
+// HELPERS
+// =============================================================================
+
+// Assemble a complete program, false on any error
+inline bool Assemble(const std::string &source, std::vector<uint8_t> &program)
+{
+    Chip32Assembler assembler;
+    AssemblyResult result;
+    program.clear();
+    return assembler.Parse(source) && assembler.BuildBinary(program, result);
+}
+
+// Same, with the assembler messages hidden, for the sources that must fail
+inline bool AssembleQuiet(const std::string &source, std::vector<uint8_t> &program)
+{
+    std::ostringstream messages;
+    std::streambuf *out = std::cout.rdbuf(messages.rdbuf());
+    const bool success = Assemble(source, program);
+    std::cout.rdbuf(out);
+    return success;
+}
+
+/**
+ * A context with its own ROM and RAM. The ROM is the program padded to 4 KB:
+ * load/store addresses are checked against the ROM size.
+ */
+struct TestVm
+{
+    static const uint16_t ROM_SIZE = 4096;
+    static const uint16_t RAM_SIZE = 4096;
+    static const uint16_t STACK_SIZE = 256;
+
+    uint8_t romData[ROM_SIZE];
+    uint8_t ramData[RAM_SIZE];
+    virtual_mem_t rom;
+    virtual_mem_t ram;
+    chip32_ctx_t ctx;
+    uint16_t progSize{0};
+
+    explicit TestVm(const std::vector<uint8_t> &program)
+    {
+        memset(romData, 0, sizeof(romData));
+        memset(ramData, 0, sizeof(ramData));
+        progSize = program.size() < ROM_SIZE ? program.size() : ROM_SIZE;
+        memcpy(romData, program.data(), progSize);
+        rom = { romData, ROM_SIZE, 0 };
+        ram = { ramData, RAM_SIZE, 0 };
+        chip32_initialize(&ctx, &rom, &ram, STACK_SIZE);
+    }
+
+    chip32_result_t Run(uint32_t max_instr = 100000)
+    {
+        return chip32_run(&ctx, progSize, max_instr);
+    }
+
+    uint32_t Reg(chip32_register_t reg)
+    {
+        return chip32_get_register(&ctx, reg);
+    }
+};
+
+#endif // CHIP32_TEST_H
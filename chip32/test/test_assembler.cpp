@@ -0,0 +1,279 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Encoding of the assembler, checked against what the VM executes
+
+#include "test.h"
+
+TEST_CASE(assembler_jumpr)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    jumpr t0\n"
+        "    halt\n", program));
+
+    // One register byte, as decoded by the VM
+    CHECK(program.size() == 3);
+    CHECK(program[0] == OP_JR);
+    CHECK(program[1] == T0);
+    CHECK(program[2] == OP_HALT);
+
+    CHECK(!AssembleQuiet("    jumpr .label\n.label:\n    halt\n", program));
+    DONE();
+}
+
+// The register holds the address of the next instruction, as a label
+TEST_CASE(assembler_jumpr_target)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons t0, 14\n"    // 0
+        "    jumpr t0\n"        // 6
+        "    lcons r0, 1\n"     // 8
+        "    lcons r0, 2\n"     // 14
+        "    halt\n", program));
+    CHECK(program.size() == 21);
+
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    for (chip32_engine_t engine : { CHIP32_ENGINE_SWITCH, CHIP32_ENGINE_THREADED, CHIP32_ENGINE_DECODED })
+    {
+        TestVm vm(program);
+        if (engine == CHIP32_ENGINE_DECODED)
+            chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE);
+        else
+            chip32_set_engine(&vm.ctx, engine);
+        CHECK(vm.Run() == VM_FINISHED);
+        CHECK(vm.Reg(R0) == 2);
+        CHECK(vm.ctx.instr_count == 3); // halt is not counted
+    }
+
+    // Unchecked loop, the dynamic target must be a verified instruction start
+    static uint8_t starts[TestVm::ROM_SIZE / 8];
+    TestVm vm(program);
+    uint32_t fault;
+    CHECK(chip32_verify(&vm.ctx, starts, sizeof(starts), &fault));
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R0) == 2);
+    DONE();
+}
+
+TEST_CASE(assembler_not)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r1, 0x0F0F0F0F\n"
+        "    not r1\n"
+        "    halt\n", program));
+
+    // A single register byte, the VM reads no second register
+    CHECK(program.size() == 9);
+    CHECK(program[6] == OP_NOT);
+    CHECK(program[7] == R1);
+    CHECK(program[8] == OP_HALT);
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R1) == 0xF0F0F0F0);
+
+    CHECK(!AssembleQuiet("    not r0, r1\n", program));
+    DONE();
+}
+
+// Arguments separated by spaces, as before the register-indirect operands
+TEST_CASE(assembler_space_separated)
+{
+    std::vector<uint8_t> spaces;
+    CHECK(Assemble(
+        "    lcons r0 5\n"
+        "    lcons r1\t0x10\n"
+        "    mov r2 r0\n"
+        "    add r2 , r1\n"
+        "    store [r1 + 8] r2\n"
+        "    load r3 [ r1+8 ]\n"
+        "    je r2 r3 .end\n"
+        "    halt\n"
+        ".end:\n"
+        "    halt\n", spaces));
+
+    std::vector<uint8_t> commas;
+    CHECK(Assemble(
+        "    lcons r0, 5\n"
+        "    lcons r1, 0x10\n"
+        "    mov r2, r0\n"
+        "    add r2, r1\n"
+        "    store [r1+8], r2\n"
+        "    load r3, [r1+8]\n"
+        "    je r2, r3, .end\n"
+        "    halt\n"
+        ".end:\n"
+        "    halt\n", commas));
+    CHECK(spaces == commas);
+
+    TestVm vm(spaces);
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R3) == 0x15);
+    CHECK(vm.Reg(IP) == spaces.size() - 1);
+
+    CHECK(!AssembleQuiet("    mov r0 r1 r2\n", spaces));
+    CHECK(!AssembleQuiet("    mov r0,,r1\n", spaces));
+    DONE();
+}
+
+// A label takes no room in the program
+TEST_CASE(assembler_label_size)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 1\n"     // 0
+        ".first:\n"
+        ".second:\n"
+        "    add r0, r0\n"      // 6
+        "    jump .third\n"     // 9
+        ".third:\n"
+        "    halt\n", program)); // 12
+
+    CHECK(program.size() == 13);
+    CHECK(program[6] == OP_ADD);
+    CHECK(program[9] == OP_JMP);
+    CHECK(program[10] == 12);
+    CHECK(program[12] == OP_HALT);
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R0) == 2);
+    CHECK(vm.ctx.instr_count == 3);
+    DONE();
+}
+
+// Every register of CHIP32_REGISTERS has a name, encoded as its index
+TEST_CASE(assembler_register_names)
+{
+    static const char *Names[] = CHIP32_REGISTER_NAMES_LIST;
+    for (int reg = 0; reg < REGISTER_COUNT; reg++)
+    {
+        std::vector<uint8_t> program;
+        CHECK(Assemble(std::string("    mov r0, ") + Names[reg] + "\n", program));
+        CHECK(program.size() == 3);
+        CHECK(program[2] == reg);
+    }
+
+    // Constant already held by ov: the optimizer names it in the mov it writes
+    Chip32Assembler assembler;
+    OptimizationResult result;
+    AssemblyResult assembly;
+    std::vector<uint8_t> program;
+    CHECK(assembler.Parse(
+        "    lcons ov, 7\n"
+        "    lcons r0, 7\n"
+        "    halt\n"));
+    assembler.Optimize(result);
+    CHECK(assembler.BuildBinary(program, assembly));
+    CHECK(result.lconsToMov == 1);
+    CHECK((program[6] == OP_MOV) && (program[7] == R0) && (program[8] == OV));
+    DONE();
+}
+
+// Operand syntax accepted by the original assembler: each source must give the same
+// program as the canonical one, with comma separated arguments
+TEST_CASE(assembler_baseline_syntax)
+{
+    static const struct
+    {
+        const char *source;
+        const char *canonical;
+    } forms[] = {
+    { "    lcons r0 5\n", "    lcons r0, 5\n" },
+    { "    lcons r0,5\n", "    lcons r0, 5\n" },
+    { "    LCONS R0, 0x05\n", "    lcons r0, 5\n" },
+    { "    Lcons T9, 4294967295\n", "    lcons t9, 0xFFFFFFFF\n" },
+    { "\tmov\tr1\tr0\n", "    mov r1, r0\n" },
+    { "    mov r1,  r0   ; copy, then add\n", "    mov r1, r0\n" },
+    { "    add r1, r0\r\n", "    add r1, r0\n" },
+    { "    store 0x10 r0\n", "    store 0x10, r0\n" },
+    { "    load r2 16\n", "    load r2, 0x10\n" },
+    { "    syscall 0x1\n", "    syscall 1\n" },
+    { "    push Ra\n    pop RA\n", "    push ra\n    pop ra\n" },
+    { "    shiftl r0 r1\n    xor t1 t2\n", "    shiftl r0, r1\n    xor t1, t2\n" },
+    { "    nop ; nothing\n    halt\n", "    nop\n    halt\n" },
+    { "; comment line\n\n    ret\n", "    ret\n" },
+    };
+
+    for (const auto &form : forms)
+    {
+        std::vector<uint8_t> program;
+        std::vector<uint8_t> expected;
+        CHECK(Assemble(form.source, program));
+        CHECK(Assemble(form.canonical, expected));
+        CHECK(program == expected);
+    }
+
+    // Wrong argument counts and names are still rejected
+    std::vector<uint8_t> program;
+    for (const char *source : { "    mov r0\n", "    mov r0 r1 r2\n", "    lcons r0\n", "    halt r0\n", "    mov r0 r99\n" })
+        CHECK(!AssembleQuiet(source, program));
+    DONE();
+}
+
+// Messages printed by Chip32Assembler::Update(), its result in 'success'
+static std::string UpdateMessages(Chip32Assembler &assembler, const std::string &source, bool &success)
+{
+    std::vector<uint8_t> program;
+    AssemblyResult result;
+    std::vector<RomRange> changes;
+    std::stringstream messages;
+    std::streambuf *out = std::cout.rdbuf(messages.rdbuf());
+    success = assembler.Update(source, program, result, changes);
+    std::cout.rdbuf(out);
+    return messages.str();
+}
+
+// A line taken from the parse cache is reported at its new line
+TEST_CASE(assembler_update_cached_line)
+{
+    Chip32Assembler assembler;
+    bool success;
+    std::string messages = UpdateMessages(assembler,
+        "    lcons r0, 1\n"
+        "    jump .missing\n"
+        "    halt\n", success);
+    CHECK(!success);
+    CHECK(messages.find("error: 2: label not found") != std::string::npos);
+
+    // First and last lines changed: the jump is parsed again, found in the cache
+    messages = UpdateMessages(assembler,
+        "    lcons r1, 2\n"
+        "    nop\n"
+        "    jump .missing\n"
+        "    halt ; end\n", success);
+    CHECK(!success);
+    CHECK(messages.find("error: 3: label not found") != std::string::npos);
+
+    // And from line 3 to line 1
+    messages = UpdateMessages(assembler,
+        "    jump .missing\n"
+        "    halt\n", success);
+    CHECK(!success);
+    CHECK(messages.find("error: 1: label not found") != std::string::npos);
+    DONE();
+}
@@ -0,0 +1,154 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Asynchronous system calls: order, full ring, flush and synchronous codes
+
+#include <mutex>
+
+#include "test.h"
+#include "chip32_async.h"
+
+// syscall 1 (asynchronous) posts r0 = 0..19, syscall 2 (synchronous) adds r0 to r4
+static const char *AsyncSource =
+    "    lcons r0, 0\n"
+    "    lcons r1, 1\n"
+    "    lcons r2, 20\n"
+    ".loop:\n"
+    "    syscall 1\n"
+    "    syscall 2\n"
+    "    add r0, r1\n"
+    "    jne r0, r2, .loop\n"
+    "    halt\n";
+
+static bool AsyncSyscall(chip32_ctx_t *ctx, uint8_t code)
+{
+    if (code == 2)
+        ctx->registers[R4] += ctx->registers[R0];
+    return code == 2;
+}
+
+// Run to the end, the ring is emptied by hand each time the VM waits on it
+TEST_CASE(async_post_poll)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(AsyncSource, program));
+    TestVm vm(program);
+    chip32_set_syscall(&vm.ctx, AsyncSyscall, nullptr);
+
+    chip32_async_t *async = chip32_async_create(3); // 4 messages
+    CHECK(async != nullptr);
+    chip32_async_set_mode(async, 1, true);
+    chip32_async_set_mode(async, 2, true);
+    chip32_async_set_mode(async, 2, false);    // back to synchronous
+    CHECK(chip32_async_attach(&vm.ctx, async));
+
+    std::vector<uint32_t> posted;
+    chip32_syscall_msg_t msgs[8];
+    chip32_result_t result;
+    int waits = 0;
+    while ((result = vm.Run()) == VM_WAIT_SYSCALL)
+    {
+        // Full ring: IP is left on the system call
+        CHECK(vm.ctx.rom->mem[vm.ctx.registers[IP]] == OP_SYSCALL);
+        CHECK(chip32_async_poll(async, msgs, 8) == 4);
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            CHECK(msgs[i].code == 1);
+            CHECK(msgs[i].args[1] == 1);
+            CHECK(msgs[i].args[2] == 20);
+            posted.push_back(msgs[i].args[0]);
+        }
+        waits++;
+    }
+    CHECK(result == VM_FINISHED);
+    CHECK(waits == 4);
+
+    // The last 4 messages are still in the ring, each one was posted once and in order
+    CHECK(chip32_async_poll(async, msgs, 8) == 4);
+    for (uint32_t i = 0; i < 4; i++)
+        posted.push_back(msgs[i].args[0]);
+    CHECK(chip32_async_poll(async, msgs, 8) == 0);
+    CHECK(posted.size() == 20);
+    for (uint32_t i = 0; i < posted.size(); i++)
+        CHECK(posted[i] == i);
+
+    // Synchronous code: called 20 times, in between
+    CHECK(vm.Reg(R4) == 190);
+
+    CHECK(chip32_async_attach(&vm.ctx, nullptr));
+    chip32_async_destroy(async);
+    DONE();
+}
+
+struct AsyncConsumer
+{
+    std::mutex lock;
+    std::vector<uint32_t> values;
+};
+
+static void AsyncHandler(const chip32_syscall_msg_t *msgs, uint32_t count, void *user_data)
+{
+    AsyncConsumer *consumer = static_cast<AsyncConsumer *>(user_data);
+    std::lock_guard<std::mutex> guard(consumer->lock);
+    for (uint32_t i = 0; i < count; i++)
+        consumer->values.push_back(msgs[i].args[0]);
+}
+
+// Consumer thread: after chip32_async_flush(), every posted message has been handled
+TEST_CASE(async_flush)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(AsyncSource, program));
+
+    AsyncConsumer consumer;
+    chip32_async_t *async = chip32_async_create(4);
+    chip32_async_set_mode(async, 1, true);
+    CHECK(chip32_async_start(async, AsyncHandler, &consumer, 3));
+
+    for (int run = 0; run < 3; run++)
+    {
+        TestVm vm(program);
+        chip32_set_syscall(&vm.ctx, AsyncSyscall, nullptr);
+        CHECK(chip32_async_attach(&vm.ctx, async));
+
+        chip32_result_t result;
+        while ((result = vm.Run()) == VM_WAIT_SYSCALL)
+            ;
+        CHECK(result == VM_FINISHED);
+        CHECK(vm.Reg(R4) == 190);
+        chip32_async_flush(async);
+        CHECK(chip32_async_attach(&vm.ctx, nullptr));
+
+        std::lock_guard<std::mutex> guard(consumer.lock);
+        CHECK(consumer.values.size() == 20);
+        for (uint32_t i = 0; i < consumer.values.size(); i++)
+            CHECK(consumer.values[i] == i);
+        consumer.values.clear();
+    }
+
+    chip32_async_stop(async);
+    chip32_async_destroy(async);
+    DONE();
+}
@@ -0,0 +1,257 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// All the interpreter loops must give the same results, registers and memory
+
+#include <random>
+
+#include "test.h"
+
+static const OpCode OpCodes[] = OPCODES_LIST;
+
+// General purpose registers, sometimes a special or an invalid one
+static uint8_t RandomRegister(std::mt19937 &rng)
+{
+    return (rng() % 64) ? rng() % (T9 + 1) : rng() % (REGISTER_COUNT + 1);
+}
+
+// Random instructions with valid-looking arguments, branches go to instruction starts
+static std::vector<uint8_t> RandomProgram(std::mt19937 &rng, int count)
+{
+    std::vector<uint8_t> program;
+    std::vector<uint32_t> starts;
+    std::vector<size_t> branches;
+
+    // Registers r0-r5 hold RAM addresses
+    for (uint8_t reg = R0; reg <= R5; reg++)
+    {
+        const uint32_t value = 32 + rng() % 3000;
+        starts.push_back(program.size());
+        program.insert(program.end(), { OP_LCONS, reg, uint8_t(value), uint8_t(value >> 8), 0, 0 });
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t op = rng() % INSTRUCTION_COUNT;
+        // No system call handler, no division by zero
+        if ((op == OP_SYSCALL) || (op == OP_DIV) || (op == OP_HALT))
+            op = OP_ADD;
+
+        starts.push_back(program.size());
+        program.push_back(op);
+        for (int k = 0; k < OpCodes[op].bytes; k++)
+            program.push_back(((op == OP_LCONS) && (k > 0)) ? rng() % 256 : RandomRegister(rng));
+
+        uint8_t *args = &program[program.size() - OpCodes[op].bytes];
+        if ((op == OP_JMP) || (op == OP_CALL) || ((op >= OP_JE) && (op <= OP_JGE)))
+            branches.push_back(program.size() - 2);
+        else if (op == OP_STORE)
+            args[0] = rng() % 200, args[1] = 0;
+        else if (op == OP_LOAD)
+            args[1] = rng() % 200, args[2] = 0;
+        else if ((op >= OP_VLOAD) && (op <= OP_VSUM16))
+        {
+            // vload v, r / vstore r, v / vsum r, v, the others take two vector registers
+            const int scalar = (op == OP_VLOAD) ? 1 : ((op == OP_VSTORE) || (op >= OP_VSUM8)) ? 0 : -1;
+            for (int k = 0; k < 2; k++)
+                args[k] = (k == scalar) ? rng() % 6 : ((rng() % 64) ? rng() % CHIP32_VREG_COUNT : CHIP32_VREG_COUNT);
+        }
+        else if ((op == OP_LOADR) || (op == OP_STORER))
+            args[op == OP_LOADR ? 1 : 0] = rng() % 6, args[2] = rng() % 64, args[3] = 0;
+        else if (op == OP_ENTER)
+            args[0] = rng() % 64, args[1] = 0;
+        else if ((op == OP_PUSHM) || (op == OP_POPM))
+            args[2] = 0;
+    }
+    starts.push_back(program.size());
+    program.push_back(OP_HALT);
+
+    for (size_t at : branches)
+    {
+        const uint32_t target = starts[rng() % starts.size()];
+        program[at] = target & 0xFF;
+        program[at + 1] = target >> 8;
+    }
+    return program;
+}
+
+struct EngineState
+{
+    chip32_result_t result;
+    uint32_t registers[REGISTER_COUNT];
+    std::vector<uint8_t> memory; //!< RAM, vector registers and banked memory
+};
+
+enum EngineMode
+{
+    MODE_SWITCH,
+    MODE_THREADED,
+    MODE_DECODED,
+    MODE_FUSED,     //!< Decoded, with all the superinstructions
+};
+
+static EngineState RunEngine(const std::vector<uint8_t> &program, EngineMode mode, uint32_t budget, bool stepByStep)
+{
+    static uint8_t ram[4096];
+    static uint8_t bank0[0x11000];
+    static uint8_t bank3[4096];
+    static chip32_decoded_t cache[4096];
+    static chip32_fusion_stats_t stats;
+    static const chip32_segment_t segments[] = {
+        { bank0, 0x00000, sizeof(bank0), true },
+        { bank3, 0x30000, sizeof(bank3), false },
+    };
+
+    std::vector<uint8_t> rom(program);
+    virtual_mem_t romMem = { rom.data(), uint16_t(rom.size()), 0 };
+    virtual_mem_t ramMem = { ram, sizeof(ram), 0 };
+    memset(ram, 0, sizeof(ram));
+    memset(bank0, 0x5A, sizeof(bank0));
+    memset(bank3, 0xA5, sizeof(bank3));
+
+    chip32_ctx_t ctx;
+    chip32_initialize(&ctx, &romMem, &ramMem, 256);
+    chip32_set_segments(&ctx, segments, 2);
+    switch (mode)
+    {
+    case MODE_SWITCH:
+        chip32_set_engine(&ctx, CHIP32_ENGINE_SWITCH);
+        break;
+    case MODE_THREADED:
+        chip32_set_engine(&ctx, CHIP32_ENGINE_THREADED);
+        break;
+    case MODE_DECODED:
+        chip32_set_decode_cache(&ctx, cache, rom.size());
+        break;
+    case MODE_FUSED:
+        chip32_set_decode_cache(&ctx, cache, rom.size());
+        chip32_fuse(&ctx, &stats, 1);
+        break;
+    }
+
+    EngineState state;
+    if (stepByStep)
+    {
+        do
+        {
+            state.result = chip32_run(&ctx, rom.size(), 1);
+        } while ((state.result == VM_PAUSED) && (ctx.instr_count < budget));
+    }
+    else
+    {
+        state.result = chip32_run(&ctx, rom.size(), budget);
+    }
+
+    for (int i = 0; i < REGISTER_COUNT; i++)
+        state.registers[i] = chip32_get_register(&ctx, chip32_register_t(i));
+    state.memory.assign(ram, ram + sizeof(ram));
+    state.memory.insert(state.memory.end(), &ctx.vregs[0][0], &ctx.vregs[0][0] + sizeof(ctx.vregs));
+    state.memory.insert(state.memory.end(), bank0, bank0 + sizeof(bank0));
+    return state;
+}
+
+static bool SameState(const EngineState &a, const EngineState &b)
+{
+    return (a.result == b.result) && (memcmp(a.registers, b.registers, sizeof(a.registers)) == 0) && (a.memory == b.memory);
+}
+
+TEST_CASE(engines_same_results)
+{
+    std::mt19937 rng(1);
+    int finished = 0;
+    for (int i = 0; i < 3000; i++)
+    {
+        const std::vector<uint8_t> program = RandomProgram(rng, 5 + rng() % 60);
+        const uint32_t budget = (rng() % 3) ? 1 + rng() % 300 : 5000;
+
+        const EngineState reference = RunEngine(program, MODE_SWITCH, budget, false);
+        CHECK(SameState(reference, RunEngine(program, MODE_THREADED, budget, false)));
+        CHECK(SameState(reference, RunEngine(program, MODE_DECODED, budget, false)));
+        CHECK(SameState(reference, RunEngine(program, MODE_FUSED, budget, false)));
+        finished += (reference.result == VM_FINISHED);
+    }
+    // The programs must not all stop on an error
+    CHECK(finished > 100);
+    DONE();
+}
+
+// A run paused after each instruction ends in the same state
+TEST_CASE(engines_step_by_step)
+{
+    std::mt19937 rng(2);
+    for (int i = 0; i < 1000; i++)
+    {
+        const std::vector<uint8_t> program = RandomProgram(rng, 5 + rng() % 60);
+        const uint32_t budget = 1 + rng() % 300;
+
+        const EngineState reference = RunEngine(program, MODE_SWITCH, budget, false);
+        for (EngineMode mode : { MODE_SWITCH, MODE_THREADED, MODE_DECODED, MODE_FUSED })
+        {
+            EngineState step = RunEngine(program, mode, budget, true);
+            CHECK(memcmp(reference.registers, step.registers, sizeof(step.registers)) == 0);
+            CHECK(reference.memory == step.memory);
+        }
+    }
+    DONE();
+}
+
+// Hand-written loop with a known result, on every engine
+TEST_CASE(engines_loop)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 1000\n"
+        "    lcons r1, 1\n"
+        "    lcons r2, 0\n"
+        ".loop:\n"
+        "    add r2, r0\n"
+        "    sub r0, r1\n"
+        "    skipz r0\n"
+        "    jump .loop\n"
+        "    halt\n", program));
+
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    static chip32_fusion_stats_t stats;
+    uint64_t count = 0;
+    for (EngineMode mode : { MODE_SWITCH, MODE_THREADED, MODE_DECODED, MODE_FUSED })
+    {
+        TestVm vm(program);
+        if (mode == MODE_SWITCH)
+            chip32_set_engine(&vm.ctx, CHIP32_ENGINE_SWITCH);
+        else if (mode == MODE_THREADED)
+            chip32_set_engine(&vm.ctx, CHIP32_ENGINE_THREADED);
+        else
+            chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE);
+        if (mode == MODE_FUSED)
+            chip32_fuse(&vm.ctx, &stats, 1);
+
+        CHECK(vm.Run() == VM_FINISHED);
+        CHECK(vm.Reg(R2) == 500500);
+        // Same instruction count as the switch engine
+        if (mode == MODE_SWITCH)
+            count = vm.ctx.instr_count;
+        CHECK(vm.ctx.instr_count == count);
+    }
+    DONE();
+}
@@ -0,0 +1,138 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Superinstructions of the decoded engine (chip32_fuse())
+
+#include "test.h"
+
+// Every superinstruction appears once in the loop
+static const char *FusionSource =
+    "    lcons r0, 50\n"
+    ".loop:\n"
+    "    lcons r1, 1\n"
+    "    sub r0, r1\n"      // lcons + sub
+    "    lcons r3, 2\n"
+    "    add r2, r3\n"      // lcons + add
+    "    push r0\n"
+    "    push r1\n"         // 2 x push
+    "    mov r4, r0\n"
+    "    pop r1\n"
+    "    pop r0\n"          // 2 x pop
+    "    mov r4, r1\n"
+    "    push r0\n"
+    "    push r1\n"
+    "    push r2\n"         // 3 x push
+    "    mov r4, r2\n"
+    "    pop r2\n"
+    "    pop r1\n"
+    "    pop r0\n"          // 3 x pop
+    "    push r4\n"
+    "    call .func\n"      // push + call
+    "    pop r4\n"
+    "    skipnz r5\n"
+    "    jump .next\n"      // skipnz + jump
+    ".next:\n"
+    "    skipz r0\n"
+    "    jump .loop\n"      // skipz + jump
+    "    halt\n"
+    ".func:\n"
+    "    push r5\n"
+    "    lcons r5, 9\n"
+    "    xor r3, r5\n"
+    "    pop r5\n"
+    "    ret\n";            // pop + ret
+
+TEST_CASE(fusion_all_fire)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(FusionSource, program));
+
+    TestVm reference(program);
+    chip32_set_engine(&reference.ctx, CHIP32_ENGINE_SWITCH);
+    CHECK(reference.Run() == VM_FINISHED);
+    CHECK(reference.Reg(R2) == 100);
+
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    static chip32_fusion_stats_t stats;
+    TestVm vm(program);
+    CHECK(chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE));
+    CHECK(chip32_fuse(&vm.ctx, &stats, 1));
+    CHECK(vm.Run() == VM_FINISHED);
+
+    for (int fusion = 0; fusion < CHIP32_FUSION_COUNT; fusion++)
+    {
+        CHECK(stats.sites[fusion] == 1);
+        CHECK(stats.fired[fusion] == 50);
+    }
+
+    // Same state and instruction count as without the superinstructions
+    for (int reg = 0; reg < REGISTER_COUNT; reg++)
+        CHECK(vm.Reg(chip32_register_t(reg)) == reference.Reg(chip32_register_t(reg)));
+    CHECK(memcmp(vm.ramData, reference.ramData, TestVm::RAM_SIZE) == 0);
+    CHECK(vm.ctx.instr_count == reference.ctx.instr_count);
+
+    // The pairs are reported by mnemonic: 3 pop, pop pairs in the image
+    FILE *report = tmpfile();
+    CHECK(report != nullptr);
+    chip32_fusion_report(&stats, report);
+    rewind(report);
+    std::string text;
+    char line[256];
+    while (fgets(line, sizeof(line), report) != nullptr)
+        text += line;
+    fclose(report);
+    CHECK(text.find("   pop      -> pop      3\n") != std::string::npos);
+    CHECK(text.find("opcodes") == std::string::npos);
+    DONE();
+}
+
+// A fused push that would overflow the stack runs as separate instructions
+TEST_CASE(fusion_push_overflow)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        ".loop:\n"
+        "    push r0\n"
+        "    push r1\n"
+        "    push r2\n"
+        "    jump .loop\n", program));
+
+    TestVm reference(program);
+    chip32_set_engine(&reference.ctx, CHIP32_ENGINE_SWITCH);
+    CHECK(reference.Run() == VM_ERR_STACK_OVERFLOW);
+
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    static chip32_fusion_stats_t stats;
+    TestVm vm(program);
+    CHECK(chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE));
+    CHECK(chip32_fuse(&vm.ctx, &stats, 1));
+    CHECK(stats.sites[CHIP32_FUSE_PUSH_PUSH_PUSH] == 1);
+    CHECK(vm.Run() == VM_ERR_STACK_OVERFLOW);
+    CHECK(stats.fired[CHIP32_FUSE_PUSH_PUSH_PUSH] > 0);
+
+    CHECK(vm.Reg(SP) == reference.Reg(SP));
+    CHECK(vm.Reg(IP) == reference.Reg(IP));
+    CHECK(vm.ctx.instr_count == reference.ctx.instr_count);
+    DONE();
+}
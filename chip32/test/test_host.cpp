@@ -0,0 +1,141 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Host function table: registration, dispatch and results
+
+#include "test.h"
+
+static uint32_t HostSum(chip32_ctx_t *, const uint32_t *args)
+{
+    return args[0] + args[1] + args[2] + args[3];
+}
+
+static uint32_t HostSuspend(chip32_ctx_t *ctx, const uint32_t *args)
+{
+    chip32_suspend(ctx);
+    return args[0] * 2;
+}
+
+static bool HostFallback(chip32_ctx_t *ctx, uint8_t)
+{
+    ctx->registers[R5] = 1;
+    return true;
+}
+
+// Runs 'program' with 'table' on an engine, 'vm' is left in its final state
+static chip32_result_t RunHost(TestVm &vm, const chip32_host_table_t *table, chip32_engine_t engine)
+{
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    chip32_set_syscall(&vm.ctx, HostFallback, nullptr);
+    chip32_set_host_table(&vm.ctx, table);
+    if (engine == CHIP32_ENGINE_DECODED)
+        chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE);
+    else
+        chip32_set_engine(&vm.ctx, engine);
+    return vm.Run();
+}
+
+TEST_CASE(host_register)
+{
+    chip32_host_table_t table;
+    chip32_host_table_init(&table);
+
+    CHECK(!chip32_host_table_register(&table, 1, HostSum, CHIP32_HOST_MAX_ARGS + 1, R0));
+    CHECK(!chip32_host_table_register(&table, 1, HostSum, 2, IP));
+    CHECK(!chip32_host_table_register(&table, 1, HostSum, 2, SP));
+    CHECK(!chip32_host_table_register(&table, 1, HostSum, 2, REGISTER_COUNT));
+    CHECK(table.functions[1].fn == nullptr);
+
+    CHECK(chip32_host_table_register(&table, 1, HostSum, CHIP32_HOST_MAX_ARGS, RA));
+    CHECK(chip32_host_table_register(&table, 255, HostSum, 0, CHIP32_HOST_NO_RESULT));
+    CHECK((table.functions[1].fn == HostSum) && (table.functions[1].nb_args == 4) && (table.functions[1].ret == RA));
+    DONE();
+}
+
+TEST_CASE(host_dispatch)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 1\n"
+        "    lcons r1, 20\n"
+        "    lcons r2, 300\n"
+        "    lcons r3, 4000\n"
+        "    syscall 5\n"      // t0 = sum
+        "    syscall 6\n"      // no result
+        "    mov r4, t0\n"
+        "    syscall 7\n"      // not registered
+        "    halt\n", program));
+
+    chip32_host_table_t table;
+    chip32_host_table_init(&table);
+    CHECK(chip32_host_table_register(&table, 5, HostSum, 4, T0));
+    CHECK(chip32_host_table_register(&table, 6, HostSum, 4, CHIP32_HOST_NO_RESULT));
+
+    for (chip32_engine_t engine : { CHIP32_ENGINE_SWITCH, CHIP32_ENGINE_THREADED, CHIP32_ENGINE_DECODED })
+    {
+        TestVm vm(program);
+        CHECK(RunHost(vm, &table, engine) == VM_ERR_UNHANDLED_INTERRUPT);
+        CHECK(vm.Reg(R4) == 4321);
+        CHECK((vm.Reg(R0) == 1) && (vm.Reg(R3) == 4000));
+        // The table replaces the handler of the context
+        CHECK(vm.Reg(R5) == 0);
+    }
+
+    // Without the table, the handler of the context again
+    TestVm vm(program);
+    CHECK(RunHost(vm, nullptr, CHIP32_ENGINE_SWITCH) == VM_FINISHED);
+    CHECK(vm.Reg(R5) == 1);
+    DONE();
+}
+
+// The function suspends the VM: its result is written, the run resumes after the system call
+TEST_CASE(host_suspend)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 21\n"
+        "    syscall 9\n"
+        "    lcons r1, 1\n"
+        "    halt\n", program));
+
+    chip32_host_table_t table;
+    chip32_host_table_init(&table);
+    CHECK(chip32_host_table_register(&table, 9, HostSuspend, 1, R2));
+
+    for (chip32_engine_t engine : { CHIP32_ENGINE_SWITCH, CHIP32_ENGINE_DECODED })
+    {
+        TestVm vm(program);
+        CHECK(RunHost(vm, &table, engine) == VM_WAIT_SYSCALL);
+        CHECK(vm.Reg(R2) == 42);
+        CHECK(vm.Reg(R1) == 0);
+        CHECK(vm.Reg(IP) == 8);
+        CHECK(vm.ctx.instr_count == 2);
+
+        CHECK(vm.Run() == VM_FINISHED);
+        CHECK(vm.Reg(R1) == 1);
+        CHECK(vm.ctx.instr_count == 3);
+    }
+    DONE();
+}
@@ -0,0 +1,109 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Memory-mapped program images
+
+#include <cstdio>
+
+#include "test.h"
+#include "chip32_image.h"
+
+static bool WriteFile(const char *path, const std::vector<uint8_t> &data)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr)
+        return false;
+    const bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return (fclose(file) == 0) && ok;
+}
+
+// Two opens of the same file share the ROM, the last close releases it
+TEST_CASE(image_shared)
+{
+    const char *path = "chip32_test_image.bin";
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 42\n"
+        "    halt\n", program));
+    CHECK(WriteFile(path, program));
+
+    chip32_image_t *first = chip32_image_open(path);
+    chip32_image_t *second = chip32_image_open(path);
+    CHECK((first != nullptr) && (first == second));
+    virtual_mem_t *rom = chip32_image_rom(first);
+    CHECK(rom == chip32_image_rom(second));
+    CHECK(rom->size == program.size());
+    CHECK(memcmp(rom->mem, program.data(), program.size()) == 0);
+
+    // Still mapped after the first close
+    chip32_image_close(first);
+    uint8_t ramData[256];
+    virtual_mem_t ram = { ramData, sizeof(ramData), 0 };
+    chip32_ctx_t ctx;
+    chip32_initialize(&ctx, rom, &ram, 64);
+    CHECK(chip32_run(&ctx, rom->size, 0) == VM_FINISHED);
+    CHECK(ctx.registers[R0] == 42);
+
+    // Replaced by a rename: the open image keeps the old code, a new open gets the new one
+    std::vector<uint8_t> update;
+    CHECK(Assemble(
+        "    lcons r0, 43\n"
+        "    halt\n", update));
+    const char *next = "chip32_test_image.new";
+    CHECK(WriteFile(next, update));
+    CHECK(rename(next, path) == 0);
+    chip32_image_t *third = chip32_image_open(path);
+    CHECK((third != nullptr) && (third != second));
+    CHECK(memcmp(chip32_image_rom(third)->mem, update.data(), update.size()) == 0);
+    CHECK(memcmp(rom->mem, program.data(), program.size()) == 0);
+
+    chip32_image_close(second);
+    chip32_image_close(third);
+    remove(path);
+    DONE();
+}
+
+TEST_CASE(image_rejected)
+{
+    const char *path = "chip32_test_image.bin";
+    CHECK(chip32_image_open("chip32_no_such_image.bin") == nullptr);
+
+    CHECK(WriteFile(path, {}));
+    CHECK(chip32_image_open(path) == nullptr);
+
+    // One byte more than the address space
+    CHECK(WriteFile(path, std::vector<uint8_t>(0x10000, OP_NOP)));
+    CHECK(chip32_image_open(path) == nullptr);
+
+    std::vector<uint8_t> largest(0xFFFF, OP_NOP);
+    largest.back() = OP_HALT;
+    CHECK(WriteFile(path, largest));
+    chip32_image_t *image = chip32_image_open(path);
+    CHECK(image != nullptr);
+    CHECK(chip32_image_rom(image)->size == 0xFFFF);
+    chip32_image_close(image);
+    remove(path);
+    DONE();
+}
@@ -0,0 +1,188 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Baseline JIT tier: chip32_jit_run() must give the results of chip32_run()
+
+#include "test.h"
+#include "chip32_jit.h"
+
+// System call 9 suspends the program, the others add their code to r1
+static bool JitSyscall(chip32_ctx_t *ctx, uint8_t code)
+{
+    if (code == 9)
+        chip32_suspend(ctx);
+    else
+        ctx->registers[R1] += code;
+    return true;
+}
+
+/**
+ * Runs 'program' by slices of 'budget' instructions (0: no limit) with chip32_run()
+ * and with chip32_jit_run(). The result, the registers (IP included) and the
+ * instruction count must be the same after each slice. 'shared' puts the ROM in
+ * the RAM, for the self-modifying programs. 'registers' gets the final registers.
+ */
+static bool SameAsInterpreter(const std::vector<uint8_t> &program, uint32_t budget, bool shared, uint32_t *registers)
+{
+    TestVm reference(program);
+    TestVm vm(program);
+    for (TestVm *v : { &reference, &vm })
+    {
+        if (shared)
+        {
+            memcpy(v->ramData, program.data(), program.size());
+            v->rom.mem = v->ramData;
+        }
+        chip32_set_syscall(&v->ctx, JitSyscall, nullptr);
+    }
+    chip32_jit_t *jit = chip32_jit_create(&vm.rom);
+
+    bool same = true;
+    for (int slice = 0; same && (slice < 10000); slice++)
+    {
+        const chip32_result_t expected = chip32_run(&reference.ctx, reference.progSize, budget);
+        const chip32_result_t result = chip32_jit_run(jit, &vm.ctx, vm.progSize, budget);
+        same = (result == expected) && (vm.ctx.instr_count == reference.ctx.instr_count) &&
+               (memcmp(vm.ctx.registers, reference.ctx.registers, sizeof(vm.ctx.registers)) == 0);
+        if ((expected != VM_PAUSED) && (expected != VM_WAIT_SYSCALL))
+            break;
+    }
+    memcpy(registers, vm.ctx.registers, sizeof(vm.ctx.registers));
+    chip32_jit_destroy(jit);
+    return same;
+}
+
+// ALU blocks ended by call, ret and compare and branch
+TEST_CASE(jit_same_results)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 20\n"
+        "    lcons r1, 1\n"
+        "    lcons r2, 0\n"
+        "    lcons r3, 3\n"
+        ".loop:\n"
+        "    add r2, r0\n"
+        "    mul r2, r3\n"
+        "    xor r2, r0\n"
+        "    ishiftr r2, r1\n"
+        "    call .func\n"
+        "    sub r0, r1\n"
+        "    jne r0, r5, .loop\n"
+        "    halt\n"
+        ".func:\n"
+        "    shiftl r4, r1\n"
+        "    or r4, r2\n"
+        "    not r4\n"
+        "    ret\n", program));
+
+    uint32_t registers[REGISTER_COUNT];
+    CHECK(SameAsInterpreter(program, 0, false, registers));
+    CHECK(registers[R0] == 0);
+    const uint32_t r4 = registers[R4];
+
+    // Slices smaller than the blocks: the interpreter runs the end of a block that does not fit
+    for (uint32_t budget = 1; budget <= 7; budget++)
+    {
+        CHECK(SameAsInterpreter(program, budget, false, registers));
+        CHECK(registers[R4] == r4);
+    }
+    DONE();
+}
+
+// A skip pending at the start of a block skips its first instruction only
+TEST_CASE(jit_pending_skip)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 0\n"
+        "    lcons r1, 5\n"
+        "    skipz r0\n"
+        "    lcons r1, 9\n"     // skipped
+        "    add r1, r1\n"
+        "    mov r2, r1\n"
+        "    halt\n", program));
+
+    for (uint32_t budget : { 0u, 1u, 2u, 3u })
+    {
+        uint32_t registers[REGISTER_COUNT];
+        CHECK(SameAsInterpreter(program, budget, false, registers));
+        CHECK(registers[R2] == 10);
+    }
+    DONE();
+}
+
+// System calls are run by the interpreter, between two blocks
+TEST_CASE(jit_syscall)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 4\n"
+        "    lcons r1, 0\n"
+        "    lcons r2, 1\n"
+        ".loop:\n"
+        "    add r1, r2\n"
+        "    syscall 3\n"
+        "    add r1, r1\n"
+        "    syscall 9\n"       // suspended
+        "    sub r0, r2\n"
+        "    jne r0, r5, .loop\n"
+        "    halt\n", program));
+
+    for (uint32_t budget : { 0u, 1u, 2u, 5u })
+    {
+        uint32_t registers[REGISTER_COUNT];
+        CHECK(SameAsInterpreter(program, budget, false, registers));
+        CHECK(registers[R1] == 120);
+    }
+    DONE();
+}
+
+// A program writing into its own code: the blocks translated from the old code are dropped
+TEST_CASE(jit_self_modifying)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r2, 0\n"     // 0
+        "    lcons r3, 3\n"     // 6
+        "    lcons r4, 1\n"     // 12
+        "    lcons r1, 7\n"     // 18
+        ".loop:\n"
+        "    lcons r0, 1\n"     // 24, value at 26
+        "    add r2, r0\n"
+        "    store 26, r1\n"    // the next iterations add 7
+        "    sub r3, r4\n"
+        "    skipz r3\n"
+        "    jump .loop\n"
+        "    halt\n", program));
+
+    for (uint32_t budget : { 0u, 1u, 3u })
+    {
+        uint32_t registers[REGISTER_COUNT];
+        CHECK(SameAsInterpreter(program, budget, true, registers));
+        CHECK(registers[R2] == 15);
+    }
+    DONE();
+}
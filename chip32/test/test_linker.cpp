@@ -0,0 +1,218 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Relocatable objects: file format, and images built by the linker
+
+#include "test.h"
+#include "chip32_linker.h"
+
+// Calls .twice and jumps to .end, both in LinkerSourceB
+static const char *LinkerSourceA =
+    "    lcons r0, 5\n"
+    "    call .twice\n"
+    "    lcons r2, 1\n"
+    "    skipnz r2\n"
+    "    jump .end\n"       // skipped: falls through into the next section
+    "    lcons r3, 7\n"
+    "    jump .end\n"
+    ".unused:\n"
+    "    lcons r1, 99\n"
+    "    ret\n"
+    "$message DC8 \"hi\", 1\n";
+
+static const char *LinkerSourceB =
+    ".twice:\n"
+    "    add r0, r0\n"
+    "    ret\n"
+    ".end:\n"
+    "    halt\n";
+
+static bool SameObject(const Chip32Object &a, const Chip32Object &b)
+{
+    if ((a.keepAll != b.keepAll) || (a.sections.size() != b.sections.size()) ||
+        (a.symbols.size() != b.symbols.size()) || (a.relocs.size() != b.relocs.size()))
+        return false;
+    for (size_t i = 0; i < a.sections.size(); i++)
+    {
+        const ObjectSection &x = a.sections[i];
+        const ObjectSection &y = b.sections[i];
+        if ((x.bytes != y.bytes) || (x.ramUsage != y.ramUsage) || (x.isData != y.isData) || (x.fallsThrough != y.fallsThrough))
+            return false;
+    }
+    for (size_t i = 0; i < a.symbols.size(); i++)
+    {
+        const ObjectSymbol &x = a.symbols[i];
+        const ObjectSymbol &y = b.symbols[i];
+        if ((x.name != y.name) || (x.section != y.section) || (x.offset != y.offset))
+            return false;
+    }
+    for (size_t i = 0; i < a.relocs.size(); i++)
+    {
+        const ObjectReloc &x = a.relocs[i];
+        const ObjectReloc &y = b.relocs[i];
+        if ((x.section != y.section) || (x.offset != y.offset) || (x.symbol != y.symbol))
+            return false;
+    }
+    return true;
+}
+
+static bool DeserializeQuiet(const std::vector<uint8_t> &data, Chip32Object &object)
+{
+    std::ostringstream messages;
+    std::streambuf *out = std::cout.rdbuf(messages.rdbuf());
+    const bool success = Chip32Linker::Deserialize(data, object);
+    std::cout.rdbuf(out);
+    return success;
+}
+
+TEST_CASE(linker_serialize)
+{
+    std::vector<Chip32Object> objects;
+    CHECK(Chip32Linker::AssembleAll({ LinkerSourceA, LinkerSourceB }, objects, 1));
+    CHECK(objects.size() == 2);
+    CHECK(!objects[0].relocs.empty());
+
+    for (const Chip32Object &object : objects)
+    {
+        std::vector<uint8_t> data;
+        Chip32Linker::Serialize(object, data);
+        Chip32Object copy;
+        CHECK(Chip32Linker::Deserialize(data, copy));
+        CHECK(SameObject(object, copy));
+
+        std::vector<uint8_t> again;
+        Chip32Linker::Serialize(copy, again);
+        CHECK(again == data);
+    }
+    DONE();
+}
+
+TEST_CASE(linker_deserialize_rejects)
+{
+    std::vector<Chip32Object> objects;
+    CHECK(Chip32Linker::AssembleAll({ LinkerSourceA }, objects, 1));
+    const Chip32Object &object = objects[0];
+    std::vector<uint8_t> data;
+    Chip32Linker::Serialize(object, data);
+
+    // Truncated anywhere, or followed by garbage
+    Chip32Object copy;
+    for (size_t size = 0; size < data.size(); size++)
+        CHECK(!DeserializeQuiet(std::vector<uint8_t>(data.begin(), data.begin() + size), copy));
+    std::vector<uint8_t> longer(data);
+    longer.push_back(0);
+    CHECK(!DeserializeQuiet(longer, copy));
+
+    // Magic and version
+    std::vector<uint8_t> corrupt(data);
+    corrupt[0] = 'X';
+    CHECK(!DeserializeQuiet(corrupt, copy));
+    corrupt = data;
+    corrupt[4]++;
+    CHECK(!DeserializeQuiet(corrupt, copy));
+
+    // Relocation past the end of its section, or of an unknown section or symbol
+    Chip32Object bad = object;
+    bad.relocs[0].offset = bad.sections[bad.relocs[0].section].bytes.size() - 1;
+    Chip32Linker::Serialize(bad, corrupt);
+    CHECK(!DeserializeQuiet(corrupt, copy));
+    bad = object;
+    bad.relocs[0].section = bad.sections.size();
+    Chip32Linker::Serialize(bad, corrupt);
+    CHECK(!DeserializeQuiet(corrupt, copy));
+    bad = object;
+    bad.relocs[0].symbol = bad.symbols.size();
+    Chip32Linker::Serialize(bad, corrupt);
+    CHECK(!DeserializeQuiet(corrupt, copy));
+
+    // Symbol defined in an unknown section, or past the end of its section
+    size_t defined = 0;
+    while ((defined < object.symbols.size()) && (object.symbols[defined].section == Chip32Object::UNDEFINED))
+        defined++;
+    CHECK(defined < object.symbols.size());
+    bad = object;
+    bad.symbols[defined].section = bad.sections.size();
+    Chip32Linker::Serialize(bad, corrupt);
+    CHECK(!DeserializeQuiet(corrupt, copy));
+    bad = object;
+    bad.symbols[defined].offset = bad.sections[bad.symbols[defined].section].bytes.size() + 1;
+    Chip32Linker::Serialize(bad, corrupt);
+    CHECK(!DeserializeQuiet(corrupt, copy));
+    DONE();
+}
+
+// Without stripping, the image of the concatenated sources
+TEST_CASE(linker_two_objects)
+{
+    std::vector<Chip32Object> objects;
+    CHECK(Chip32Linker::AssembleAll({ LinkerSourceA, LinkerSourceB }, objects, 2));
+
+    Chip32Linker linker;
+    AssemblyResult result;
+    std::vector<uint8_t> program;
+    CHECK(linker.Link(objects, false, program, result));
+    CHECK(linker.GetStrippedSize() == 0);
+
+    std::vector<uint8_t> expected;
+    CHECK(Assemble(std::string(LinkerSourceA) + LinkerSourceB, expected));
+    CHECK(program == expected);
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R0) == 10);
+    CHECK(vm.Reg(R3) == 7);
+    DONE();
+}
+
+// .unused is left out, the section reached by falling through a skipped jump and the constants are kept
+TEST_CASE(linker_strip_dead)
+{
+    std::vector<Chip32Object> objects;
+    CHECK(Chip32Linker::AssembleAll({ LinkerSourceA, LinkerSourceB }, objects, 1));
+
+    Chip32Linker linker;
+    AssemblyResult result;
+    std::vector<uint8_t> program;
+    CHECK(linker.Link(objects, true, program, result));
+    CHECK(linker.GetStrippedSize() == 6 + 1);
+    CHECK(linker.GetLabels().count(".unused") == 0);
+    CHECK(linker.GetLabels().count(".twice") == 1);
+    CHECK(linker.GetLabels().count("$message") == 1);
+
+    Chip32Assembler assembler;
+    AssemblyResult fullResult;
+    std::vector<uint8_t> full;
+    CHECK(assembler.Parse(std::string(LinkerSourceA) + LinkerSourceB));
+    CHECK(assembler.BuildBinary(full, fullResult));
+    CHECK(program.size() + 7 == full.size());
+    CHECK(result.constantsSize > 0);
+    CHECK(result.constantsSize == fullResult.constantsSize);
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R0) == 10);
+    CHECK(vm.Reg(R3) == 7);
+    DONE();
+}
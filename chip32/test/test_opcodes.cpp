@@ -0,0 +1,607 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Behaviour of the instructions
+
+#include <algorithm>
+
+#include "test.h"
+#include "chip32_jit.h"
+
+static const OpCode OpCodes[] = OPCODES_LIST;
+
+// One use of each instruction, in opcode order
+static const char *OpcodeSamples[INSTRUCTION_COUNT] = {
+    "nop",
+    "halt",
+    "syscall 1",
+    "lcons r0, 5",
+    "mov r0, r1",
+    "push r0",
+    "pop r0",
+    "call .end",
+    "ret",
+    "store 0x10, r0",
+    "load r0, 0x10",
+    "add r0, r1",
+    "sub r0, r1",
+    "mul r0, r1",
+    "div r0, r1",
+    "shiftl r0, r1",
+    "shiftr r0, r1",
+    "ishiftr r0, r1",
+    "and r0, r1",
+    "or r0, r1",
+    "xor r0, r1",
+    "not r0",
+    "jump .end",
+    "jumpr r0",
+    "skipz r0",
+    "skipnz r0",
+    "bank r0",
+    "loadb r0, r1",
+    "storeb r1, r0",
+    "memcpy r0, r1, r2",
+    "memset r0, r1, r2",
+    "memcmp r0, r1, r2",
+    "je r0, r1, .end",
+    "jne r0, r1, .end",
+    "jlt r0, r1, .end",
+    "jge r0, r1, .end",
+    "load r0, [r1+8]",
+    "store [r1-4], r0",
+    "vload v0, r1",
+    "vstore r1, v0",
+    "vadd8 v0, v1",
+    "vadd16 v0, v1",
+    "vsub8 v0, v1",
+    "vsub16 v0, v1",
+    "vmin8 v0, v1",
+    "vmin16 v0, v1",
+    "vmax8 v0, v1",
+    "vmax16 v0, v1",
+    "vxor v0, v1",
+    "vsum8 r0, v1",
+    "vsum16 r0, v1",
+    "pushm r0-r3, ra",
+    "popm r0-r3, ra",
+    "enter 16",
+    "leave",
+};
+
+// OPCODES_LIST gives the size of the encoding produced by the assembler
+TEST_CASE(opcodes_sizes)
+{
+    for (int op = 0; op < INSTRUCTION_COUNT; op++)
+    {
+        std::vector<uint8_t> program;
+        CHECK(Assemble(std::string("    ") + OpcodeSamples[op] + "\n.end:\n", program));
+        CHECK(program.size() == 1U + OpCodes[op].bytes);
+        CHECK(program[0] == op);
+    }
+    DONE();
+}
+
+// A skip jumps over the whole instruction, arguments included
+TEST_CASE(opcodes_skip_sizes)
+{
+    for (const char *skipped : { "not r1", "jump .end", "jumpr r1", "skipz r1", "skipnz r1" })
+    {
+        std::vector<uint8_t> program;
+        CHECK(Assemble(
+            "    lcons r0, 0\n"
+            "    lcons r1, 7\n"
+            "    skipz r0\n"
+            "    " + std::string(skipped) + "\n"
+            "    lcons r2, 1\n"
+            "    halt\n"
+            ".end:\n"
+            "    halt\n", program));
+
+        TestVm vm(program);
+        CHECK(vm.Run() == VM_FINISHED);
+        CHECK(vm.Reg(R1) == 7);
+        CHECK(vm.Reg(R2) == 1);
+    }
+    DONE();
+}
+
+// The skips test the value of the register, not its index (r0 is index 0)
+TEST_CASE(opcodes_skip_register_value)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 5\n"
+        "    lcons r1, 0\n"
+        "    skipz r0\n"
+        "    lcons r2, 1\n"
+        "    skipnz r1\n"
+        "    lcons r3, 1\n"
+        "    skipz r0\n"       // skip + jump superinstructions
+        "    jump .first\n"
+        "    halt\n"
+        ".first:\n"
+        "    skipnz r1\n"
+        "    jump .second\n"
+        "    halt\n"
+        ".second:\n"
+        "    lcons r4, 1\n"
+        "    halt\n", program));
+
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    static chip32_fusion_stats_t stats;
+    for (int mode = 0; mode < 5; mode++)
+    {
+        TestVm vm(program);
+        chip32_result_t result;
+        if (mode < 2)
+            chip32_set_engine(&vm.ctx, (mode == 0) ? CHIP32_ENGINE_SWITCH : CHIP32_ENGINE_THREADED);
+        if (mode >= 2 && mode < 4)
+            CHECK(chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE));
+        if (mode == 3)
+            CHECK(chip32_fuse(&vm.ctx, &stats, 1));
+        if (mode == 4)
+        {
+            chip32_jit_t *jit = chip32_jit_create(&vm.rom);
+            CHECK(jit != nullptr);
+            result = chip32_jit_run(jit, &vm.ctx, vm.progSize, 100000);
+            chip32_jit_destroy(jit);
+        }
+        else
+        {
+            result = vm.Run();
+        }
+
+        CHECK(result == VM_FINISHED);
+        CHECK(vm.Reg(R2) == 1);
+        CHECK(vm.Reg(R3) == 1);
+        CHECK(vm.Reg(R4) == 1);
+    }
+    CHECK(stats.fired[CHIP32_FUSE_SKIPZ_JMP] == 1);
+    CHECK(stats.fired[CHIP32_FUSE_SKIPNZ_JMP] == 1);
+    DONE();
+}
+
+// =============================================================================
+// BLOCK MEMORY
+// =============================================================================
+
+// Overlapping ranges are copied as memmove() does
+TEST_CASE(opcodes_memcpy)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 0x102\n"
+        "    lcons r1, 0x100\n"
+        "    lcons r2, 6\n"
+        "    memcpy r0, r1, r2\n"
+        "    halt\n", program));
+
+    TestVm vm(program);
+    for (int i = 0; i < 8; i++)
+        vm.ramData[0x100 + i] = i + 1;
+    CHECK(vm.Run() == VM_FINISHED);
+
+    const uint8_t expected[] = { 1, 2, 1, 2, 3, 4, 5, 6, 0 };
+    CHECK(memcmp(&vm.ramData[0x100], expected, sizeof(expected)) == 0);
+    DONE();
+}
+
+TEST_CASE(opcodes_memset)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 0x200\n"
+        "    lcons r1, 0x1AB\n"     // low byte only
+        "    lcons r2, 5\n"
+        "    memset r0, r1, r2\n"
+        "    halt\n", program));
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+
+    const uint8_t expected[] = { 0, 0xAB, 0xAB, 0xAB, 0xAB, 0xAB, 0 };
+    CHECK(memcmp(&vm.ramData[0x1FF], expected, sizeof(expected)) == 0);
+    DONE();
+}
+
+TEST_CASE(opcodes_memcmp)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r2, 4\n"
+        "    lcons r0, 0x100\n"
+        "    lcons r1, 0x110\n"
+        "    memcmp r0, r1, r2\n"   // equal
+        "    lcons r3, 0x100\n"
+        "    lcons r1, 0x120\n"
+        "    memcmp r3, r1, r2\n"   // lower
+        "    lcons r4, 0x120\n"
+        "    lcons r1, 0x100\n"
+        "    memcmp r4, r1, r2\n"   // greater
+        "    halt\n", program));
+
+    TestVm vm(program);
+    const uint8_t low[] = { 1, 2, 3, 4 };
+    const uint8_t high[] = { 1, 2, 4, 0 };
+    memcpy(&vm.ramData[0x100], low, 4);
+    memcpy(&vm.ramData[0x110], low, 4);
+    memcpy(&vm.ramData[0x120], high, 4);
+    CHECK(vm.Run() == VM_FINISHED);
+
+    CHECK(vm.Reg(R0) == 0);
+    CHECK(vm.Reg(R3) == 0xFFFFFFFF);
+    CHECK(vm.Reg(R4) == 1);
+    DONE();
+}
+
+// =============================================================================
+// COMPARE AND BRANCH
+// =============================================================================
+
+// Signed comparisons: -1 is lower than 1
+TEST_CASE(opcodes_compare_branch)
+{
+    static const struct
+    {
+        const char *mnemonic;
+        uint32_t a;
+        uint32_t b;
+        bool taken;
+    } cases[] = {
+        { "je",  5, 5, true },
+        { "je",  5, 6, false },
+        { "jne", 5, 6, true },
+        { "jne", 5, 5, false },
+        { "jlt", 0xFFFFFFFF, 1, true },
+        { "jlt", 1, 0xFFFFFFFF, false },
+        { "jlt", 5, 5, false },
+        { "jge", 1, 0xFFFFFFFF, true },
+        { "jge", 5, 5, true },
+        { "jge", 0xFFFFFFFF, 1, false },
+    };
+
+    for (const auto &test : cases)
+    {
+        std::vector<uint8_t> program;
+        CHECK(Assemble(
+            "    lcons r0, " + std::to_string(test.a) + "\n"
+            "    lcons r1, " + std::to_string(test.b) + "\n"
+            "    " + test.mnemonic + " r0, r1, .taken\n"
+            "    lcons r2, 1\n"
+            "    halt\n"
+            ".taken:\n"
+            "    lcons r2, 2\n"
+            "    halt\n", program));
+
+        TestVm vm(program);
+        CHECK(vm.Run() == VM_FINISHED);
+        CHECK(vm.Reg(R2) == (test.taken ? 2U : 1U));
+    }
+    DONE();
+}
+
+// =============================================================================
+// REGISTER-INDIRECT MEMORY
+// =============================================================================
+
+TEST_CASE(opcodes_loadr)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r1, 0x300\n"
+        "    load r0, [r1+8]\n"
+        "    load r2, [r1-4]\n"
+        "    halt\n", program));
+    CHECK(program[6] == OP_LOADR);
+
+    TestVm vm(program);
+    const uint8_t above[] = { 0x78, 0x56, 0x34, 0x12 };
+    const uint8_t below[] = { 0xEF, 0xBE, 0xAD, 0xDE };
+    memcpy(&vm.ramData[0x308], above, 4);
+    memcpy(&vm.ramData[0x2FC], below, 4);
+    CHECK(vm.Run() == VM_FINISHED);
+
+    CHECK(vm.Reg(R0) == 0x12345678);
+    CHECK(vm.Reg(R2) == 0xDEADBEEF);
+    DONE();
+}
+
+TEST_CASE(opcodes_storer)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r1, 0x300\n"
+        "    lcons r0, 0x12345678\n"
+        "    store [r1-4], r0\n"
+        "    store [r1+2], r0\n"
+        "    halt\n", program));
+    CHECK(program[12] == OP_STORER);
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+
+    const uint8_t expected[] = { 0, 0x78, 0x56, 0x34, 0x12, 0, 0, 0x78, 0x56, 0x34, 0x12, 0 };
+    CHECK(memcmp(&vm.ramData[0x2FB], expected, sizeof(expected)) == 0);
+    DONE();
+}
+
+// =============================================================================
+// BANKED MEMORY
+// =============================================================================
+
+// Bank 1: writable, ends 2 bytes after a word boundary. Bank 2: read-only.
+static uint8_t BankA[0x1802];
+static uint8_t BankB[0x1000];
+static const chip32_segment_t BankSegments[] = {
+    { BankA, 0x10000, sizeof(BankA), true },
+    { BankB, 0x20000, sizeof(BankB), false },
+};
+
+// Runs 'source' with the segments on each engine, all must give 'expected'
+static bool RunBanked(const std::string &source, chip32_result_t expected, uint32_t r3, uint32_t r4)
+{
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    std::vector<uint8_t> program;
+    if (!Assemble(source, program))
+        return false;
+
+    for (chip32_engine_t engine : { CHIP32_ENGINE_SWITCH, CHIP32_ENGINE_THREADED, CHIP32_ENGINE_DECODED })
+    {
+        memset(BankA, 0, sizeof(BankA));
+        for (uint32_t i = 0; i < sizeof(BankB); i++)
+            BankB[i] = i;
+
+        TestVm vm(program);
+        chip32_set_segments(&vm.ctx, BankSegments, 2);
+        if (engine == CHIP32_ENGINE_DECODED)
+            chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE);
+        else
+            chip32_set_engine(&vm.ctx, engine);
+        if ((vm.Run() != expected) || (vm.Reg(R3) != r3) || (vm.Reg(R4) != r4))
+            return false;
+        // Read-only bank never written
+        for (uint32_t i = 0; i < sizeof(BankB); i++)
+        {
+            if (BankB[i] != uint8_t(i))
+                return false;
+        }
+    }
+    return true;
+}
+
+// The bank register selects the segment, even when the TLB holds the same low address
+TEST_CASE(opcodes_banked)
+{
+    CHECK(RunBanked(
+        "    lcons r0, 1\n"
+        "    bank r0\n"
+        "    lcons r1, 0x10\n"
+        "    lcons r2, 0x11223344\n"
+        "    storeb r1, r2\n"
+        "    loadb r3, r1\n"        // TLB hit in bank 1
+        "    lcons r0, 2\n"
+        "    bank r0\n"
+        "    loadb r4, r1\n"        // same page number in bank 2
+        "    halt\n", VM_FINISHED, 0x11223344, 0x13121110));
+    CHECK(BankA[0x10] == 0x44);
+    CHECK(BankA[0x13] == 0x11);
+    DONE();
+}
+
+// The 4 bytes must be inside the segment, a TLB entry of the same page does not extend it
+TEST_CASE(opcodes_banked_segment_end)
+{
+    const std::string select =
+        "    lcons r0, 1\n"
+        "    bank r0\n"
+        "    lcons r1, 0x1700\n"
+        "    loadb r3, r1\n";   // TLB entry for the last page
+    CHECK(RunBanked(select +
+        "    lcons r1, 0x17FE\n"
+        "    lcons r2, 0x55667788\n"
+        "    storeb r1, r2\n"
+        "    loadb r4, r1\n"
+        "    halt\n", VM_FINISHED, 0, 0x55667788));
+    CHECK(RunBanked(select +
+        "    lcons r1, 0x17FF\n"
+        "    loadb r4, r1\n"
+        "    halt\n", VM_ERR_INVALID_ADDRESS, 0, 0));
+    CHECK(RunBanked(select +
+        "    lcons r1, 0x17FF\n"
+        "    storeb r1, r0\n"
+        "    halt\n", VM_ERR_INVALID_ADDRESS, 0, 0));
+    // Outside any segment
+    CHECK(RunBanked(
+        "    lcons r1, 0x10\n"
+        "    loadb r4, r1\n"
+        "    halt\n", VM_ERR_INVALID_ADDRESS, 0, 0));
+    DONE();
+}
+
+// Writes into a read-only segment fail, also after a read cached its page
+TEST_CASE(opcodes_banked_read_only)
+{
+    CHECK(RunBanked(
+        "    lcons r0, 2\n"
+        "    bank r0\n"
+        "    lcons r1, 0x20\n"
+        "    loadb r3, r1\n"
+        "    storeb r1, r0\n"
+        "    halt\n", VM_ERR_INVALID_ADDRESS, 0x23222120, 0));
+    CHECK(RunBanked(
+        "    lcons r0, 2\n"
+        "    bank r0\n"
+        "    lcons r1, 0x20\n"
+        "    storeb r1, r0\n"
+        "    halt\n", VM_ERR_INVALID_ADDRESS, 0, 0));
+    DONE();
+}
+
+// =============================================================================
+// VECTOR REGISTERS
+// =============================================================================
+
+// Lanes chosen to tell wrapping, signed and unsigned results apart
+static const uint8_t VectorA[CHIP32_VREG_SIZE] = {
+    0x01, 0xFF, 0x80, 0x7F, 0x00, 0x10, 0xF0, 0x55, 0x00, 0x80, 0xFF, 0x7F, 0x34, 0x12, 0xCD, 0xAB };
+static const uint8_t VectorB[CHIP32_VREG_SIZE] = {
+    0xFF, 0x01, 0x80, 0x01, 0x00, 0x20, 0x20, 0xAA, 0x01, 0x00, 0x01, 0x80, 0x11, 0x11, 0x22, 0x22 };
+
+// vload, vstore and the lane-wise instructions
+TEST_CASE(opcodes_vector_lanes)
+{
+    static const struct
+    {
+        const char *mnemonic;
+        bool lanes16; //!< Signed 16-bit lanes, unsigned bytes otherwise
+        int (*expr)(int x, int y);
+    } cases[] = {
+        { "vadd8",  false, [](int x, int y) { return x + y; } },
+        { "vadd16", true,  [](int x, int y) { return x + y; } },
+        { "vsub8",  false, [](int x, int y) { return x - y; } },
+        { "vsub16", true,  [](int x, int y) { return x - y; } },
+        { "vmin8",  false, [](int x, int y) { return std::min(x, y); } },
+        { "vmin16", true,  [](int x, int y) { return std::min(x, y); } },
+        { "vmax8",  false, [](int x, int y) { return std::max(x, y); } },
+        { "vmax16", true,  [](int x, int y) { return std::max(x, y); } },
+        { "vxor",   false, [](int x, int y) { return x ^ y; } },
+    };
+
+    for (const auto &test : cases)
+    {
+        std::vector<uint8_t> program;
+        CHECK(Assemble(
+            "    lcons r0, 0x100\n"
+            "    lcons r1, 0x110\n"
+            "    lcons r2, 0x200\n"
+            "    vload v3, r0\n"
+            "    vload v6, r1\n"
+            "    " + std::string(test.mnemonic) + " v3, v6\n"
+            "    vstore r2, v3\n"
+            "    halt\n", program));
+
+        TestVm vm(program);
+        memcpy(&vm.ramData[0x100], VectorA, CHIP32_VREG_SIZE);
+        memcpy(&vm.ramData[0x110], VectorB, CHIP32_VREG_SIZE);
+        CHECK(vm.Run() == VM_FINISHED);
+
+        uint8_t expected[CHIP32_VREG_SIZE];
+        for (int i = 0; i < CHIP32_VREG_SIZE; i += (test.lanes16 ? 2 : 1))
+        {
+            if (test.lanes16)
+            {
+                const int x = int16_t(VectorA[i] | (VectorA[i + 1] << 8));
+                const int y = int16_t(VectorB[i] | (VectorB[i + 1] << 8));
+                const int result = test.expr(x, y);
+                expected[i] = result & 0xFF;
+                expected[i + 1] = (result >> 8) & 0xFF;
+            }
+            else
+            {
+                expected[i] = test.expr(VectorA[i], VectorB[i]) & 0xFF;
+            }
+        }
+        CHECK(memcmp(&vm.ramData[0x200], expected, CHIP32_VREG_SIZE) == 0);
+        CHECK(memcmp(vm.ctx.vregs[6], VectorB, CHIP32_VREG_SIZE) == 0);
+    }
+    DONE();
+}
+
+// Horizontal sums: unsigned bytes, signed 16-bit lanes
+TEST_CASE(opcodes_vector_sums)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 0x100\n"
+        "    vload v2, r0\n"
+        "    vsum8 r3, v2\n"
+        "    vsum16 r4, v2\n"
+        "    halt\n", program));
+
+    TestVm vm(program);
+    memcpy(&vm.ramData[0x100], VectorA, CHIP32_VREG_SIZE);
+    CHECK(vm.Run() == VM_FINISHED);
+
+    uint32_t sum8 = 0;
+    int32_t sum16 = 0;
+    for (int i = 0; i < CHIP32_VREG_SIZE; i++)
+        sum8 += VectorA[i];
+    for (int i = 0; i < CHIP32_VREG_SIZE; i += 2)
+        sum16 += int16_t(VectorA[i] | (VectorA[i + 1] << 8));
+    CHECK(vm.Reg(R3) == sum8);
+    CHECK(vm.Reg(R4) == uint32_t(sum16));
+    DONE();
+}
+
+// =============================================================================
+// STACK
+// =============================================================================
+
+// 'count' times the instruction, then halt
+static std::string Repeat(const std::string &instruction, int count)
+{
+    std::string source;
+    for (int i = 0; i < count; i++)
+        source += "    " + instruction + "\n";
+    return source + "    halt\n";
+}
+
+// The stack takes exactly STACK_SIZE bytes, one more push overflows, superinstructions included
+TEST_CASE(opcodes_stack_full)
+{
+    static const int WORDS = TestVm::STACK_SIZE / 4;
+    static const uint32_t BOTTOM = TestVm::RAM_SIZE - TestVm::STACK_SIZE;
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    static chip32_fusion_stats_t stats;
+
+    for (const char *instruction : { "push r0", "pushm r0-r3" })
+    {
+        const int perInstr = (instruction[4] == 'm') ? 4 : 1;
+        for (int extra = 0; extra <= 1; extra++)
+        {
+            std::vector<uint8_t> program;
+            const int count = WORDS / perInstr + extra;
+            CHECK(Assemble(Repeat(instruction, count), program));
+
+            for (int mode = 0; mode < 4; mode++)
+            {
+                TestVm vm(program);
+                if (mode < 2)
+                    chip32_set_engine(&vm.ctx, (mode == 0) ? CHIP32_ENGINE_SWITCH : CHIP32_ENGINE_THREADED);
+                else
+                    CHECK(chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE));
+                if (mode == 3)
+                    CHECK(chip32_fuse(&vm.ctx, &stats, 1));
+
+                CHECK(vm.Run() == (extra ? VM_ERR_STACK_OVERFLOW : VM_FINISHED));
+                CHECK(vm.Reg(SP) == BOTTOM);
+                CHECK(vm.ctx.instr_count == uint64_t(WORDS / perInstr));
+                if ((mode == 3) && (perInstr == 1))
+                    CHECK(stats.fired[CHIP32_FUSE_PUSH_PUSH_PUSH] > 0);
+            }
+        }
+    }
+    DONE();
+}
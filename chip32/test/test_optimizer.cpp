@@ -0,0 +1,221 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Peephole optimizer: each rewrite is counted, and the program computes the same values
+
+#include "test.h"
+
+/**
+ * Assemble 'source' with and without Optimize(). Both programs must finish with
+ * the same r0-r5, 'program' gets the optimized one.
+ */
+static bool Optimize(const std::string &source, OptimizationResult &result, std::vector<uint8_t> &program)
+{
+    std::vector<uint8_t> original;
+    if (!Assemble(source, original))
+        return false;
+
+    Chip32Assembler assembler;
+    AssemblyResult assembly;
+    program.clear();
+    if (!assembler.Parse(source))
+        return false;
+    assembler.Optimize(result);
+    if (!assembler.BuildBinary(program, assembly))
+        return false;
+    if (program.size() + result.bytesSaved != original.size())
+        return false;
+
+    TestVm before(original);
+    TestVm after(program);
+    if ((before.Run() != VM_FINISHED) || (after.Run() != VM_FINISHED))
+        return false;
+    for (uint8_t reg = R0; reg <= R5; reg++)
+    {
+        if (before.Reg(chip32_register_t(reg)) != after.Reg(chip32_register_t(reg)))
+            return false;
+    }
+    return true;
+}
+
+TEST_CASE(optimizer_redundant_mov)
+{
+    OptimizationResult result;
+    std::vector<uint8_t> program;
+    CHECK(Optimize(
+        "    lcons r0, 5\n"
+        "    mov r1, r0\n"
+        "    mov r1, r0\n"      // already a copy
+        "    mov r0, r1\n"      // same
+        "    add r1, r0\n"
+        "    mov r2, r0\n"      // r1 changed, kept
+        "    halt\n", result, program));
+    CHECK(result.movRemoved == 2);
+    CHECK(result.bytesSaved == 6);
+    CHECK((result.removedLines == std::vector<uint16_t>{ 3, 4 }));
+    CHECK(result.lconsRemoved + result.lconsToMov + result.pushPopRemoved + result.deadRemoved == 0);
+    DONE();
+}
+
+TEST_CASE(optimizer_lcons)
+{
+    OptimizationResult result;
+    std::vector<uint8_t> program;
+    CHECK(Optimize(
+        "    lcons r0, 5\n"
+        "    lcons r1, 5\n"     // mov r1, r0
+        "    lcons r0, 5\n"     // removed
+        "    lcons r2, 6\n"
+        "    halt\n", result, program));
+    CHECK(result.lconsToMov == 1);
+    CHECK(result.lconsRemoved == 1);
+    CHECK(result.bytesSaved == 3 + 6);
+    CHECK(program[6] == OP_MOV);
+    CHECK((program[7] == R1) && (program[8] == R0));
+    DONE();
+}
+
+TEST_CASE(optimizer_push_pop)
+{
+    OptimizationResult result;
+    std::vector<uint8_t> program;
+    CHECK(Optimize(
+        "    lcons r0, 3\n"
+        "    push r0\n"
+        "    pop r1\n"          // mov r1, r0
+        "    push r2\n"
+        "    pop r2\n"          // both removed
+        "    add r1, r0\n"
+        "    halt\n", result, program));
+    CHECK(result.pushPopRemoved == 2);
+    CHECK(result.bytesSaved == 1 + 4);
+    CHECK(program[6] == OP_MOV);
+    CHECK((program[7] == R1) && (program[8] == R0));
+    DONE();
+}
+
+TEST_CASE(optimizer_jump_threading)
+{
+    OptimizationResult result;
+    std::vector<uint8_t> program;
+    CHECK(Optimize(
+        "    lcons r0, 1\n"
+        "    lcons r1, 1\n"
+        "    je r0, r1, .first\n"  // goes to .second
+        "    lcons r2, 5\n"
+        "    halt\n"
+        ".first:\n"
+        "    jump .second\n"       // jumps to the next instruction, removed
+        ".second:\n"
+        "    lcons r2, 7\n"
+        "    halt\n", result, program));
+    CHECK(result.jumpsThreaded == 1);
+    CHECK(result.jumpsRemoved == 1);
+    CHECK(result.lconsToMov == 1);     // r1 = r0
+    CHECK(result.bytesSaved == 3 + 3);
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R2) == 7);
+    DONE();
+}
+
+// Nothing runs between halt or jump and the next label, the code after the label is kept
+TEST_CASE(optimizer_dead_code)
+{
+    OptimizationResult result;
+    std::vector<uint8_t> program;
+    CHECK(Optimize(
+        "    lcons r0, 1\n"
+        "    jump .end\n"
+        "    lcons r0, 2\n"     // dead
+        "    add r0, r0\n"      // dead
+        ".keep:\n"
+        "    lcons r1, 3\n"
+        "    ret\n"
+        ".end:\n"
+        "    call .keep\n"
+        "    halt\n"
+        "    lcons r3, 4\n"     // dead
+        "    halt\n", result, program));
+    CHECK(result.deadRemoved == 4);
+    CHECK(result.bytesSaved == 6 + 3 + 6 + 1);
+    CHECK((result.removedLines == std::vector<uint16_t>{ 3, 4, 11, 12 }));
+    DONE();
+}
+
+// The instruction after a skip may run or not: none of the rewrites apply to it
+TEST_CASE(optimizer_skip_guarded)
+{
+    OptimizationResult result;
+    std::vector<uint8_t> program;
+    CHECK(Optimize(
+        "    lcons r0, 5\n"
+        "    lcons r1, 0\n"
+        "    mov r2, r0\n"
+        "    skipz r1\n"
+        "    mov r2, r0\n"      // would be a redundant mov
+        "    skipnz r1\n"
+        "    jump .next\n"      // would be a jump to the next instruction
+        ".next:\n"
+        "    skipz r1\n"
+        "    halt\n"            // the code after it is not dead
+        "    lcons r3, 9\n"
+        "    halt\n", result, program));
+    CHECK(result.movRemoved + result.lconsRemoved + result.lconsToMov + result.jumpsThreaded +
+          result.jumpsRemoved + result.pushPopRemoved + result.deadRemoved == 0);
+    CHECK(result.bytesSaved == 0);
+
+    TestVm vm(program);
+    CHECK(vm.Run() == VM_FINISHED);
+    CHECK(vm.Reg(R3) == 9);
+    DONE();
+}
+
+// Code addresses computed at run time: moving code would break them
+TEST_CASE(optimizer_skipped)
+{
+    const std::string source =
+        "    lcons r2, 26\n"    // .end
+        "    lcons r0, 5\n"
+        "    mov r1, r0\n"
+        "    mov r1, r0\n"
+        "    jumpr r2\n"
+        "    lcons r3, 1\n"
+        ".end:\n"               // 26
+        "    halt\n";
+    OptimizationResult result;
+    std::vector<uint8_t> program;
+    CHECK(Optimize(source, result, program));
+    CHECK(result.skipped);
+    CHECK(result.movRemoved == 0);
+    CHECK(result.bytesSaved == 0);
+    CHECK(result.removedLines.empty());
+
+    std::vector<uint8_t> original;
+    CHECK(Assemble(source, original));
+    CHECK(program == original);
+    DONE();
+}
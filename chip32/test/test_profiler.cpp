@@ -0,0 +1,164 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Execution profiler, the tests are built with VM_ENABLE_PROFILER
+
+#include "test.h"
+#include "chip32_profiler.h"
+
+typedef void (*ProfilerWriter)(const chip32_profiler_t *prof, FILE *out);
+
+// Lines written by one of the chip32_profiler_write_xxx() functions
+static std::vector<std::string> ProfilerLines(const chip32_profiler_t *prof, ProfilerWriter writer)
+{
+    std::vector<std::string> lines;
+    FILE *out = tmpfile();
+    if (out == nullptr)
+        return lines;
+    writer(prof, out);
+    rewind(out);
+    char line[256];
+    while (fgets(line, sizeof(line), out) != nullptr)
+        lines.push_back(std::string(line, strcspn(line, "\n")));
+    fclose(out);
+    return lines;
+}
+
+static int CountPrefix(const std::vector<std::string> &lines, const std::string &prefix)
+{
+    int count = 0;
+    for (const std::string &line : lines)
+        count += (line.compare(0, prefix.size(), prefix) == 0);
+    return count;
+}
+
+static void TimingWithoutLabels(const chip32_profiler_t *prof, FILE *out)
+{
+    chip32_profiler_write_timing(prof, nullptr, 0, out);
+}
+
+// A jump is not a call: a loop without call has no function
+TEST_CASE(profiler_loop_without_call)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 4\n"
+        "    lcons r1, 1\n"
+        ".loop:\n"
+        "    sub r0, r1\n"
+        "    skipz r0\n"
+        "    jump .loop\n"
+        "    halt\n", program));
+
+    TestVm vm(program);
+    chip32_profiler_t *prof = chip32_profiler_create(&vm.rom);
+    CHECK(chip32_profiler_attach(&vm.ctx, prof));
+    CHECK(vm.Run() == VM_FINISHED);
+
+    const std::vector<std::string> csv = ProfilerLines(prof, chip32_profiler_write_csv);
+    const std::vector<std::string> folded = ProfilerLines(prof, chip32_profiler_write_folded);
+    chip32_profiler_set_cost_model(prof, &chip32_cost_cortex_m0);
+    const std::vector<std::string> timing = ProfilerLines(prof, TimingWithoutLabels);
+    chip32_profiler_destroy(prof);
+
+    CHECK(CountPrefix(csv, "opcode,jump,3") == 1);
+    CHECK(CountPrefix(csv, "function,") == 0);
+    CHECK(folded.size() == 1);
+    CHECK(folded[0] == "entry 14");
+    CHECK(CountPrefix(timing, "function,") == 0);
+    DONE();
+}
+
+static bool ProfilerSyscall(chip32_ctx_t *, uint8_t)
+{
+    return true;
+}
+
+static const chip32_label_t ProfilerLabels[] = { { ".func", 30 }, { "start", 0 }, { ".loop", 18 } };
+
+static void TimingWithLabels(const chip32_profiler_t *prof, FILE *out)
+{
+    chip32_profiler_write_timing(prof, ProfilerLabels, 3, out);
+}
+
+// Row of the timing report, without the time in us
+static std::string TimingRow(const std::string &kind, const std::string &key, uint64_t count, uint64_t cycles)
+{
+    return kind + "," + key + "," + std::to_string(count) + "," + std::to_string(cycles) + ",";
+}
+
+TEST_CASE(profiler_calls)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 3\n"        // 0
+        "    lcons r1, 1\n"        // 6
+        "    lcons r5, 10\n"       // 12
+        ".loop:\n"
+        "    call .func\n"         // 18
+        "    sub r0, r1\n"         // 21
+        "    skipz r0\n"           // 24
+        "    jump .loop\n"         // 26
+        "    halt\n"               // 29
+        ".func:\n"
+        "    mov r2, r0\n"         // 30
+        "    syscall 3\n"          // 33
+        "    memcpy r3, r4, r5\n"  // 35, 10 bytes: 3 words
+        "    ret\n", program));    // 39
+
+    TestVm vm(program);
+    chip32_set_syscall(&vm.ctx, ProfilerSyscall, nullptr);
+    chip32_profiler_t *prof = chip32_profiler_create(&vm.rom);
+    chip32_profiler_set_cost_model(prof, &chip32_cost_cortex_m0);
+    CHECK(chip32_profiler_attach(&vm.ctx, prof));
+    CHECK(vm.Run() == VM_FINISHED);
+
+    const std::vector<std::string> csv = ProfilerLines(prof, chip32_profiler_write_csv);
+    const std::vector<std::string> folded = ProfilerLines(prof, chip32_profiler_write_folded);
+    const std::vector<std::string> timing = ProfilerLines(prof, TimingWithLabels);
+    const uint64_t total = chip32_profiler_cycles(prof);
+    chip32_profiler_destroy(prof);
+
+    // 3 calls of 4 instructions each, the loop jumps do not nest
+    CHECK(CountPrefix(csv, "function,") == 1);
+    CHECK(CountPrefix(csv, "function,0x001E,3,12,") == 1);
+    CHECK(folded.size() == 2);
+    CHECK(CountPrefix(folded, "entry 1") == 1);
+    CHECK(CountPrefix(folded, "entry;0x001E 12") == 1);
+
+    // Cycles of the model: each instruction, the system call handler and the words copied
+    const chip32_cost_model_t &model = chip32_cost_cortex_m0;
+    const uint16_t *cost = model.opcodes;
+    const uint64_t start = 3 * cost[OP_LCONS];
+    const uint64_t loop = 3 * (cost[OP_CALL] + cost[OP_SUB] + cost[OP_SKIPZ]) + 2 * cost[OP_JMP] + cost[OP_HALT];
+    const uint64_t call = cost[OP_MOV] + cost[OP_SYSCALL] + model.syscall_handler + cost[OP_MEMCPY] + 3 * model.mem_word + cost[OP_RET];
+    CHECK(CountPrefix(timing, TimingRow("function", "0x001E .func", 3, 3 * call)) == 1);
+    CHECK(CountPrefix(timing, TimingRow("label", "start", 3, start)) == 1);
+    CHECK(CountPrefix(timing, TimingRow("label", ".loop", 12, loop)) == 1);
+    CHECK(CountPrefix(timing, TimingRow("label", ".func", 12, 3 * call)) == 1);
+    CHECK(CountPrefix(timing, TimingRow("syscall", "3", 3, 3 * model.syscall_handler)) == 1);
+    CHECK(CountPrefix(timing, TimingRow("total", model.name, 27, start + loop + 3 * call)) == 1);
+    CHECK(total == start + loop + 3 * call);
+    DONE();
+}
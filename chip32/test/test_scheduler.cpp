@@ -0,0 +1,122 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Work-stealing scheduler: every job completes once, with the result of a single chip32_run()
+
+#include <memory>
+
+#include "test.h"
+#include "chip32_scheduler.h"
+
+// System call 9 suspends the VM, the others add their code to r3
+static bool SchedulerSyscall(chip32_ctx_t *ctx, uint8_t code)
+{
+    if (code == 9)
+        chip32_suspend(ctx);
+    else
+        ctx->registers[R3] += code;
+    return true;
+}
+
+// Sum of 1..count, every fourth program waits on a system call in its middle
+static std::string SchedulerProgram(int index)
+{
+    const int count = 1 + (index * 37) % 2000;
+    return "    lcons r0, " + std::to_string(count) + "\n"
+           "    lcons r1, 1\n"
+           "    lcons r2, 0\n"
+           "    syscall 2\n" +
+           std::string((index % 4) ? "" : "    syscall 9\n") +
+           ".loop:\n"
+           "    add r2, r0\n"
+           "    sub r0, r1\n"
+           "    skipz r0\n"
+           "    jump .loop\n"
+           "    halt\n";
+}
+
+TEST_CASE(scheduler_jobs_complete_once)
+{
+    static const int COUNT = 64;
+    std::vector<std::unique_ptr<TestVm>> vms;
+    std::vector<std::unique_ptr<TestVm>> references;
+    for (int i = 0; i < COUNT; i++)
+    {
+        std::vector<uint8_t> program;
+        CHECK(Assemble(SchedulerProgram(i), program));
+        vms.emplace_back(new TestVm(program));
+        references.emplace_back(new TestVm(program));
+        chip32_set_syscall(&vms.back()->ctx, SchedulerSyscall, nullptr);
+        chip32_set_syscall(&references.back()->ctx, SchedulerSyscall, nullptr);
+    }
+
+    // Small quantum: the long jobs are paused and queued again many times
+    Chip32Scheduler scheduler(4, 50);
+    std::vector<uint32_t> jobs;
+    for (auto &vm : vms)
+        jobs.push_back(scheduler.Submit(&vm->ctx, vm->progSize));
+    scheduler.Start();
+
+    std::vector<int> completions(COUNT, 0);
+    std::vector<int> waits(COUNT, 0);
+    Chip32Completion completion;
+    while (scheduler.WaitCompletion(completion))
+    {
+        CHECK(completion.job < COUNT);
+        CHECK(jobs[completion.job] == completion.job);
+        if (completion.result == VM_WAIT_SYSCALL)
+        {
+            // Only the programs with a syscall 9, only once
+            CHECK((completion.job % 4) == 0);
+            CHECK(waits[completion.job]++ == 0);
+            scheduler.Resume(completion.job);
+            continue;
+        }
+        CHECK(completion.result == VM_FINISHED);
+        completions[completion.job]++;
+    }
+
+    uint64_t instructions = 0;
+    for (int i = 0; i < COUNT; i++)
+    {
+        CHECK(completions[i] == 1);
+        CHECK(waits[i] == ((i % 4) ? 0 : 1));
+
+        // Same state as the program run in one go, resumed after its system call
+        TestVm &reference = *references[i];
+        chip32_result_t result = reference.Run(0);
+        if (result == VM_WAIT_SYSCALL)
+            result = reference.Run(0);
+        CHECK(result == VM_FINISHED);
+        CHECK(memcmp(vms[i]->ctx.registers, reference.ctx.registers, sizeof(reference.ctx.registers)) == 0);
+        CHECK(vms[i]->ctx.instr_count == reference.ctx.instr_count);
+        instructions += vms[i]->ctx.instr_count;
+    }
+
+    const Chip32SchedulerStats stats = scheduler.GetStats();
+    CHECK(stats.instructions == instructions);
+    scheduler.Stop();
+    DONE();
+}
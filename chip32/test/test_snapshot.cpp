@@ -0,0 +1,188 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Snapshots, restores and clones of a context
+
+#include "test.h"
+#include "chip32_snapshot.h"
+#include "chip32_async.h"
+#include "chip32_profiler.h"
+#include "chip32_trace.h"
+
+// Two entry points, each one writes its own RAM page
+static const char *SnapshotSource =
+    "    lcons r0, 0x11\n"      // 0: first entry
+    "    store 0x100, r0\n"
+    "    halt\n"
+    "    lcons r0, 0x22\n"      // 11: second entry
+    "    store 0x200, r0\n"
+    "    halt\n";
+
+static const uint32_t SECOND_ENTRY = 11;
+
+static chip32_result_t RunFrom(TestVm &vm, uint32_t entry)
+{
+    chip32_set_register(&vm.ctx, IP, entry);
+    return vm.Run();
+}
+
+TEST_CASE(snapshot_restore_older)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(SnapshotSource, program));
+    TestVm vm(program);
+
+    chip32_snapshot_t *first = chip32_snapshot_create(&vm.ctx);
+    CHECK(first != nullptr);
+    CHECK(RunFrom(vm, 0) == VM_FINISHED);
+    chip32_snapshot_t *second = chip32_snapshot_create(&vm.ctx);
+    CHECK(second != nullptr);
+    CHECK(RunFrom(vm, SECOND_ENTRY) == VM_FINISHED);
+    CHECK(vm.ramData[0x100] == 0x11);
+    CHECK(vm.ramData[0x200] == 0x22);
+
+    // The page written between the two snapshots is restored too
+    chip32_snapshot_restore(first, &vm.ctx);
+    CHECK(vm.ramData[0x100] == 0);
+    CHECK(vm.ramData[0x200] == 0);
+    CHECK(vm.Reg(R0) == 0);
+
+    chip32_snapshot_restore(second, &vm.ctx);
+    CHECK(vm.ramData[0x100] == 0x11);
+    CHECK(vm.ramData[0x200] == 0);
+    CHECK(vm.Reg(R0) == 0x11);
+
+    // Restoring the same snapshot again only needs the pages written since
+    CHECK(RunFrom(vm, SECOND_ENTRY) == VM_FINISHED);
+    chip32_snapshot_restore(second, &vm.ctx);
+    CHECK(vm.ramData[0x100] == 0x11);
+    CHECK(vm.ramData[0x200] == 0);
+
+    chip32_snapshot_destroy(first);
+    chip32_snapshot_destroy(second);
+    DONE();
+}
+
+TEST_CASE(snapshot_clone_restore_other)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(SnapshotSource, program));
+    TestVm vm(program);
+
+    chip32_snapshot_t *first = chip32_snapshot_create(&vm.ctx);
+    CHECK(RunFrom(vm, 0) == VM_FINISHED);
+    chip32_snapshot_t *second = chip32_snapshot_create(&vm.ctx);
+
+    // A clone of the second snapshot, put back to the first one
+    chip32_ctx_t clone;
+    virtual_mem_t cloneRam;
+    CHECK(chip32_snapshot_clone(second, &clone, &cloneRam));
+    CHECK(cloneRam.mem[0x100] == 0x11);
+    chip32_snapshot_restore(first, &clone);
+    CHECK(cloneRam.mem[0x100] == 0);
+
+    // The context itself is not changed
+    CHECK(vm.ramData[0x100] == 0x11);
+
+    chip32_snapshot_release_clone(second, &clone);
+    chip32_snapshot_destroy(first);
+    chip32_snapshot_destroy(second);
+    DONE();
+}
+
+// The ROM of a clone would point into the RAM of the context
+TEST_CASE(snapshot_clone_rom_in_ram)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(SnapshotSource, program));
+    TestVm vm(program);
+    memcpy(vm.ramData, program.data(), program.size());
+    vm.rom.mem = vm.ramData;
+
+    chip32_snapshot_t *snap = chip32_snapshot_create(&vm.ctx);
+    CHECK(snap != nullptr);
+    chip32_ctx_t clone;
+    virtual_mem_t cloneRam;
+    CHECK(!chip32_snapshot_clone(snap, &clone, &cloneRam));
+
+    // Partial overlap: the ROM starts in the last bytes of the RAM
+    vm.rom.mem = vm.ramData + TestVm::RAM_SIZE - 16;
+    CHECK(!chip32_snapshot_clone(snap, &clone, &cloneRam));
+
+    // Separate again
+    vm.rom.mem = vm.romData;
+    CHECK(chip32_snapshot_clone(snap, &clone, &cloneRam));
+    chip32_snapshot_release_clone(snap, &clone);
+    chip32_snapshot_destroy(snap);
+    DONE();
+}
+
+// The objects written while running stay with the context
+TEST_CASE(snapshot_clone_detached)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 3\n"
+        ".loop:\n"
+        "    lcons r1, 1\n"
+        "    sub r0, r1\n"
+        "    skipz r0\n"
+        "    jump .loop\n"
+        "    halt\n", program));
+    TestVm vm(program);
+
+    static chip32_decoded_t cache[TestVm::ROM_SIZE];
+    static chip32_fusion_stats_t stats;
+    CHECK(chip32_set_decode_cache(&vm.ctx, cache, TestVm::ROM_SIZE));
+    CHECK(chip32_fuse(&vm.ctx, &stats, 1));
+    chip32_profiler_t *prof = chip32_profiler_create(&vm.rom);
+    CHECK(chip32_profiler_attach(&vm.ctx, prof));
+    chip32_trace_record_t records[16];
+    chip32_trace_t trace;
+    CHECK(chip32_trace_init(&trace, records, 16));
+    chip32_trace_attach(&vm.ctx, &trace);
+    chip32_async_t *async = chip32_async_create(16);
+    CHECK(chip32_async_attach(&vm.ctx, async));
+
+    chip32_snapshot_t *snap = chip32_snapshot_create(&vm.ctx);
+    chip32_ctx_t clone;
+    virtual_mem_t cloneRam;
+    CHECK(chip32_snapshot_clone(snap, &clone, &cloneRam));
+    CHECK(clone.fusion == nullptr);
+    CHECK(clone.profiler == nullptr);
+    CHECK(clone.trace == nullptr);
+    CHECK(clone.async == nullptr);
+
+    // The clone runs the shared superinstructions without statistics
+    CHECK(chip32_run(&clone, vm.progSize, 0) == VM_FINISHED);
+    CHECK(clone.registers[R0] == 0);
+    CHECK(stats.fired[CHIP32_FUSE_LCONS_SUB] == 0);
+    CHECK(trace.count == 0);
+
+    chip32_snapshot_release_clone(snap, &clone);
+    chip32_snapshot_destroy(snap);
+    chip32_async_destroy(async);
+    chip32_profiler_destroy(prof);
+    DONE();
+}
@@ -0,0 +1,145 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Post-mortem trace: records of the last instructions
+
+#include "test.h"
+#include "chip32_trace.h"
+
+static const char *TraceSource =
+    "    lcons r0, 3\n"     // 0
+    "    lcons r1, 1\n"     // 6
+    ".loop:\n"
+    "    push r0\n"         // 12
+    "    pop r2\n"          // 14
+    "    sub r0, r1\n"      // 16
+    "    skipz r0\n"        // 19
+    "    jump .loop\n"      // 21
+    "    halt\n";           // 24
+
+static bool SameRecord(const chip32_trace_record_t &a, const chip32_trace_record_t &b)
+{
+    return (a.from == b.from) && (a.to == b.to) && (a.opcode == b.opcode) && (a.reg == b.reg) && (a.value == b.value);
+}
+
+// Only the taken transfers are recorded, with the register they tested
+TEST_CASE(trace_records)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(TraceSource, program));
+
+    for (chip32_engine_t engine : { CHIP32_ENGINE_SWITCH, CHIP32_ENGINE_THREADED })
+    {
+        TestVm vm(program);
+        chip32_set_engine(&vm.ctx, engine);
+        chip32_trace_record_t ring[8];
+        chip32_trace_t trace;
+        CHECK(chip32_trace_init(&trace, ring, 8));
+        chip32_trace_attach(&vm.ctx, &trace);
+        CHECK(vm.Run() == VM_FINISHED);
+
+        // The run start, two loop jumps, then the skip jumps over the last one
+        chip32_trace_record_t records[8];
+        CHECK(trace.count == 4);
+        CHECK(chip32_trace_read(&trace, records, 8) == 4);
+        const chip32_trace_record_t expected[4] = {
+            { 0xFFFF, 0, CHIP32_TRACE_ENTRY, CHIP32_TRACE_NO_REG, 0 },
+            { 21, 12, OP_JMP, CHIP32_TRACE_NO_REG, 0 },
+            { 21, 12, OP_JMP, CHIP32_TRACE_NO_REG, 0 },
+            { 19, 21, OP_SKIPZ, R0, 0 },
+        };
+        for (int i = 0; i < 4; i++)
+            CHECK(SameRecord(records[i], expected[i]));
+
+        // A run started elsewhere by the host is recorded, a resumed one is not
+        vm.ctx.registers[IP] = 0;
+        CHECK(vm.Run() == VM_FINISHED);
+        CHECK(chip32_trace_read(&trace, records, 8) == 8);
+        CHECK((records[4].opcode == CHIP32_TRACE_ENTRY) && (records[4].from == 24) && (records[4].to == 0));
+        for (int i = 1; i < 4; i++)
+            CHECK(SameRecord(records[4 + i], expected[i]));
+    }
+    DONE();
+}
+
+// The instructions between two transfers are found again in the ROM
+TEST_CASE(trace_write)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(TraceSource, program));
+
+    TestVm vm(program);
+    chip32_trace_record_t ring[2];
+    chip32_trace_t trace;
+    CHECK(chip32_trace_init(&trace, ring, 2));
+    chip32_trace_attach(&vm.ctx, &trace);
+    CHECK(vm.Run() == VM_FINISHED);
+
+    FILE *out = tmpfile();
+    CHECK(out != nullptr);
+    chip32_trace_write(&trace, &vm.ctx, out);
+    rewind(out);
+    std::string text;
+    char line[256];
+    while (fgets(line, sizeof(line), out) != nullptr)
+        text += line;
+    fclose(out);
+
+    // The last loop iteration, its start is given by the oldest record kept
+    CHECK(text ==
+        "# 4 transfers, last 2\n"
+        "0x0015  jump 0x000C                 ; -> 0x000C\n"
+        "0x000C  push r0\n"
+        "0x000E  pop r2\n"
+        "0x0010  sub r0, r1\n"
+        "0x0013  skipz r0                    ; skips 0x0015, r0 = 0x00000000\n"
+        "0x0018  halt                        ; <- ip\n");
+    DONE();
+}
+
+// A run paused after each instruction records the same trace
+TEST_CASE(trace_paused_runs)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(TraceSource, program));
+
+    chip32_trace_record_t ring[2][32];
+    chip32_trace_t trace[2];
+    for (int paused = 0; paused < 2; paused++)
+    {
+        TestVm vm(program);
+        CHECK(chip32_trace_init(&trace[paused], ring[paused], 32));
+        chip32_trace_attach(&vm.ctx, &trace[paused]);
+        chip32_result_t result;
+        while ((result = vm.Run(paused ? 1 : 0)) == VM_PAUSED)
+            ;
+        CHECK(result == VM_FINISHED);
+    }
+
+    CHECK(trace[0].count == trace[1].count);
+    for (uint64_t i = 0; i < trace[0].count; i++)
+        CHECK(SameRecord(ring[0][i], ring[1][i]));
+    DONE();
+}
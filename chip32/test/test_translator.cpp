@@ -0,0 +1,115 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Translated programs must behave as the interpreter: the corpus of random programs
+// is generated and translated by chip32_translator_corpus at build time
+
+#include "test.h"
+#include "translator_corpus.h"
+
+// Deterministic system calls: change registers, stop, suspend or move IP
+static bool CorpusSyscall(chip32_ctx_t *ctx, uint8_t code)
+{
+    const uint32_t r0 = chip32_get_register(ctx, R0);
+    switch (code)
+    {
+    case 0:
+        chip32_set_register(ctx, R0, r0 * 3 + 1);
+        return true;
+    case 1:
+        if ((r0 & 3) == 0)
+            chip32_suspend(ctx);
+        chip32_set_register(ctx, T9, r0 ^ 0x55);
+        return true;
+    case 2:
+        return (r0 & 7) != 0;
+    default:
+        chip32_set_register(ctx, IP, chip32_get_register(ctx, IP) + (r0 & 1));
+        return true;
+    }
+}
+
+struct CorpusState
+{
+    chip32_result_t result;
+    uint32_t registers[REGISTER_COUNT];
+    uint8_t ram[4096];
+    uint64_t dirty[CHIP32_DIRTY_WORDS];
+    uint64_t instrCount;
+    bool skip;
+};
+
+// Run until the end, resuming the suspended system calls. 'budget' is 0 for the translation.
+static void RunCorpus(const translator_corpus_t &entry, bool translated, uint32_t budget, CorpusState &state)
+{
+    std::vector<uint8_t> rom(entry.program, entry.program + entry.size);
+    virtual_mem_t romMem = { rom.data(), entry.size, 0 };
+    virtual_mem_t ramMem = { state.ram, sizeof(state.ram), 0 };
+    memset(state.ram, 0, sizeof(state.ram));
+
+    chip32_ctx_t ctx;
+    chip32_initialize(&ctx, &romMem, &ramMem, 256);
+    chip32_set_syscall(&ctx, CorpusSyscall, nullptr);
+    int resumes = 0;
+    do
+    {
+        state.result = translated ? entry.run(&ctx, entry.size) : chip32_run(&ctx, entry.size, budget);
+    } while ((state.result == VM_WAIT_SYSCALL) && (++resumes < 50));
+
+    memcpy(state.registers, ctx.registers, sizeof(state.registers));
+    memcpy(state.dirty, ctx.dirty, sizeof(state.dirty));
+    state.instrCount = ctx.instr_count;
+    state.skip = ctx.skip;
+}
+
+TEST_CASE(translator_corpus_same_results)
+{
+    static CorpusState interpreted;
+    static CorpusState translated;
+    int compared = 0;
+    int finished = 0;
+
+    for (const translator_corpus_t &entry : translator_corpus)
+    {
+        // Endless loops cannot be compared
+        RunCorpus(entry, false, 200000, interpreted);
+        if (interpreted.result == VM_PAUSED)
+            continue;
+        RunCorpus(entry, true, 0, translated);
+
+        CHECK(translated.result == interpreted.result);
+        CHECK(memcmp(translated.registers, interpreted.registers, sizeof(interpreted.registers)) == 0);
+        CHECK(memcmp(translated.ram, interpreted.ram, sizeof(interpreted.ram)) == 0);
+        CHECK(memcmp(translated.dirty, interpreted.dirty, sizeof(interpreted.dirty)) == 0);
+        CHECK(translated.instrCount == interpreted.instrCount);
+        CHECK(translated.skip == interpreted.skip);
+        compared++;
+        finished += (interpreted.result == VM_FINISHED);
+    }
+    // Most random programs stop on an error, some must reach their end
+    CHECK(compared > 100);
+    CHECK(finished > 0);
+    DONE();
+}
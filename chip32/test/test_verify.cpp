@@ -0,0 +1,200 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Static verification: faulty images are rejected, verified runs equal checked runs
+
+#include "test.h"
+
+// Verify the image from IP, 'fault' gets the address of the faulty instruction
+static bool Verify(TestVm &vm, uint32_t &fault)
+{
+    static uint8_t starts[TestVm::ROM_SIZE / 8];
+    return chip32_verify(&vm.ctx, starts, sizeof(starts), &fault);
+}
+
+// The first instruction (lcons r0, 1) is valid, the faulty one is at address 6
+static bool RejectedAt6(const std::vector<uint8_t> &instruction)
+{
+    std::vector<uint8_t> program = { OP_LCONS, R0, 1, 0, 0, 0 };
+    program.insert(program.end(), instruction.begin(), instruction.end());
+    program.push_back(OP_HALT);
+
+    TestVm vm(program);
+    uint32_t fault = 0;
+    return !Verify(vm, fault) && (fault == 6) && (vm.ctx.verified == nullptr);
+}
+
+TEST_CASE(verify_rejects)
+{
+    // Register indexes
+    CHECK(RejectedAt6({ OP_MOV, R0, REGISTER_COUNT }));
+    CHECK(RejectedAt6({ OP_ADD, 40, R1 }));
+    CHECK(RejectedAt6({ OP_JE, R0, REGISTER_COUNT, 0, 0 }));
+    // Jump, call and branch targets outside the ROM
+    CHECK(RejectedAt6({ OP_JMP, 0x00, 0x10 }));
+    CHECK(RejectedAt6({ OP_CALL, 0xFF, 0xFF }));
+    CHECK(RejectedAt6({ OP_JNE, R0, R1, 0x00, 0x20 }));
+    // Fixed addresses: the 4 bytes must be inside the RAM
+    CHECK(RejectedAt6({ OP_STORE, uint8_t(TestVm::RAM_SIZE - 3), uint8_t((TestVm::RAM_SIZE - 3) >> 8), R0 }));
+    CHECK(RejectedAt6({ OP_LOAD, R1, uint8_t(TestVm::RAM_SIZE - 1), uint8_t((TestVm::RAM_SIZE - 1) >> 8) }));
+    // IP is never written by an instruction
+    CHECK(RejectedAt6({ OP_MOV, IP, R0 }));
+
+    // The last fixed address accepted
+    std::vector<uint8_t> program = { OP_STORE, uint8_t(TestVm::RAM_SIZE - 4), uint8_t((TestVm::RAM_SIZE - 4) >> 8), R0, OP_HALT };
+    TestVm last(program);
+    uint32_t fault = 0;
+    CHECK(Verify(last, fault));
+    DONE();
+}
+
+// A ROM ending in the middle of an instruction
+TEST_CASE(verify_truncated)
+{
+    const std::vector<uint8_t> program = { OP_NOP, OP_LCONS, R0, 1, 0 };
+    TestVm vm(program);
+    vm.rom.size = program.size();
+    uint32_t fault = 0;
+    CHECK(!Verify(vm, fault));
+    CHECK(fault == 1);
+
+    // Same with the skipped instruction of a skipz
+    const std::vector<uint8_t> skip = { OP_SKIPZ, R0, OP_LCONS, R0, 1 };
+    TestVm vm2(skip);
+    vm2.rom.size = skip.size();
+    CHECK(!Verify(vm2, fault));
+    CHECK(fault == 0);
+    DONE();
+}
+
+// A program that can write into its own code is never verified
+TEST_CASE(verify_rom_in_ram)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 1\n"
+        "    halt\n", program));
+
+    TestVm vm(program);
+    uint32_t fault = 0;
+    CHECK(Verify(vm, fault));
+
+    memcpy(vm.ramData, program.data(), program.size());
+    vm.rom.mem = vm.ramData;
+    CHECK(!Verify(vm, fault));
+    CHECK(vm.ctx.verified == nullptr);
+
+    // Partial overlap: the ROM starts in the last bytes of the RAM
+    TestVm vm2(program);
+    vm2.rom.mem = vm2.ramData + TestVm::RAM_SIZE - 16;
+    vm2.rom.size = 64;
+    CHECK(!Verify(vm2, fault));
+    DONE();
+}
+
+// Same results with and without the checks, for any budget
+TEST_CASE(verify_same_as_checked)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r0, 30\n"
+        "    lcons r1, 1\n"
+        "    lcons r2, 0\n"
+        ".loop:\n"
+        "    call .step\n"
+        "    sub r0, r1\n"
+        "    skipz r0\n"
+        "    jump .loop\n"
+        "    load r3, 100\n"
+        "    halt\n"
+        ".step:\n"
+        "    push r0\n"
+        "    add r2, r0\n"
+        "    store 100, r2\n"
+        "    pop r4\n"
+        "    ret\n", program));
+
+    for (uint32_t budget : { 0u, 1u, 3u, 7u })
+    {
+        TestVm checked(program);
+        TestVm verified(program);
+        uint32_t fault = 0;
+        CHECK(Verify(verified, fault));
+
+        chip32_result_t expected;
+        chip32_result_t result;
+        do
+        {
+            expected = checked.Run(budget);
+            result = verified.Run(budget);
+            CHECK(result == expected);
+            CHECK(memcmp(verified.ctx.registers, checked.ctx.registers, sizeof(checked.ctx.registers)) == 0);
+            CHECK(verified.ctx.instr_count == checked.ctx.instr_count);
+        } while (expected == VM_PAUSED);
+
+        CHECK(expected == VM_FINISHED);
+        CHECK(verified.Reg(R3) == 465);
+        CHECK(memcmp(verified.ramData, checked.ramData, TestVm::RAM_SIZE) == 0);
+    }
+    DONE();
+}
+
+// System call 1 jumps to the address in r5
+static bool JumpSyscall(chip32_ctx_t *ctx, uint8_t code)
+{
+    if (code == 1)
+        ctx->registers[IP] = ctx->registers[R5] - 1; // IP is on the last byte of the syscall
+    return true;
+}
+
+// A system call moving IP outside the verified code: the run goes on with the checks
+TEST_CASE(verify_syscall_target)
+{
+    std::vector<uint8_t> program;
+    CHECK(Assemble(
+        "    lcons r5, 0\n"     // patched below
+        "    syscall 1\n"
+        "    halt\n", program));
+
+    // Never reached from the entry point: not verified, and with an invalid register
+    const uint32_t target = program.size();
+    program[2] = uint8_t(target);
+    program[3] = uint8_t(target >> 8);
+    program.insert(program.end(), { OP_LCONS, R1, 7, 0, 0, 0, OP_MOV, R0, 40, OP_HALT });
+
+    TestVm checked(program);
+    TestVm verified(program);
+    uint32_t fault = 0;
+    CHECK(Verify(verified, fault));
+    for (TestVm *vm : { &checked, &verified })
+    {
+        chip32_set_syscall(&vm->ctx, JumpSyscall, nullptr);
+        CHECK(vm->Run() == VM_ERR_INVALID_REGISTER);
+        CHECK(vm->Reg(R1) == 7);
+    }
+    CHECK(memcmp(verified.ctx.registers, checked.ctx.registers, sizeof(checked.ctx.registers)) == 0);
+    CHECK(verified.ctx.instr_count == checked.ctx.instr_count);
+    DONE();
+}
@@ -0,0 +1,199 @@
+/*
+The MIT License
+
+Copyright (c) 2022 Anthony Rabine
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Generates the differential corpus of the translator: random programs and their
+// translation into C. Run by the build, see test_translator.cpp.
+//
+//     chip32_translator_corpus <count> <seed> <output.c> <output.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <vector>
+
+#include "chip32.h"
+#include "chip32_translator.h"
+
+static const OpCode OpCodes[] = OPCODES_LIST;
+
+// Random instructions, with special or invalid registers from time to time. Branches
+// and most jumpr targets are instruction starts, system calls use the codes 0 to 3.
+static std::vector<uint8_t> RandomProgram(std::mt19937 &rng, int count)
+{
+    std::vector<uint8_t> program;
+    std::vector<uint32_t> starts;
+    std::vector<size_t> branches;
+
+    // Registers r0-r5 hold RAM addresses
+    for (uint8_t reg = R0; reg <= R5; reg++)
+    {
+        const uint32_t value = 32 + rng() % 4000;
+        starts.push_back(program.size());
+        program.insert(program.end(), { OP_LCONS, reg, uint8_t(value), uint8_t(value >> 8), 0, 0 });
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        starts.push_back(program.size());
+        uint8_t op = rng() % INSTRUCTION_COUNT;
+        if ((op == OP_DIV) || (op == OP_HALT))
+            op = OP_ADD;
+
+        // Block memory on a valid range most of the time
+        if ((op >= OP_MEMCPY) && (op <= OP_MEMCMP) && (rng() % 4))
+        {
+            for (uint8_t reg = R0; reg <= R2; reg++)
+            {
+                const uint32_t value = (reg == R2) ? rng() % 300 : rng() % 4096;
+                starts.push_back(program.size());
+                program.insert(program.end(), { OP_LCONS, reg, uint8_t(value), uint8_t(value >> 8), 0, 0 });
+            }
+            starts.push_back(program.size());
+            program.insert(program.end(), { op, R0, R1, R2 });
+            continue;
+        }
+
+        program.push_back(op);
+        for (int k = 0; k < OpCodes[op].bytes; k++)
+        {
+            if ((op == OP_LCONS) && (k > 0))
+                program.push_back(rng() % 256);
+            else if (op == OP_SYSCALL)
+                program.push_back(rng() % 4);
+            else
+                program.push_back((rng() % 16) ? rng() % (T9 + 1) : rng() % (REGISTER_COUNT + 2));
+        }
+
+        uint8_t *args = &program[program.size() - OpCodes[op].bytes];
+        if ((op == OP_JMP) || (op == OP_CALL) || ((op >= OP_JE) && (op <= OP_JGE)))
+            branches.push_back(program.size() - 2);
+        else if (op == OP_STORE)
+            args[0] = rng() % 200, args[1] = 0;
+        else if (op == OP_LOAD)
+            args[1] = rng() % 200, args[2] = 0;
+        else if (((op == OP_LOADR) || (op == OP_STORER)) && (rng() % 4))
+        {
+            // Base register r0-r5, offset -32 to 31
+            const int16_t offset = int16_t(rng() % 64) - 32;
+            uint8_t *base = &args[(op == OP_LOADR) ? 1 : 0];
+            base[0] = rng() % 6;
+            base[1] = offset & 0xFF;
+            base[2] = (offset >> 8) & 0xFF;
+        }
+        else if ((op >= OP_VLOAD) && (op <= OP_VSUM16))
+        {
+            // vload v, r / vstore r, v / vsum r, v, the others take two vector registers
+            const int scalar = (op == OP_VLOAD) ? 1 : ((op == OP_VSTORE) || (op >= OP_VSUM8)) ? 0 : -1;
+            for (int k = 0; k < 2; k++)
+                args[k] = (k == scalar) ? rng() % 6 : rng() % (CHIP32_VREG_COUNT + 1);
+        }
+        else if ((op == OP_PUSHM) || (op == OP_POPM))
+        {
+            const uint32_t mask = (rng() % 5) ? (rng() & rng() & 0x1AFFFF) : rng();
+            args[0] = mask & 0xFF;
+            args[1] = (mask >> 8) & 0xFF;
+            args[2] = (mask >> 16) & 0xFF;
+        }
+        else if ((op == OP_ENTER) && (rng() % 4))
+            args[0] = rng() % 64, args[1] = 0;
+        else if ((op == OP_JR) && (rng() % 2))
+        {
+            // Load the target into the register first
+            const uint8_t reg = args[0] % 6;
+            const uint32_t target = starts[rng() % starts.size()];
+            args[0] = reg;
+            program.insert(program.end() - 2, { OP_LCONS, reg, uint8_t(target), uint8_t(target >> 8), 0, 0 });
+        }
+    }
+    starts.push_back(program.size());
+    program.push_back(OP_HALT);
+
+    for (size_t at : branches)
+    {
+        const uint32_t target = starts[rng() % starts.size()];
+        program[at] = target & 0xFF;
+        program[at + 1] = target >> 8;
+    }
+
+    // Random registers and constants may read as a division opcode
+    for (uint8_t &byte : program)
+    {
+        if (byte == OP_DIV)
+            byte = OP_MUL;
+    }
+    return program;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 5)
+    {
+        fprintf(stderr, "usage: %s <count> <seed> <output.c> <output.h>\n", argv[0]);
+        return 1;
+    }
+    const int count = atoi(argv[1]);
+    std::mt19937 rng(atoi(argv[2]));
+    std::ofstream source(argv[3]);
+    std::ofstream header(argv[4]);
+
+    header << "// Generated by chip32_translator_corpus, do not edit\n"
+              "#include \"chip32.h\"\n\n"
+              "typedef struct\n{\n"
+              "    chip32_result_t (*run)(chip32_ctx_t *ctx, uint16_t prog_size);\n"
+              "    const uint8_t *program;\n"
+              "    uint16_t size;\n"
+              "} translator_corpus_t;\n\n"
+              "#ifdef __cplusplus\nextern \"C\" {\n#endif\n"
+              "extern const translator_corpus_t translator_corpus[" << count << "];\n"
+              "#ifdef __cplusplus\n}\n#endif\n";
+
+    source << "// Generated by chip32_translator_corpus, do not edit\n"
+              "#include \"translator_corpus.h\"\n";
+
+    Chip32Translator translator;
+    for (int i = 0; i < count; i++)
+    {
+        const std::vector<uint8_t> program = RandomProgram(rng, 5 + rng() % 60);
+        const std::string name = "corpus" + std::to_string(i);
+        std::string translated;
+        if (!translator.Translate(program, name, translated))
+        {
+            fprintf(stderr, "cannot translate program %d\n", i);
+            return 1;
+        }
+
+        source << "\nstatic const uint8_t " << name << "_program[" << program.size() << "] = {";
+        for (size_t k = 0; k < program.size(); k++)
+            source << ((k % 16) ? " " : "\n    ") << int(program[k]) << ",";
+        source << "\n};\n" << translated;
+    }
+
+    source << "\nconst translator_corpus_t translator_corpus[" << count << "] = {\n";
+    for (int i = 0; i < count; i++)
+        source << "    { corpus" << i << ", corpus" << i << "_program, sizeof(corpus" << i << "_program) },\n";
+    source << "};\n";
+    return 0;
+}